@@ -30,29 +30,74 @@
 
 namespace xpf {
 
+// How allocators obtain their memory bulks: Flags given to create() and
+// the constructors, along with those of the allocator. Bulks come from
+// the heap (::malloc()) unless any of these is given.
+enum EBulkFlag
+{
+	// Map bulks from the system directly (mmap() or VirtualAlloc()).
+	EB_MAPPED    = 0x100,
+
+	// Back bulks with huge pages to save TLB misses: Explicit ones
+	// (MAP_HUGETLB, or MEM_LARGE_PAGES on Windows) if the system has
+	// some reserved, or transparent ones (madvise()) otherwise.
+	// Implies EB_MAPPED.
+	EB_HUGEPAGES = 0x200,
+
+	// Fault in every page at creation rather than on first touch.
+	// Implies EB_MAPPED.
+	EB_POPULATE  = 0x400,
+
+	// Lock bulks in physical memory (mlock() or VirtualLock()). The
+	// creation fails if the limit of locked memory does not allow it.
+	// Implies EB_MAPPED.
+	EB_LOCKED    = 0x800,
+};
+
 //============---------- BuddyAllocator -----------================//
 
 struct BuddyAllocatorDetails;
+struct BuddyCacheDetails;
 
 class XPF_API BuddyAllocator
 {
 public:
+	enum EFlag
+	{
+		// Allow the allocator to be shared by threads. Sizes up to 1 Kb
+		// are served by per-thread caches which take 64 Kb spans from the
+		// shared pool and give them back once entirely free, while the
+		// others go to the shared pool under a lock. Blocks may be freed
+		// by any thread. Pools smaller than 1 Mb are not cached. used()
+		// counts spans held by caches as used.
+		EF_CONCURRENT = 0x1,
+
+		// Map another arena of the same size when the pool is exhausted
+		// instead of failing, up to 64 arenas. Blocks are freed to the
+		// arena they come from. Arenas but the first one are given back
+		// to the system once they have stayed entirely free for a while
+		// (see setGrowthPolicy()). capacity() counts arenas mapped.
+		EF_GROWABLE = 0x2,
+	};
+
 	/*****
 	 *  Create a buddy-algorithm based memory allocator in slot of 'slotId'
 	 *  which preallocates a memory bulk of size 'size'. The 'size' shall 
 	 *  be power of 2 or it will be promoted to be one (nearest but not 
 	 *  less than). The promoted size value should neither less than 2^4 
-	 *  (16 bytes) nor larger than 2^31 (2 Gb). Later calls of 
+	 *  (16 bytes) nor larger than 2^40 (1 Tb) on 64-bit models, or 2^31
+	 *  (2 Gb) on others. Later calls of 
 	 *  BuddyAllocator::instance() with the same 'slotId' returns the 
 	 *  pointer to this global memory pool instance. One should call
 	 *  BuddyAllocator::destroy() with the same 'slotId' after done using 
 	 *  to release the entire memory bulk.
 	 *
 	 *  'slotId' should be a unsigned short integer ranged from 0 to 255.
+	 *  'flags' is a combination of EFlag and EBulkFlag values.
 	 *
 	 *  Returns the promoted memory bulk size. Or 0 on error.
 	 */
-	static u32  create( u32 size, u16 slotId = 0 );
+	static u64  create( u64 size, u16 slotId = 0, u32 flags = 0 );
 
 	/*****
 	 *  Delete the BuddyAllocator instance in slot of 'slotId' 
@@ -68,31 +113,31 @@ public:
 	static BuddyAllocator* instance(u16 slotId = 0);
 
 public:
-	explicit BuddyAllocator(u32 size);
+	explicit BuddyAllocator(u64 size, u32 flags = 0);
 	~BuddyAllocator();
 
 	// Returns the maximum capacity in bytes.
-	u32   capacity () const;
+	u64   capacity () const;
 
 	// Return the maximum allocatable space in bytes.
-	u32   available () const;
+	u64   available () const;
 
 	// Return the used (allocated) space in bytes.
-	u32   used() const;
+	u64   used() const;
 
 	// Return the high water mark in bytes since last reset
-	u32   hwm() const;
+	u64   hwm() const;
 
 	// Return the high water mark in bytes and reset its value.
-	u32   reset();
+	u64   reset();
 
 	// Allocate a memory chunk which is at least 'bytes' long.
 	// Our implementation guarantees the returned pointer is 
 	// 16-bytes aligned.
-	void* alloc ( u32 size );
+	void* alloc ( u64 size );
 
 	// Free up a memory chunk which is previously allocated by this allocator.
-	void  dealloc ( void *p, u32 size );
+	void  dealloc ( void *p, u64 size );
 
 	// dealloc() without size hint
 	void  free ( void *p );
@@ -100,11 +145,26 @@ public:
 	// Extend or shrink the allocated block size.
 	// May move the memory block to a new location and returns the new address.
 	// The content of the memory block is preserved up to the lesser of the new and old sizes.
-	void* realloc ( void *p, u32 size );
+	void* realloc ( void *p, u64 size );
 
 	// Allocate for an array of 'num' elements, each of length 'size' bytes.
 	// All allocated memory bytes are initialized to 0.
-	void* calloc ( u32 num, u32 size );
+	void* calloc ( u64 num, u64 size );
+
+	// Give back the spans cached by the calling thread and hand its cache
+	// over to the next thread that allocates. The cache of a thread is
+	// retired as well when the thread exits; calling it beforehand only
+	// gives the spans back earlier. No-op without EF_CONCURRENT.
+	void  flushThreadCache ();
+
+	// Limit the number of arenas of an EF_GROWABLE allocator to
+	// 'maxArenas' (1 to 64), and give back arenas which have stayed
+	// entirely free for 'releaseDelayMs' milliseconds. This is checked
+	// as blocks are freed. No-op otherwise.
+	void  setGrowthPolicy ( u32 maxArenas, u32 releaseDelayMs = 1000 );
+
+	// Return the number of arenas mapped.
+	u32   arenaCount () const;
 
 private:
 	// non-copyable
@@ -112,6 +172,7 @@ private:
 	BuddyAllocator& operator = (const BuddyAllocator& other) { return *this; }
 
 	BuddyAllocatorDetails *mDetails;
+	BuddyCacheDetails     *mCaches; // thread caches of EF_CONCURRENT, or NULL.
 }; // end of class BuddyAllocator
 
 //============---------- BuddyAllocator -----------================//
@@ -130,27 +191,30 @@ struct LinearAllocatorDetails;
 
 class XPF_API LinearAllocator
 {
-	// NOTE: Expose the same interface as BuddyAllocator.
+	// NOTE: Expose the same interface as BuddyAllocator. Every cell
+	//       has an overhead of 8 bytes, or 16 bytes if the capacity
+	//       is larger than 2 Gb.
 public:
-	static u32  create( u32 size, u16 slotId = 0 );
+	// 'flags' is a combination of EBulkFlag values.
+	static u64  create( u64 size, u16 slotId = 0, u32 flags = 0 );
 	static void destory(u16 slotId = 0);
 	static LinearAllocator* instance(u16 slotId = 0);
 
-	explicit LinearAllocator(u32 size);
+	explicit LinearAllocator(u64 size, u32 flags = 0);
 	~LinearAllocator();
 
-	u32   capacity () const;
-	u32   available () const;
-	u32   used() const;
-	u32   hwm() const;
+	u64   capacity () const;
+	u64   available () const;
+	u64   used() const;
+	u64   hwm() const;
 	// Return current hwm and reset both hwm and stack pointer.
-	u32   reset();
+	u64   reset();
 
-	void* alloc ( u32 size );
-	void  dealloc ( void *p, u32 size );
+	void* alloc ( u64 size );
+	void  dealloc ( void *p, u64 size );
 	void  free ( void *p );
-	void* realloc ( void *p, u32 size );
-	void* calloc ( u32 num, u32 size );
+	void* realloc ( void *p, u64 size );
+	void* calloc ( u64 num, u64 size );
 
 private:
 	// non-copyable
@@ -170,11 +234,80 @@ private:
 
 
 
+//============---------- PoolAllocator -----------================//
+
+
+
+struct PoolAllocatorDetails;
+
+class XPF_API PoolAllocator
+{
+	// NOTE: Expose the same interface as BuddyAllocator, but every
+	//       block is an object of the same size, which is given to
+	//       create() and the constructor. Both alloc() and free() are
+	//       O(1) with no per-object overhead.
+public:
+	/*****
+	 *  Create a pool of objects of 'objectSize' bytes in slot of 'slotId'
+	 *  which preallocates a memory bulk of at most 'size' bytes. The
+	 *  'objectSize' is promoted to be a multiply of 8, and 'size' is cut
+	 *  down to a multiply of it, but holds at least one object.
+	 *
+	 *  'flags' is a combination of EBulkFlag values.
+	 *
+	 *  Returns the capacity in bytes. Or 0 on error.
+	 */
+	static u64  create( u64 size, u32 objectSize, u16 slotId = 0, u32 flags = 0 );
+	static void destory(u16 slotId = 0);
+	static PoolAllocator* instance(u16 slotId = 0);
+
+	PoolAllocator(u64 size, u32 objectSize, u32 flags = 0);
+	~PoolAllocator();
+
+	u64   capacity () const;
+	// Return the object size if there is a free object, or 0.
+	u64   available () const;
+	u64   used() const;
+	u64   hwm() const;
+	u64   reset();
+
+	// Return the size of objects.
+	u32   objectSize () const;
+
+	// Return a free object, or NULL if 'size' is larger than the
+	// object size or there is no free object. Our implementation
+	// guarantees the returned pointer is 8-bytes aligned, or 16-bytes
+	// if the object size is a multiply of 16.
+	void* alloc ( u64 size );
+	void  dealloc ( void *p, u64 size );
+	void  free ( void *p );
+	// Objects never move: Return 'p' if 'size' fits in an object, or NULL.
+	void* realloc ( void *p, u64 size );
+	void* calloc ( u64 num, u64 size );
+
+private:
+	// non-copyable
+	PoolAllocator(const PoolAllocator& other) {}
+	PoolAllocator& operator = (const PoolAllocator& other) { return *this; }
+
+	PoolAllocatorDetails *mDetails;
+}; // end of class PoolAllocator
+
+
+
+//============---------- PoolAllocator -----------================//
+
+
+
+
+
+
+
 
 
 //============---------- STL allocator compatible -----------================//
 
-// A wrapper to wrap both LinearAllocator and BuddyAllocator with a 
+// A wrapper to wrap LinearAllocator, BuddyAllocator and PoolAllocator with a 
 // specific slot index to a dedicated type for STL-compatible allocator.
 template < typename ALLOCATOR, u16 SLOT = 0 >
 class AllocInstOf
@@ -190,9 +323,9 @@ public:
 // ALLOC_GETTER can be any type meet the following requirements:
 // 1. Has a public typedef named 'ALLOCATOR_TYPE' refer to
 //    the actual allocator type which has 3 required APIs:
-//     a. void* alloc ( u32 size );
-//     b. void  dealloc ( void *p, u32 size );
-//     c. u32   capacity () const;
+//     a. void* alloc ( u64 size );
+//     b. void  dealloc ( void *p, u64 size );
+//     c. u64   capacity () const;
 // 2. Has a public static API declared as:
 //     static ALLOCATOR* get();
 //    to return the proper allocator instance.
@@ -205,7 +338,7 @@ public:
 	typedef T& reference;
 	typedef const T& const_reference;
 	typedef T value_type;
-	typedef u32 size_type;
+	typedef size_t size_type;
 	typedef ptrdiff_t difference_type;
 
 	template < typename U >
@@ -272,7 +405,8 @@ public:
 	size_type max_size() const
 	{
 		xpfAssert( ( "Null mPool.", mPool != 0 ) );
-		return (mPool->capacity() / sizeof(value_type));
+		const u64 n = (mPool->capacity() / sizeof(value_type));
+		return (n > (size_type)-1) ? (size_type)-1 : (size_type)n;
 	}
 
 	// Call the c'tor to construct object using the storage space passed in.
@@ -0,0 +1,321 @@
+/*******************************************************************************
+ * Copyright (c) 2013 matt@moregeek.com.tw
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ * 3. This notice may not be removed or altered from any source
+ *    distribution.
+ ********************************************************************************/
+
+#ifndef _XPF_IOBUFFER_HEADER_
+#define _XPF_IOBUFFER_HEADER_
+
+#include "platform.h"
+#include "refcnt.h"
+#include "allocators.h"
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <vector>
+
+namespace xpf {
+
+// NOTE: Header-only impl.
+
+/**
+ *  A reference-counted memory block for zero-copy I/O. The storage
+ *  follows the object header in a single allocation, which is taken
+ *  from a BuddyAllocator if given or from the global heap otherwise.
+ *
+ *  The valid data always starts at data() and is length() bytes long.
+ *  The rest of the storage (the tail room) can be filled by writing
+ *  at tail() and then calling commit().
+ *
+ *  Counting is atomic so a buffer can be shared among threads (e.g.
+ *  by several NetIoMux workers). Its content, however, is not guarded
+ *  and should be treated as immutable once shared. Buffers from a
+ *  BuddyAllocator created with EF_CONCURRENT may be created and released
+ *  in any thread. Other pools are not thread-safe: Their buffers must be
+ *  created and released in the same thread.
+ */
+class IoBuffer : public AtomicRefCounted
+{
+public:
+	// Born with ref count 1 and length 0.
+	static IoBuffer* create(u32 capacity, BuddyAllocator *pool = 0)
+	{
+		return new (capacity, pool) IoBuffer(capacity);
+	}
+
+	// Create a buffer holding a copy of 'len' bytes from 'src'.
+	static IoBuffer* create(const c8 *src, u32 len, BuddyAllocator *pool = 0)
+	{
+		IoBuffer *buf = create(len, pool);
+		::memcpy(buf->data(), src, len);
+		buf->commit(len);
+		return buf;
+	}
+
+	inline c8*       data()           { return (c8*)this + HeaderSize; }
+	inline const c8* data() const     { return (const c8*)this + HeaderSize; }
+	inline u32       capacity() const { return mCapacity; }
+	inline u32       length() const   { return mLength; }
+	inline c8*       tail()           { return data() + mLength; }
+	inline u32       tailroom() const { return mCapacity - mLength; }
+
+	// Append 'bytes' which have been written at tail() to the valid data.
+	inline void commit(u32 bytes)
+	{
+		xpfAssert(("Committing beyond the capacity.", bytes <= tailroom()));
+		mLength += bytes;
+	}
+
+	inline void setLength(u32 len)
+	{
+		xpfAssert(("Length beyond the capacity.", len <= mCapacity));
+		mLength = len;
+	}
+
+	// The object header occupies the first HeaderSize bytes of the
+	// allocation so that data() keeps the 16-bytes alignment.
+	static const u32 HeaderSize = 48;
+
+private:
+	explicit IoBuffer(u32 capacity)
+		: mCapacity(capacity), mLength(0)
+	{
+		xpfSAssert((sizeof(IoBuffer) + sizeof(BuddyAllocator*) <= HeaderSize));
+	}
+
+	virtual ~IoBuffer() {}
+
+	// The source allocator is recorded in the last pointer-sized word of
+	// the header, which is not part of the object, so that it remains
+	// readable in operator delete.
+	static BuddyAllocator** poolOf(void *p)
+	{
+		return (BuddyAllocator**)((c8*)p + HeaderSize - sizeof(BuddyAllocator*));
+	}
+
+	static void* operator new(size_t size, u32 capacity, BuddyAllocator *pool)
+	{
+		const u32 total = HeaderSize + capacity;
+		void *p = (pool) ? pool->alloc(total) : ::malloc(total);
+		if (p == 0)
+			throw std::bad_alloc();
+		*poolOf(p) = pool;
+		return p;
+	}
+
+	static void operator delete(void *p, u32 capacity, BuddyAllocator *pool)
+	{
+		operator delete(p);
+	}
+
+	static void operator delete(void *p)
+	{
+		BuddyAllocator *pool = *poolOf(p);
+		if (pool)
+			pool->free(p);
+		else
+			::free(p);
+	}
+
+	u32 mCapacity;
+	u32 mLength;
+};
+
+/**
+ *  An ordered chain of slices of IoBuffers. Slices refer to (and hold
+ *  a reference on) the buffers rather than copying them, so a chain
+ *  is cheap to copy, slice and concatenate. Used for vectored sends
+ *  by NetIoMux::asyncSend().
+ *
+ *  A chain itself is a value type and is not thread-safe.
+ */
+class IoBufferChain
+{
+public:
+	struct Segment
+	{
+		IoBuffer *Buffer;
+		u32       Offset;
+		u32       Length;
+	};
+
+	IoBufferChain() : mLength(0) {}
+
+	IoBufferChain(const IoBufferChain& that)
+		: mSegments(that.mSegments), mLength(that.mLength)
+	{
+		for (u32 i = 0; i < (u32)mSegments.size(); ++i)
+			mSegments[i].Buffer->ref();
+	}
+
+	~IoBufferChain()
+	{
+		clear();
+	}
+
+	IoBufferChain& operator = (const IoBufferChain& that)
+	{
+		if (this != &that)
+		{
+			IoBufferChain tmp(that);
+			swap(tmp);
+		}
+		return *this;
+	}
+
+	// Append the valid data of 'buf'.
+	void append(IoBuffer *buf)
+	{
+		append(buf, 0, buf->length());
+	}
+
+	// Append 'len' bytes of 'buf' starting at 'offset'.
+	// A reference of 'buf' is held by this chain.
+	void append(IoBuffer *buf, u32 offset, u32 len)
+	{
+		xpfAssert(("Slice out of range.", (offset + len) <= buf->capacity()));
+		if (len == 0)
+			return;
+
+		// Merge with the last segment if contiguous.
+		if (!mSegments.empty())
+		{
+			Segment &last = mSegments.back();
+			if ((last.Buffer == buf) && (last.Offset + last.Length == offset))
+			{
+				last.Length += len;
+				mLength += len;
+				return;
+			}
+		}
+
+		Segment seg = { buf, offset, len };
+		buf->ref();
+		mSegments.push_back(seg);
+		mLength += len;
+	}
+
+	void append(const IoBufferChain& that)
+	{
+		for (u32 i = 0; i < that.segmentCount(); ++i)
+		{
+			const Segment &seg = that.segment(i);
+			append(seg.Buffer, seg.Offset, seg.Length);
+		}
+	}
+
+	// Return a chain sharing 'len' bytes from 'offset' of this chain.
+	IoBufferChain slice(u32 offset, u32 len) const
+	{
+		xpfAssert(("Slice out of range.", (offset + len) <= mLength));
+		IoBufferChain ret;
+		for (u32 i = 0; (i < (u32)mSegments.size()) && (len > 0); ++i)
+		{
+			const Segment &seg = mSegments[i];
+			if (offset >= seg.Length)
+			{
+				offset -= seg.Length;
+				continue;
+			}
+			const u32 n = (seg.Length - offset < len) ? (seg.Length - offset) : len;
+			ret.append(seg.Buffer, seg.Offset + offset, n);
+			len -= n;
+			offset = 0;
+		}
+		return ret;
+	}
+
+	// Drop 'bytes' from the front of this chain.
+	void trimFront(u32 bytes)
+	{
+		xpfAssert(("Trimming beyond the length.", bytes <= mLength));
+		u32 drop = 0;
+		while ((drop < (u32)mSegments.size()) && (bytes > 0))
+		{
+			Segment &seg = mSegments[drop];
+			if (bytes < seg.Length)
+			{
+				seg.Offset += bytes;
+				seg.Length -= bytes;
+				mLength -= bytes;
+				bytes = 0;
+				break;
+			}
+			bytes -= seg.Length;
+			mLength -= seg.Length;
+			seg.Buffer->unref();
+			++drop;
+		}
+		mSegments.erase(mSegments.begin(), mSegments.begin() + drop);
+	}
+
+	// Copy up to 'len' bytes from 'offset' of this chain to 'dst'.
+	// Returns the number of bytes copied.
+	u32 copyTo(c8 *dst, u32 len, u32 offset = 0) const
+	{
+		u32 copied = 0;
+		for (u32 i = 0; (i < (u32)mSegments.size()) && (copied < len); ++i)
+		{
+			const Segment &seg = mSegments[i];
+			if (offset >= seg.Length)
+			{
+				offset -= seg.Length;
+				continue;
+			}
+			u32 n = seg.Length - offset;
+			if (n > len - copied)
+				n = len - copied;
+			::memcpy(dst + copied, seg.Buffer->data() + seg.Offset + offset, n);
+			copied += n;
+			offset = 0;
+		}
+		return copied;
+	}
+
+	void clear()
+	{
+		for (u32 i = 0; i < (u32)mSegments.size(); ++i)
+			mSegments[i].Buffer->unref();
+		mSegments.clear();
+		mLength = 0;
+	}
+
+	void swap(IoBufferChain& that)
+	{
+		mSegments.swap(that.mSegments);
+		const u32 len = mLength;
+		mLength = that.mLength;
+		that.mLength = len;
+	}
+
+	inline bool           empty() const        { return (mLength == 0); }
+	inline u32            length() const       { return mLength; }
+	inline u32            segmentCount() const { return (u32)mSegments.size(); }
+	inline const Segment& segment(u32 i) const { return mSegments[i]; }
+
+private:
+	std::vector<Segment> mSegments;
+	u32                  mLength;
+};
+
+} // end of namespace xpf
+
+#endif // _XPF_IOBUFFER_HEADER_
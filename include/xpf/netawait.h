@@ -0,0 +1,276 @@
+/*******************************************************************************
+ * Copyright (c) 2013 matt@moregeek.com.tw
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ * 3. This notice may not be removed or altered from any source
+ *    distribution.
+ ********************************************************************************/ 
+
+#ifndef _XPF_NETAWAIT_HEADER_
+#define _XPF_NETAWAIT_HEADER_
+
+#include "platform.h"
+#include "netendpoint.h"
+#include "netiomux.h"
+#include "allocators.h"
+
+/*****
+ * C++20 co_await adapters for NetIoMux operations.
+ *
+ * Header-only. Available only when the compiler implements C++20
+ * coroutines, in which case XPF_HAS_NETAWAIT is defined as 1.
+ *
+ * A coroutine returning NetTask starts running immediately and
+ * runs until its first co_await on one of the awaitables below.
+ * It is then resumed from NetIoMuxCallback::onIoCompleted() on
+ * the thread which calls NetIoMux::runOnce(), and its frame is
+ * released once it returns. For example:
+ *
+ *   NetTask echo(NetIoMux *mux, NetEndpoint *ep)
+ *   {
+ *       c8 buf[512];
+ *       s32 bytes;
+ *       while ((bytes = co_await awaitRecv(mux, ep, buf, 512)) > 0)
+ *           co_await awaitSend(mux, ep, buf, bytes);
+ *   }
+ *
+ * Coroutine frames are allocated from the BuddyAllocator in slot
+ * XPF_NETAWAIT_FRAME_SLOT if it has been created, or from the global
+ * heap otherwise. As BuddyAllocator is not thread-safe, tasks should
+ * be started from the same thread which runs the mux in that case.
+ * Use BasicNetTask with another allocator getter (see Allocator<>
+ * in allocators.h) to allocate frames elsewhere.
+ */
+
+#if defined(__cpp_impl_coroutine) && (__cpp_impl_coroutine >= 201902L)
+#define XPF_HAS_NETAWAIT 1
+
+#include <coroutine>
+#include <exception>
+#include <new>
+
+#ifndef XPF_NETAWAIT_FRAME_SLOT
+#define XPF_NETAWAIT_FRAME_SLOT (0)
+#endif
+
+namespace xpf
+{
+
+template < typename ALLOC_GETTER >
+class BasicNetTask
+{
+public:
+	struct promise_type
+	{
+		BasicNetTask get_return_object() { return BasicNetTask(); }
+		std::suspend_never initial_suspend() noexcept { return std::suspend_never(); }
+		std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+		void return_void() {}
+		void unhandled_exception()
+		{
+			xpfAssert(("Unhandled exception in a NetTask.", false));
+			std::terminate();
+		}
+
+		// Each frame is prefixed with a header which records the
+		// allocator it came from (0 for the global heap). The header
+		// is 16 bytes to keep the 16-bytes alignment of frames.
+		static void* operator new(std::size_t size)
+		{
+			typename ALLOC_GETTER::ALLOCATOR_TYPE *pool = ALLOC_GETTER::get();
+			const std::size_t total = size + FrameHeaderSize;
+			void *p = (pool) ? pool->alloc((u32)total) : ::operator new(total);
+			if (p == 0)
+				throw std::bad_alloc();
+			*(typename ALLOC_GETTER::ALLOCATOR_TYPE**)p = pool;
+			return (c8*)p + FrameHeaderSize;
+		}
+
+		static void operator delete(void *p, std::size_t size)
+		{
+			c8 *base = (c8*)p - FrameHeaderSize;
+			typename ALLOC_GETTER::ALLOCATOR_TYPE *pool = *(typename ALLOC_GETTER::ALLOCATOR_TYPE**)base;
+			if (pool)
+				pool->dealloc(base, (u32)(size + FrameHeaderSize));
+			else
+				::operator delete(base);
+		}
+
+		static const std::size_t FrameHeaderSize = 16;
+	};
+};
+
+typedef BasicNetTask< AllocInstOf<BuddyAllocator, XPF_NETAWAIT_FRAME_SLOT> > NetTask;
+
+// Common base of all awaitables: issues one async operation on
+// suspension and resumes the coroutine on its completion.
+class NetIoAwaiter : public NetIoMuxCallback
+{
+public:
+	bool await_ready() const noexcept { return false; }
+
+	void onIoCompleted(NetIoMux::EIoType type, NetEndpoint::EError ec, NetEndpoint *sep, vptr tepOrPeer, const c8 *buf, u32 len)
+	{
+		mError = ec;
+		mTepOrPeer = tepOrPeer;
+		mLength = len;
+		if (mErrorOut)
+			*mErrorOut = ec;
+		// NOTE: 'this' lives in the coroutine frame which
+		//       may have been released after resume().
+		mHandle.resume();
+	}
+
+protected:
+	NetIoAwaiter(NetIoMux *mux, NetEndpoint *ep, NetEndpoint::EError *ec)
+		: mMux(mux), mEp(ep), mErrorOut(ec), mError(NetEndpoint::EE_SUCCESS)
+		, mTepOrPeer(0), mLength(0) {}
+
+	NetIoMux                *mMux;
+	NetEndpoint             *mEp;
+	NetEndpoint::EError     *mErrorOut;
+	NetEndpoint::EError      mError;
+	vptr                     mTepOrPeer;
+	u32                      mLength;
+	std::coroutine_handle<>  mHandle;
+};
+
+// Resumes with the received bytes (0 on orderly shutdown) or -1 on error.
+class NetRecvAwaiter : public NetIoAwaiter
+{
+public:
+	NetRecvAwaiter(NetIoMux *mux, NetEndpoint *ep, c8 *buf, u32 buflen, NetEndpoint::EError *ec)
+		: NetIoAwaiter(mux, ep, ec), mBuf(buf), mBufLen(buflen) {}
+
+	void await_suspend(std::coroutine_handle<> h)
+	{
+		mHandle = h;
+		mMux->asyncRecv(mEp, mBuf, mBufLen, this);
+	}
+
+	s32 await_resume() const { return (mError == NetEndpoint::EE_SUCCESS) ? (s32)mLength : -1; }
+
+private:
+	c8  *mBuf;
+	u32  mBufLen;
+};
+
+// Resumes with the sent bytes or -1 on error.
+class NetSendAwaiter : public NetIoAwaiter
+{
+public:
+	NetSendAwaiter(NetIoMux *mux, NetEndpoint *ep, const c8 *buf, u32 buflen, NetEndpoint::EError *ec)
+		: NetIoAwaiter(mux, ep, ec), mBuf(buf), mBufLen(buflen) {}
+
+	void await_suspend(std::coroutine_handle<> h)
+	{
+		mHandle = h;
+		mMux->asyncSend(mEp, mBuf, mBufLen, this);
+	}
+
+	s32 await_resume() const { return (mError == NetEndpoint::EE_SUCCESS) ? (s32)mLength : -1; }
+
+private:
+	const c8 *mBuf;
+	u32       mBufLen;
+};
+
+// Resumes with the accepted endpoint (already joined) or 0 on error.
+class NetAcceptAwaiter : public NetIoAwaiter
+{
+public:
+	NetAcceptAwaiter(NetIoMux *mux, NetEndpoint *ep, NetEndpoint::EError *ec)
+		: NetIoAwaiter(mux, ep, ec) {}
+
+	void await_suspend(std::coroutine_handle<> h)
+	{
+		mHandle = h;
+		mMux->asyncAccept(mEp, this);
+	}
+
+	NetEndpoint* await_resume() const { return (mError == NetEndpoint::EE_SUCCESS) ? (NetEndpoint*)mTepOrPeer : 0; }
+};
+
+// Resumes with true if connected.
+class NetConnectAwaiter : public NetIoAwaiter
+{
+public:
+	NetConnectAwaiter(NetIoMux *mux, NetEndpoint *ep, const c8 *host, const c8 *serviceOrPort, NetEndpoint::EError *ec)
+		: NetIoAwaiter(mux, ep, ec), mHost(host), mService(serviceOrPort) {}
+
+	void await_suspend(std::coroutine_handle<> h)
+	{
+		mHandle = h;
+		mMux->asyncConnect(mEp, mHost, mService, this);
+	}
+
+	bool await_resume() const { return (mError == NetEndpoint::EE_SUCCESS); }
+
+private:
+	const c8 *mHost;
+	const c8 *mService;
+};
+
+// Resumes from the thread which runs the mux. Can be used to hop
+// onto the mux thread, or to let other completions be dispatched.
+class NetWakeupAwaiter : public NetIoAwaiter
+{
+public:
+	explicit NetWakeupAwaiter(NetIoMux *mux)
+		: NetIoAwaiter(mux, 0, 0) {}
+
+	void await_suspend(std::coroutine_handle<> h)
+	{
+		mHandle = h;
+		mMux->asyncWakeup(this);
+	}
+
+	void await_resume() const {}
+};
+
+inline NetRecvAwaiter awaitRecv(NetIoMux *mux, NetEndpoint *ep, c8 *buf, u32 buflen, NetEndpoint::EError *ec = 0)
+{
+	return NetRecvAwaiter(mux, ep, buf, buflen, ec);
+}
+
+inline NetSendAwaiter awaitSend(NetIoMux *mux, NetEndpoint *ep, const c8 *buf, u32 buflen, NetEndpoint::EError *ec = 0)
+{
+	return NetSendAwaiter(mux, ep, buf, buflen, ec);
+}
+
+inline NetAcceptAwaiter awaitAccept(NetIoMux *mux, NetEndpoint *ep, NetEndpoint::EError *ec = 0)
+{
+	return NetAcceptAwaiter(mux, ep, ec);
+}
+
+// NOTE: 'host' and 'serviceOrPort' are copied by the mux once the awaiter is suspended.
+inline NetConnectAwaiter awaitConnect(NetIoMux *mux, NetEndpoint *ep, const c8 *host, const c8 *serviceOrPort, NetEndpoint::EError *ec = 0)
+{
+	return NetConnectAwaiter(mux, ep, host, serviceOrPort, ec);
+}
+
+inline NetWakeupAwaiter awaitWakeup(NetIoMux *mux)
+{
+	return NetWakeupAwaiter(mux);
+}
+
+}; // end of namespace xpf
+
+#endif // __cpp_impl_coroutine
+
+#endif // _XPF_NETAWAIT_HEADER_
@@ -0,0 +1,111 @@
+/*******************************************************************************
+ * Copyright (c) 2013 matt@moregeek.com.tw
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ * 3. This notice may not be removed or altered from any source
+ *    distribution.
+ ********************************************************************************/ 
+
+#ifndef _XPF_NETCONNPOOL_HEADER_
+#define _XPF_NETCONNPOOL_HEADER_
+
+#include "platform.h"
+#include "netendpoint.h"
+#include "netiomux.h"
+
+namespace xpf
+{
+
+class NetConnPool;
+struct NetConnPoolDetails;
+
+class NetConnPoolCallback
+{
+public:
+	// Called when a checkout completes. On success 'ep' is a connected
+	// endpoint joined to the mux of the pool, which the caller shall
+	// return by NetConnPool::checkin() or NetConnPool::discard(), and
+	// never delete. Otherwise 'ep' is 0 and 'ec' is the error of the
+	// connect attempt (EE_RESOLVE or EE_CONNECT).
+	virtual void onCheckout(NetConnPool *pool, NetEndpoint::EError ec, NetEndpoint *ep, vptr userData) = 0;
+};
+
+/*****
+ * A pool of outbound TCP connections keyed by destination (host and
+ * service), to avoid connect latency and TIME_WAIT buildup when the
+ * same upstreams are connected over and over.
+ *
+ * A checkout is served by an idle connection of the destination if
+ * there is a healthy one, or by a new connection if the destination has
+ * less than 'maxPerDest' connections (idle, in use or connecting). Else
+ * the request waits until a connection of the destination is checked in
+ * or discarded. Waiters are served in order.
+ *
+ * Idle connections are health checked on checkout: Those closed by the
+ * peer, failed or having unexpected data to read are discarded. A
+ * connection idle for more than 'idleTimeoutMs' is closed by a timer of
+ * the mux, and so is the oldest one when a destination has more than
+ * 'maxIdlePerDest' idle connections.
+ *
+ * The callback is called from the mux worker when a new connection is
+ * made, or from the calling thread when a checkout, checkin or discard
+ * call can serve a request at once. It may call back into the pool.
+ *
+ * All the calls are thread-safe. Delete the pool when no checkout is
+ * pending and the mux is no longer running. Connections still checked
+ * out are closed with it.
+ */
+class XPF_API NetConnPool
+{
+public:
+	NetConnPool(NetIoMux *mux, u32 maxPerDest = 8, u32 maxIdlePerDest = 8, u32 idleTimeoutMs = 30000);
+	~NetConnPool();
+
+	// Request a connection to 'host':'serviceOrPort'. Completes with
+	// cb->onCheckout(this, ec, ep, userData).
+	void checkout(const c8 *host, const c8 *serviceOrPort, NetConnPoolCallback *cb, vptr userData = 0);
+
+	// Return a connection to the pool when done with it. No async
+	// operation of 'ep' shall be pending. It is kept for reuse unless
+	// 'reusable' is false or it is not connected any more.
+	void checkin(NetEndpoint *ep, bool reusable = true);
+
+	// Close a checked out connection instead of returning it.
+	void discard(NetEndpoint *ep);
+
+	// Close all the idle connections.
+	void purge();
+
+	NetIoMux* getMux() const;
+	u32       getConnectionCount() const; // in use, idle and connecting.
+	u32       getIdleCount() const;
+	u32       getWaiterCount() const;
+	u64       getReuseCount() const;      // checkouts served by idle connections.
+	u64       getConnectCount() const;    // connections made.
+
+private:
+	// Non-copyable
+	NetConnPool(const NetConnPool& that) {}
+	NetConnPool& operator = (const NetConnPool& that) { return *this; }
+
+	NetConnPoolDetails *mDetails;
+};
+
+}; // end of namespace xpf
+
+#endif // _XPF_NETCONNPOOL_HEADER_
@@ -0,0 +1,108 @@
+/*******************************************************************************
+ * Copyright (c) 2013 matt@moregeek.com.tw
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ * 3. This notice may not be removed or altered from any source
+ *    distribution.
+ ********************************************************************************/ 
+
+#ifndef _XPF_NETCOROUTINE_HEADER_
+#define _XPF_NETCOROUTINE_HEADER_
+
+#include "platform.h"
+#include "netendpoint.h"
+#include "netiomux.h"
+
+namespace xpf
+{
+
+struct NetCoSchedulerDetails;
+
+/*****
+ * Synchronous-style networking on top of coroutines and NetIoMux.
+ *
+ * A NetCoScheduler owns a set of coroutines running on the thread
+ * which calls run(). Inside a coroutine body, recv()/send()/accept()/
+ * connect() issue the corresponding async operation on the mux and
+ * switch back to the scheduler. The coroutine is resumed with the
+ * result once the operation completes. This keeps the per-connection
+ * state on the coroutine stack instead of in callback state machines.
+ *
+ * General usage:
+ *   1. Create a scheduler on an existing NetIoMux. The scheduler
+ *      drives the mux by calling runOnce() itself, so the mux shall
+ *      not be run by any other thread.
+ *   2. Call spawn() to create coroutines. spawn() can be called
+ *      either before run() or from inside a running coroutine.
+ *   3. Call run() on the thread which owns the scheduler. It returns
+ *      when all coroutines have finished or stop() has been called.
+ *
+ * Endpoints used with a scheduler must be joined to its mux. Accepted
+ * endpoints are joined automatically. Every pending operation must be
+ * completed (or its endpoint departed) before its coroutine is
+ * deleted along with the scheduler.
+ */
+class XPF_API NetCoScheduler
+{
+public:
+	typedef void (*CoBody)(NetCoScheduler *sched, vptr data);
+
+	explicit NetCoScheduler(NetIoMux *mux);
+	~NetCoScheduler();
+
+	// Create a coroutine which calls 'body' with 'data' once the
+	// scheduler runs it. Give 'stackSize' as 0 to use the platform
+	// default value.
+	bool spawn(CoBody body, vptr data, u32 stackSize = 0);
+
+	// Run all coroutines until they have finished or stop() is called.
+	// 'pollMs' is the timeout passed to NetIoMux::runOnce() while all
+	// coroutines are waiting for I/O.
+	void run(u32 pollMs = 10);
+	void stop();
+
+	// Number of unfinished coroutines.
+	u32  count() const;
+
+	NetIoMux* getMux() const;
+
+	// Blocking operations for coroutine bodies only. They suspend the
+	// calling coroutine until the async operation completes and report
+	// the result via 'ec' if given.
+	// recv() returns the received bytes (0 on orderly shutdown), send()
+	// returns the sent bytes. Both return -1 on error.
+	s32          recv   (NetEndpoint *ep, c8 *buf, u32 buflen, NetEndpoint::EError *ec = 0);
+	s32          send   (NetEndpoint *ep, const c8 *buf, u32 buflen, NetEndpoint::EError *ec = 0);
+	NetEndpoint* accept (NetEndpoint *ep, NetEndpoint::EError *ec = 0);
+	bool         connect(NetEndpoint *ep, const c8 *host, const c8 *serviceOrPort, NetEndpoint::EError *ec = 0);
+	bool         connect(NetEndpoint *ep, const c8 *host, u32 port, NetEndpoint::EError *ec = 0);
+
+	// Give other runnable coroutines a chance to run.
+	void         yield();
+
+private:
+	// Non-copyable
+	NetCoScheduler(const NetCoScheduler& that) {}
+	NetCoScheduler& operator = (const NetCoScheduler& that) { return *this; }
+
+	NetCoSchedulerDetails *mDetails;
+};
+
+}; // end of namespace xpf
+
+#endif // _XPF_NETCOROUTINE_HEADER_
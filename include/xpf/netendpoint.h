@@ -63,6 +63,8 @@ public:
 		EE_ACCEPT,
 		EE_SHUTDOWN,
 		EE_WOULDBLOCK,
+		EE_QUEUE_FULL,
+		EE_FILEIO,
 
 		EE_MAX,
 		EE_UNKNOWN,
@@ -85,11 +87,21 @@ public:
 	static const u32 ProtocolUDP  = 0x2;
 	static const u32 ProtocolIPv4 = 0x100;
 	static const u32 ProtocolIPv6 = 0x200;
+	// In-process stream endpoints for NetIoMux (with ProtocolTCP): No
+	// socket or syscall is involved. A listener created with a name and
+	// a numeric port is connectable by NetIoMux::asyncConnect() once
+	// joined to a mux. They only support the async operations of
+	// NetIoMux listed in NetIoMux::setMemoryFaults(), and shutdown().
+	static const u32 ProtocolMemory = 0x400;
 
 	static NetEndpoint* create(u32 protocol);
-	static NetEndpoint* create(u32 protocol, const c8 *addr, const c8 *serviceOrPort, u32 *errorcode = 0, u32 backlog = 10);
+	static NetEndpoint* create(u32 protocol, const c8 *addr, const c8 *serviceOrPort, u32 *errorcode = 0, u32 backlog = 10, u32 fastOpenQueue = 0);
 	static void         release(NetEndpoint* ep);
 	static bool         resolvePeer(u32 protocol, Peer &peer, const c8 * host, const c8 * serviceOrPort);
+	// Resolve up to 'maxPeers' addresses in the order given by the resolver.
+	// Addresses of both families are resolved if 'protocol' has both
+	// ProtocolIPv4 and ProtocolIPv6. Returns the number of addresses.
+	static u32          resolvePeers(u32 protocol, Peer *peers, u32 maxPeers, const c8 * host, const c8 * serviceOrPort);
 
 	explicit NetEndpoint(u32 protocol);
 	virtual ~NetEndpoint();
@@ -98,7 +110,11 @@ public:
 	bool         connect(const c8 *addr, const c8 *serviceOrPort, u32 *errorcode = 0);
 
 	// Incoming endpoint only
-	bool         listen (const c8 *addr, const c8 *serviceOrPort, u32 *errorcode = 0, u32 backlog = 10);
+	// A non-zero 'fastOpenQueue' enables TCP Fast Open on a TCP endpoint and
+	// limits the number of pending connections which carry data in SYN.
+	// It is a best-effort option: Connections fall back to the regular
+	// handshake if the host does not support or has disabled it.
+	bool         listen (const c8 *addr, const c8 *serviceOrPort, u32 *errorcode = 0, u32 backlog = 10, u32 fastOpenQueue = 0);
 	NetEndpoint* accept (u32 *errorcode = 0);
 
 	s32          recv     ( c8 *buf, s32 len, u32 *errorcode = 0);
@@ -139,6 +155,7 @@ private:
 	vptr             pUserData;
 
 	friend class NetIoMuxImpl;
+	friend class NetIoMuxMemory;
 };
 
 }; // end of namespace xpf
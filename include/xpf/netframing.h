@@ -0,0 +1,117 @@
+/*******************************************************************************
+ * Copyright (c) 2013 matt@moregeek.com.tw
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ * 3. This notice may not be removed or altered from any source
+ *    distribution.
+ ********************************************************************************/ 
+
+#ifndef _XPF_NETFRAMING_HEADER_
+#define _XPF_NETFRAMING_HEADER_
+
+#include "platform.h"
+#include "netendpoint.h"
+#include "netiomux.h"
+
+namespace xpf
+{
+
+class NetFrameReader;
+struct NetFrameReaderDetails;
+
+class NetFrameCallback
+{
+public:
+	// Called with EE_SUCCESS for every complete frame. 'frame' points to
+	// the payload (without its length prefix or delimiter) inside the
+	// read-ahead buffer and is only valid during this call.
+	// Otherwise the reader has stopped and 'frame' is null: 'ec' is
+	// EE_SHUTDOWN if the peer has shut down the connection, or EE_RECV on
+	// receive errors and malformed or oversized frames.
+	virtual void onFrame(NetFrameReader *reader, NetEndpoint::EError ec, const c8 *frame, u32 len) = 0;
+};
+
+/*****
+ * Per-connection framing on a read-ahead buffer.
+ *
+ * Instead of issuing small receives to find message boundaries, the
+ * reader receives as much as the buffer can hold at once and emits all
+ * complete frames found in it. Partial frames are kept for the next
+ * receive. The buffer grows to hold a frame larger than itself, up to
+ * the maximum frame size.
+ *
+ * Data can be driven into the reader by any of:
+ *   1. start(): Keep an async receive pending on the mux. Frames are
+ *      emitted from the mux worker. The endpoint must be joined.
+ *   2. pump():  Do one blocking NetEndpoint::recv().
+ *   3. feed():  Copy data obtained elsewhere.
+ * A reader shall be driven by one thread at a time.
+ *
+ * The callback may call stop() to stop emitting frames. It shall not
+ * delete the reader except for the final (non EE_SUCCESS) call. In async
+ * mode, depart the endpoint before deleting a reader which is running.
+ */
+class XPF_API NetFrameReader
+{
+public:
+	enum EFraming
+	{
+		EF_VARINT = 0, // unsigned LEB128 length prefix (as protobuf)
+		EF_U16,        // 2 bytes length prefix in network byte order
+		EF_U32,        // 4 bytes length prefix in network byte order
+		EF_DELIMITER,  // frames terminated by a delimiter sequence
+	};
+
+	// Default to EF_U32 framing. 'bufferSize' is the initial size of
+	// the read-ahead buffer, which is also the preferred receive size.
+	NetFrameReader(NetEndpoint *ep, NetFrameCallback *cb, u32 bufferSize = 65536);
+	~NetFrameReader();
+
+	// Frames longer than 'maxFrameSize' bytes fail the reader with EE_RECV.
+	void setLengthPrefixed(EFraming type, u32 maxFrameSize = 0x100000);
+	void setDelimited(const c8 *delim, u32 delimLen, u32 maxFrameSize = 0x100000);
+
+	// Async mode: Keep receiving via 'mux' until stopped or failed.
+	bool start(NetIoMux *mux);
+	void stop();
+	bool isRunning() const;
+
+	// Sync mode: Receive once and emit complete frames. Returns the
+	// number of frames emitted, or -1 if the reader has stopped.
+	s32  pump();
+
+	// Append 'len' bytes and emit complete frames. Returns the number
+	// of frames emitted, or -1 if the reader has stopped.
+	s32  feed(const c8 *data, u32 len);
+
+	NetEndpoint* getEndpoint() const;
+	u32          getBufferedBytes() const; // bytes of the pending partial frame.
+	u64          getRecvCount() const;     // receives done so far.
+	u64          getFrameCount() const;    // frames emitted so far.
+
+private:
+	// Non-copyable
+	NetFrameReader(const NetFrameReader& that) {}
+	NetFrameReader& operator = (const NetFrameReader& that) { return *this; }
+
+	NetFrameReaderDetails *mDetails;
+};
+
+}; // end of namespace xpf
+
+#endif // _XPF_NETFRAMING_HEADER_
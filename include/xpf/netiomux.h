@@ -31,7 +31,11 @@ namespace xpf
 {
 
 class NetIoMuxImpl;
+class NetIoMuxMemory;
+class NetIoMuxTracer;
 class NetIoMuxCallback;
+class IoBuffer;
+class IoBufferChain;
 
 class XPF_API NetIoMux
 {
@@ -62,6 +66,33 @@ public:
 		EIT_SENDTO,
 		EIT_ACCEPT,
 		EIT_CONNECT,
+		EIT_WAKEUP,
+		EIT_BROADCAST,
+		EIT_FILEREAD,
+		EIT_FILEWRITE,
+		EIT_TIMER,
+	};
+
+	// Scheduling classes of endpoints (see setPriority()).
+	enum EPriority
+	{
+		EPR_LOW = 0,
+		EPR_NORMAL,
+		EPR_HIGH,
+	};
+
+	enum EFileSync
+	{
+		EFS_NONE = 0,
+		EFS_DATASYNC, // fdatasync() after writing.
+		EFS_SYNC,     // fsync() after writing.
+	};
+
+	enum EFdEvent
+	{
+		EFE_READ   = 0x1,
+		EFE_WRITE  = 0x2,
+		EFE_HANGUP = 0x4, // hang up or error. Reported regardless of interest.
 	};
 
 	NetIoMux();
@@ -80,14 +111,239 @@ public:
 	void asyncRecvFrom(NetEndpoint *ep, c8 *buf, u32 buflen, NetIoMuxCallback *cb = 0);
 	void asyncSend(NetEndpoint *ep, const c8 *buf, u32 buflen, NetIoMuxCallback *cb = 0);
 	void asyncSendTo(NetEndpoint *ep, const NetEndpoint::Peer *peer, const c8 *buf, u32 buflen, NetIoMuxCallback *cb = 0);
+
+	// UDP segmentation: Send 'buf' to 'peer' as datagrams of 'segmentSize'
+	// bytes each (the last one may be shorter) in a single operation. On
+	// Linux trains of datagrams are passed to the kernel at once with
+	// UDP_SEGMENT (GSO), on Windows with UDP_SEND_MSG_SIZE (and fail
+	// with EE_SEND if the host lacks it), on BSD one by one. Completes
+	// as EIT_SENDTO with 'len' of the whole buffer and the SegmentSize
+	// of the completion record set, once all the datagrams are sent.
+	void asyncSendSegments(NetEndpoint *ep, const NetEndpoint::Peer *peer, const c8 *buf, u32 buflen, u32 segmentSize, NetIoMuxCallback *cb = 0);
 	void asyncAccept(NetEndpoint *ep, NetIoMuxCallback *cb = 0);
 	void asyncConnect(NetEndpoint *ep, const c8 *host, const c8 *serviceOrPort, NetIoMuxCallback *cb = 0);
 	void asyncConnect(NetEndpoint *ep, const c8 *host, u32 port, NetIoMuxCallback *cb = 0); // A varient asyncConnect() which takes a numeric port number. 
 
-	// Join/depart the endpoint to/from netiomux.
+	// TCP Fast Open: Connect and send 'len' bytes of initial data in one
+	// operation. Where supported, the data goes along with SYN to servers
+	// listening with a fast open queue (see NetEndpoint::listen()), which
+	// saves a round trip for connections made once a cookie is cached.
+	// Otherwise it falls back to a regular connect followed by a send.
+	// 'data' shall remain valid until the completion, which passes it as
+	// 'buf' with 'len' of the sent bytes. 'ec' is EE_CONNECT if the
+	// handshake failed, or EE_SEND if the data failed to be sent after it.
+	void asyncConnect(NetEndpoint *ep, const c8 *host, const c8 *serviceOrPort, const c8 *data, u32 len, NetIoMuxCallback *cb = 0);
+	void asyncConnect(NetEndpoint *ep, const c8 *host, u32 port, const c8 *data, u32 len, NetIoMuxCallback *cb = 0);
+
+	// Happy Eyeballs (RFC 8305): Race TCP connect attempts to all the
+	// addresses of 'host', alternating IPv6 and IPv4. An attempt is
+	// started every 'attemptDelayMs', or as soon as the previous one
+	// fails. The first established connection wins and the others are
+	// cancelled. Completes with cb->onIoCompleted(EIT_CONNECT, ec, ep,
+	// peer, 0, 0), where 'ep' is a new endpoint joined to this mux and
+	// connected to 'peer' (a NetEndpoint::Peer*, valid during the call).
+	// The caller owns 'ep' and shall depart and delete it after use. On
+	// failure 'ep' is 0 and 'ec' is EE_RESOLVE or EE_CONNECT.
+	void asyncConnectAny(const c8 *host, const c8 *serviceOrPort, NetIoMuxCallback *cb = 0, u32 attemptDelayMs = 250);
+	// The variant racing the given addresses (up to 16).
+	void asyncConnectAny(const NetEndpoint::Peer *peers, u32 count, NetIoMuxCallback *cb = 0, u32 attemptDelayMs = 250);
+
+	// Zero-copy variants: The mux holds a reference of every involved
+	// IoBuffer until the operation completes, so callers may unref theirs
+	// right after the call. asyncRecv() receives into the tail room of 'buf'
+	// and commits the received bytes. Its completion passes 'buf' as
+	// 'tepOrPeer' and the received range as 'buf'/'len'. asyncSend() sends
+	// the whole chain with vectored I/O and completes with a null 'buf' and
+	// 'len' of the sent bytes. Chain sends do not take part in coalescing.
+	// Not supported on in-memory endpoints, where they complete with
+	// EE_INVALID_OP and 'buf'/'chain' left untouched.
+	void asyncRecv(NetEndpoint *ep, IoBuffer *buf, NetIoMuxCallback *cb = 0);
+	void asyncSend(NetEndpoint *ep, const IoBufferChain &chain, NetIoMuxCallback *cb = 0);
+
+	// Send the same payload to each of 'count' endpoints in 'eps'. The
+	// payload is shared by all the sends rather than copied, and the mux
+	// releases its references after the last of them completes. Instead of
+	// per-endpoint completions, a single aggregate completion is emitted:
+	// cb->onIoCompleted(EIT_BROADCAST, ec, 0, 0, 0, delivered), where
+	// 'delivered' is the number of endpoints the whole payload was sent to
+	// and 'ec' is EE_SUCCESS if that equals 'count' or EE_SEND otherwise.
+	// Endpoints not joined or departed before sending count as failures.
+	void asyncBroadcast(NetEndpoint *const *eps, u32 count, const IoBufferChain &payload, NetIoMuxCallback *cb = 0);
+	void asyncBroadcast(NetEndpoint *const *eps, u32 count, IoBuffer *payload, NetIoMuxCallback *cb = 0);
+
+	// One-shot timer: After 'delayMs' milliseconds, a worker calls
+	// cb->onIoCompleted(EIT_TIMER, EE_SUCCESS, 0, userData, 0, 0).
+	// Returns the id of the timer. cancelTimer() returns true if the
+	// timer is cancelled before it expires, in which case no completion
+	// is emitted. A runOnce() call waits no longer than the earliest
+	// timer to expire, and the next call emits it. Safe to be called
+	// from any thread.
+	u64  asyncTimer(u32 delayMs, NetIoMuxCallback *cb = 0, vptr userData = 0);
+	bool cancelTimer(u64 timerId);
+
+	// Wake up a thread blocking in runOnce() and have it call
+	// cb->onIoCompleted(EIT_WAKEUP, EE_SUCCESS, 0, 0, 0, 0).
+	// Safe to be called from any thread.
+	void asyncWakeup(NetIoMuxCallback *cb = 0);
+
+	// Join/depart the endpoint to/from netiomux. Operations still pending
+	// on a departed endpoint complete with an error through runOnce().
 	bool join(NetEndpoint *ep);
 	bool depart(NetEndpoint *ep);
 
+	// Send coalescing: When enabled on a joined endpoint, consecutive queued
+	// asyncSend() operations are flushed with a single vectored send once the
+	// socket becomes writable. Completion callbacks are still delivered per
+	// operation, and each of them reports its full buffer length on success.
+	// Returns false if the platform multiplexer does not support it.
+	bool setSendCoalescing(NetEndpoint *ep, bool val = true);
+
+	// UDP receive offload: When enabled on a joined UDP endpoint, the host
+	// may coalesce consecutive datagrams of the same size from the same
+	// peer (UDP_GRO), and one asyncRecvFrom() receives them all at once.
+	// The SegmentSize of the completion record tells the datagram size
+	// (the last one may be shorter), so size the buffers for 64 KB.
+	// Returns false if the host or the platform multiplexer does not
+	// support it.
+	bool setReceiveOffload(NetEndpoint *ep, bool val = true);
+
+	// Write-side backpressure: Bytes of queued (not yet completed) send
+	// operations are accounted per endpoint. Once they reach 'highBytes',
+	// NetIoMuxCallback::onWriteWatermark() is called with 'aboveHigh' set
+	// and isWriteBlocked() returns true until they drain to 'lowBytes' or
+	// less, which is notified by another onWriteWatermark() call.
+	// Give 'highBytes' as 0 to disable.
+	bool setWriteWatermarks(NetEndpoint *ep, u32 lowBytes, u32 highBytes);
+	bool isWriteBlocked(NetEndpoint *ep) const;
+	u32  getQueuedWriteBytes(NetEndpoint *ep) const;
+
+	// Readiness of arbitrary file descriptors (pipes, eventfd, timerfd,
+	// signalfd, ...) which are not NetEndpoints. Once 'fd' becomes ready
+	// for any of 'events' (EFdEvent flags), a worker calls
+	// cb->onFdReady(fd, readyEvents, userData). It is level-triggered: The
+	// callback is called again by the next runOnce() if the descriptor is
+	// still ready, so it shall consume the readiness (e.g. read an
+	// eventfd). The same descriptor is never dispatched to more than one
+	// worker at a time. Callbacks may modify or unwatch any descriptor.
+	// Unwatch a descriptor before closing it. The mux neither changes
+	// the blocking mode of 'fd' nor closes it.
+	// Returns false if 'fd' is watched already or cannot be watched, or
+	// if the platform multiplexer does not support it (IOCP).
+	bool watchFd(s32 fd, u32 events, NetIoMuxCallback *cb = 0, vptr userData = 0);
+	bool modifyFd(s32 fd, u32 events); // 0 to pause.
+	bool unwatchFd(s32 fd);
+
+	// Asynchronous file I/O at absolute offsets. Operations are performed
+	// by an internal pool of I/O threads and completed by a mux worker
+	// with cb->onIoCompleted(EIT_FILEREAD/EIT_FILEWRITE, ec, 0, userData,
+	// buf, bytes). A read may complete short at the end of file. A write
+	// completes after all bytes are written and, per 'sync', flushed to
+	// storage. Give 'len' as 0 to sync only. 'ec' is EE_FILEIO on failure,
+	// or EE_QUEUE_FULL if the pool queue is full.
+	// 'fd' is a file descriptor (a CRT one on Windows).
+	void asyncFileRead(s32 fd, c8 *buf, u32 len, u64 offset, NetIoMuxCallback *cb = 0, vptr userData = 0);
+	void asyncFileWrite(s32 fd, const c8 *buf, u32 len, u64 offset, EFileSync sync = EFS_NONE, NetIoMuxCallback *cb = 0, vptr userData = 0);
+
+	// Number of I/O threads (2 by default) and the cap of queued file
+	// operations (1024 by default, 0 for no limit). Call it before the
+	// first file operation.
+	void setFileIoThreads(u32 threads, u32 maxQueued = 1024);
+
+	// Fair scheduling of ready endpoints: In one turn a worker performs
+	// at most 'opsPerTurn' operations or 'bytesPerTurn' requested bytes
+	// of a ready endpoint, then moves it to the tail of the ready list
+	// if it has more to do, so that one busy endpoint cannot hold up the
+	// others. Give 0 for no limit. Defaults to 16 operations and 256 KB.
+	// setPriority() puts an endpoint in a scheduling class: EPR_HIGH
+	// endpoints get 4 times the budget and twice the turns of EPR_NORMAL
+	// ones (the default), EPR_LOW endpoints a quarter of the budget and
+	// half of the turns. Both only apply to the readiness-based multiplexers
+	// (epoll, kqueue). setPriority() returns false elsewhere and for
+	// in-memory endpoints.
+	void setTurnBudget(u32 opsPerTurn, u32 bytesPerTurn);
+	bool setPriority(NetEndpoint *ep, EPriority prio);
+
+	// Mux-wide cap on queued send bytes of all joined endpoints. Send
+	// operations exceeding the cap complete with NetEndpoint::EE_QUEUE_FULL.
+	// Give 0 (the default) for no limit.
+	void setMaxQueuedBytes(u64 bytes);
+	u64  getQueuedBytes() const;
+
+	// Fault injection for in-memory endpoints (NetEndpoint::ProtocolMemory)
+	// whose operations are performed by this mux.
+	struct MemoryFaults
+	{
+		u32 MaxSendBytes;  // cap of bytes taken by one send (partial writes), 0: no cap.
+		u32 MaxRecvBytes;  // cap of bytes returned by one receive, 0: no cap.
+		u32 StallPercent;  // chance of an attempt to find the pipe "not ready" (EAGAIN).
+		u32 Seed;          // seed of the pseudo-random sequence.
+	};
+
+	// In-memory endpoints: Pairs of NetEndpoint::ProtocolMemory endpoints
+	// exchange data through in-process pipes of 256 KB per direction. The
+	// mux performs their operations without any syscall and with the same
+	// semantics as on sockets: asyncConnect() to a joined in-memory
+	// listener (by its name and port), asyncAccept(), and asyncRecv()/
+	// asyncSend() on raw buffers, where a send takes as many bytes as the
+	// pipe can hold and a receive of 0 bytes tells the peer has shut down.
+	// Other operations complete with EE_INVALID_OP, as do broadcasts to
+	// any in-memory endpoint. Per-endpoint settings (priority, coalescing,
+	// offload and write watermarks) are not supported and return false.
+	// In-memory endpoints shall be joined before any operation and closed
+	// before the mux is deleted. Accepted ones come joined to the mux of
+	// the listener.
+	// Faults are applied when the operations are attempted. Pass zeros to
+	// disable them. Call it before starting I/O.
+	void setMemoryFaults(const MemoryFaults &faults);
+
+	// Trace recording: While tracing, every asyncRecv(), asyncRecvFrom(),
+	// asyncSend(), asyncSendTo(), asyncSendSegments(), asyncAccept(),
+	// asyncConnect() and asyncConnectAny() operation is recorded on
+	// completion with its submission time, endpoint, type, requested and
+	// completed sizes, and latency, into a ring file at 'path' keeping
+	// the latest 'capacity' records (see xpf/nettrace.h to read and
+	// replay it). Operations submitted before startTrace() are not
+	// recorded. Endpoints get trace-local ids on first sight. Traced
+	// operations are completed one callback call each rather than in
+	// batches. Returns false if already tracing or 'path' cannot be
+	// written. stopTrace() flushes and closes the file.
+	bool startTrace(const c8 *path, u32 capacity = 65536);
+	void stopTrace();
+
+	// Callback profiling: While enabled, every completion is timed around
+	// its callback call and accounted to its I/O type: the number of
+	// calls, total and maximum durations, and a histogram of durations in
+	// log2 microsecond buckets. Calls taking 'slowThresholdUs' or longer
+	// are counted as slow, and the latest 64 of them are kept along with
+	// their I/O type, error and endpoint. It costs two clock reads per
+	// completion. Profiled completions are emitted one callback call each
+	// rather than in batches. Disabling keeps the figures collected so
+	// far; resetProfile() clears them.
+	enum { PROFILE_BUCKETS = 24 };
+
+	struct ProfileStats
+	{
+		u64 Count;
+		u64 TotalUs;
+		u64 MaxUs;
+		u64 SlowCount;
+		u64 Histogram[PROFILE_BUCKETS]; // [i]: calls of [2^i, 2^(i+1)) us, [0] also 0 us, the last one also longer.
+	};
+
+	struct SlowCallback
+	{
+		EIoType              Type;
+		NetEndpoint::EError  Error;
+		NetEndpoint         *Endpoint;   // 0 for timers, file I/O and wakeups.
+		u64                  TimeUs;     // start of the call on a monotonic clock.
+		u64                  DurationUs;
+	};
+
+	void enableProfiler(bool val = true, u32 slowThresholdUs = 1000);
+	bool getProfile(EIoType type, ProfileStats &stats) const; // false for invalid types.
+	u32  getSlowCallbacks(SlowCallback *out, u32 max) const;  // copies the latest ones, oldest first.
+	void resetProfile();
+
 	// Default callback setter/getter
 	inline void setDefaultCallback(NetIoMuxCallback *cb) { pDefaultMuxCallback = cb; }
 	inline NetIoMuxCallback* getDefaultCallback() const { return pDefaultMuxCallback; }
@@ -101,13 +357,50 @@ private:
 
 	NetIoMuxCallback *pDefaultMuxCallback;
 	NetIoMuxImpl *pImpl;
+	NetIoMuxMemory *pMemory;
+	NetIoMuxTracer *pTracer;
 };
 
 
+// A completion record, which carries the same arguments
+// as NetIoMuxCallback::onIoCompleted().
+struct NetIoMuxCompletion
+{
+	NetIoMux::EIoType    Type;
+	NetEndpoint::EError  Error;
+	NetEndpoint         *Endpoint;
+	vptr                 TepOrPeer;
+	const c8            *Buffer;
+	u32                  Length;
+	u32                  SegmentSize; // datagram size of segmented UDP sends and offloaded receives, or 0.
+};
+
 class NetIoMuxCallback
 {
 public:
 	virtual void onIoCompleted(NetIoMux::EIoType type, NetEndpoint::EError ec, NetEndpoint *sep, vptr tepOrPeer, const c8 *buf, u32 len) = 0;
+
+	// The mux emits completions through this call. Consecutive completions
+	// popped in one runOnce() pass that share the same callback are passed
+	// together in 'records', in completion order. The records are only
+	// valid during this call. Override it to process them in a tight
+	// loop. The default implementation calls onIoCompleted() per record.
+	virtual void onIoCompletedBatch(const NetIoMuxCompletion *records, u32 count)
+	{
+		for (u32 i = 0; i < count; ++i)
+		{
+			const NetIoMuxCompletion &r = records[i];
+			onIoCompleted(r.Type, r.Error, r.Endpoint, r.TepOrPeer, r.Buffer, r.Length);
+		}
+	}
+
+	// Called when queued send bytes of 'ep' cross its write watermarks.
+	// See NetIoMux::setWriteWatermarks().
+	virtual void onWriteWatermark(NetEndpoint *ep, bool aboveHigh) {}
+
+	// Called when a descriptor registered by NetIoMux::watchFd() is
+	// ready. 'events' is a combination of NetIoMux::EFdEvent flags.
+	virtual void onFdReady(s32 fd, u32 events, vptr userData) {}
 };
 
 }; // end of namespace xpf
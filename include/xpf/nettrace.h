@@ -0,0 +1,142 @@
+/*******************************************************************************
+ * Copyright (c) 2013 matt@moregeek.com.tw
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ * 3. This notice may not be removed or altered from any source
+ *    distribution.
+ ********************************************************************************/ 
+
+#ifndef _XPF_NETTRACE_HEADER_
+#define _XPF_NETTRACE_HEADER_
+
+#include "platform.h"
+#include "netendpoint.h"
+#include "netiomux.h"
+
+namespace xpf
+{
+
+/*****
+ * The ring file written by NetIoMux::startTrace(): A NetTraceHeader
+ * followed by 'Capacity' slots of NetTraceRecord. The n-th record (from
+ * 0) is written to slot n % Capacity, so the file keeps the latest
+ * 'Capacity' records out of 'Written'. Records are written in order of
+ * completion, in the byte order of the recording host.
+ */
+struct NetTraceHeader
+{
+	static const u32 MAGIC   = 0x54465058; // "XPFT"
+	static const u16 VERSION = 1;
+
+	u32 Magic;
+	u16 Version;
+	u16 RecordSize;
+	u32 Capacity;
+	u32 Reserved;
+	u64 Written;
+	u64 Reserved2;
+};
+
+struct NetTraceRecord
+{
+	u64 TimeUs;      // submission time, microseconds since the trace started.
+	u32 LatencyUs;   // from submission to completion.
+	u32 EndpointId;  // trace-local id of the endpoint, 0 for none.
+	u32 PeerId;      // id of the accepted endpoint of an EIT_ACCEPT, otherwise 0.
+	u32 Requested;   // bytes requested by the operation.
+	u32 Length;      // 'len' of the completion.
+	u8  Type;        // NetIoMux::EIoType
+	u8  Error;       // NetEndpoint::EError
+	u16 Reserved;
+};
+
+struct NetTraceReaderDetails;
+
+// Loads a trace file into memory.
+class XPF_API NetTraceReader
+{
+public:
+	NetTraceReader();
+	~NetTraceReader();
+
+	// Load the records kept in the ring file at 'path', oldest first.
+	// Returns false if it is not a trace file.
+	bool open(const c8 *path);
+
+	u32 getCount() const;
+	const NetTraceRecord& getRecord(u32 idx) const;
+
+	// Number of records overwritten in the ring.
+	u64 getOverwrittenCount() const;
+
+private:
+	// Non-copyable
+	NetTraceReader(const NetTraceReader& that) {}
+	NetTraceReader& operator = (const NetTraceReader& that) { return *this; }
+
+	NetTraceReaderDetails *mDetails;
+};
+
+struct NetTraceReplayDetails;
+
+/*****
+ * Replays the inbound traffic of a server trace against a server at
+ * 'host':'serviceOrPort': Every connection accepted in the trace is
+ * made again at the same time offset, and sends what the traced server
+ * received, in chunks of the same sizes and at the same times, until
+ * the traced server saw the end of the stream. Whatever the server
+ * sends is read and discarded. Connections accepted before the trace
+ * started are made at the time of their first receive.
+ *
+ * All the operations are performed by 'mux', which the caller runs.
+ */
+class XPF_API NetTraceReplay
+{
+public:
+	explicit NetTraceReplay(NetIoMux *mux);
+	~NetTraceReplay();
+
+	// Build the connection scripts from 'trace'. Returns the number of
+	// connections to replay.
+	u32  load(const NetTraceReader &trace);
+
+	// Start replaying. 'speed' scales the pace of the trace (2.0 for
+	// twice as fast). Returns false if already started or nothing is
+	// loaded.
+	bool start(const c8 *host, const c8 *serviceOrPort, f32 speed = 1.0f);
+
+	// Whether every connection has finished (or failed).
+	bool isDone() const;
+
+	u32  getConnectionCount() const;
+	u32  getErrorCount() const;   // connections failed to connect or send.
+	u64  getSentBytes() const;
+	u64  getRecvBytes() const;
+	u32  getMaxLagUs() const;     // the most a send started behind its time.
+
+private:
+	// Non-copyable
+	NetTraceReplay(const NetTraceReplay& that) {}
+	NetTraceReplay& operator = (const NetTraceReplay& that) { return *this; }
+
+	NetTraceReplayDetails *mDetails;
+};
+
+}; // end of namespace xpf
+
+#endif // _XPF_NETTRACE_HEADER_
@@ -25,6 +25,7 @@
 #define _XPF_REFCNT_HEADER_
 
 #include "platform.h"
+#include "atomic.h"
 
 namespace xpf {
 
@@ -93,6 +94,63 @@ namespace xpf {
 	};
 
 
+	/**
+	 *  Same as RefCounted except that the reference count is manipulated
+	 *  atomically. Use it for objects whose owners live in different threads.
+	 */
+	class AtomicRefCounted
+	{
+	public:
+		AtomicRefCounted()
+			: mRefCount(1)
+			, mDebugName(0)
+		{
+		}
+
+		virtual ~AtomicRefCounted()
+		{
+		}
+
+		virtual s32 ref() const
+		{
+			return xpfAtomicAdd(&mRefCount, 1) + 1;
+		}
+
+		virtual bool unref() const
+		{
+			const s32 cnt = xpfAtomicAdd(&mRefCount, -1) - 1;
+			xpfAssert( ( "Expecting a positive ref count.", cnt >= 0 ));
+
+			if (0 == cnt)
+			{
+				delete this;
+				return true;
+			}
+			return false;
+		}
+
+		inline s32 getRefCount() const
+		{
+			return mRefCount;
+		}
+
+		inline const c8* getDebugName() const
+		{
+			return mDebugName;
+		}
+
+	protected:
+		void setDebugName(const c8* name)
+		{
+			mDebugName = name;
+		}
+
+	private:
+		mutable volatile s32 mRefCount;
+		const c8*            mDebugName;
+	};
+
+
 	/**
 	 *  A RefCounted-derived class with floating reference support.
 	 *  A floating reference means the object has been created with
@@ -42,15 +42,27 @@ namespace xpf {
 
 /*
  * An abstraction of TLS support from native platforms.
- * On Windows, it wraps TlsAlloc()/TlsFree()/TlsGetValue()/TlsSetValue().
+ * On Windows, it wraps TlsAlloc()/TlsFree()/TlsGetValue()/TlsSetValue(), or the
+ * FlsXXX() counterparts for indices with a destructor.
  * On POSIX platforms, it wraps pthread_key_create()/pthread_key_delete()/pthread_getspecific()/pthread_setspecific().
  */
 
+// Function prototype of the destructor of an index. It is called with
+// the data associated with the index by a thread which exits.
+#if defined(XPF_PLATFORM_WINDOWS)
+typedef void (__stdcall *TlsDestructor) (vptr);
+#else
+typedef void (*TlsDestructor) (vptr);
+#endif
+
 // Returns an opaque value called index. Except 0 indicates an error occurred, do not make any 
 // assumption on the content of it.
 // Use this index in subsequent calls to TlsDelete()/TlsGet()/TlsSet().
-vptr XPF_API TlsCreate();
-// Delete an index created by TlsCreate().
+// If dtor is given, it is called for each thread exiting with a data other than 0
+// associated with the index (on Windows, each fiber deleted as well: FLS is used instead).
+vptr XPF_API TlsCreate(TlsDestructor dtor = 0);
+// Delete an index created by TlsCreate(). Destructors are not called for threads
+// exiting afterwards. On Windows, they are called for all data still associated.
 void XPF_API TlsDelete(vptr index);
 // Retrieve the data associated with the index and the calling thread.
 // After an index has been created, it is by default associated with 0
@@ -22,16 +22,294 @@
  ********************************************************************************/
 
 #include <xpf/allocators.h>
+#include <xpf/atomic.h>
+#include <xpf/threadlock.h>
+#include <xpf/tls.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(XPF_COMPILER_MSVC)
+#  include <intrin.h>
+#endif
+
+#if defined(XPF_PLATFORM_WINDOWS)
+#  include <Windows.h>
+#else
+#  include <stdio.h>
+#  include <time.h>
+#  include <unistd.h>
+#  include <sys/mman.h>
+#endif
+
 #define MINSIZE_POWOF2 (4)
-#define MAXSIZE_POWOF2 (31)
 #define INVALID_VALUE  (0xFFFFFFFF)
 #define MAXSLOT (256)
 
+// Bulks are up to 1 Tb on 64-bit models, and up to 2 Gb on others.
+#if defined(XPF_MODEL_64)
+#  define MAXSIZE_POWOF2 (40)
+#else
+#  define MAXSIZE_POWOF2 (31)
+#endif
+#define INVALID_OFFSET ((usize)-1)
+
+// Thread caches of concurrent BuddyAllocators.
+#define CACHE_SPAN_POWOF2  (16)  // 64 Kb spans.
+#define CACHE_MAX_POWOF2   (10)  // sizes up to 1 Kb are cached.
+#define CACHE_CLASSES      (CACHE_MAX_POWOF2 - MINSIZE_POWOF2 + 1)
+#define CACHE_SPAN_HEADER  (64)
+#define CACHE_MIN_CAPACITY (1 << (CACHE_SPAN_POWOF2 + 4))
+#define CACHE_REMOTE_BATCH (32)  // blocks freed for another thread pushed at once.
+#define CACHE_HOT_MAX      (64)  // blocks freed by a thread kept per class for reuse.
+
 namespace xpf {
 
+// Sizes and offsets within a memory bulk. Models of 32-bit keep to
+// 32-bit arithmetic.
+#if defined(XPF_MODEL_64)
+typedef u64 usize;
+#else
+typedef u32 usize;
+#endif
+
+// Index of the highest/lowest set bit of a non-zero value.
+static inline u32 highestBitOf ( const u32 v )
+{
+#if defined(XPF_COMPILER_MSVC)
+	unsigned long idx;
+	_BitScanReverse(&idx, v);
+	return (u32)idx;
+#else
+	return (31 - (u32)__builtin_clz(v));
+#endif
+}
+
+static inline u32 lowestBitOf ( const u32 v )
+{
+#if defined(XPF_COMPILER_MSVC)
+	unsigned long idx;
+	_BitScanForward(&idx, v);
+	return (u32)idx;
+#else
+	return (u32)__builtin_ctz(v);
+#endif
+}
+
+#if defined(XPF_MODEL_64)
+static inline u32 highestBitOf ( const u64 v )
+{
+#if defined(XPF_COMPILER_MSVC)
+	unsigned long idx;
+	_BitScanReverse64(&idx, v);
+	return (u32)idx;
+#else
+	return (63 - (u32)__builtin_clzll(v));
+#endif
+}
+
+static inline u32 lowestBitOf ( const u64 v )
+{
+#if defined(XPF_COMPILER_MSVC)
+	unsigned long idx;
+	_BitScanForward64(&idx, v);
+	return (u32)idx;
+#else
+	return (u32)__builtin_ctzll(v);
+#endif
+}
+#endif
+
+// Sizes beyond the bulk of 32-bit models fail as too large.
+static inline usize bulkSizeOf ( const u64 size )
+{
+	return (size > (usize)-1) ? (usize)-1 : (usize)size;
+}
+
+//============---------- Bulk memory -----------================//
+
+#define BULK_BACKING (EB_MAPPED | EB_HUGEPAGES | EB_POPULATE | EB_LOCKED)
+
+static usize bulkPageSize()
+{
+#if defined(XPF_PLATFORM_WINDOWS)
+	SYSTEM_INFO si;
+	::GetSystemInfo(&si);
+	return (usize)si.dwPageSize;
+#else
+	return (usize)::sysconf(_SC_PAGESIZE);
+#endif
+}
+
+// Size of huge pages, or 0 if the system has none.
+static usize bulkHugePageSize()
+{
+#if defined(XPF_PLATFORM_WINDOWS)
+	return (usize)::GetLargePageMinimum();
+#elif defined(XPF_PLATFORM_LINUX)
+	static volatile usize _huge_page_size = INVALID_OFFSET;
+	if (INVALID_OFFSET == _huge_page_size)
+	{
+		usize size = 0;
+		FILE *f = ::fopen("/proc/meminfo", "r");
+		if (f)
+		{
+			char line[128];
+			unsigned long kb;
+			while (::fgets(line, sizeof(line), f))
+			{
+				if (1 == ::sscanf(line, "Hugepagesize: %lu kB", &kb))
+				{
+					size = (usize)kb * 1024;
+					break;
+				}
+			}
+			::fclose(f);
+		}
+		_huge_page_size = size;
+	}
+	return _huge_page_size;
+#else
+	return 0;
+#endif
+}
+
+static inline usize bulkRoundUp ( const usize size, const usize align )
+{
+	return (size + align - 1) & ~(align - 1);
+}
+
+/****************************************************************************
+ * A memory bulk of an allocator: Taken from the heap, or mapped from the
+ * system if any of the EBulkFlag values is given.
+ ****************************************************************************/
+
+struct BulkMemory
+{
+	BulkMemory() : Ptr(0), Length(0), Mapped(false) {}
+
+	bool acquire ( const usize size, const u32 flags )
+	{
+		xpfAssert( ( "Expecting a released bulk.", Ptr == 0 ) );
+		if (0 == (flags & BULK_BACKING))
+		{
+			Ptr = (char*) ::malloc(size);
+			Length = size;
+			Mapped = false;
+			return (NULL != Ptr);
+		}
+
+		Mapped = true;
+		const usize page = bulkPageSize();
+		const usize hugePage = (flags & EB_HUGEPAGES) ? bulkHugePageSize() : 0;
+		if (!map(bulkRoundUp(size, page), hugePage))
+			return false;
+
+		// Fault in every page, as huge ones where advised.
+		if (flags & EB_POPULATE)
+		{
+			for (usize off = 0; off < Length; off += page)
+				((volatile char*)Ptr)[off] = 0;
+		}
+
+#if defined(XPF_PLATFORM_WINDOWS)
+		if ((flags & EB_LOCKED) && !::VirtualLock(Ptr, Length))
+#else
+		if ((flags & EB_LOCKED) && (0 != ::mlock(Ptr, Length)))
+#endif
+		{
+			release();
+			return false;
+		}
+		return true;
+	}
+
+	void release ()
+	{
+		if (NULL == Ptr)
+			return;
+		if (!Mapped)
+			::free(Ptr);
+		else
+#if defined(XPF_PLATFORM_WINDOWS)
+			::VirtualFree(Ptr, 0, MEM_RELEASE);
+#else
+			::munmap(Ptr, Length);
+#endif
+		Ptr = 0;
+		Length = 0;
+	}
+
+	char  *Ptr;
+	usize  Length;  // of the mapping, which may be rounded up.
+	bool   Mapped;
+
+private:
+	// Map 'length' bytes, a multiple of the page size. Try explicit huge
+	// pages first if 'hugePage' is not 0, then fall back to regular pages
+	// advised to be backed by transparent huge ones.
+	bool map ( const usize length, const usize hugePage )
+	{
+#if defined(XPF_PLATFORM_WINDOWS)
+		if (0 != hugePage)
+		{
+			// Large pages are never paged out, and need the
+			// SeLockMemoryPrivilege.
+			Length = bulkRoundUp(length, hugePage);
+			Ptr = (char*) ::VirtualAlloc(NULL, Length, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+			if (NULL != Ptr)
+				return true;
+		}
+		Length = length;
+		Ptr = (char*) ::VirtualAlloc(NULL, Length, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		return (NULL != Ptr);
+#else
+		void *p = MAP_FAILED;
+#if defined(MAP_HUGETLB)
+		// Explicit huge pages come from a pool reserved by the system
+		// administrator (vm.nr_hugepages).
+		if (0 != hugePage)
+		{
+			Length = bulkRoundUp(length, hugePage);
+			p = ::mmap(NULL, Length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		}
+#endif
+		if (MAP_FAILED != p)
+		{
+			Ptr = (char*)p;
+			return true;
+		}
+
+		// Transparent huge pages only back ranges aligned to their size:
+		// Map more and trim both ends.
+		const usize align = (length >= hugePage) ? hugePage : 0;
+		p = ::mmap(NULL, length + align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (MAP_FAILED == p)
+			return false;
+
+		char *head = (char*)p;
+		Ptr = head;
+		Length = length;
+		if (0 != align)
+		{
+			Ptr = (char*)bulkRoundUp((usize)head, align);
+			if (Ptr > head)
+				::munmap(head, (usize)(Ptr - head));
+			if (Ptr + length < head + length + align)
+				::munmap(Ptr + length, (usize)(head + align - Ptr));
+		}
+#if defined(MADV_HUGEPAGE)
+		if (0 != hugePage)
+			::madvise(Ptr, Length, MADV_HUGEPAGE);
+#endif
+		return true;
+#endif
+	}
+};
+
+//============---------- Bulk memory -----------================//
+
+
+
 //============---------- BuddyAllocator -----------================//
 
 static BuddyAllocator* _global_pool_instances[MAXSLOT] = { 0 };
@@ -39,9 +317,12 @@ static BuddyAllocator* _global_pool_instances[MAXSLOT] = { 0 };
 /****************************************************************************
  * An implementation of Buddy memory allocation algorithm
  * http://en.wikipedia.org/wiki/Buddy_memory_allocation
+ * An arena manages one memory bulk. Its bookkeeping outlives the bulk, so
+ * that a bulk of a growable allocator can be unmapped and mapped again.
+ * The bulk is backed as told by the EBulkFlag values of the allocator.
  ****************************************************************************/
 
-struct BuddyAllocatorDetails
+struct BuddyArena
 {
 private:
 	struct FreeBlockRecord;
@@ -58,9 +339,14 @@ private:
 	};
 
 public:
-	explicit BuddyAllocatorDetails(u32 size)
-		: TierNum(1)
+	BuddyArena(usize size, bool withSpans, u32 backing)
+		: Base(0)
+		, SpanMap(0)
 		, Capacity(1 << MINSIZE_POWOF2)
+		, Chunk(0)
+		, Backing(backing)
+		, TierNum(1)
+		, FreeTiers(0)
 		, UsedBytes(0)
 		, HWMBytes(0)
 	{
@@ -71,7 +357,7 @@ public:
 		// probably doesn't hold. Which is fatal to our implementation.
 		xpfSAssert((sizeof(FreeBlockRecord) <= (1<<MINSIZE_POWOF2)));
 
-		const u32 maxSize = (1 << MAXSIZE_POWOF2);
+		const usize maxSize = ((usize)1 << MAXSIZE_POWOF2);
 
 		while ( xpfLikely (Capacity < size) )
 		{
@@ -80,38 +366,70 @@ public:
 			if ( xpfUnlikely (maxSize == Capacity) )
 				break;
 		}
-		FlagsLen = (1 << ((TierNum <= 3) ? 0 : (TierNum - 3))); // about 1/64 size of Capacity.
+		FlagsLen = ((usize)1 << ((TierNum <= 3) ? 0 : (TierNum - 3))); // about 1/64 size of Capacity.
 
-		Chunk         = (char*)             ::malloc(sizeof(char) * Capacity);
 		Flags         = (char*)             ::malloc(sizeof(char) * FlagsLen);
 		FreeChainHead = (FreeBlockRecord**) ::malloc(sizeof(FreeBlockRecord*) * TierNum);
 
+		// A bit per span-sized block for thread caches (see BuddyCacheDetails).
+		if (withSpans && (Capacity >= CACHE_MIN_CAPACITY))
+			SpanMap = (u8*) ::malloc(spanMapLength());
+
+		map();
+	}
+
+	~BuddyArena()
+	{
+		unmap();
+		::free(Flags);
+		::free(FreeChainHead);
+		::free(SpanMap);
+	}
+
+	// (Re)acquire the memory bulk with all of it free. Return false on
+	// out of memory.
+	bool map()
+	{
+		xpfAssert( ( "Expecting an unmapped arena.", Chunk == 0 ) );
+		if ( xpfUnlikely (!Bulk.acquire(Capacity, Backing)) )
+			return false;
+		Chunk = Bulk.Ptr;
+
 		::memset(Flags, 0, sizeof(char) * FlagsLen);
 		::memset(FreeChainHead, 0, sizeof(FreeBlockRecord*) * TierNum);
+		if (SpanMap)
+			::memset(SpanMap, 0, spanMapLength());
+		FreeTiers = 0;
+		UsedBytes = 0;
 
 		// make sure the top-most tier places its only block in its free chain.
 		setBlockInUse(0, 0, true);
 		recycle(0, 0);
+
+		Base = (vptr)Chunk;
+		return true;
 	}
 
-	~BuddyAllocatorDetails()
+	// Give back the memory bulk. Blocks in use are lost.
+	void unmap()
 	{
-		::free(Chunk);
-		::free(Flags);
-		::free(FreeChainHead);
+		Base = 0;
+		Bulk.release();
+		Chunk = 0;
+		FreeTiers = 0;
 	}
 
-	void* alloc ( const u32 size )
+	void* alloc ( const usize size )
 	{
 		const u32 tier = tierOf(size);
 		if ( xpfUnlikely(INVALID_VALUE == tier) )
 			return NULL;
 
-		const u32 blockId = obtain(tier);
-		if ( xpfUnlikely (INVALID_VALUE == blockId) )
+		const usize blockId = obtain(tier);
+		if ( xpfUnlikely (INVALID_OFFSET == blockId) )
 			return NULL;
 
-		const u32 bsize = blockSizeOf(tier);
+		const usize bsize = blockSizeOf(tier);
 
 		UsedBytes += bsize;
 		if (UsedBytes > HWMBytes)
@@ -121,16 +439,16 @@ public:
 	}
 
 	// Return the allocated block with size hint.
-	void dealloc ( void *p, const u32 size )
+	void dealloc ( void *p, const usize size )
 	{
 		const u32 tier = tierOf(size);
 		xpfAssert( ( "Expecting a valid tier index." , tier != INVALID_VALUE ) );
 		if ( xpfUnlikely(INVALID_VALUE == tier) )
 			return;
 
-		const u32 blockId = blockIdOf(tier, p);
-		xpfAssert( ( "Expecting a valid blockId." , blockId != INVALID_VALUE ) );
-		if ( xpfLikely ( blockId != INVALID_VALUE ) )
+		const usize blockId = blockIdOf(tier, p);
+		xpfAssert( ( "Expecting a valid blockId." , blockId != INVALID_OFFSET ) );
+		if ( xpfLikely ( blockId != INVALID_OFFSET ) )
 		{
 			recycle(tier, blockId);
 			UsedBytes -= blockSizeOf(tier);
@@ -140,7 +458,8 @@ public:
 	// dealloc() without size hint.
 	void free ( void *p )
 	{
-		u32 tier, blockId;
+		u32 tier;
+		usize blockId;
 		bool located = locateBlockInUse(p, tier, blockId);
 		xpfAssert( ( "Expecting a managed pointer.", located ) );
 		if (located)
@@ -154,7 +473,7 @@ public:
 	// May move the memory block to a new location (whose addr will be returned).
 	// The content of the memory block is preserved up to the lesser of the new and old sizes.
 	// Return NULL on error, in which case the memory content will not be touched.
-	void* realloc ( void *p, const u32 size )
+	void* realloc ( void *p, const usize size )
 	{
 		// forwarding cases
 		if ( xpfUnlikely ( NULL == p ) )
@@ -167,10 +486,11 @@ public:
 			return NULL;
 		}
 
-		u32 tier, blockId;
+		u32 tier;
+		usize blockId;
 		if (locateBlockInUse(p, tier, blockId))
 		{
-			const u32 blockSize = blockSizeOf(tier);
+			const usize blockSize = blockSizeOf(tier);
 
 			// boundary cases
 			if ((0 == tier) && (size > blockSize))
@@ -210,107 +530,131 @@ public:
 		return 0;
 	}
 
-	inline u32 capacity() const { return Capacity; }
-	inline u32 usedBytes() const { return UsedBytes; }
-	inline u32 hwmBytes(bool reset = false) { u32 ret = HWMBytes; if (reset) HWMBytes = 0; return ret; }
-	u32 available() const
+	// Return the size of the allocated block pointed by p, or 0 on error.
+	usize sizeOf ( void *p ) const
 	{
-		for (u32 t=0; t<TierNum; ++t)
-		{
-			if (NULL != FreeChainHead[t])
-			{
-				return blockSizeOf(t);
-			}
-		}
-		return 0;
+		u32 tier;
+		usize blockId;
+		return (locateBlockInUse(p, tier, blockId)) ? blockSizeOf(tier) : 0;
+	}
+
+	inline usize capacity() const { return Capacity; }
+	inline const char* base() const { return Chunk; }
+	inline bool mapped() const { return (Chunk != 0); }
+	inline u32 backing() const { return Backing; }
+	inline usize usedBytes() const { return UsedBytes; }
+	inline usize hwmBytes(bool reset = false) { usize ret = HWMBytes; if (reset) HWMBytes = 0; return ret; }
+	usize available() const
+	{
+		// The lowest tier index holds the largest blocks.
+		return (0 != FreeTiers) ? blockSizeOf(lowestBitOf(FreeTiers)) : 0;
 	}
 
 private:
 
-	u32 obtain( const u32 tier )
+	usize obtain( const u32 tier )
 	{
-		// 1. Check if there is any free block available in given tier, 
-		//    return one of them if does.
-		FreeBlockRecord *fbr = FreeChainHead[tier];
-		if (NULL != fbr)
+		// 1. Find the nearest tier which has a free block no smaller than
+		//    required, i.e. the highest set bit of tiers 0 to 'tier'.
+		const usize candidates = FreeTiers & (INVALID_OFFSET >> (sizeof(usize) * 8 - 1 - tier));
+		if (0 == candidates)
+			return INVALID_OFFSET;
+
+		u32 t = highestBitOf(candidates);
+		usize blockId = popFree(t);
+		setBlockInUse(t, blockId, true);
+
+		// 2. Split it down to given tier. Keep the first half of each
+		//    split for use and push another in the free block chain.
+		while (t < tier)
 		{
-			const u32 blockSize = blockSizeOf(tier);
-			const u32 blockId = ((u32)((char*)fbr - Chunk))/blockSize;
+			++t;
+			blockId <<= 1;
+			setBlockInUse(t, blockId, true);
+			pushFree(t, blockId + 1);
+		}
+		return blockId;
+	}
 
-			FreeChainHead[tier] = fbr->Next;
-			if (fbr->Next)
+	void recycle( u32 tier, usize blockId )
+	{
+		while (true)
+		{
+			// 1. Validate the in-use bit of given block.
+			xpfAssert( ( "Expecting a in-using blockId.", isBlockInUse(tier, blockId) == true ) );
+			setBlockInUse(tier, blockId, false);
+
+			// 2a. The buddy block is currently in-use, so we just push
+			//     the recycling block to the free block chain of current tier.
+			const usize buddyBlockId = buddyIdOf(blockId);
+			if ((0 == tier) || (isBlockInUse(tier, buddyBlockId)))
 			{
-				fbr->Next->Prev = NULL;
+				pushFree(tier, blockId);
+				return;
 			}
 
-			setBlockInUse(tier, blockId, true);
-			return blockId;
+			// 2b. The buddy block is also free, remove buddy block
+			//     from the free block chain and return these 2 blocks
+			//     back to upper tier.
+			unlinkFree(tier, buddyBlockId);
+			--tier;
+			blockId >>= 1;
 		}
+	}
 
-		// 2. Ask the upper tier to split one of its free block to two smaller 
-		//    blocks to join given tier. Return one of them for use and push
-		//    another in the free block chain of current tier.
-		const u32 upperBlockId = (tier > 0)? obtain(tier-1) : INVALID_VALUE;
-		if (INVALID_VALUE != upperBlockId)
+	inline FreeBlockRecord* recordOf ( const u32 tier, const usize blockId ) const
+	{
+		// Placed at the end of the block.
+		return (FreeBlockRecord*)(Chunk + (blockSizeOf(tier) * (blockId + 1)) - sizeof(FreeBlockRecord));
+	}
+
+	inline void pushFree ( const u32 tier, const usize blockId )
+	{
+		FreeBlockRecord *fbr = recordOf(tier, blockId);
+		if (FreeChainHead[tier])
 		{
-			const u32 blockId1 = (upperBlockId << 1);
-			const u32 blockId2 = blockId1 + 1;
-			setBlockInUse(tier, blockId1, true);
-			setBlockInUse(tier, blockId2, true);
-			recycle(tier, blockId2);
-			return blockId1;
+			FreeChainHead[tier]->Prev = fbr;
 		}
-
-		// 3. No available free block, returns INVALID_VALUE.
-		return INVALID_VALUE;
+		fbr->Next = FreeChainHead[tier];
+		fbr->Prev = NULL;
+		FreeChainHead[tier] = fbr;
+		FreeTiers |= ((usize)1 << tier);
 	}
 
-	void recycle( const u32 tier, const u32 blockId)
+	inline usize popFree ( const u32 tier )
 	{
-		// 1. Validate the in-use bit of given block.
-		xpfAssert( ( "Expecting a in-using blockId.", isBlockInUse(tier, blockId) == true ) );
-		setBlockInUse(tier, blockId, false);
-
-		// 2. Check the status of its buddy block. 
-		const u32 buddyBlockId = buddyIdOf(blockId);
-		const u32 blockSize = blockSizeOf(tier);
-		if ((0 == tier) || (isBlockInUse(tier, buddyBlockId)))
+		FreeBlockRecord *fbr = FreeChainHead[tier];
+		xpfAssert( ( "Expecting a free block.", fbr != NULL ) );
+		FreeChainHead[tier] = fbr->Next;
+		if (fbr->Next)
 		{
-			// 2a. The buddy block is currently in-use, so we just
-			//     clear the in-use bit of the recycling block and
-			//     push it to the free block chain of current tier.
-
-			// Setup FreeBlockRecord and push to free chain
-			FreeBlockRecord * fbr = (FreeBlockRecord*)(Chunk + (blockSize * (blockId + 1)) - sizeof(FreeBlockRecord));
-			if (FreeChainHead[tier])
-			{
-				FreeChainHead[tier]->Prev = fbr;
-			}
-			fbr->Next = FreeChainHead[tier];
-			fbr->Prev = NULL;
-			FreeChainHead[tier] = fbr;
+			fbr->Next->Prev = NULL;
 		}
 		else
 		{
-			// 2b. The buddy block is also free, remove buddy block 
-			//     from the free block chain and return these 2 blocks
-			//     back to upper tier.
-
-			FreeBlockRecord * fbr = (FreeBlockRecord*)(Chunk + (blockSize * (buddyBlockId + 1)) - sizeof(FreeBlockRecord));
-			if (fbr->Prev)
-			{
-				fbr->Prev->Next = fbr->Next;
-			}
-			if (fbr->Next)
-			{
-				fbr->Next->Prev = fbr->Prev;
-			}
-			if (fbr == FreeChainHead[tier])
-			{
-				FreeChainHead[tier] = (fbr->Prev)? fbr->Prev: fbr->Next;
-			}
+			FreeTiers &= ~((usize)1 << tier);
+		}
+		return (usize)(((char*)fbr - Chunk) >> shiftOf(tier));
+	}
 
-			recycle(tier-1, (blockId >> 1));
+	inline void unlinkFree ( const u32 tier, const usize blockId )
+	{
+		FreeBlockRecord *fbr = recordOf(tier, blockId);
+		if (fbr->Prev)
+		{
+			fbr->Prev->Next = fbr->Next;
+		}
+		else
+		{
+			FreeChainHead[tier] = fbr->Next;
+		}
+		if (fbr->Next)
+		{
+			fbr->Next->Prev = fbr->Prev;
+		}
+		if (NULL == FreeChainHead[tier])
+		{
+			FreeTiers &= ~((usize)1 << tier);
 		}
 	}
 
@@ -320,13 +664,13 @@ private:
 		if ( xpfUnlikely ((char*)p < Chunk) )
 			return false;
 
-		const u32 offset = (u32)((char*)p - Chunk);
+		const usize offset = (usize)((char*)p - Chunk);
 		xpfAssert( ( "Expecting a managed pointer ( < bulk length).", offset < Capacity ) );
 		if ( xpfUnlikely (offset >= Capacity) )
 			return false;
 
 		// Check if it aligns to minimal block size.
-		const bool aligned = (offset == (offset & (0xFFFFFFFF << MINSIZE_POWOF2)));
+		const bool aligned = (offset == (offset & (INVALID_OFFSET << MINSIZE_POWOF2)));
 		xpfAssert( ( "Expecting an aligned pointer.", aligned ) );
 		return aligned;
 	}
@@ -338,75 +682,75 @@ private:
 		if ( xpfUnlikely (isValidPtr(p)) )
 			return NULL;
 
-		const u32 offset = (u32)((char*)p - Chunk);
+		const usize offset = (usize)((char*)p - Chunk);
 		return (void*)(Chunk + (offset ^ blockSizeOf(tier)));
 	}
 
 	// Input: Block id of any tier.
 	// Return: The block id of its buddy on the same tier.
-	inline u32 buddyIdOf ( const u32 blockId ) const
+	inline usize buddyIdOf ( const usize blockId ) const
 	{
 		return (blockId ^ 0x1);
 	}
 
 	// Input: A pointer to an allocated block and its tier index.
-	// Return: The block id of the input block on that tier. Or INVALID_VALUE on error.
-	inline u32 blockIdOf ( const u32 tier, void *p ) const
+	// Return: The block id of the input block on that tier. Or INVALID_OFFSET on error.
+	inline usize blockIdOf ( const u32 tier, void *p ) const
 	{
 		const bool valid = isValidPtr(p);
 		xpfAssert( ( "Expecting a valid pointer.", valid ) );
 		if ( xpfUnlikely (!valid) )
-			return INVALID_VALUE;
+			return INVALID_OFFSET;
 
 		// Check if p aligns to the block size of given tier.
-		const u32 offset = (u32)((char*)p - Chunk);
-		const u32 mask = (0xFFFFFFFF << (MINSIZE_POWOF2 + TierNum - tier - 1));
+		const usize offset = (usize)((char*)p - Chunk);
+		const usize mask = (INVALID_OFFSET << shiftOf(tier));
 		const bool aligned = (offset == (offset & mask));
 		xpfAssert( ( "Expecting an aligned pointer.", aligned ) );
 		if ( xpfUnlikely (!aligned) )
-			return INVALID_VALUE;
+			return INVALID_OFFSET;
 
-		return (offset / blockSizeOf(tier));
+		return (offset >> shiftOf(tier));
 	}
 
-	// Return the block size of given tier.
-	inline u32 blockSizeOf ( const u32 tier ) const
+	// Return the block size of given tier and its log2.
+	inline usize blockSizeOf ( const u32 tier ) const
 	{
 		xpfAssert( ( "Expecting a valid tier index.", tier < TierNum ) );
-		return (1 << (MINSIZE_POWOF2 + TierNum - tier - 1));
+		return ((usize)1 << shiftOf(tier));
+	}
+
+	inline u32 shiftOf ( const u32 tier ) const
+	{
+		return (MINSIZE_POWOF2 + TierNum - tier - 1);
 	}
 
 	// Input: Block size.
 	// Return: The index of tier which deals with such block size.
-	inline u32 tierOf ( const u32 size ) const
+	inline u32 tierOf ( const usize size ) const
 	{
-		u32 s = (1 << MINSIZE_POWOF2);
-		s32 t = TierNum - 1;
-		while (t >= 0)
-		{
-			if (size <= s)
-				return (u32)t;
-			s <<= 1;
-			t--;
-		}
+		if (size <= (1 << MINSIZE_POWOF2))
+			return (TierNum - 1);
 
-		return INVALID_VALUE;
+		// Number of tiers above the smallest one: ceil(log2(size)) - MINSIZE_POWOF2.
+		const u32 depth = highestBitOf(size - 1) + 1 - MINSIZE_POWOF2;
+		return (depth < TierNum) ? (TierNum - 1 - depth) : INVALID_VALUE;
 	}
 
-	inline bool isBlockInUse (const u32 tier, const u32 blockId) const
+	inline bool isBlockInUse (const u32 tier, const usize blockId) const
 	{
 		xpfAssert( ( "Expecting a valid tier index.", tier < TierNum ) );
-		const u32 idx = (1 << tier) + blockId;
-		const u32 offset = (idx >> 3);
+		const usize idx = ((usize)1 << tier) + blockId;
+		const usize offset = (idx >> 3);
 		const char mask = (1 << (idx & 0x7));
 		return (0 != (Flags[offset] & mask));
 	}
 
-	inline void setBlockInUse (const u32 tier, const u32 blockId, bool val)
+	inline void setBlockInUse (const u32 tier, const usize blockId, bool val)
 	{
 		xpfAssert( ( "Expecting a valid tier index.", tier < TierNum ) );
-		const u32 idx = (1 << tier) + blockId;
-		const u32 offset = (idx >> 3);
+		const usize idx = ((usize)1 << tier) + blockId;
+		const usize offset = (idx >> 3);
 		const char mask = (1 << (idx & 0x7));
 		if (val)
 		{
@@ -422,133 +766,1095 @@ private:
 	// based on given pointer. Return true if found one with its tier
 	// index and block id stored in outTier and outBlockId. Return false
 	// on error.
-	bool locateBlockInUse ( void *p, u32& outTier, u32& outBlockId ) const
+	// The blocks containing the pointer are in use (allocated or split)
+	// from tier 0 down to the tier of the allocated block, and free
+	// below. So the tier is found by a binary search on in-use bits,
+	// among the tiers whose blocks the pointer is aligned to.
+	bool locateBlockInUse ( void *p, u32& outTier, usize& outBlockId ) const
 	{
-		bool ret = false;
-		u32 t = TierNum;
-		do
+		if ( xpfUnlikely (!isValidPtr(p)) )
+			return false;
+
+		const usize offset = (usize)((char*)p - Chunk);
+		const u32 alignment = (0 == offset) ? TierNum : (lowestBitOf(offset) - MINSIZE_POWOF2 + 1);
+		u32 lo = (alignment < TierNum) ? (TierNum - alignment) : 0;
+		u32 hi = TierNum - 1;
+		while (lo < hi)
 		{
-			--t;
-			const u32 blockId = blockIdOf(t, p);
-			xpfAssert( ( "Expecting a valid blockId.", blockId != INVALID_VALUE ) );
-			if (INVALID_VALUE == blockId)
-				break;
+			const u32 mid = (lo + hi + 1) >> 1;
+			if (isBlockInUse(mid, offset >> shiftOf(mid)))
+				lo = mid;
+			else
+				hi = mid - 1;
+		}
 
-			if (isBlockInUse(t, blockId))
-			{
-				outTier = t;
-				outBlockId = blockId;
-				ret = true;
-				break;
-			}
-		} while (0 != t);
-		return ret;
+		const usize blockId = (offset >> shiftOf(lo));
+		const bool inUse = isBlockInUse(lo, blockId);
+		xpfAssert( ( "Expecting a pointer to an allocated block.", inUse ) );
+		if ( xpfUnlikely (!inUse) )
+			return false;
+
+		outTier = lo;
+		outBlockId = blockId;
+		return true;
+	}
+
+	inline usize spanMapLength() const
+	{
+		return ((Capacity >> CACHE_SPAN_POWOF2) + 7) >> 3;
 	}
 
-	u32		          Capacity;
+public:
+	volatile vptr     Base;    // Chunk, or 0 when unmapped. Read without lock.
+	u8*               SpanMap; // a bit per span-sized block: 1 if it is a span.
+
+private:
+	usize             Capacity;
 	char*	          Chunk;
-	u32               FlagsLen;
+	u32               Backing;   // EBulkFlag values.
+	BulkMemory        Bulk;
+	usize             FlagsLen;
 	char*             Flags;
 	u32               TierNum;
 	FreeBlockRecord** FreeChainHead;
+	usize             FreeTiers; // bit t is set if FreeChainHead[t] is not empty.
 
-	u32               UsedBytes;
-	u32               HWMBytes;
+	usize             UsedBytes;
+	usize             HWMBytes;
 };
 
-// *****************************************************************************
+/****************************************************************************
+ * The arenas of a BuddyAllocator. There is a single arena unless the
+ * allocator is growable (EF_GROWABLE), in which case another arena of the
+ * same size is mapped once none of the others can serve an allocation.
+ * Blocks are freed to the arena whose address range holds them. Arenas
+ * but the first one are unmapped once they have stayed entirely free for
+ * ReleaseDelayMs, which is checked as blocks are freed. The table of
+ * arenas is only appended to and arenas live as long as the allocator
+ * (unmapped ones are mapped again when needed), so that arenaOf() can be
+ * called without the lock of a concurrent allocator.
+ ****************************************************************************/
 
-BuddyAllocator::BuddyAllocator(u32 size)
-	: mDetails(new BuddyAllocatorDetails(size))
+#define MAXARENA (64)
+
+static u64 buddyNowMs()
 {
+#if defined(XPF_PLATFORM_WINDOWS)
+	return (u64)::GetTickCount64();
+#else
+	struct timespec ts;
+	::clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((u64)ts.tv_sec * 1000) + ((u64)ts.tv_nsec / 1000000);
+#endif
 }
 
-BuddyAllocator::~BuddyAllocator()
+struct BuddyAllocatorDetails
 {
-	if (mDetails)
+	BuddyAllocatorDetails(usize size, u32 flags)
+		: Count(1)
+		, Current(0)
+		, MaxArenas((flags & BuddyAllocator::EF_GROWABLE) ? MAXARENA : 1)
+		, ReleaseDelayMs(1000)
+		, Idle(0)
+		, WithSpans(0 != (flags & BuddyAllocator::EF_CONCURRENT))
+		, Growable(0 != (flags & BuddyAllocator::EF_GROWABLE))
+		, UsedBytes(0)
+		, HWMBytes(0)
 	{
-		delete mDetails;
-		mDetails = (BuddyAllocatorDetails*)0xfefefefe;
+		::memset(Arenas, 0, sizeof(Arenas));
+		::memset(IdleSince, 0, sizeof(IdleSince));
+		Arenas[0] = new BuddyArena(size, WithSpans, flags & BULK_BACKING);
 	}
-}
 
-u32 BuddyAllocator::capacity() const
-{
-	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
-	return mDetails->capacity();
-}
+	~BuddyAllocatorDetails()
+	{
+		for (u32 i = 0; i < Count; ++i)
+			delete Arenas[i];
+	}
 
-u32 BuddyAllocator::available() const
-{
-	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
-	return mDetails->available();
-}
+	// A single arena keeps its own statistics.
+	void* alloc ( const usize size )
+	{
+		BuddyArena *a = Arenas[Current];
+		if ( xpfLikely (!Growable) )
+			return a->alloc(size);
 
-u32 BuddyAllocator::used() const
-{
-	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
-	return mDetails->usedBytes();
-}
+		const usize before = a->usedBytes();
+		void *p = a->alloc(size);
+		if ( xpfUnlikely (NULL == p) )
+			return allocElsewhere(size);
 
-u32 BuddyAllocator::hwm() const
-{
-	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
-	return mDetails->hwmBytes();
-}
+		charge(Current, before);
+		return p;
+	}
 
-u32 BuddyAllocator::reset()
-{
-	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
-	return mDetails->hwmBytes(true);
-}
+	void dealloc ( void *p, const usize size )
+	{
+		if ( xpfLikely (!Growable) )
+		{
+			Arenas[0]->dealloc(p, size);
+			return;
+		}
 
-void* BuddyAllocator::alloc(u32 size)
-{
-	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
-	return mDetails->alloc(size);
-}
+		const u32 i = indexOf(p);
+		xpfAssert( ( "Expecting a managed pointer.", i != INVALID_VALUE ) );
+		if ( xpfUnlikely (INVALID_VALUE == i) )
+			return;
 
-void BuddyAllocator::dealloc(void *p, u32 size)
-{
-	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
-	mDetails->dealloc(p, size);
-}
+		const usize before = Arenas[i]->usedBytes();
+		Arenas[i]->dealloc(p, size);
+		discharge(i, before);
+	}
 
-void BuddyAllocator::free(void *p)
-{
-	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
-	mDetails->free(p);
-}
+	void free ( void *p )
+	{
+		if ( xpfLikely (!Growable) )
+		{
+			Arenas[0]->free(p);
+			return;
+		}
 
-void* BuddyAllocator::realloc(void *p, u32 size)
-{
-	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
-	return mDetails->realloc(p, size);
-}
+		const u32 i = indexOf(p);
+		xpfAssert( ( "Expecting a managed pointer.", i != INVALID_VALUE ) );
+		if ( xpfUnlikely (INVALID_VALUE == i) )
+			return;
 
-void* BuddyAllocator::calloc(u32 num, u32 size)
-{
-	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
-	const u32 length = num * size;
-	void *ptr = mDetails->alloc(length);
-	if ( xpfLikely(NULL != ptr) )
-	{
-		::memset(ptr, 0, length);
+		const usize before = Arenas[i]->usedBytes();
+		Arenas[i]->free(p);
+		discharge(i, before);
 	}
-	return ptr;
-}
 
+	void* realloc ( void *p, const usize size )
+	{
+		if ( xpfLikely (!Growable) )
+			return Arenas[0]->realloc(p, size);
 
+		if ( xpfUnlikely ( NULL == p ) )
+			return alloc(size);
+		if ( xpfUnlikely ( 0 == size ) )
+		{
+			free(p);
+			return NULL;
+		}
 
-//===========----- BuddyAllocator static members ------==============//
+		const u32 i = indexOf(p);
+		xpfAssert( ( "Expecting a managed pointer.", i != INVALID_VALUE ) );
+		if ( xpfUnlikely (INVALID_VALUE == i) )
+			return NULL;
 
-u32 BuddyAllocator::create(u32 size, u16 slotId)
-{
-	if ( xpfUnlikely(slotId >= MAXSLOT) )
-		return 0;
+		// The block stays in its arena if it can.
+		BuddyArena *a = Arenas[i];
+		const usize before = a->usedBytes();
+		void *b = a->realloc(p, size);
+		if (NULL != b)
+		{
+			charge(i, before);
+			return b;
+		}
 
-	destory(slotId);
-	_global_pool_instances[slotId] = new BuddyAllocator(size);
+		// Move it to another arena.
+		const usize blockSize = a->sizeOf(p);
+		if (0 == blockSize)
+			return NULL;
+		b = allocElsewhere(size);
+		if (NULL != b)
+		{
+			::memcpy(b, p, (size < blockSize) ? size : blockSize);
+			free(p);
+		}
+		return b;
+	}
+
+	// Return the index of the arena holding p, or INVALID_VALUE.
+	// Safe without lock for blocks in use. The range is checked even
+	// for a single arena as callers tell foreign pointers apart by it.
+	inline u32 indexOf ( const void *p ) const
+	{
+		const u32 count = Count;
+		const usize capacity = Arenas[0]->capacity();
+		for (u32 i = 0; i < count; ++i)
+		{
+			const vptr base = Arenas[i]->Base;
+			if ((base != 0) && ((vptr)p >= base) && ((vptr)p - base < capacity))
+				return i;
+		}
+		return INVALID_VALUE;
+	}
+
+	inline BuddyArena* arenaOf ( const void *p ) const
+	{
+		const u32 i = indexOf(p);
+		return (INVALID_VALUE == i) ? NULL : Arenas[i];
+	}
+
+	void setGrowthPolicy ( u32 maxArenas, u32 releaseDelayMs )
+	{
+		if (!Growable)
+			return;
+
+		// Arenas already mapped beyond the limit are kept until released.
+		MaxArenas = (maxArenas < 1) ? 1 : ((maxArenas > MAXARENA) ? MAXARENA : maxArenas);
+		ReleaseDelayMs = releaseDelayMs;
+	}
+
+	u32 arenaCount() const
+	{
+		u32 count = 0;
+		for (u32 i = 0; i < Count; ++i)
+		{
+			if (Arenas[i]->mapped())
+				++count;
+		}
+		return count;
+	}
+
+	// Total size of arenas mapped.
+	u64 capacity() const
+	{
+		u64 total = 0;
+		for (u32 i = 0; i < Count; ++i)
+		{
+			if (Arenas[i]->mapped())
+				total += Arenas[i]->capacity();
+		}
+		return total;
+	}
+
+	usize available() const
+	{
+		usize ret = 0;
+		for (u32 i = 0; i < Count; ++i)
+		{
+			if (Arenas[i]->mapped() && (Arenas[i]->available() > ret))
+				ret = Arenas[i]->available();
+		}
+		if (Growable && (ret < Arenas[0]->capacity()) && (arenaCount() < MaxArenas))
+			ret = Arenas[0]->capacity();
+		return ret;
+	}
+
+	inline bool withSpans() const { return (Arenas[0]->SpanMap != 0); }
+	inline u64 usedBytes() const
+	{
+		return (Growable) ? UsedBytes : Arenas[0]->usedBytes();
+	}
+
+	inline u64 hwmBytes(bool reset = false)
+	{
+		if (!Growable)
+			return Arenas[0]->hwmBytes(reset);
+		u64 ret = HWMBytes;
+		if (reset)
+			HWMBytes = 0;
+		return ret;
+	}
+
+private:
+	// Serve an allocation the current arena failed: From other arenas in
+	// use first, then from entirely free ones, then from a new one.
+	void* allocElsewhere ( const usize size )
+	{
+		for (u32 pass = 0; pass < 2; ++pass)
+		{
+			for (u32 i = 0; i < Count; ++i)
+			{
+				BuddyArena *a = Arenas[i];
+				if ((i == Current) || !a->mapped() || ((0 == pass) == (0 != IdleSince[i])))
+					continue;
+
+				const usize before = a->usedBytes();
+				void *p = a->alloc(size);
+				if (NULL != p)
+				{
+					Current = i;
+					charge(i, before);
+					return p;
+				}
+			}
+		}
+
+		if (size > Arenas[0]->capacity())
+			return NULL;
+
+		// Map an arena released earlier, or append a new one.
+		u32 i = 0;
+		while ((i < Count) && Arenas[i]->mapped())
+			++i;
+		if (i == Count)
+		{
+			if (Count >= MaxArenas)
+				return NULL;
+			Arenas[i] = new BuddyArena(Arenas[0]->capacity(), WithSpans, Arenas[0]->backing());
+			xpfAtomicAdd(&Count, 1); // publish it to lock-free readers.
+			if (!Arenas[i]->mapped())
+				return NULL;
+		}
+		else if ((arenaCount() >= MaxArenas) || !Arenas[i]->map())
+		{
+			return NULL;
+		}
+
+		void *p = Arenas[i]->alloc(size);
+		if (NULL != p)
+		{
+			Current = i;
+			charge(i, 0);
+		}
+		return p;
+	}
+
+	inline void charge ( const u32 i, const usize before )
+	{
+		UsedBytes = UsedBytes + Arenas[i]->usedBytes() - before; // may shrink on realloc().
+		if (UsedBytes > HWMBytes)
+			HWMBytes = UsedBytes;
+
+		if ( xpfUnlikely (0 != IdleSince[i]) && (0 != Arenas[i]->usedBytes()) )
+		{
+			IdleSince[i] = 0;
+			--Idle;
+		}
+	}
+
+	inline void discharge ( const u32 i, const usize before )
+	{
+		UsedBytes -= before - Arenas[i]->usedBytes();
+		if ( xpfUnlikely (0 == Arenas[i]->usedBytes()) && (0 != i) && (0 == IdleSince[i]) )
+		{
+			const u64 now = buddyNowMs();
+			IdleSince[i] = (0 != now) ? now : 1;
+			++Idle;
+
+			// Let it drain rather than refill it.
+			if (Current == i)
+				Current = 0;
+		}
+		if ( xpfUnlikely (0 != Idle) )
+			releaseIdle();
+	}
+
+	void releaseIdle()
+	{
+		const u64 now = buddyNowMs();
+		for (u32 i = 1; i < Count; ++i)
+		{
+			if ((0 != IdleSince[i]) && (now - IdleSince[i] >= ReleaseDelayMs))
+			{
+				Arenas[i]->unmap();
+				IdleSince[i] = 0;
+				--Idle;
+				if (Current == i)
+					Current = 0;
+			}
+		}
+	}
+
+	BuddyArena   *Arenas[MAXARENA];
+	u64           IdleSince[MAXARENA]; // when an arena became entirely free, or 0.
+	volatile u32  Count;               // number of arenas ever made.
+	u32           Current;             // the arena allocations go to first.
+	u32           MaxArenas;           // 1 unless growable.
+	u32           ReleaseDelayMs;
+	u32           Idle;                // number of non-zero IdleSince.
+	const bool    WithSpans;
+	const bool    Growable;
+	u64           UsedBytes;           // of all arenas, when growable.
+	u64           HWMBytes;
+};
+
+/****************************************************************************
+ * Thread caches of a concurrent BuddyAllocator (EF_CONCURRENT).
+ * The buddy structure is shared and guarded by a lock. Each thread owns a
+ * cache which serves small sizes from spans: Blocks of the buddy structure
+ * of 1 << CACHE_SPAN_POWOF2 bytes carved into blocks of one size class.
+ * A span is taken from the shared structure as a batch under the lock, and
+ * given back once it is entirely free while its class has another span to
+ * serve from. Blocks freed by the owner of their span are kept in a short
+ * list per class and handed out first. Blocks freed by other threads are
+ * batched per owner and pushed onto a lock-free list of the owner, which
+ * takes them back on its next refill. The cache of a thread is retired
+ * when the thread exits, unless flushThreadCache() did already.
+ ****************************************************************************/
+
+// The thread cache of the concurrent allocator used last by a thread,
+// which saves looking up the TLS index on every call. Allocators are
+// told apart by serial numbers as addresses may be reused. The
+// initial-exec model saves a call to __tls_get_addr() per access from
+// the shared library.
+#if defined(XPF_COMPILER_GNUC)
+#  define CACHE_TLS XPF_TLS __attribute__((tls_model("initial-exec")))
+#else
+#  define CACHE_TLS XPF_TLS
+#endif
+static CACHE_TLS u64  _tls_last_serial = 0;
+static CACHE_TLS vptr _tls_last_cache = 0;
+static volatile u64 _cache_serials = 0;
+
+struct BuddyCacheDetails
+{
+private:
+	struct CacheBlock
+	{
+		CacheBlock *Next;
+	};
+
+	struct ThreadCache;
+
+	// Resides at the beginning of each span.
+	struct CacheSpan
+	{
+		CacheSpan   *Prev;
+		CacheSpan   *Next;
+		CacheBlock  *Free;    // blocks given back.
+		ThreadCache *Owner;
+		u32          Class;
+		u32          Bump;    // offset of the first block never handed out.
+		u32          InUse;
+		bool         Listed;  // in the partial list of its class.
+	};
+
+	struct ThreadCache
+	{
+		ThreadCache       *NextCache;
+		BuddyCacheDetails *Home;
+		volatile bool      Detached; // to be adopted by another thread.
+		CacheBlock        *Hot[CACHE_CLASSES];     // blocks freed lately, handed out first.
+		u32                HotCount[CACHE_CLASSES];
+		CacheSpan         *Partial[CACHE_CLASSES]; // spans with blocks to hand out.
+		u32                Empty[CACHE_CLASSES];   // number of entirely free spans.
+		ThreadCache       *OutOwner; // owner of the blocks in Out.
+		CacheBlock        *Out;      // blocks freed for OutOwner, not pushed yet.
+		CacheBlock        *OutTail;
+		u32                OutCount;
+		volatile vptr      Remote;   // CacheBlock list freed by other threads.
+	};
+
+public:
+	explicit BuddyCacheDetails(BuddyAllocatorDetails *core)
+		: Core(core)
+		, Caches(0)
+		, Enabled(false)
+		, TlsIndex(TlsCreate(&BuddyCacheDetails::onThreadExit))
+		, Serial(xpfAtomicAdd64(&_cache_serials, 1) + 1)
+	{
+		xpfSAssert((sizeof(CacheSpan) <= CACHE_SPAN_HEADER));
+		xpfAssert( ( "Unable to create a TLS index.", TlsIndex != 0 ) );
+
+		Enabled = (Core->withSpans() && (TlsIndex != 0));
+	}
+
+	~BuddyCacheDetails()
+	{
+		// Before the caches go: Deleting the index may retire them.
+		if (TlsIndex)
+			TlsDelete(TlsIndex);
+		while (Caches)
+		{
+			ThreadCache *c = Caches;
+			Caches = c->NextCache;
+			delete c;
+		}
+	}
+
+	void* alloc ( const usize size )
+	{
+		if ( xpfLikely ((size <= (1 << CACHE_MAX_POWOF2)) && Enabled) )
+		{
+			ThreadCache *c = cacheOfThread(true);
+			const u32 cls = classOf((u32)size);
+			CacheBlock *b = c->Hot[cls];
+			if ( xpfLikely (NULL != b) )
+			{
+				c->Hot[cls] = b->Next;
+				--c->HotCount[cls];
+				return b;
+			}
+			void *p = take(c, cls);
+			if ( xpfLikely (NULL != p) )
+				return p;
+		}
+
+		// Large sizes, or no span left: A smaller block of the
+		// shared structure may still do.
+		ScopedThreadLock sl(Lock);
+		return Core->alloc(size);
+	}
+
+	void dealloc ( void *p, const usize size )
+	{
+		CacheSpan *s = cachedSpanOf(p);
+		if ( xpfLikely (NULL != s) )
+		{
+			give(s, (CacheBlock*)p);
+			return;
+		}
+		ScopedThreadLock sl(Lock);
+		Core->dealloc(p, size);
+	}
+
+	void free ( void *p )
+	{
+		CacheSpan *s = cachedSpanOf(p);
+		if ( xpfLikely (NULL != s) )
+		{
+			give(s, (CacheBlock*)p);
+			return;
+		}
+		ScopedThreadLock sl(Lock);
+		Core->free(p);
+	}
+
+	void* realloc ( void *p, const usize size )
+	{
+		if ( xpfUnlikely ( NULL == p ) )
+			return alloc(size);
+
+		CacheSpan *s = cachedSpanOf(p);
+		if (NULL == s)
+		{
+			ScopedThreadLock sl(Lock);
+			return Core->realloc(p, size);
+		}
+
+		if ( xpfUnlikely ( 0 == size ) )
+		{
+			give(s, (CacheBlock*)p);
+			return NULL;
+		}
+
+		// Keep the block unless the size falls in another class.
+		const u32 blockSize = (1 << (MINSIZE_POWOF2 + s->Class));
+		if ((size <= blockSize) && ((size > (blockSize >> 1)) || (blockSize == (1 << MINSIZE_POWOF2))))
+			return p;
+
+		void *b = alloc(size);
+		if (NULL != b)
+		{
+			::memcpy(b, p, (size < blockSize) ? size : blockSize);
+			give(s, (CacheBlock*)p);
+		}
+		return b;
+	}
+
+	void flush()
+	{
+		ThreadCache *c = cacheOfThread(false);
+		if (NULL == c)
+			return;
+
+		TlsSet(TlsIndex, 0);
+		retire(c);
+	}
+
+	BuddyAllocatorDetails* core() { return Core; }
+	ThreadLock& lock() { return Lock; }
+
+private:
+#if defined(XPF_PLATFORM_WINDOWS)
+	static void __stdcall onThreadExit ( vptr data )
+#else
+	static void onThreadExit ( vptr data )
+#endif
+	{
+		ThreadCache *c = (ThreadCache*)data;
+		c->Home->retire(c);
+	}
+
+	// Give back what the cache of a leaving thread holds and let another
+	// thread adopt it.
+	void retire ( ThreadCache *c )
+	{
+		_tls_last_serial = 0;
+		pushOut(c);
+		for (u32 i = 0; i < CACHE_CLASSES; ++i)
+			cool(c, i, c->HotCount[i]);
+		drain(c);
+		trim(c);
+
+		ScopedThreadLock sl(Lock);
+		c->Detached = true;
+		// Blocks pushed before the others could see it detached.
+		drain(c);
+		trim(c);
+	}
+
+	// Give back all entirely free spans.
+	void trim ( ThreadCache *c )
+	{
+		for (u32 i = 0; i < CACHE_CLASSES; ++i)
+		{
+			CacheSpan *s = c->Partial[i];
+			while (s)
+			{
+				CacheSpan *next = s->Next;
+				if (0 == s->InUse)
+				{
+					unlink(c, s);
+					release(s);
+				}
+				s = next;
+			}
+			c->Empty[i] = 0;
+		}
+	}
+
+	static inline u32 classOf ( const u32 size )
+	{
+		return (size <= (1 << MINSIZE_POWOF2)) ? 0 : (highestBitOf(size - 1) + 1 - MINSIZE_POWOF2);
+	}
+
+	static inline vptr exchangeOf ( volatile vptr *dest, vptr comperand, vptr exchange )
+	{
+#if defined(XPF_MODEL_64)
+		return (vptr)xpfAtomicCAS64(dest, comperand, exchange);
+#else
+		return (vptr)xpfAtomicCAS(dest, comperand, exchange);
+#endif
+	}
+
+	// Spans are aligned to their size within the arena, and
+	// arenas are not.
+	inline CacheSpan* spanOf ( void *p ) const
+	{
+		const char *base = Core->arenaOf(p)->base();
+		const usize offset = (usize)((char*)p - base);
+		return (CacheSpan*)(base + (offset & (INVALID_OFFSET << CACHE_SPAN_POWOF2)));
+	}
+
+	// The span of 'p', or NULL if 'p' is not a block of a span. Bits of
+	// spans are changed under the lock but read without it: Those of
+	// spans holding live blocks do not change.
+	inline CacheSpan* cachedSpanOf ( void *p ) const
+	{
+		if (!Enabled)
+			return NULL;
+		const BuddyArena *a = Core->arenaOf(p);
+		if (NULL == a)
+			return NULL;
+		const char *base = a->base();
+		const usize offset = (usize)((char*)p - base);
+		const usize idx = offset >> CACHE_SPAN_POWOF2;
+		if (0 == (a->SpanMap[idx >> 3] & (1 << (idx & 0x7))))
+			return NULL;
+		return (CacheSpan*)(base + (offset & (INVALID_OFFSET << CACHE_SPAN_POWOF2)));
+	}
+
+	inline void markSpan ( CacheSpan *s, bool val )
+	{
+		BuddyArena *a = Core->arenaOf(s);
+		const usize idx = (usize)((char*)s - a->base()) >> CACHE_SPAN_POWOF2;
+		if (val)
+			a->SpanMap[idx >> 3] |= (u8)(1 << (idx & 0x7));
+		else
+			a->SpanMap[idx >> 3] &= (u8)((1 << (idx & 0x7)) ^ 0xFF);
+	}
+
+	ThreadCache* cacheOfThread ( bool create )
+	{
+		if ( xpfLikely (_tls_last_serial == Serial) )
+			return (ThreadCache*)_tls_last_cache;
+
+		ThreadCache *c = (ThreadCache*) TlsGet(TlsIndex);
+		if (c != 0)
+		{
+			_tls_last_serial = Serial;
+			_tls_last_cache = (vptr)c;
+		}
+		if ( xpfLikely (c != 0) || !create )
+			return c;
+
+		// Adopt a cache left by a thread or make a new one.
+		ScopedThreadLock sl(Lock);
+		for (c = Caches; c != 0; c = c->NextCache)
+		{
+			if (c->Detached)
+				break;
+		}
+		if (0 == c)
+		{
+			c = new ThreadCache;
+			::memset(c, 0, sizeof(ThreadCache));
+			c->NextCache = Caches;
+			c->Home = this;
+			Caches = c;
+		}
+		c->Detached = false;
+		TlsSet(TlsIndex, (vptr)c);
+		_tls_last_serial = Serial;
+		_tls_last_cache = (vptr)c;
+		return c;
+	}
+
+	void* take ( ThreadCache *c, const u32 cls )
+	{
+		// Take back the blocks freed by other threads early, which keeps
+		// spans from piling up.
+		if ( xpfUnlikely (0 != c->Remote) )
+			drain(c);
+
+		CacheSpan *s = c->Partial[cls];
+		if ( xpfUnlikely (NULL == s) )
+		{
+			pushOut(c);
+			s = refill(c, cls);
+			if (NULL == s)
+				return NULL;
+		}
+
+		const u32 blockSize = (1 << (MINSIZE_POWOF2 + cls));
+		void *b;
+		if (s->Free)
+		{
+			b = s->Free;
+			s->Free = s->Free->Next;
+		}
+		else
+		{
+			b = (char*)s + s->Bump;
+			s->Bump += blockSize;
+		}
+		if (0 == s->InUse++)
+			c->Empty[cls] = 0;
+
+		// Full spans leave the list until a block comes back.
+		if ((NULL == s->Free) && (s->Bump + blockSize > (1 << CACHE_SPAN_POWOF2)))
+			unlink(c, s);
+		return b;
+	}
+
+	void give ( CacheSpan *s, CacheBlock *b )
+	{
+		ThreadCache *c = cacheOfThread(false);
+		ThreadCache *o = s->Owner;
+		if ( xpfLikely (o == c) )
+		{
+			// Reused first, without touching the span until it cools.
+			const u32 cls = s->Class;
+			if ( xpfUnlikely (c->HotCount[cls] == CACHE_HOT_MAX) )
+				cool(c, cls, CACHE_HOT_MAX / 2);
+			b->Next = c->Hot[cls];
+			c->Hot[cls] = b;
+			++c->HotCount[cls];
+			return;
+		}
+		if (NULL == c)
+		{
+			b->Next = NULL;
+			push(o, b, b);
+			return;
+		}
+
+		// Batch the blocks of one owner to push them at once.
+		if (c->OutOwner != o)
+		{
+			pushOut(c);
+			c->OutOwner = o;
+			c->OutTail = b;
+		}
+		b->Next = c->Out;
+		c->Out = b;
+		if (++c->OutCount == CACHE_REMOTE_BATCH)
+			pushOut(c);
+	}
+
+	// Put the first 'count' blocks of the hot list of class 'cls' back
+	// into their spans.
+	void cool ( ThreadCache *c, const u32 cls, u32 count )
+	{
+		c->HotCount[cls] -= count;
+		while (count--)
+		{
+			CacheBlock *b = c->Hot[cls];
+			c->Hot[cls] = b->Next;
+			putBack(c, spanOf(b), b);
+		}
+	}
+
+	void pushOut ( ThreadCache *c )
+	{
+		if (NULL == c->Out)
+			return;
+		push(c->OutOwner, c->Out, c->OutTail);
+		c->OutOwner = NULL;
+		c->Out = c->OutTail = NULL;
+		c->OutCount = 0;
+	}
+
+	// Push the list of blocks from 'head' to 'tail' onto the remote list
+	// of 'o'. A detached cache has no thread to take them back, which is
+	// then done on its behalf.
+	void push ( ThreadCache *o, CacheBlock *head, CacheBlock *tail )
+	{
+		vptr old;
+		do
+		{
+			old = o->Remote;
+			tail->Next = (CacheBlock*)old;
+		} while (exchangeOf(&o->Remote, old, (vptr)head) != old);
+
+		if ( xpfUnlikely (o->Detached) )
+		{
+			ScopedThreadLock sl(Lock);
+			if (o->Detached)
+			{
+				drain(o);
+				trim(o);
+			}
+		}
+	}
+
+	void putBack ( ThreadCache *c, CacheSpan *s, CacheBlock *b )
+	{
+		b->Next = s->Free;
+		s->Free = b;
+		if (!s->Listed)
+			link(c, s);
+
+		// Keep one free span per class to absorb churn around a span
+		// boundary, give back the others.
+		if (0 == --s->InUse)
+		{
+			if (0 == c->Empty[s->Class])
+			{
+				c->Empty[s->Class] = 1;
+			}
+			else
+			{
+				unlink(c, s);
+				release(s);
+			}
+		}
+	}
+
+	// Take back blocks freed by other threads.
+	void drain ( ThreadCache *c )
+	{
+		vptr head = c->Remote;
+		while ((head != 0) && (exchangeOf(&c->Remote, head, 0) != head))
+			head = c->Remote;
+
+		CacheBlock *b = (CacheBlock*)head;
+		while (b)
+		{
+			CacheBlock *next = b->Next;
+			putBack(c, spanOf(b), b);
+			b = next;
+		}
+	}
+
+	CacheSpan* refill ( ThreadCache *c, const u32 cls )
+	{
+		CacheSpan *s = 0;
+		{
+			ScopedThreadLock sl(Lock);
+			s = (CacheSpan*) Core->alloc(1 << CACHE_SPAN_POWOF2);
+			if (NULL != s)
+				markSpan(s, true);
+		}
+		if (NULL == s)
+			return NULL;
+
+		s->Free = 0;
+		s->Owner = c;
+		s->Class = cls;
+		s->Bump = CACHE_SPAN_HEADER;
+		s->InUse = 0;
+		s->Listed = false;
+		link(c, s);
+		return s;
+	}
+
+	void release ( CacheSpan *s )
+	{
+		ScopedThreadLock sl(Lock);
+		markSpan(s, false);
+		Core->dealloc(s, (1 << CACHE_SPAN_POWOF2));
+	}
+
+	void link ( ThreadCache *c, CacheSpan *s )
+	{
+		CacheSpan *&head = c->Partial[s->Class];
+		s->Prev = NULL;
+		s->Next = head;
+		if (head)
+			head->Prev = s;
+		head = s;
+		s->Listed = true;
+	}
+
+	void unlink ( ThreadCache *c, CacheSpan *s )
+	{
+		if (s->Prev)
+			s->Prev->Next = s->Next;
+		else
+			c->Partial[s->Class] = s->Next;
+		if (s->Next)
+			s->Next->Prev = s->Prev;
+		s->Prev = s->Next = NULL;
+		s->Listed = false;
+	}
+
+	BuddyAllocatorDetails *Core;
+	ThreadLock             Lock;
+	ThreadCache           *Caches;  // all caches ever made, guarded by Lock.
+	bool                   Enabled; // the arenas keep span maps.
+	vptr                   TlsIndex;
+	const u64              Serial;
+};
+
+// *****************************************************************************
+
+BuddyAllocator::BuddyAllocator(u64 size, u32 flags)
+	: mDetails(new BuddyAllocatorDetails(bulkSizeOf(size), flags))
+	, mCaches(0)
+{
+	if (flags & EF_CONCURRENT)
+		mCaches = new BuddyCacheDetails(mDetails);
+}
+
+BuddyAllocator::~BuddyAllocator()
+{
+	if (mCaches)
+	{
+		delete mCaches;
+		mCaches = 0;
+	}
+	if (mDetails)
+	{
+		delete mDetails;
+		mDetails = (BuddyAllocatorDetails*)0xfefefefe;
+	}
+}
+
+u64 BuddyAllocator::capacity() const
+{
+	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
+	if (mCaches)
+	{
+		ScopedThreadLock sl(mCaches->lock());
+		return mDetails->capacity();
+	}
+	return mDetails->capacity();
+}
+
+u64 BuddyAllocator::available() const
+{
+	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
+	if (mCaches)
+	{
+		ScopedThreadLock sl(mCaches->lock());
+		return mDetails->available();
+	}
+	return mDetails->available();
+}
+
+u64 BuddyAllocator::used() const
+{
+	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
+	return mDetails->usedBytes();
+}
+
+u64 BuddyAllocator::hwm() const
+{
+	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
+	return mDetails->hwmBytes();
+}
+
+u64 BuddyAllocator::reset()
+{
+	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
+	if (mCaches)
+	{
+		ScopedThreadLock sl(mCaches->lock());
+		return mDetails->hwmBytes(true);
+	}
+	return mDetails->hwmBytes(true);
+}
+
+void* BuddyAllocator::alloc(u64 size)
+{
+	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
+	return (mCaches) ? mCaches->alloc(bulkSizeOf(size)) : mDetails->alloc(bulkSizeOf(size));
+}
+
+void BuddyAllocator::dealloc(void *p, u64 size)
+{
+	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
+	if (mCaches)
+		mCaches->dealloc(p, bulkSizeOf(size));
+	else
+		mDetails->dealloc(p, bulkSizeOf(size));
+}
+
+void BuddyAllocator::free(void *p)
+{
+	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
+	if (mCaches)
+		mCaches->free(p);
+	else
+		mDetails->free(p);
+}
+
+void* BuddyAllocator::realloc(void *p, u64 size)
+{
+	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
+	return (mCaches) ? mCaches->realloc(p, bulkSizeOf(size)) : mDetails->realloc(p, bulkSizeOf(size));
+}
+
+void* BuddyAllocator::calloc(u64 num, u64 size)
+{
+	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
+	if ( xpfUnlikely ((0 != size) && (num > ((u64)-1) / size)) )
+		return NULL;
+	const u64 length = num * size;
+	void *ptr = alloc(length);
+	if ( xpfLikely(NULL != ptr) )
+	{
+		::memset(ptr, 0, length);
+	}
+	return ptr;
+}
+
+void BuddyAllocator::flushThreadCache()
+{
+	if (mCaches)
+		mCaches->flush();
+}
+
+void BuddyAllocator::setGrowthPolicy(u32 maxArenas, u32 releaseDelayMs)
+{
+	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
+	if (mCaches)
+	{
+		ScopedThreadLock sl(mCaches->lock());
+		mDetails->setGrowthPolicy(maxArenas, releaseDelayMs);
+		return;
+	}
+	mDetails->setGrowthPolicy(maxArenas, releaseDelayMs);
+}
+
+u32 BuddyAllocator::arenaCount() const
+{
+	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
+	if (mCaches)
+	{
+		ScopedThreadLock sl(mCaches->lock());
+		return mDetails->arenaCount();
+	}
+	return mDetails->arenaCount();
+}
+
+
+
+//===========----- BuddyAllocator static members ------==============//
+
+u64 BuddyAllocator::create(u64 size, u16 slotId, u32 flags)
+{
+	if ( xpfUnlikely(slotId >= MAXSLOT) )
+		return 0;
+
+	destory(slotId);
+	_global_pool_instances[slotId] = new BuddyAllocator(size, flags);
 	xpfAssert( ( "Unable to create memory bulk.", _global_pool_instances[slotId] != 0 ) );
 	return (_global_pool_instances[slotId])? _global_pool_instances[slotId]->capacity() : 0;
 }
@@ -598,32 +1904,144 @@ static LinearAllocator* _global_stack_instances[MAXSLOT] = { 0 };
 
 struct LinearAllocatorDetails
 {
+	// Precedes each cell. The top bit of PrevOffset tells whether the
+	// cell has been freed. Pools up to 2 Gb keep to 32-bit records.
+	template < typename OFFSET >
 	struct FreeCellRecord
 	{
-		u32 PrevOffset;
-		u32 CRC;
+		OFFSET PrevOffset;
+		OFFSET CRC;
 	};
 
+	BulkMemory Bulk;
 	char *Chunk;
-	u32   Current;
-	u32   Previous;
+	usize Current;
+	usize Previous;
+
+	usize Capacity;
+	usize HWMBytes;
+	bool  Wide;     // cells use FreeCellRecord<u64>.
+
+	inline usize recordSize() const
+	{
+		return (Wide) ? sizeof(FreeCellRecord<u64>) : sizeof(FreeCellRecord<u32>);
+	}
+
+	usize available() const
+	{
+		const usize size = Capacity - Current;
+		if (size < recordSize())
+			return 0;
+		return size - recordSize();
+	}
+
+	template < typename OFFSET >
+	void* alloc ( usize size )
+	{
+		typedef FreeCellRecord<OFFSET> Record;
+		const OFFSET freed = ((OFFSET)1 << (sizeof(OFFSET) * 8 - 1));
+
+		// Every allocation has an internal space overhead of
+		// sizeof(Record) (8 bytes, or 16 bytes for wide records).
+		if (size > available())
+			return NULL;
+		size += sizeof(Record);
+
+		// Upgrade the size if it is not a multiply of 8.
+		// This can make sure every pointer we return is 8-bytes aligned.
+		if ( 0 != (size & 0x7) )
+		{
+			size = (((size >> 3) + 1) << 3);
+		}
+
+		if (size > available())
+			return NULL;
+
+		xpfAssert( ("Expecting Current < Capacity", Current < Capacity) );
+		if ( xpfLikely(Current < Capacity) )
+		{
+			Record *rec = (Record*)(Chunk + Current);
+			rec->PrevOffset = (OFFSET)Previous;
+			rec->CRC        = rec->PrevOffset ^ 0x5FEE1299; // as checksum of prev.
+			Previous = Current;
+
+			// This implies the top bit of rec->PrevOffset is not used and
+			// can be used as a flag indicates the chunk has been freed or not.
+			xpfAssert( ("Expecting a clear top bit of PrevOffset", 0 == (rec->PrevOffset & freed)) );
+
+			char *ret = Chunk + Current + sizeof(Record);
+			Current += size;
+
+			if ( Current > HWMBytes )
+				HWMBytes = Current;
+
+			return (void*)ret;
+		}
+
+		return NULL;
+	}
+
+	template < typename OFFSET >
+	void free ( void *p )
+	{
+		typedef FreeCellRecord<OFFSET> Record;
+		const OFFSET freed = ((OFFSET)1 << (sizeof(OFFSET) * 8 - 1));
+
+		char *cell = (char*)p - sizeof(Record);
+
+		xpfAssert( ( "Expecting managed pointer.", ( (cell >= Chunk) && (cell < Chunk + Capacity) ) ) );
+
+		if ( xpfLikely( (cell >= Chunk) && (cell < Chunk + Capacity) ) )
+		{
+			// Check if data corrupted.
+			Record *rec = (Record*)cell;
+			xpfAssert( ("Checksum matched (data corrupted)", ((rec->PrevOffset & ~freed) ^ 0x5FEE1299) == rec->CRC ) );
+			xpfAssert( ("In-using cell", (0 == (rec->PrevOffset & freed))) );
+
+			// Mark this cell as freed
+			rec->PrevOffset |= freed;
+
+			// For cells who are not at the top of the stack,
+			// just return here.
+			if ( Previous != (usize)(cell - Chunk) )
+				return;
+
+			// For the top-most cell, we need to apply a rollback sequence
+			// to adjust both Current and Previous to fit the next top-most
+			// cell which is still alive.
+			while (true)
+			{
+				Current = (usize)((char*)rec - Chunk);
+
+				// Quit the loop if hit the bottom of stack (all cells have been freed).
+				if ( xpfUnlikely ( 0 == Current ) )
+				{
+					Previous = 0;
+					break;
+				}
+
+				// Locate and verify the FreeCellRecord of previous cell.
+				rec = (Record*)(Chunk + Previous);
+				xpfAssert( ("Checksum matched (data corrupted)", ((rec->PrevOffset & ~freed) ^ 0x5FEE1299) == rec->CRC ) );
+				Previous = (usize)(rec->PrevOffset & ~freed);
 
-	u32   Capacity;
-	u32   HWMBytes;
+				// Quit the loop whenever we meet an alive cell.
+				if ( 0 == (rec->PrevOffset & freed) )
+					break;
+			} // end of while (true)
+		}
+	}
 };
 
-LinearAllocator::LinearAllocator(u32 size)
+LinearAllocator::LinearAllocator(u64 size, u32 flags)
 {
-	// This assumption shall always true for current implementation.
-	xpfSAssert( MAXSIZE_POWOF2 <= 31);
-
 	if ( size < (1 << MINSIZE_POWOF2) )
 	{
 		size = (1 << MINSIZE_POWOF2);
 	}
-	else if ( size > (1 << MAXSIZE_POWOF2) )
+	else if ( size > ((usize)1 << MAXSIZE_POWOF2) )
 	{
-		size = (1 << MAXSIZE_POWOF2);
+		size = ((usize)1 << MAXSIZE_POWOF2);
 	}
 	else if ( xpfUnlikely(0 != (size & 0x7)) )
 	{
@@ -632,103 +2050,65 @@ LinearAllocator::LinearAllocator(u32 size)
 	}
 
 	mDetails = new LinearAllocatorDetails;
-	mDetails->Chunk = (char*) ::malloc(size);
+	mDetails->Bulk.acquire((usize)size, flags & BULK_BACKING);
+	mDetails->Chunk = mDetails->Bulk.Ptr;
 	mDetails->Current = 0;
 	mDetails->Previous = 0;
-	mDetails->Capacity = size;
+	mDetails->Capacity = (NULL != mDetails->Chunk) ? (usize)size : 0;
 	mDetails->HWMBytes = 0;
+	mDetails->Wide = (size > ((u64)1 << 31));
 }
 
 LinearAllocator::~LinearAllocator()
 {
 	if (mDetails)
 	{
-		::free(mDetails->Chunk);
+		mDetails->Bulk.release();
 		delete mDetails;
 		mDetails = (LinearAllocatorDetails*)0xfefefefe;
 	}
 }
 
-u32 LinearAllocator::capacity() const
+u64 LinearAllocator::capacity() const
 {
 	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
 	return mDetails->Capacity;
 }
 
-u32 LinearAllocator::available() const
+u64 LinearAllocator::available() const
 {
 	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
-	const u32 size = mDetails->Capacity - mDetails->Current;
-	if (size < sizeof(LinearAllocatorDetails::FreeCellRecord))
-		return 0;
-	return size - sizeof(LinearAllocatorDetails::FreeCellRecord);
+	return mDetails->available();
 }
 
-u32 LinearAllocator::used() const
+u64 LinearAllocator::used() const
 {
 	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
 	return mDetails->Current;
 }
 
-u32 LinearAllocator::hwm() const
+u64 LinearAllocator::hwm() const
 {
 	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
 	return mDetails->HWMBytes;
 }
 
-u32 LinearAllocator::reset()
+u64 LinearAllocator::reset()
 {
 	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
 
-	u32 ret = mDetails->HWMBytes;
+	u64 ret = mDetails->HWMBytes;
 	mDetails->Current = mDetails->Previous = mDetails->HWMBytes = 0;
 	return ret;
 }
 
-void* LinearAllocator::alloc(u32 size)
+void* LinearAllocator::alloc(u64 size)
 {
 	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
-
-	// Every allocation has an internal space overhead of
-	// sizeof(MemoryStackDetails::FreeCellRecord) (8 bytes).
-	size += sizeof(LinearAllocatorDetails::FreeCellRecord);
-
-	// Upgrade the size if it is not a multiply of 8.
-	// This can make sure every pointer we return is 8-bytes aligned.
-	if ( 0 != (size & 0x7) )
-	{
-		size = (((size >> 3) + 1) << 3);
-	}
-
-	if (size > available())
-		return NULL;
-
-	xpfAssert( ("Expecting Current < Capacity", mDetails->Current < mDetails->Capacity) );
-	if ( xpfLikely(mDetails->Current < mDetails->Capacity) )
-	{
-		LinearAllocatorDetails::FreeCellRecord *rec =
-			(LinearAllocatorDetails::FreeCellRecord*)(mDetails->Chunk + mDetails->Current);
-		rec->PrevOffset = mDetails->Previous;
-		rec->CRC        = rec->PrevOffset ^ 0x5FEE1299; // as checksum of prev.
-		mDetails->Previous = mDetails->Current;
-
-		// This implies the first bit of rec->PrevOffset is not used and 
-		// can be used as a flag indicates the chunk has been freed or not.
-		xpfAssert( ("Expecting PrevOffset < (1<<MAXSIZE_POWOF2)", rec->PrevOffset < (1<<MAXSIZE_POWOF2)) );
-
-		char *ret = mDetails->Chunk + mDetails->Current + sizeof(LinearAllocatorDetails::FreeCellRecord);
-		mDetails->Current += size;
-
-		if ( mDetails->Current > mDetails->HWMBytes )
-			mDetails->HWMBytes = mDetails->Current;
-
-		return (void*)ret;
-	}
-
-	return NULL;
+	return (mDetails->Wide) ? mDetails->alloc<u64>(bulkSizeOf(size)) : mDetails->alloc<u32>(bulkSizeOf(size));
 }
 
-void LinearAllocator::dealloc(void *p, u32 size)
+void LinearAllocator::dealloc(void *p, u64 size)
 {
 	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
 	XPF_NOTUSED(size);
@@ -738,53 +2118,13 @@ void LinearAllocator::dealloc(void *p, u32 size)
 void LinearAllocator::free(void *p)
 {
 	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
-
-	char *cell = (char*)p - sizeof(LinearAllocatorDetails::FreeCellRecord);
-
-	xpfAssert( ( "Expecting managed pointer.", ( (cell >= mDetails->Chunk) && (cell < mDetails->Chunk + mDetails->Capacity) ) ) );
-
-	if ( xpfLikely( (cell >= mDetails->Chunk) && (cell < mDetails->Chunk + mDetails->Capacity) ) )
-	{
-		// Check if data corrupted.
-		LinearAllocatorDetails::FreeCellRecord *rec = (LinearAllocatorDetails::FreeCellRecord*)cell;
-		xpfAssert( ("Checksum matched (data corrupted)", ((rec->PrevOffset & 0x7FFFFFFF) ^ 0x5FEE1299) == rec->CRC ) );
-		xpfAssert( ("In-using cell", (0 == (rec->PrevOffset & 0x80000000))) );
-
-		// Mark this cell as freed
-		rec->PrevOffset |= 0x80000000;
-
-		// For cells who are not at the top of the stack,
-		// just return here.
-		if ( mDetails->Previous != (cell - mDetails->Chunk) )
-			return;
-
-		// For the top-most cell, we need to apply a rollback sequence
-		// to adjust both mDetails->Current and mDetails->Previous to fit 
-		// the next top-most cell which is still alive.
-		while (true)
-		{
-			mDetails->Current = (u32)((char*)rec - mDetails->Chunk);
-
-			// Quit the loop if hit the bottom of stack (all cells have been freed).
-			if ( xpfUnlikely ( 0 == mDetails->Current ) )
-			{
-				mDetails->Previous = 0;
-				break;
-			}
-
-			// Locate and verify the FreeCellRecord of previous cell.
-			rec = (LinearAllocatorDetails::FreeCellRecord*)(mDetails->Chunk + mDetails->Previous);
-			xpfAssert( ("Checksum matched (data corrupted)", ((rec->PrevOffset & 0x7FFFFFFF) ^ 0x5FEE1299) == rec->CRC ) );
-			mDetails->Previous = (rec->PrevOffset & 0x7FFFFFFF);
-
-			// Quit the loop whenever we meet an alive cell.
-			if ( 0 == (rec->PrevOffset & 0x80000000) )
-				break;
-		} // end of while (true)
-	}
+	if (mDetails->Wide)
+		mDetails->free<u64>(p);
+	else
+		mDetails->free<u32>(p);
 }
 
-void* LinearAllocator::realloc(void *p, u32 size)
+void* LinearAllocator::realloc(void *p, u64 size)
 {
 	// NOTE: Using of realloc() of MemoryStack is highly
 	//       discouraged.
@@ -803,21 +2143,23 @@ void* LinearAllocator::realloc(void *p, u32 size)
 	{
 		if ( NULL != p )
 		{
-			::memcpy(ptr, p, size);
+			::memcpy(ptr, p, (usize)size);
 			free(p);
 		}
 	}
 	return ptr;
 }
 
-void* LinearAllocator::calloc(u32 num, u32 size)
+void* LinearAllocator::calloc(u64 num, u64 size)
 {
 	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
-	const u32 length = num * size;
+	if ( xpfUnlikely ((0 != size) && (num > ((u64)-1) / size)) )
+		return NULL;
+	const u64 length = num * size;
 	void *ptr = alloc(length);
 	if ( xpfLikely(NULL != ptr) )
 	{
-		::memset(ptr, 0, length);
+		::memset(ptr, 0, (usize)length);
 	}
 	return ptr;
 }
@@ -825,13 +2167,13 @@ void* LinearAllocator::calloc(u32 num, u32 size)
 
 //===========----- LinearAllocator static members ------==============//
 
-u32  LinearAllocator::create(u32 size, u16 slotId)
+u64  LinearAllocator::create(u64 size, u16 slotId, u32 flags)
 {
 	if ( xpfUnlikely(slotId >= MAXSLOT) )
 		return 0;
 
 	destory(slotId);
-	_global_stack_instances[slotId] = new LinearAllocator(size);
+	_global_stack_instances[slotId] = new LinearAllocator(size, flags);
 	xpfAssert( ( "Unable to create memory bulk.", _global_stack_instances[slotId] != 0 ) );
 	return (_global_stack_instances[slotId])? _global_stack_instances[slotId]->capacity() : 0;
 }
@@ -857,5 +2199,243 @@ LinearAllocator* LinearAllocator::instance(u16 slotId)
 //============---------- LinearAllocator -----------================//
 
 
+
+
+
+
+
+//============---------- PoolAllocator -----------================//
+
+static PoolAllocator* _global_object_pool_instances[MAXSLOT] = { 0 };
+
+/****************************************************************************
+ * A slab allocator of objects of the same size.
+ * The bulk is carved into objects lazily: Objects are handed out from the
+ * free list first, which links freed objects in place, then from the part
+ * of the bulk never used.
+ ****************************************************************************/
+
+struct PoolAllocatorDetails
+{
+	struct FreeObjectRecord
+	{
+		FreeObjectRecord *Next;
+	};
+
+	BulkMemory        Bulk;
+	char             *Chunk;
+	usize             Capacity;
+	u32               ObjectSize;
+	usize             Bump;     // offset of the first object never handed out.
+	FreeObjectRecord *FreeList;
+
+	usize             UsedBytes;
+	usize             HWMBytes;
+};
+
+PoolAllocator::PoolAllocator(u64 size, u32 objectSize, u32 flags)
+{
+	// Free objects hold a FreeObjectRecord.
+	xpfSAssert( (sizeof(PoolAllocatorDetails::FreeObjectRecord) <= 8) );
+
+	if ( objectSize < 8 )
+	{
+		objectSize = 8;
+	}
+	else if ( objectSize > ((u32)1 << 31) )
+	{
+		objectSize = ((u32)1 << 31);
+	}
+	else if ( xpfUnlikely(0 != (objectSize & 0x7)) )
+	{
+		// Upgrade size if it is not a multiply of 8.
+		objectSize = (((objectSize >> 3) + 1) << 3);
+	}
+
+	if ( size > ((usize)1 << MAXSIZE_POWOF2) )
+	{
+		size = ((usize)1 << MAXSIZE_POWOF2);
+	}
+	size -= (size % objectSize);
+	if ( size < objectSize )
+	{
+		size = objectSize;
+	}
+
+	mDetails = new PoolAllocatorDetails;
+	mDetails->Bulk.acquire((usize)size, flags & BULK_BACKING);
+	mDetails->Chunk = mDetails->Bulk.Ptr;
+	mDetails->Capacity = (NULL != mDetails->Chunk) ? (usize)size : 0;
+	mDetails->ObjectSize = objectSize;
+	mDetails->Bump = 0;
+	mDetails->FreeList = 0;
+	mDetails->UsedBytes = 0;
+	mDetails->HWMBytes = 0;
+}
+
+PoolAllocator::~PoolAllocator()
+{
+	if (mDetails)
+	{
+		mDetails->Bulk.release();
+		delete mDetails;
+		mDetails = (PoolAllocatorDetails*)0xfefefefe;
+	}
+}
+
+u64 PoolAllocator::capacity() const
+{
+	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
+	return mDetails->Capacity;
+}
+
+u64 PoolAllocator::available() const
+{
+	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
+	return (mDetails->UsedBytes < mDetails->Capacity) ? mDetails->ObjectSize : 0;
+}
+
+u64 PoolAllocator::used() const
+{
+	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
+	return mDetails->UsedBytes;
+}
+
+u64 PoolAllocator::hwm() const
+{
+	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
+	return mDetails->HWMBytes;
+}
+
+u64 PoolAllocator::reset()
+{
+	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
+	u64 ret = mDetails->HWMBytes;
+	mDetails->HWMBytes = 0;
+	return ret;
+}
+
+u32 PoolAllocator::objectSize() const
+{
+	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
+	return mDetails->ObjectSize;
+}
+
+void* PoolAllocator::alloc(u64 size)
+{
+	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
+	if ( xpfUnlikely(size > mDetails->ObjectSize) )
+		return NULL;
+
+	void *ret;
+	if ( xpfLikely(NULL != mDetails->FreeList) )
+	{
+		ret = mDetails->FreeList;
+		mDetails->FreeList = mDetails->FreeList->Next;
+	}
+	else if ( mDetails->Bump < mDetails->Capacity )
+	{
+		ret = mDetails->Chunk + mDetails->Bump;
+		mDetails->Bump += mDetails->ObjectSize;
+	}
+	else
+	{
+		return NULL;
+	}
+
+	mDetails->UsedBytes += mDetails->ObjectSize;
+	if ( mDetails->UsedBytes > mDetails->HWMBytes )
+		mDetails->HWMBytes = mDetails->UsedBytes;
+	return ret;
+}
+
+void PoolAllocator::dealloc(void *p, u64 size)
+{
+	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
+	XPF_NOTUSED(size);
+	free(p);
+}
+
+void PoolAllocator::free(void *p)
+{
+	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
+
+	const bool managed = ( ((char*)p >= mDetails->Chunk) && ((char*)p < mDetails->Chunk + mDetails->Bump) );
+	xpfAssert( ( "Expecting managed pointer.", managed ) );
+	xpfAssert( ( "Expecting an aligned pointer.", !managed || (0 == (((char*)p - mDetails->Chunk) % mDetails->ObjectSize)) ) );
+	if ( xpfLikely(managed) )
+	{
+		PoolAllocatorDetails::FreeObjectRecord *rec = (PoolAllocatorDetails::FreeObjectRecord*)p;
+		rec->Next = mDetails->FreeList;
+		mDetails->FreeList = rec;
+		mDetails->UsedBytes -= mDetails->ObjectSize;
+	}
+}
+
+void* PoolAllocator::realloc(void *p, u64 size)
+{
+	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
+
+	if ( NULL == p )
+		return alloc(size);
+
+	if ( 0 == size )
+	{
+		free(p);
+		return NULL;
+	}
+
+	return (size <= mDetails->ObjectSize) ? p : NULL;
+}
+
+void* PoolAllocator::calloc(u64 num, u64 size)
+{
+	xpfAssert( ( "Null mDetails.", mDetails != 0 ) );
+	if ( xpfUnlikely ((0 != size) && (num > ((u64)-1) / size)) )
+		return NULL;
+	const u64 length = num * size;
+	void *ptr = alloc(length);
+	if ( xpfLikely(NULL != ptr) )
+	{
+		::memset(ptr, 0, (usize)length);
+	}
+	return ptr;
+}
+
+
+//===========----- PoolAllocator static members ------==============//
+
+u64  PoolAllocator::create(u64 size, u32 objectSize, u16 slotId, u32 flags)
+{
+	if ( xpfUnlikely(slotId >= MAXSLOT) )
+		return 0;
+
+	destory(slotId);
+	_global_object_pool_instances[slotId] = new PoolAllocator(size, objectSize, flags);
+	xpfAssert( ( "Unable to create memory bulk.", _global_object_pool_instances[slotId] != 0 ) );
+	return (_global_object_pool_instances[slotId])? _global_object_pool_instances[slotId]->capacity() : 0;
+}
+
+void PoolAllocator::destory(u16 slotId)
+{
+	if ( xpfUnlikely(slotId >= MAXSLOT) )
+		return;
+
+	if ( xpfLikely (_global_object_pool_instances[slotId] != 0) )
+	{
+		delete _global_object_pool_instances[slotId];
+		_global_object_pool_instances[slotId] = 0;
+	}
+}
+
+PoolAllocator* PoolAllocator::instance(u16 slotId)
+{
+	return (xpfUnlikely(slotId >= MAXSLOT))? NULL: _global_object_pool_instances[slotId];
+}
+
+
+//============---------- PoolAllocator -----------================//
+
+
 }; // end of namespace xpf
 
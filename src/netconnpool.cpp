@@ -0,0 +1,469 @@
+/*******************************************************************************
+ * Copyright (c) 2013 matt@moregeek.com.tw
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ * 3. This notice may not be removed or altered from any source
+ *    distribution.
+ ********************************************************************************/ 
+
+#include <xpf/netconnpool.h>
+#include <xpf/threadlock.h>
+
+#include <string>
+#include <deque>
+#include <map>
+#include <vector>
+
+#ifdef XPF_PLATFORM_WINDOWS
+#include <WinSock2.h>
+#include <Windows.h>
+#else
+#include <poll.h>
+#include <time.h>
+#endif
+
+namespace xpf
+{
+
+static u64 connPoolNowMs()
+{
+#ifdef XPF_PLATFORM_WINDOWS
+	return (u64)::GetTickCount64();
+#else
+	struct timespec ts;
+	::clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((u64)ts.tv_sec * 1000) + ((u64)ts.tv_nsec / 1000000);
+#endif
+}
+
+// An idle connection is healthy if it has nothing to read: Readability
+// means the peer has closed it, it has failed, or the peer has sent
+// data nobody asked for.
+static bool connPoolIsHealthy(NetEndpoint *ep)
+{
+	if (ep->getStatus() != NetEndpoint::ESTAT_CONNECTED)
+		return false;
+#ifdef XPF_PLATFORM_WINDOWS
+	SOCKET s = (SOCKET)ep->getSocket();
+	fd_set rfds;
+	FD_ZERO(&rfds);
+	FD_SET(s, &rfds);
+	struct timeval tv = { 0, 0 };
+	return (::select(0, &rfds, 0, 0, &tv) == 0);
+#else
+	struct pollfd pfd;
+	pfd.fd = ep->getSocket();
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return (::poll(&pfd, 1, 0) == 0);
+#endif
+}
+
+struct NetConnPoolIdle
+{
+	NetEndpoint *Ep;
+	u64          Since;
+};
+
+struct NetConnPoolWaiter
+{
+	NetConnPoolCallback *Cb;
+	vptr                 UserData;
+};
+
+struct NetConnPoolDest
+{
+	std::string                    Host;
+	std::string                    Service;
+	std::deque<NetConnPoolIdle>    Idle;    // the most recently used at the back.
+	std::deque<NetConnPoolWaiter>  Waiters;
+	u32                            Total;   // in use, idle and connecting.
+	u32                            Connecting;
+};
+
+// A checkout result to be delivered outside the lock.
+struct NetConnPoolHandout
+{
+	NetConnPoolWaiter    Waiter;
+	NetEndpoint::EError  Error;
+	NetEndpoint         *Ep;
+};
+
+// Work collected under the lock and done after releasing it.
+struct NetConnPoolActions
+{
+	std::vector<NetConnPoolHandout> Handouts;
+	std::vector<NetEndpoint*>       Closing;
+	std::vector<NetConnPoolDest*>   Connects;
+};
+
+struct NetConnPoolDetails;
+
+// The callback of one connect attempt.
+struct NetConnPoolConnect : public NetIoMuxCallback
+{
+	NetConnPoolDetails *Details;
+	NetConnPoolDest    *Dest;
+
+	NetConnPoolConnect(NetConnPoolDetails *details, NetConnPoolDest *dest) : Details(details), Dest(dest) {}
+	virtual ~NetConnPoolConnect() {}
+	void onIoCompleted(NetIoMux::EIoType type, NetEndpoint::EError ec, NetEndpoint *sep, vptr tepOrPeer, const c8 *buf, u32 len);
+};
+
+struct NetConnPoolDetails : public NetIoMuxCallback
+{
+	NetConnPool                               *Pool;
+	NetIoMux                                  *Mux;
+	u32                                        MaxPerDest;
+	u32                                        MaxIdlePerDest;
+	u32                                        IdleTimeoutMs;
+	ThreadLock                                 Lock;
+	std::map<std::string, NetConnPoolDest*>    Dests;
+	std::map<NetEndpoint*, NetConnPoolDest*>   Owners;  // established connections.
+	u32                                        Total;
+	u32                                        IdleCnt;
+	u32                                        WaiterCnt;
+	u64                                        Reuses;
+	u64                                        Connects;
+	u64                                        TimerId;
+	bool                                       TimerArmed;
+
+	virtual ~NetConnPoolDetails() {}
+
+	// Pop a healthy idle connection of 'dest', or return 0. Unhealthy
+	// ones are dropped into 'act'.
+	NetEndpoint* popIdleLocked(NetConnPoolDest *dest, NetConnPoolActions &act)
+	{
+		while (!dest->Idle.empty())
+		{
+			NetEndpoint *ep = dest->Idle.back().Ep;
+			dest->Idle.pop_back();
+			IdleCnt--;
+			if (connPoolIsHealthy(ep))
+				return ep;
+			dropLocked(ep, act);
+		}
+		return 0;
+	}
+
+	// Forget an established connection and close it later.
+	void dropLocked(NetEndpoint *ep, NetConnPoolActions &act)
+	{
+		std::map<NetEndpoint*, NetConnPoolDest*>::iterator it = Owners.find(ep);
+		xpfAssert(("Dropping an endpoint not owned by the pool.", it != Owners.end()));
+		it->second->Total--;
+		Total--;
+		Owners.erase(it);
+		act.Closing.push_back(ep);
+	}
+
+	void serveLocked(NetConnPoolDest *dest, NetEndpoint::EError ec, NetEndpoint *ep, NetConnPoolActions &act)
+	{
+		NetConnPoolHandout h;
+		h.Waiter = dest->Waiters.front();
+		h.Error = ec;
+		h.Ep = ep;
+		dest->Waiters.pop_front();
+		WaiterCnt--;
+		act.Handouts.push_back(h);
+	}
+
+	// Serve the waiters of 'dest' which no pending connect is going to
+	// serve, by idle connections or by new ones within the limit.
+	void pumpLocked(NetConnPoolDest *dest, NetConnPoolActions &act)
+	{
+		while (dest->Waiters.size() > dest->Connecting)
+		{
+			NetEndpoint *ep = popIdleLocked(dest, act);
+			if (ep)
+			{
+				Reuses++;
+				serveLocked(dest, NetEndpoint::EE_SUCCESS, ep, act);
+			}
+			else if (dest->Total < MaxPerDest)
+			{
+				dest->Total++;
+				dest->Connecting++;
+				Total++;
+				act.Connects.push_back(dest);
+			}
+			else
+			{
+				break;
+			}
+		}
+	}
+
+	// Arm the eviction timer to expire with the oldest idle connection.
+	void armTimerLocked()
+	{
+		if (TimerArmed || (IdleCnt == 0))
+			return;
+
+		u64 oldest = (u64)-1;
+		for (std::map<std::string, NetConnPoolDest*>::iterator it = Dests.begin(); it != Dests.end(); ++it)
+		{
+			if (!it->second->Idle.empty() && (it->second->Idle.front().Since < oldest))
+				oldest = it->second->Idle.front().Since;
+		}
+		const u64 now = connPoolNowMs();
+		const u64 due = oldest + IdleTimeoutMs;
+		TimerArmed = true;
+		TimerId = Mux->asyncTimer((due > now) ? (u32)(due - now) : 0, this);
+	}
+
+	void perform(NetConnPoolActions &act)
+	{
+		for (u32 i = 0; i < (u32)act.Closing.size(); ++i)
+		{
+			Mux->depart(act.Closing[i]);
+			delete act.Closing[i];
+		}
+		for (u32 i = 0; i < (u32)act.Connects.size(); ++i)
+		{
+			NetConnPoolDest *dest = act.Connects[i];
+			Mux->asyncConnectAny(dest->Host.c_str(), dest->Service.c_str(), new NetConnPoolConnect(this, dest));
+		}
+		for (u32 i = 0; i < (u32)act.Handouts.size(); ++i)
+		{
+			NetConnPoolHandout &h = act.Handouts[i];
+			h.Waiter.Cb->onCheckout(Pool, h.Error, h.Ep, h.Waiter.UserData);
+		}
+	}
+
+	void onConnected(NetConnPoolDest *dest, NetEndpoint::EError ec, NetEndpoint *ep)
+	{
+		NetConnPoolActions act;
+		Lock.lock();
+		dest->Connecting--;
+		if (ep)
+		{
+			Connects++;
+			Owners[ep] = dest;
+		}
+		else
+		{
+			dest->Total--;
+			Total--;
+		}
+		// Every connect is made for a waiter, which takes the result.
+		xpfAssert(("No waiter for a new connection.", !dest->Waiters.empty()));
+		serveLocked(dest, ec, ep, act);
+		pumpLocked(dest, act);
+		Lock.unlock();
+		perform(act);
+	}
+
+	// Eviction timer.
+	void onIoCompleted(NetIoMux::EIoType type, NetEndpoint::EError ec, NetEndpoint *sep, vptr tepOrPeer, const c8 *buf, u32 len)
+	{
+		xpfAssert(("Unexpected completion type.", type == NetIoMux::EIT_TIMER));
+
+		NetConnPoolActions act;
+		Lock.lock();
+		TimerArmed = false;
+		const u64 now = connPoolNowMs();
+		for (std::map<std::string, NetConnPoolDest*>::iterator it = Dests.begin(); it != Dests.end(); ++it)
+		{
+			NetConnPoolDest *dest = it->second;
+			while (!dest->Idle.empty() && (dest->Idle.front().Since + IdleTimeoutMs <= now))
+			{
+				NetEndpoint *ep = dest->Idle.front().Ep;
+				dest->Idle.pop_front();
+				IdleCnt--;
+				dropLocked(ep, act);
+			}
+			// Closed connections make room for waiters.
+			pumpLocked(dest, act);
+		}
+		armTimerLocked();
+		Lock.unlock();
+		perform(act);
+	}
+};
+
+void NetConnPoolConnect::onIoCompleted(NetIoMux::EIoType type, NetEndpoint::EError ec, NetEndpoint *sep, vptr tepOrPeer, const c8 *buf, u32 len)
+{
+	xpfAssert(("Unexpected completion type.", type == NetIoMux::EIT_CONNECT));
+	NetConnPoolDetails *details = Details;
+	NetConnPoolDest *dest = Dest;
+	delete this;
+	details->onConnected(dest, ec, (ec == NetEndpoint::EE_SUCCESS) ? sep : 0);
+}
+
+NetConnPool::NetConnPool(NetIoMux *mux, u32 maxPerDest, u32 maxIdlePerDest, u32 idleTimeoutMs)
+{
+	xpfAssert(("Null mux.", mux != 0));
+	xpfAssert(("Zero connection limit.", maxPerDest != 0));
+
+	mDetails = new NetConnPoolDetails;
+	mDetails->Pool = this;
+	mDetails->Mux = mux;
+	mDetails->MaxPerDest = maxPerDest;
+	mDetails->MaxIdlePerDest = maxIdlePerDest;
+	mDetails->IdleTimeoutMs = idleTimeoutMs;
+	mDetails->Total = 0;
+	mDetails->IdleCnt = 0;
+	mDetails->WaiterCnt = 0;
+	mDetails->Reuses = 0;
+	mDetails->Connects = 0;
+	mDetails->TimerId = 0;
+	mDetails->TimerArmed = false;
+}
+
+NetConnPool::~NetConnPool()
+{
+	if (mDetails)
+	{
+		xpfAssert(("Deleting a pool with pending checkouts.", mDetails->WaiterCnt == 0));
+		if (mDetails->TimerArmed)
+			mDetails->Mux->cancelTimer(mDetails->TimerId);
+
+		for (std::map<NetEndpoint*, NetConnPoolDest*>::iterator it = mDetails->Owners.begin();
+			it != mDetails->Owners.end(); ++it)
+		{
+			mDetails->Mux->depart(it->first);
+			delete it->first;
+		}
+		for (std::map<std::string, NetConnPoolDest*>::iterator it = mDetails->Dests.begin();
+			it != mDetails->Dests.end(); ++it)
+		{
+			delete it->second;
+		}
+		delete mDetails;
+		mDetails = 0;
+	}
+}
+
+void NetConnPool::checkout(const c8 *host, const c8 *serviceOrPort, NetConnPoolCallback *cb, vptr userData)
+{
+	xpfAssert(("Null callback.", cb != 0));
+
+	std::string key(host);
+	key.push_back('\n');
+	key.append(serviceOrPort);
+
+	NetConnPoolActions act;
+	mDetails->Lock.lock();
+	NetConnPoolDest *&dest = mDetails->Dests[key];
+	if (dest == 0)
+	{
+		dest = new NetConnPoolDest;
+		dest->Host = host;
+		dest->Service = serviceOrPort;
+		dest->Total = 0;
+		dest->Connecting = 0;
+	}
+	NetConnPoolWaiter w;
+	w.Cb = cb;
+	w.UserData = userData;
+	dest->Waiters.push_back(w);
+	mDetails->WaiterCnt++;
+	mDetails->pumpLocked(dest, act);
+	mDetails->Lock.unlock();
+	mDetails->perform(act);
+}
+
+void NetConnPool::checkin(NetEndpoint *ep, bool reusable)
+{
+	NetConnPoolActions act;
+	mDetails->Lock.lock();
+	std::map<NetEndpoint*, NetConnPoolDest*>::iterator it = mDetails->Owners.find(ep);
+	xpfAssert(("Checking in an endpoint not owned by the pool.", it != mDetails->Owners.end()));
+	NetConnPoolDest *dest = it->second;
+	if (reusable && (ep->getStatus() == NetEndpoint::ESTAT_CONNECTED) && (mDetails->MaxIdlePerDest != 0))
+	{
+		NetConnPoolIdle idle;
+		idle.Ep = ep;
+		idle.Since = connPoolNowMs();
+		dest->Idle.push_back(idle);
+		mDetails->IdleCnt++;
+		if (dest->Idle.size() > mDetails->MaxIdlePerDest)
+		{
+			NetEndpoint *oldest = dest->Idle.front().Ep;
+			dest->Idle.pop_front();
+			mDetails->IdleCnt--;
+			mDetails->dropLocked(oldest, act);
+		}
+	}
+	else
+	{
+		mDetails->dropLocked(ep, act);
+	}
+	mDetails->pumpLocked(dest, act);
+	mDetails->armTimerLocked();
+	mDetails->Lock.unlock();
+	mDetails->perform(act);
+}
+
+void NetConnPool::discard(NetEndpoint *ep)
+{
+	checkin(ep, false);
+}
+
+void NetConnPool::purge()
+{
+	NetConnPoolActions act;
+	mDetails->Lock.lock();
+	for (std::map<std::string, NetConnPoolDest*>::iterator it = mDetails->Dests.begin();
+		it != mDetails->Dests.end(); ++it)
+	{
+		NetConnPoolDest *dest = it->second;
+		while (!dest->Idle.empty())
+		{
+			NetEndpoint *ep = dest->Idle.front().Ep;
+			dest->Idle.pop_front();
+			mDetails->IdleCnt--;
+			mDetails->dropLocked(ep, act);
+		}
+	}
+	mDetails->Lock.unlock();
+	mDetails->perform(act);
+}
+
+NetIoMux* NetConnPool::getMux() const
+{
+	return mDetails->Mux;
+}
+
+u32 NetConnPool::getConnectionCount() const
+{
+	return mDetails->Total;
+}
+
+u32 NetConnPool::getIdleCount() const
+{
+	return mDetails->IdleCnt;
+}
+
+u32 NetConnPool::getWaiterCount() const
+{
+	return mDetails->WaiterCnt;
+}
+
+u64 NetConnPool::getReuseCount() const
+{
+	return mDetails->Reuses;
+}
+
+u64 NetConnPool::getConnectCount() const
+{
+	return mDetails->Connects;
+}
+
+} // end of namespace xpf
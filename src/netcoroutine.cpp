@@ -0,0 +1,311 @@
+/*******************************************************************************
+ * Copyright (c) 2013 matt@moregeek.com.tw
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ * 3. This notice may not be removed or altered from any source
+ *    distribution.
+ ********************************************************************************/ 
+
+#include <xpf/netcoroutine.h>
+#include <xpf/coroutine.h>
+#include <xpf/lexicalcast.h>
+#include <xpf/string.h>
+#include <deque>
+
+#if !defined(XPF_COROUTINE_USE_FCONTEXT) && defined(XPF_PLATFORM_WINDOWS)
+#define NETCO_CALL __stdcall
+#else
+#define NETCO_CALL
+#endif
+
+namespace xpf
+{
+
+struct NetCoSchedulerDetails;
+
+struct NetCoTask
+{
+	NetCoScheduler         *Sched;
+	NetCoSchedulerDetails  *Details;
+	NetCoScheduler::CoBody  Body;
+	vptr                    Data;
+	vptr                    Routine;
+	bool                    Finished;
+	NetCoTask              *Prev;     // links of all unfinished tasks.
+	NetCoTask              *Next;
+};
+
+struct NetCoSchedulerDetails
+{
+	NetIoMux               *Mux;
+	vptr                    SchedRoutine; // the coroutine which calls run().
+	NetCoTask              *Current;
+	NetCoTask              *Tasks;        // head of all unfinished tasks.
+	u32                     Count;
+	std::deque<NetCoTask*>  Runnable;
+	bool                    Stopping;
+};
+
+// Stack-allocated callback of a single pending operation.
+// Records the result and requeues the waiting coroutine.
+struct NetCoWaiter : public NetIoMuxCallback
+{
+	explicit NetCoWaiter(NetCoSchedulerDetails *d)
+		: Details(d), Task(d->Current), Ec(NetEndpoint::EE_SUCCESS)
+		, TepOrPeer(0), Length(0), Done(false) {}
+
+	void onIoCompleted(NetIoMux::EIoType type, NetEndpoint::EError ec, NetEndpoint *sep, vptr tepOrPeer, const c8 *buf, u32 len)
+	{
+		Ec = ec;
+		TepOrPeer = tepOrPeer;
+		Length = len;
+		Done = true;
+		Details->Runnable.push_back(Task);
+	}
+
+	// Switch back to the scheduler until the operation completes.
+	void wait()
+	{
+		while (!Done)
+			SwitchToCoroutine(Details->SchedRoutine);
+	}
+
+	NetCoSchedulerDetails *Details;
+	NetCoTask             *Task;
+	NetEndpoint::EError    Ec;
+	vptr                   TepOrPeer;
+	u32                    Length;
+	bool                   Done;
+};
+
+static void NETCO_CALL netco_body(vptr data)
+{
+	NetCoTask *task = (NetCoTask*)data;
+	task->Body(task->Sched, task->Data);
+	task->Finished = true;
+
+	// Never return from the coroutine body as it terminates the thread.
+	// The scheduler deletes this coroutine once switched back.
+	SwitchToCoroutine(task->Details->SchedRoutine);
+
+	// debug assert: should never reach here.
+	xpfAssert(("Resuming a finished coroutine.", false));
+}
+
+static void netco_release(NetCoSchedulerDetails *d, NetCoTask *t)
+{
+	if (t->Prev)
+		t->Prev->Next = t->Next;
+	else
+		d->Tasks = t->Next;
+	if (t->Next)
+		t->Next->Prev = t->Prev;
+	d->Count--;
+
+	DeleteCoroutine(t->Routine);
+	delete t;
+}
+
+static inline bool netco_check(NetCoSchedulerDetails *d, NetEndpoint::EError *ec)
+{
+	xpfAssert(("Blocking operations are for coroutine bodies only.", d->Current != 0));
+	if (d->Current == 0)
+	{
+		if (ec)
+			*ec = NetEndpoint::EE_INVALID_OP;
+		return false;
+	}
+	return true;
+}
+
+NetCoScheduler::NetCoScheduler(NetIoMux *mux)
+{
+	xpfAssert(("Null mux.", mux != 0));
+	mDetails = new NetCoSchedulerDetails;
+	mDetails->Mux = mux;
+	mDetails->SchedRoutine = 0;
+	mDetails->Current = 0;
+	mDetails->Tasks = 0;
+	mDetails->Count = 0;
+	mDetails->Stopping = false;
+}
+
+NetCoScheduler::~NetCoScheduler()
+{
+	xpfAssert(("Deleting a running scheduler.", mDetails->Current == 0));
+
+	// Unfinished coroutines are simply deleted. Their pending
+	// operations (if any) must have been cancelled by the caller.
+	mDetails->Runnable.clear();
+	while (mDetails->Tasks)
+		netco_release(mDetails, mDetails->Tasks);
+
+	delete mDetails;
+	mDetails = 0;
+}
+
+bool NetCoScheduler::spawn(CoBody body, vptr data, u32 stackSize)
+{
+	xpfAssert(("Null coroutine body.", body != 0));
+	if (body == 0)
+		return false;
+
+	// Coroutines are created on the thread which runs the scheduler.
+	InitThreadForCoroutines(0);
+
+	NetCoTask *t = new NetCoTask;
+	t->Sched = this;
+	t->Details = mDetails;
+	t->Body = body;
+	t->Data = data;
+	t->Finished = false;
+	t->Routine = CreateCoroutine(stackSize, netco_body, (vptr)t);
+	if (t->Routine == 0)
+	{
+		delete t;
+		return false;
+	}
+
+	t->Prev = 0;
+	t->Next = mDetails->Tasks;
+	if (mDetails->Tasks)
+		mDetails->Tasks->Prev = t;
+	mDetails->Tasks = t;
+	mDetails->Count++;
+	mDetails->Runnable.push_back(t);
+	return true;
+}
+
+void NetCoScheduler::run(u32 pollMs)
+{
+	xpfAssert(("Calling run() from a scheduled coroutine.", mDetails->Current == 0));
+	InitThreadForCoroutines(0);
+	mDetails->SchedRoutine = GetCurrentCoroutine();
+	mDetails->Stopping = false;
+
+	while (!mDetails->Stopping && (mDetails->Count > 0))
+	{
+		// Resume every runnable coroutine before polling the mux.
+		while (!mDetails->Runnable.empty())
+		{
+			NetCoTask *t = mDetails->Runnable.front();
+			mDetails->Runnable.pop_front();
+
+			mDetails->Current = t;
+			SwitchToCoroutine(t->Routine);
+			mDetails->Current = 0;
+
+			if (t->Finished)
+				netco_release(mDetails, t);
+		}
+
+		if (mDetails->Stopping || (mDetails->Count == 0))
+			break;
+
+		if (NetIoMux::ERS_DISABLED == mDetails->Mux->runOnce(pollMs))
+			break;
+	}
+}
+
+void NetCoScheduler::stop()
+{
+	mDetails->Stopping = true;
+}
+
+u32 NetCoScheduler::count() const
+{
+	return mDetails->Count;
+}
+
+NetIoMux* NetCoScheduler::getMux() const
+{
+	return mDetails->Mux;
+}
+
+s32 NetCoScheduler::recv(NetEndpoint *ep, c8 *buf, u32 buflen, NetEndpoint::EError *ec)
+{
+	if (!netco_check(mDetails, ec))
+		return -1;
+
+	NetCoWaiter w(mDetails);
+	mDetails->Mux->asyncRecv(ep, buf, buflen, &w);
+	w.wait();
+
+	if (ec)
+		*ec = w.Ec;
+	return (w.Ec == NetEndpoint::EE_SUCCESS) ? (s32)w.Length : -1;
+}
+
+s32 NetCoScheduler::send(NetEndpoint *ep, const c8 *buf, u32 buflen, NetEndpoint::EError *ec)
+{
+	if (!netco_check(mDetails, ec))
+		return -1;
+
+	NetCoWaiter w(mDetails);
+	mDetails->Mux->asyncSend(ep, buf, buflen, &w);
+	w.wait();
+
+	if (ec)
+		*ec = w.Ec;
+	return (w.Ec == NetEndpoint::EE_SUCCESS) ? (s32)w.Length : -1;
+}
+
+NetEndpoint* NetCoScheduler::accept(NetEndpoint *ep, NetEndpoint::EError *ec)
+{
+	if (!netco_check(mDetails, ec))
+		return 0;
+
+	NetCoWaiter w(mDetails);
+	mDetails->Mux->asyncAccept(ep, &w);
+	w.wait();
+
+	if (ec)
+		*ec = w.Ec;
+	return (w.Ec == NetEndpoint::EE_SUCCESS) ? (NetEndpoint*)w.TepOrPeer : 0;
+}
+
+bool NetCoScheduler::connect(NetEndpoint *ep, const c8 *host, const c8 *serviceOrPort, NetEndpoint::EError *ec)
+{
+	if (!netco_check(mDetails, ec))
+		return false;
+
+	NetCoWaiter w(mDetails);
+	mDetails->Mux->asyncConnect(ep, host, serviceOrPort, &w);
+	w.wait();
+
+	if (ec)
+		*ec = w.Ec;
+	return (w.Ec == NetEndpoint::EE_SUCCESS);
+}
+
+bool NetCoScheduler::connect(NetEndpoint *ep, const c8 *host, u32 port, NetEndpoint::EError *ec)
+{
+	string portStr = lexical_cast<c8>(port);
+	return connect(ep, host, portStr.c_str(), ec);
+}
+
+void NetCoScheduler::yield()
+{
+	if (!netco_check(mDetails, 0))
+		return;
+
+	mDetails->Runnable.push_back(mDetails->Current);
+	SwitchToCoroutine(mDetails->SchedRoutine);
+}
+
+} // end of namespace xpf
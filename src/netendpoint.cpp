@@ -35,6 +35,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/select.h>
 #include <netdb.h>
 #include <unistd.h>
@@ -48,6 +49,10 @@
 namespace xpf
 {
 
+// Defined by the in-memory transport of NetIoMux.
+void netIoMuxMemoryShutdown(NetEndpoint *ep, NetEndpoint::EShutdownDir dir);
+void netIoMuxMemoryClose(NetEndpoint *ep);
+
 class NetEndpointImpl
 {
 public:
@@ -67,6 +72,15 @@ public:
 
 		Status = NetEndpoint::ESTAT_INIT;
 
+		// In-memory endpoints have no socket.
+		if (protocol & NetEndpoint::ProtocolMemory)
+		{
+			xpfAssert( ("Expecting a TCP in-memory endpoint.", (protocol & NetEndpoint::ProtocolTCP) != 0) );
+			if ((protocol & NetEndpoint::ProtocolTCP) == 0)
+				Status = NetEndpoint::ESTAT_INVALID;
+			return;
+		}
+
 		// Decide detail socket parameters.
 		int family = AF_UNSPEC;
 		int type = 0;
@@ -214,7 +228,7 @@ public:
 	}
 
 	// TCP: do bind() and listen(). UDP: do bind().
-	bool listen (const c8 *addr, const c8 *serviceOrPort, u32 *errorcode, u32 backlog)
+	bool listen (const c8 *addr, const c8 *serviceOrPort, u32 *errorcode, u32 backlog, u32 fastOpenQueue)
 	{
 		bool ret = false;
 
@@ -226,6 +240,18 @@ public:
 			return false;
 		}
 
+		// In-memory listeners are only named: NetIoMux::join() registers
+		// them for in-memory connects.
+		if (Protocol & NetEndpoint::ProtocolMemory)
+		{
+			::strncpy(Address, (addr) ? addr : "localhost", XPF_NETENDPOINT_MAXADDRLEN - 1);
+			Port = lexical_cast<u32, c8>(serviceOrPort);
+			Status = NetEndpoint::ESTAT_LISTENING;
+			if (errorcode)
+				*errorcode = (u32)NetEndpoint::EE_SUCCESS;
+			return true;
+		}
+
 		// perform getaddrinfo() to prepare proper sockaddr data.
 		struct addrinfo hint = {0};
 		struct addrinfo *results;
@@ -265,6 +291,15 @@ public:
 			// for TCP endpoint, need to do listen().
 			if ( (Protocol & NetEndpoint::ProtocolTCP) != 0 )
 			{
+#ifdef TCP_FASTOPEN
+				// Best-effort: Linux takes the queue length while others
+				// take it as a boolean.
+				if (fastOpenQueue > 0)
+				{
+					int qlen = (int)fastOpenQueue;
+					::setsockopt(Socket, IPPROTO_TCP, TCP_FASTOPEN, (const char*)&qlen, sizeof(qlen));
+				}
+#endif
 				ec = ::listen(Socket, backlog);
 				if (0 != ec)
 				{
@@ -599,6 +634,8 @@ NetEndpoint::~NetEndpoint()
 {
 	if (pImpl != 0)
 	{
+		if (pImpl->Protocol & ProtocolMemory)
+			netIoMuxMemoryClose(this);
 		delete pImpl;
 		pImpl = 0;
 	}
@@ -609,10 +646,10 @@ NetEndpoint* NetEndpoint::create(u32 protocol)
 	return new NetEndpoint(protocol);
 }
 
-NetEndpoint* NetEndpoint::create(u32 protocol, const c8 *addr, const c8 *serviceOrPort, u32 *errorcode, u32 backlog)
+NetEndpoint* NetEndpoint::create(u32 protocol, const c8 *addr, const c8 *serviceOrPort, u32 *errorcode, u32 backlog, u32 fastOpenQueue)
 {
 	NetEndpoint *ret = new NetEndpoint(protocol);
-	if (!ret || !ret->listen(addr, serviceOrPort, errorcode, backlog))
+	if (!ret || !ret->listen(addr, serviceOrPort, errorcode, backlog, fastOpenQueue))
 	{
 		delete ret;
 		return 0;
@@ -645,6 +682,37 @@ bool NetEndpoint::resolvePeer(u32 protocol, NetEndpoint::Peer &peer, const c8 *
 	return true;
 }
 
+u32 NetEndpoint::resolvePeers(u32 protocol, NetEndpoint::Peer *peers, u32 maxPeers, const c8 * host, const c8 * serviceOrPort)
+{
+	const u32 families = NetEndpoint::ProtocolIPv4 | NetEndpoint::ProtocolIPv6;
+	struct addrinfo hint = { 0 };
+	struct addrinfo *results;
+	if ((protocol & families) == families)
+		hint.ai_family = AF_UNSPEC;
+	else
+		hint.ai_family = (protocol & NetEndpoint::ProtocolIPv6) ? AF_INET6 : AF_INET;
+	hint.ai_socktype = (protocol & NetEndpoint::ProtocolTCP) ? SOCK_STREAM : SOCK_DGRAM;
+	hint.ai_protocol = (protocol & NetEndpoint::ProtocolTCP) ? IPPROTO_TCP : IPPROTO_UDP;
+	hint.ai_flags = (AF_INET6 == hint.ai_family) ? AI_V4MAPPED : 0;
+	int ec = ::getaddrinfo(host, serviceOrPort, &hint, &results);
+	if (0 != ec)
+	{
+		return 0;
+	}
+
+	u32 cnt = 0;
+	for (struct addrinfo *ai = results; (ai != 0) && (cnt < maxPeers); ai = ai->ai_next)
+	{
+		if ((ai->ai_addrlen == 0) || (ai->ai_addrlen > XPF_NETENDPOINT_MAXADDRLEN))
+			continue;
+		std::memcpy(peers[cnt].Data, ai->ai_addr, ai->ai_addrlen);
+		peers[cnt].Length = (s32)ai->ai_addrlen;
+		++cnt;
+	}
+	::freeaddrinfo(results);
+	return cnt;
+}
+
 bool NetEndpoint::platformInit()
 {
 	return NetEndpointImpl::platformInit();
@@ -655,9 +723,9 @@ bool NetEndpoint::connect(const c8 *addr, const c8 *serviceOrPort, u32 *errorcod
 	return pImpl->connect(addr, serviceOrPort, errorcode);
 }
 
-bool NetEndpoint::listen (const c8 *addr, const c8 *serviceOrPort, u32 *errorcode, u32 backlog)
+bool NetEndpoint::listen (const c8 *addr, const c8 *serviceOrPort, u32 *errorcode, u32 backlog, u32 fastOpenQueue)
 {
-	return pImpl->listen(addr, serviceOrPort, errorcode, backlog);
+	return pImpl->listen(addr, serviceOrPort, errorcode, backlog, fastOpenQueue);
 }
 
 NetEndpoint* NetEndpoint::accept (u32 *errorcode)
@@ -695,11 +763,20 @@ s32 NetEndpoint::sendTo ( const Peer *peer, const c8 *buf, s32 len, u32 *errorco
 
 void NetEndpoint::shutdown(NetEndpoint::EShutdownDir dir, u32 *errorcode)
 {
+	if (pImpl->Protocol & ProtocolMemory)
+	{
+		netIoMuxMemoryShutdown(this, dir);
+		if (errorcode)
+			*errorcode = (u32)EE_SUCCESS;
+		return;
+	}
 	return pImpl->shutdown(dir, errorcode);
 }
 
 void NetEndpoint::close ()
 {
+	if (pImpl->Protocol & ProtocolMemory)
+		netIoMuxMemoryClose(this);
 	pImpl->close();
 }
 
@@ -0,0 +1,397 @@
+/*******************************************************************************
+ * Copyright (c) 2013 matt@moregeek.com.tw
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ * 3. This notice may not be removed or altered from any source
+ *    distribution.
+ ********************************************************************************/ 
+
+#include <xpf/netframing.h>
+#include <string.h>
+
+namespace xpf
+{
+
+#define NETFRAME_MAX_VARINT_BYTES (5)
+#define NETFRAME_MAX_DELIM_BYTES  (16)
+
+struct NetFrameReaderDetails : public NetIoMuxCallback
+{
+	NetFrameReader            *Reader;
+	NetEndpoint               *Ep;
+	NetFrameCallback          *Cb;
+	NetIoMux                  *Mux;
+	c8                        *Buf;
+	u32                        Capacity;
+	u32                        ChunkSize; // preferred receive size.
+	u32                        Head;      // start of the pending frame.
+	u32                        Tail;      // end of received data.
+	u32                        Need;      // bytes (from Head) the pending frame needs. 0 if unknown.
+	u32                        Scanned;   // bytes (from Head) searched for the delimiter.
+	NetFrameReader::EFraming   Framing;
+	u32                        MaxFrame;
+	c8                         Delim[NETFRAME_MAX_DELIM_BYTES];
+	u32                        DelimLen;
+	u64                        Recvs;
+	u64                        Frames;
+	bool                       Pending;   // an async receive is pending.
+	bool                       Stopping;
+	bool                       Failed;
+
+	virtual ~NetFrameReaderDetails() {}
+
+	void onIoCompleted(NetIoMux::EIoType type, NetEndpoint::EError ec, NetEndpoint *sep, vptr tepOrPeer, const c8 *buf, u32 len)
+	{
+		Pending = false;
+		if (ec != NetEndpoint::EE_SUCCESS)
+		{
+			fail(NetEndpoint::EE_RECV);
+			return;
+		}
+		if (len == 0)
+		{
+			fail(NetEndpoint::EE_SHUTDOWN);
+			return;
+		}
+
+		Recvs++;
+		Tail += len;
+		if (parse() < 0)
+			return; // The reader may have been deleted.
+		if (!Stopping)
+			arm();
+	}
+
+	void arm()
+	{
+		reserve();
+		Pending = true;
+		Mux->asyncRecv(Ep, Buf + Tail, Capacity - Tail, this);
+	}
+
+	// The final call of the callback. Do not touch any member afterward.
+	void fail(NetEndpoint::EError ec)
+	{
+		Failed = true;
+		Stopping = true;
+		Cb->onFrame(Reader, ec, 0, 0);
+	}
+
+	// Locate the pending frame at Head. Returns 1 with the header/body/
+	// trailer sizes if it is complete, 0 if more data is needed, or -1
+	// if it is malformed or oversized.
+	s32 locate(u32 &hdr, u32 &body, u32 &trailer)
+	{
+		const u8 *p = (const u8*)Buf + Head;
+		const u32 avail = Tail - Head;
+		trailer = 0;
+
+		switch (Framing)
+		{
+		case NetFrameReader::EF_VARINT:
+			hdr = 0;
+			body = 0;
+			while (true)
+			{
+				if (hdr >= avail)
+					return 0;
+				const u8 b = p[hdr];
+				if ((hdr == NETFRAME_MAX_VARINT_BYTES - 1) && (b > 0x0f))
+					return -1; // overflows u32.
+				body |= (u32)(b & 0x7f) << (7 * hdr);
+				++hdr;
+				if ((b & 0x80) == 0)
+					break;
+			}
+			break;
+		case NetFrameReader::EF_U16:
+			hdr = 2;
+			if (avail < hdr)
+				return 0;
+			body = ((u32)p[0] << 8) | (u32)p[1];
+			break;
+		case NetFrameReader::EF_U32:
+			hdr = 4;
+			if (avail < hdr)
+				return 0;
+			body = ((u32)p[0] << 24) | ((u32)p[1] << 16) | ((u32)p[2] << 8) | (u32)p[3];
+			break;
+		case NetFrameReader::EF_DELIMITER:
+			{
+				hdr = 0;
+				trailer = DelimLen;
+				// Resume from where the last search ended. A delimiter may
+				// straddle the previous end of data.
+				u32 from = (Scanned >= DelimLen) ? (Scanned - DelimLen + 1) : 0;
+				while (from + DelimLen <= avail)
+				{
+					const u8 *hit = (const u8*)::memchr(p + from, (u8)Delim[0], avail - DelimLen + 1 - from);
+					if (hit == 0)
+						break;
+					from = (u32)(hit - p);
+					if (0 == ::memcmp(hit, Delim, DelimLen))
+					{
+						body = from;
+						return (body > MaxFrame) ? -1 : 1;
+					}
+					++from;
+				}
+				Scanned = avail;
+				if (avail >= MaxFrame + DelimLen)
+					return -1;
+				Need = 0;
+				return 0;
+			}
+		default:
+			xpfAssert(("Unrecognized framing.", false));
+			return -1;
+		}
+
+		if (body > MaxFrame)
+			return -1;
+		Need = hdr + body;
+		return (avail >= Need) ? 1 : 0;
+	}
+
+	// Emit all complete frames. Returns the number of frames emitted or
+	// -1 if the reader has failed (and may have been deleted).
+	s32 parse()
+	{
+		s32 cnt = 0;
+		while (!Stopping)
+		{
+			u32 hdr = 0, body = 0, trailer = 0;
+			const s32 r = locate(hdr, body, trailer);
+			if (r == 0)
+				break;
+			if (r < 0)
+			{
+				fail(NetEndpoint::EE_RECV);
+				return -1;
+			}
+
+			const c8 *frame = Buf + Head + hdr;
+			Head += hdr + body + trailer;
+			Need = 0;
+			Scanned = 0;
+			Frames++;
+			cnt++;
+			Cb->onFrame(Reader, NetEndpoint::EE_SUCCESS, frame, body);
+		}
+		return cnt;
+	}
+
+	// Make room at Tail for the next receive.
+	void reserve()
+	{
+		if (Head == Tail)
+		{
+			Head = Tail = 0;
+			Scanned = 0;
+		}
+
+		// Move the pending frame to the front if it cannot fit in the
+		// rest of the buffer or the tail room is getting small.
+		if ((Head > 0) && ((Head + Need > Capacity) || (Capacity - Tail < ChunkSize / 4)))
+		{
+			::memmove(Buf, Buf + Head, Tail - Head);
+			Tail -= Head;
+			Head = 0;
+		}
+
+		u32 want = Capacity;
+		if (Need > want)
+			want = Need;
+		else if (Tail == Capacity)
+			want = Capacity * 2; // a frame of unknown length fills up the buffer.
+		if (want != Capacity)
+		{
+			c8 *nb = new c8[want];
+			::memcpy(nb, Buf + Head, Tail - Head);
+			delete[] Buf;
+			Buf = nb;
+			Tail -= Head;
+			Head = 0;
+			Capacity = want;
+		}
+	}
+};
+
+NetFrameReader::NetFrameReader(NetEndpoint *ep, NetFrameCallback *cb, u32 bufferSize)
+{
+	xpfAssert(("Null callback.", cb != 0));
+	if (bufferSize < 16)
+		bufferSize = 16;
+
+	mDetails = new NetFrameReaderDetails;
+	mDetails->Reader = this;
+	mDetails->Ep = ep;
+	mDetails->Cb = cb;
+	mDetails->Mux = 0;
+	mDetails->Buf = new c8[bufferSize];
+	mDetails->Capacity = bufferSize;
+	mDetails->ChunkSize = bufferSize;
+	mDetails->Head = 0;
+	mDetails->Tail = 0;
+	mDetails->Need = 0;
+	mDetails->Scanned = 0;
+	mDetails->Framing = EF_U32;
+	mDetails->MaxFrame = 0x100000;
+	mDetails->DelimLen = 0;
+	mDetails->Recvs = 0;
+	mDetails->Frames = 0;
+	mDetails->Pending = false;
+	mDetails->Stopping = true;
+	mDetails->Failed = false;
+}
+
+NetFrameReader::~NetFrameReader()
+{
+	xpfAssert(("Deleting a reader with a pending receive.", !mDetails->Pending));
+	delete[] mDetails->Buf;
+	delete mDetails;
+	mDetails = 0;
+}
+
+void NetFrameReader::setLengthPrefixed(EFraming type, u32 maxFrameSize)
+{
+	xpfAssert(("Not a length-prefixed framing.", type != EF_DELIMITER));
+	mDetails->Framing = type;
+	mDetails->MaxFrame = maxFrameSize;
+	mDetails->Need = 0;
+	mDetails->Scanned = 0;
+}
+
+void NetFrameReader::setDelimited(const c8 *delim, u32 delimLen, u32 maxFrameSize)
+{
+	xpfAssert(("Invalid delimiter length.", (delimLen > 0) && (delimLen <= NETFRAME_MAX_DELIM_BYTES)));
+	if ((delimLen == 0) || (delimLen > NETFRAME_MAX_DELIM_BYTES))
+		return;
+
+	::memcpy(mDetails->Delim, delim, delimLen);
+	mDetails->DelimLen = delimLen;
+	mDetails->Framing = EF_DELIMITER;
+	mDetails->MaxFrame = maxFrameSize;
+	mDetails->Need = 0;
+	mDetails->Scanned = 0;
+}
+
+bool NetFrameReader::start(NetIoMux *mux)
+{
+	NetFrameReaderDetails *d = mDetails;
+	xpfAssert(("Null mux.", mux != 0));
+	if ((mux == 0) || d->Failed || (d->Ep == 0))
+		return false;
+
+	d->Mux = mux;
+	d->Stopping = false;
+	if (!d->Pending)
+	{
+		// Emit frames buffered while stopped first.
+		if (d->parse() < 0)
+			return false;
+		if (!d->Stopping)
+			d->arm();
+	}
+	return true;
+}
+
+void NetFrameReader::stop()
+{
+	mDetails->Stopping = true;
+}
+
+bool NetFrameReader::isRunning() const
+{
+	return (mDetails->Mux != 0) && !mDetails->Stopping;
+}
+
+s32 NetFrameReader::pump()
+{
+	NetFrameReaderDetails *d = mDetails;
+	xpfAssert(("Pumping a reader with a pending receive.", !d->Pending));
+	if (d->Failed || d->Pending || (d->Ep == 0))
+		return -1;
+
+	d->Stopping = false;
+	d->reserve();
+	u32 errorcode = 0;
+	s32 bytes = d->Ep->recv(d->Buf + d->Tail, (s32)(d->Capacity - d->Tail), &errorcode);
+	if (bytes <= 0)
+	{
+		d->fail((bytes == 0) ? NetEndpoint::EE_SHUTDOWN : NetEndpoint::EE_RECV);
+		return -1;
+	}
+
+	d->Recvs++;
+	d->Tail += (u32)bytes;
+	return d->parse();
+}
+
+s32 NetFrameReader::feed(const c8 *data, u32 len)
+{
+	NetFrameReaderDetails *d = mDetails;
+	if (d->Failed)
+		return -1;
+
+	// Emit frames buffered while stopped first.
+	d->Stopping = false;
+	s32 cnt = d->parse();
+	if (cnt < 0)
+		return -1;
+
+	while ((len > 0) && !d->Stopping)
+	{
+		d->reserve();
+		u32 n = d->Capacity - d->Tail;
+		if (n > len)
+			n = len;
+		::memcpy(d->Buf + d->Tail, data, n);
+		d->Tail += n;
+		data += n;
+		len -= n;
+
+		const s32 r = d->parse();
+		if (r < 0)
+			return -1;
+		cnt += r;
+	}
+	return cnt;
+}
+
+NetEndpoint* NetFrameReader::getEndpoint() const
+{
+	return mDetails->Ep;
+}
+
+u32 NetFrameReader::getBufferedBytes() const
+{
+	return mDetails->Tail - mDetails->Head;
+}
+
+u64 NetFrameReader::getRecvCount() const
+{
+	return mDetails->Recvs;
+}
+
+u64 NetFrameReader::getFrameCount() const
+{
+	return mDetails->Frames;
+}
+
+} // end of namespace xpf
@@ -22,6 +22,7 @@
  ********************************************************************************/ 
 
 #include <xpf/netiomux.h>
+#include <xpf/iobuffer.h>
 #include <xpf/string.h>
 #include <xpf/lexicalcast.h>
 
@@ -36,6 +37,9 @@
 #else
 #  error NetIoMux is not supported on current platform.
 #endif
+#include "platform/netiomux_connectrace.hpp"
+#include "platform/netiomux_memory.hpp"
+#include "platform/netiomux_trace.hpp"
 
 namespace xpf
 {
@@ -43,11 +47,23 @@ namespace xpf
 NetIoMux::NetIoMux()
 {
 	pImpl = new NetIoMuxImpl();
+	pMemory = new NetIoMuxMemory(pImpl);
+	pTracer = new NetIoMuxTracer();
 	pDefaultMuxCallback = 0;
 }
 
 NetIoMux::~NetIoMux()
 {
+	if (pTracer)
+	{
+		delete pTracer;
+		pTracer = 0;
+	}
+	if (pMemory)
+	{
+		delete pMemory;
+		pMemory = 0;
+	}
 	if (pImpl)
 	{
 		delete pImpl;
@@ -58,64 +74,290 @@ NetIoMux::~NetIoMux()
 void NetIoMux::enable(bool val)
 {
 	pImpl->enable(val);
+	pMemory->enable(val);
 }
 
 void NetIoMux::run()
 {
-	pImpl->run();
+	pMemory->run();
 }
 
 NetIoMux::ERunningStaus NetIoMux::runOnce(u32 timeoutMs)
 {
-	return pImpl->runOnce(timeoutMs);
+	return pMemory->runOnce(timeoutMs);
 }
 
 void NetIoMux::asyncRecv(NetEndpoint *ep, c8 *buf, u32 buflen, NetIoMuxCallback *cb)
 {
-	pImpl->asyncRecv(ep, buf, buflen, cb ? cb : pDefaultMuxCallback);
+	if (NetIoMuxMemory::isMemory(ep))
+		pMemory->submit(ep, EIT_RECV, buf, buflen, pTracer->wrap(ep, buflen, cb ? cb : pDefaultMuxCallback));
+	else
+		pImpl->asyncRecv(ep, buf, buflen, pTracer->wrap(ep, buflen, cb ? cb : pDefaultMuxCallback));
 }
 
 void NetIoMux::asyncRecvFrom(NetEndpoint *ep, c8 *buf, u32 buflen, NetIoMuxCallback *cb)
 {
-	pImpl->asyncRecvFrom(ep, buf, buflen, cb ? cb : pDefaultMuxCallback);
+	if (NetIoMuxMemory::isMemory(ep))
+		pMemory->submit(ep, EIT_RECVFROM, buf, buflen, pTracer->wrap(ep, buflen, cb ? cb : pDefaultMuxCallback));
+	else
+		pImpl->asyncRecvFrom(ep, buf, buflen, pTracer->wrap(ep, buflen, cb ? cb : pDefaultMuxCallback));
 }
 
 void NetIoMux::asyncSend(NetEndpoint *ep, const c8 *buf, u32 buflen, NetIoMuxCallback *cb)
 {
-	pImpl->asyncSend(ep, buf, buflen, cb ? cb : pDefaultMuxCallback);
+	if (NetIoMuxMemory::isMemory(ep))
+		pMemory->submit(ep, EIT_SEND, (c8*)buf, buflen, pTracer->wrap(ep, buflen, cb ? cb : pDefaultMuxCallback));
+	else
+		pImpl->asyncSend(ep, buf, buflen, pTracer->wrap(ep, buflen, cb ? cb : pDefaultMuxCallback));
 }
 
 void NetIoMux::asyncSendTo(NetEndpoint *ep, const NetEndpoint::Peer *peer, const c8 *buf, u32 buflen, NetIoMuxCallback *cb)
 {
-	pImpl->asyncSendTo(ep, peer, buf, buflen, cb ? cb : pDefaultMuxCallback);
+	if (NetIoMuxMemory::isMemory(ep))
+		pMemory->submit(ep, EIT_SENDTO, (c8*)buf, buflen, pTracer->wrap(ep, buflen, cb ? cb : pDefaultMuxCallback));
+	else
+		pImpl->asyncSendTo(ep, peer, buf, buflen, 0, pTracer->wrap(ep, buflen, cb ? cb : pDefaultMuxCallback));
+}
+
+void NetIoMux::asyncSendSegments(NetEndpoint *ep, const NetEndpoint::Peer *peer, const c8 *buf, u32 buflen, u32 segmentSize, NetIoMuxCallback *cb)
+{
+	if (NetIoMuxMemory::isMemory(ep))
+		pMemory->submit(ep, EIT_SENDTO, (c8*)buf, buflen, pTracer->wrap(ep, buflen, cb ? cb : pDefaultMuxCallback));
+	else
+		pImpl->asyncSendTo(ep, peer, buf, buflen, segmentSize, pTracer->wrap(ep, buflen, cb ? cb : pDefaultMuxCallback));
 }
 
 void NetIoMux::asyncAccept(NetEndpoint *ep, NetIoMuxCallback *cb)
 {
-	pImpl->asyncAccept(ep, cb ? cb : pDefaultMuxCallback);
+	if (NetIoMuxMemory::isMemory(ep))
+		pMemory->submit(ep, EIT_ACCEPT, 0, 0, pTracer->wrap(ep, 0, cb ? cb : pDefaultMuxCallback));
+	else
+		pImpl->asyncAccept(ep, pTracer->wrap(ep, 0, cb ? cb : pDefaultMuxCallback));
 }
 
 void NetIoMux::asyncConnect(NetEndpoint *ep, const c8 *host, const c8 *serviceOrPort, NetIoMuxCallback *cb)
 {
-	pImpl->asyncConnect(ep, host, serviceOrPort, cb ? cb : pDefaultMuxCallback);
+	asyncConnect(ep, host, serviceOrPort, 0, 0, cb);
 }
 
 void NetIoMux::asyncConnect(NetEndpoint *ep, const c8 *host, u32 port, NetIoMuxCallback *cb)
 {
 	string portStr = lexical_cast<c8>(port);
-	pImpl->asyncConnect(ep, host, portStr.c_str(), cb ? cb : pDefaultMuxCallback);
+	asyncConnect(ep, host, portStr.c_str(), 0, 0, cb);
+}
+
+void NetIoMux::asyncConnect(NetEndpoint *ep, const c8 *host, const c8 *serviceOrPort, const c8 *data, u32 len, NetIoMuxCallback *cb)
+{
+	if (NetIoMuxMemory::isMemory(ep))
+		pMemory->connect(ep, host, serviceOrPort, data, len, pTracer->wrap(ep, len, cb ? cb : pDefaultMuxCallback));
+	else
+		pImpl->asyncConnect(ep, host, serviceOrPort, data, len, pTracer->wrap(ep, len, cb ? cb : pDefaultMuxCallback));
+}
+
+void NetIoMux::asyncConnect(NetEndpoint *ep, const c8 *host, u32 port, const c8 *data, u32 len, NetIoMuxCallback *cb)
+{
+	string portStr = lexical_cast<c8>(port);
+	asyncConnect(ep, host, portStr.c_str(), data, len, cb);
+}
+
+void NetIoMux::asyncConnectAny(const c8 *host, const c8 *serviceOrPort, NetIoMuxCallback *cb, u32 attemptDelayMs)
+{
+	NetIoMuxConnectRace::start(pImpl, host, serviceOrPort, 0, 0, attemptDelayMs, pTracer->wrap(0, 0, cb ? cb : pDefaultMuxCallback));
+}
+
+void NetIoMux::asyncConnectAny(const NetEndpoint::Peer *peers, u32 count, NetIoMuxCallback *cb, u32 attemptDelayMs)
+{
+	NetIoMuxConnectRace::start(pImpl, 0, 0, peers, count, attemptDelayMs, pTracer->wrap(0, 0, cb ? cb : pDefaultMuxCallback));
+}
+
+void NetIoMux::asyncRecv(NetEndpoint *ep, IoBuffer *buf, NetIoMuxCallback *cb)
+{
+	if (NetIoMuxMemory::isMemory(ep))
+		pMemory->reject(ep, EIT_RECV, pTracer->wrap(ep, 0, cb ? cb : pDefaultMuxCallback));
+	else
+		pImpl->asyncRecv(ep, buf, pTracer->wrap(ep, buf->tailroom(), cb ? cb : pDefaultMuxCallback));
+}
+
+void NetIoMux::asyncSend(NetEndpoint *ep, const IoBufferChain &chain, NetIoMuxCallback *cb)
+{
+	if (NetIoMuxMemory::isMemory(ep))
+		pMemory->reject(ep, EIT_SEND, pTracer->wrap(ep, 0, cb ? cb : pDefaultMuxCallback));
+	else
+		pImpl->asyncSend(ep, chain, pTracer->wrap(ep, chain.length(), cb ? cb : pDefaultMuxCallback));
+}
+
+void NetIoMux::asyncBroadcast(NetEndpoint *const *eps, u32 count, const IoBufferChain &payload, NetIoMuxCallback *cb)
+{
+	for (u32 i = 0; i < count; ++i)
+	{
+		if (NetIoMuxMemory::isMemory(eps[i]))
+		{
+			pMemory->rejectBroadcast(cb ? cb : pDefaultMuxCallback);
+			return;
+		}
+	}
+	pImpl->asyncBroadcast(eps, count, payload, cb ? cb : pDefaultMuxCallback);
+}
+
+void NetIoMux::asyncBroadcast(NetEndpoint *const *eps, u32 count, IoBuffer *payload, NetIoMuxCallback *cb)
+{
+	IoBufferChain chain;
+	chain.append(payload);
+	asyncBroadcast(eps, count, chain, cb);
+}
+
+u64 NetIoMux::asyncTimer(u32 delayMs, NetIoMuxCallback *cb, vptr userData)
+{
+	return pImpl->asyncTimer(delayMs, cb ? cb : pDefaultMuxCallback, userData);
+}
+
+bool NetIoMux::cancelTimer(u64 timerId)
+{
+	return pImpl->cancelTimer(timerId);
+}
+
+void NetIoMux::asyncWakeup(NetIoMuxCallback *cb)
+{
+	pImpl->asyncWakeup(cb ? cb : pDefaultMuxCallback);
 }
 
 bool NetIoMux::join(NetEndpoint *ep)
 {
+	if (NetIoMuxMemory::isMemory(ep))
+		return pMemory->join(ep);
 	return pImpl->join(ep);
 }
 
 bool NetIoMux::depart(NetEndpoint *ep)
 {
+	pTracer->forget(ep);
+	if (NetIoMuxMemory::isMemory(ep))
+		return pMemory->depart(ep);
 	return pImpl->depart(ep);
 }
 
+bool NetIoMux::setSendCoalescing(NetEndpoint *ep, bool val)
+{
+	if (NetIoMuxMemory::isMemory(ep))
+		return false;
+	return pImpl->setSendCoalescing(ep, val);
+}
+
+bool NetIoMux::setReceiveOffload(NetEndpoint *ep, bool val)
+{
+	if (NetIoMuxMemory::isMemory(ep))
+		return false;
+	return pImpl->setReceiveOffload(ep, val);
+}
+
+bool NetIoMux::setWriteWatermarks(NetEndpoint *ep, u32 lowBytes, u32 highBytes)
+{
+	if (NetIoMuxMemory::isMemory(ep))
+		return false;
+	return pImpl->setWriteWatermarks(ep, lowBytes, highBytes);
+}
+
+bool NetIoMux::isWriteBlocked(NetEndpoint *ep) const
+{
+	if (NetIoMuxMemory::isMemory(ep))
+		return false;
+	return pImpl->isWriteBlocked(ep);
+}
+
+u32 NetIoMux::getQueuedWriteBytes(NetEndpoint *ep) const
+{
+	if (NetIoMuxMemory::isMemory(ep))
+		return 0;
+	return pImpl->getQueuedWriteBytes(ep);
+}
+
+bool NetIoMux::watchFd(s32 fd, u32 events, NetIoMuxCallback *cb, vptr userData)
+{
+	return pImpl->watchFd(fd, events, cb ? cb : pDefaultMuxCallback, userData);
+}
+
+bool NetIoMux::modifyFd(s32 fd, u32 events)
+{
+	return pImpl->modifyFd(fd, events);
+}
+
+bool NetIoMux::unwatchFd(s32 fd)
+{
+	return pImpl->unwatchFd(fd);
+}
+
+void NetIoMux::asyncFileRead(s32 fd, c8 *buf, u32 len, u64 offset, NetIoMuxCallback *cb, vptr userData)
+{
+	pImpl->asyncFile(EIT_FILEREAD, fd, buf, len, offset, EFS_NONE, cb ? cb : pDefaultMuxCallback, userData);
+}
+
+void NetIoMux::asyncFileWrite(s32 fd, const c8 *buf, u32 len, u64 offset, EFileSync sync, NetIoMuxCallback *cb, vptr userData)
+{
+	pImpl->asyncFile(EIT_FILEWRITE, fd, (c8*)buf, len, offset, sync, cb ? cb : pDefaultMuxCallback, userData);
+}
+
+void NetIoMux::setFileIoThreads(u32 threads, u32 maxQueued)
+{
+	pImpl->setFileIoThreads(threads, maxQueued);
+}
+
+void NetIoMux::setTurnBudget(u32 opsPerTurn, u32 bytesPerTurn)
+{
+	pImpl->setTurnBudget(opsPerTurn, bytesPerTurn);
+}
+
+bool NetIoMux::setPriority(NetEndpoint *ep, EPriority prio)
+{
+	if (NetIoMuxMemory::isMemory(ep))
+		return false;
+	return pImpl->setPriority(ep, prio);
+}
+
+void NetIoMux::setMaxQueuedBytes(u64 bytes)
+{
+	pImpl->setMaxQueuedBytes(bytes);
+}
+
+void NetIoMux::setMemoryFaults(const MemoryFaults &faults)
+{
+	pMemory->setFaults(faults);
+}
+
+bool NetIoMux::startTrace(const c8 *path, u32 capacity)
+{
+	return pTracer->start(path, capacity);
+}
+
+void NetIoMux::stopTrace()
+{
+	pTracer->stop();
+}
+
+void NetIoMux::enableProfiler(bool val, u32 slowThresholdUs)
+{
+	pImpl->profiler().enable(val, slowThresholdUs);
+}
+
+bool NetIoMux::getProfile(EIoType type, ProfileStats &stats) const
+{
+	return pImpl->profiler().get(type, stats);
+}
+
+u32 NetIoMux::getSlowCallbacks(SlowCallback *out, u32 max) const
+{
+	return pImpl->profiler().getSlow(out, max);
+}
+
+void NetIoMux::resetProfile()
+{
+	pImpl->profiler().reset();
+}
+
+u64 NetIoMux::getQueuedBytes() const
+{
+	return pImpl->getQueuedBytes();
+}
+
 const char * NetIoMux::getMultiplexerType(EPlatformMultiplexer &epm)
 {
 	return NetIoMuxImpl::getMultiplexerType(epm);
@@ -0,0 +1,447 @@
+/*******************************************************************************
+ * Copyright (c) 2013 matt@moregeek.com.tw
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ * 3. This notice may not be removed or altered from any source
+ *    distribution.
+ ********************************************************************************/ 
+
+#include <xpf/nettrace.h>
+#include <xpf/threadlock.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef XPF_PLATFORM_WINDOWS
+#include <Windows.h>
+#else
+#include <time.h>
+#endif
+
+#define REPLAY_RECV_SIZE (16 * 1024)
+
+namespace xpf
+{
+
+static u64 traceNowUs()
+{
+#ifdef XPF_PLATFORM_WINDOWS
+	LARGE_INTEGER freq, now;
+	::QueryPerformanceFrequency(&freq);
+	::QueryPerformanceCounter(&now);
+	return (u64)((now.QuadPart / freq.QuadPart) * 1000000 + ((now.QuadPart % freq.QuadPart) * 1000000) / freq.QuadPart);
+#else
+	struct timespec ts;
+	::clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((u64)ts.tv_sec * 1000000) + ((u64)ts.tv_nsec / 1000);
+#endif
+}
+
+//============---------- NetTraceReader -----------================//
+
+struct NetTraceReaderDetails
+{
+	std::vector<NetTraceRecord> Records;
+	u64                         Overwritten;
+};
+
+NetTraceReader::NetTraceReader()
+{
+	mDetails = new NetTraceReaderDetails;
+	mDetails->Overwritten = 0;
+}
+
+NetTraceReader::~NetTraceReader()
+{
+	delete mDetails;
+	mDetails = 0;
+}
+
+bool NetTraceReader::open(const c8 *path)
+{
+	mDetails->Records.clear();
+	mDetails->Overwritten = 0;
+
+	FILE *f = ::fopen(path, "rb");
+	if (f == 0)
+		return false;
+
+	NetTraceHeader h;
+	bool ok = (1 == ::fread(&h, sizeof(h), 1, f))
+		&& (h.Magic == NetTraceHeader::MAGIC)
+		&& (h.Version == NetTraceHeader::VERSION)
+		&& (h.RecordSize == sizeof(NetTraceRecord))
+		&& (h.Capacity > 0);
+	if (ok)
+	{
+		const u32 count = (h.Written < h.Capacity) ? (u32)h.Written : h.Capacity;
+		std::vector<NetTraceRecord> slots(count);
+		ok = (count == 0) || (count == ::fread(&slots[0], sizeof(NetTraceRecord), count, f));
+		if (ok)
+		{
+			// The oldest record is in the slot to be written next.
+			const u32 first = (h.Written > h.Capacity) ? (u32)(h.Written % h.Capacity) : 0;
+			mDetails->Records.reserve(count);
+			for (u32 i = 0; i < count; ++i)
+				mDetails->Records.push_back(slots[(first + i) % count]);
+			mDetails->Overwritten = h.Written - count;
+		}
+	}
+	::fclose(f);
+	return ok;
+}
+
+u32 NetTraceReader::getCount() const
+{
+	return (u32)mDetails->Records.size();
+}
+
+const NetTraceRecord& NetTraceReader::getRecord(u32 idx) const
+{
+	xpfAssert(("Trace record index out of range.", idx < mDetails->Records.size()));
+	return mDetails->Records[idx];
+}
+
+u64 NetTraceReader::getOverwrittenCount() const
+{
+	return mDetails->Overwritten;
+}
+
+//============---------- NetTraceReplay -----------================//
+
+struct NetTraceReplayEvent
+{
+	u64 AtUs;   // since the first connection of the trace.
+	u32 Length; // 0 for the end of the stream.
+
+	bool operator < (const NetTraceReplayEvent &other) const { return AtUs < other.AtUs; }
+};
+
+struct NetTraceReplayDetails;
+
+// A replayed connection, which is also the callback of its operations.
+struct NetTraceReplayConn : public NetIoMuxCallback
+{
+	NetTraceReplayDetails              *Details;
+	std::vector<NetTraceReplayEvent>    Events;
+	u64                                 StartUs;
+	u32                                 Next;     // the event being replayed.
+	u32                                 Offset;   // bytes of it sent.
+	NetEndpoint                        *Ep;
+	bool                                Ended;    // the stream has ended in the trace.
+	bool                                Sending;
+	bool                                PeerGone;
+	bool                                Done;
+	c8                                  RecvBuf[REPLAY_RECV_SIZE];
+
+	virtual ~NetTraceReplayConn() {}
+	void onIoCompleted(NetIoMux::EIoType type, NetEndpoint::EError ec, NetEndpoint *sep, vptr tepOrPeer, const c8 *buf, u32 len);
+	void advance();  // require Details->Lock.
+	void finish(bool failed);  // require Details->Lock.
+};
+
+struct NetTraceReplayDetails
+{
+	NetIoMux                          *Mux;
+	std::vector<NetTraceReplayConn*>   Conns;
+	std::vector<c8>                    Payload;
+	std::string                        Host;
+	std::string                        Service;
+	f32                                Speed;
+	u64                                StartUs;
+	bool                               Started;
+	u32                                DoneCnt;
+	u32                                Errors;
+	u64                                SentBytes;
+	u64                                RecvBytes;
+	u32                                MaxLagUs;
+	ThreadLock                         Lock;
+
+	// Time of the replay in the clock of the trace.
+	u64 traceTimeUs() const
+	{
+		return (u64)((f64)(traceNowUs() - StartUs) * Speed);
+	}
+
+	void clear()
+	{
+		for (u32 i = 0; i < (u32)Conns.size(); ++i)
+			delete Conns[i];
+		Conns.clear();
+	}
+};
+
+void NetTraceReplayConn::onIoCompleted(NetIoMux::EIoType type, NetEndpoint::EError ec, NetEndpoint *sep, vptr tepOrPeer, const c8 *buf, u32 len)
+{
+	ScopedThreadLock ml(Details->Lock);
+	if (Done)
+		return;
+
+	switch (type)
+	{
+	case NetIoMux::EIT_TIMER:
+		if (Ep == 0)
+			Details->Mux->asyncConnectAny(Details->Host.c_str(), Details->Service.c_str(), this);
+		else
+			advance();
+		break;
+
+	case NetIoMux::EIT_CONNECT:
+		if (ec != NetEndpoint::EE_SUCCESS)
+		{
+			finish(true);
+			break;
+		}
+		Ep = sep;
+		Details->Mux->asyncRecv(Ep, RecvBuf, REPLAY_RECV_SIZE, this);
+		advance();
+		break;
+
+	case NetIoMux::EIT_SEND:
+		Sending = false;
+		if ((ec != NetEndpoint::EE_SUCCESS) || PeerGone)
+		{
+			finish(ec != NetEndpoint::EE_SUCCESS);
+			break;
+		}
+		Details->SentBytes += len;
+		Offset += len;
+		if (Offset >= Events[Next].Length)
+		{
+			Next++;
+			Offset = 0;
+		}
+		advance();
+		break;
+
+	case NetIoMux::EIT_RECV:
+		if ((ec != NetEndpoint::EE_SUCCESS) || (len == 0))
+		{
+			// Wait for the send in flight.
+			PeerGone = true;
+			if (!Sending)
+				finish(false);
+			break;
+		}
+		Details->RecvBytes += len;
+		Details->Mux->asyncRecv(Ep, RecvBuf, REPLAY_RECV_SIZE, this);
+		break;
+
+	default:
+		break;
+	}
+}
+
+void NetTraceReplayConn::advance()
+{
+	if (Next >= (u32)Events.size())
+		return;
+
+	const NetTraceReplayEvent &e = Events[Next];
+	const u64 now = Details->traceTimeUs();
+	if ((Offset == 0) && (e.AtUs > now + 500))
+	{
+		const u32 delayMs = (u32)(((f64)(e.AtUs - now) / Details->Speed) / 1000);
+		Details->Mux->asyncTimer(delayMs, this);
+		return;
+	}
+
+	if ((Offset == 0) && (now > e.AtUs) && (now - e.AtUs > Details->MaxLagUs))
+		Details->MaxLagUs = (u32)(now - e.AtUs);
+
+	if (e.Length == 0)
+	{
+		// Shut down writing and wait for the server to close.
+		Next = (u32)Events.size();
+		Ep->shutdown(NetEndpoint::ESD_WRITE);
+		return;
+	}
+	Sending = true;
+	Details->Mux->asyncSend(Ep, &Details->Payload[Offset], e.Length - Offset, this);
+}
+
+void NetTraceReplayConn::finish(bool failed)
+{
+	if (Ep)
+	{
+		Details->Mux->depart(Ep);
+		delete Ep;
+		Ep = 0;
+	}
+	if (failed)
+		Details->Errors++;
+	Done = true;
+	Details->DoneCnt++;
+}
+
+NetTraceReplay::NetTraceReplay(NetIoMux *mux)
+{
+	mDetails = new NetTraceReplayDetails;
+	mDetails->Mux = mux;
+	mDetails->Speed = 1.0f;
+	mDetails->StartUs = 0;
+	mDetails->Started = false;
+	mDetails->DoneCnt = 0;
+	mDetails->Errors = 0;
+	mDetails->SentBytes = 0;
+	mDetails->RecvBytes = 0;
+	mDetails->MaxLagUs = 0;
+}
+
+NetTraceReplay::~NetTraceReplay()
+{
+	mDetails->clear();
+	delete mDetails;
+	mDetails = 0;
+}
+
+u32 NetTraceReplay::load(const NetTraceReader &trace)
+{
+	ScopedThreadLock ml(mDetails->Lock);
+	if (mDetails->Started)
+		return 0;
+	mDetails->clear();
+
+	std::map<u32, NetTraceReplayConn*> byId;
+	u32 maxLen = 0;
+	u64 base = 0;
+	for (u32 i = 0; i < trace.getCount(); ++i)
+	{
+		const NetTraceRecord &r = trace.getRecord(i);
+		if (r.Error != NetEndpoint::EE_SUCCESS)
+			continue;
+
+		const u64 at = r.TimeUs + r.LatencyUs;
+		u32 id = 0;
+		if ((r.Type == NetIoMux::EIT_ACCEPT) && (r.PeerId != 0))
+			id = r.PeerId;
+		else if ((r.Type == NetIoMux::EIT_RECV) && (r.EndpointId != 0))
+			id = r.EndpointId;
+		else
+			continue;
+
+		NetTraceReplayConn *conn = byId[id];
+		if (conn == 0)
+		{
+			conn = new NetTraceReplayConn;
+			conn->Details = mDetails;
+			conn->StartUs = at;
+			conn->Next = conn->Offset = 0;
+			conn->Ep = 0;
+			conn->Ended = conn->Sending = conn->PeerGone = conn->Done = false;
+			byId[id] = conn;
+			mDetails->Conns.push_back(conn);
+			if ((mDetails->Conns.size() == 1) || (at < base))
+				base = at;
+		}
+		if ((r.Type != NetIoMux::EIT_RECV) || conn->Ended)
+			continue;
+
+		NetTraceReplayEvent e;
+		e.AtUs = at;
+		e.Length = r.Length;
+		conn->Events.push_back(e);
+		conn->Ended = (r.Length == 0);
+		if (r.Length > maxLen)
+			maxLen = r.Length;
+	}
+
+	// Rebase the times on the first connection.
+	for (u32 i = 0; i < (u32)mDetails->Conns.size(); ++i)
+	{
+		NetTraceReplayConn *conn = mDetails->Conns[i];
+		std::stable_sort(conn->Events.begin(), conn->Events.end());
+		conn->StartUs -= base;
+		for (u32 j = 0; j < (u32)conn->Events.size(); ++j)
+			conn->Events[j].AtUs -= base;
+		// Close the stream after the last receive of the trace.
+		if (!conn->Ended)
+		{
+			NetTraceReplayEvent e;
+			e.AtUs = (conn->Events.empty()) ? conn->StartUs : conn->Events.back().AtUs;
+			e.Length = 0;
+			conn->Events.push_back(e);
+		}
+	}
+
+	mDetails->Payload.resize((maxLen > 0) ? maxLen : 1);
+	for (u32 i = 0; i < (u32)mDetails->Payload.size(); ++i)
+		mDetails->Payload[i] = (c8)(i % 251);
+	return (u32)mDetails->Conns.size();
+}
+
+bool NetTraceReplay::start(const c8 *host, const c8 *serviceOrPort, f32 speed)
+{
+	ScopedThreadLock ml(mDetails->Lock);
+	if (mDetails->Started || mDetails->Conns.empty() || (speed <= 0.0f))
+		return false;
+
+	mDetails->Host = (host) ? host : "localhost";
+	mDetails->Service = serviceOrPort;
+	mDetails->Speed = speed;
+	mDetails->StartUs = traceNowUs();
+	mDetails->Started = true;
+	for (u32 i = 0; i < (u32)mDetails->Conns.size(); ++i)
+	{
+		NetTraceReplayConn *conn = mDetails->Conns[i];
+		mDetails->Mux->asyncTimer((u32)(((f64)conn->StartUs / speed) / 1000), conn);
+	}
+	return true;
+}
+
+bool NetTraceReplay::isDone() const
+{
+	ScopedThreadLock ml(mDetails->Lock);
+	return mDetails->Started && (mDetails->DoneCnt == (u32)mDetails->Conns.size());
+}
+
+u32 NetTraceReplay::getConnectionCount() const
+{
+	ScopedThreadLock ml(mDetails->Lock);
+	return (u32)mDetails->Conns.size();
+}
+
+u32 NetTraceReplay::getErrorCount() const
+{
+	ScopedThreadLock ml(mDetails->Lock);
+	return mDetails->Errors;
+}
+
+u64 NetTraceReplay::getSentBytes() const
+{
+	ScopedThreadLock ml(mDetails->Lock);
+	return mDetails->SentBytes;
+}
+
+u64 NetTraceReplay::getRecvBytes() const
+{
+	ScopedThreadLock ml(mDetails->Lock);
+	return mDetails->RecvBytes;
+}
+
+u32 NetTraceReplay::getMaxLagUs() const
+{
+	ScopedThreadLock ml(mDetails->Lock);
+	return mDetails->MaxLagUs;
+}
+
+} // end of namespace xpf
@@ -0,0 +1,297 @@
+/*******************************************************************************
+ * Copyright (c) 2013 matt@moregeek.com.tw
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ * 3. This notice may not be removed or altered from any source
+ *    distribution.
+ ********************************************************************************/
+
+#include <xpf/netiomux.h>
+#include <xpf/string.h>
+
+#if !defined(XPF_PLATFORM_WINDOWS)
+#  include <sys/socket.h>
+#  include <netdb.h>
+#endif
+
+// NOTE: Requires the NetIoMuxImpl of the platform being included beforehand.
+
+namespace xpf
+{
+
+// State of a NetIoMux::asyncConnectAny() call. Connect attempts to the
+// candidate addresses race on the mux per Happy Eyeballs (RFC 8305).
+// It receives the completions of its own attempts and timers, and
+// releases itself once the result is emitted and all of them are back.
+class NetIoMuxConnectRace : public NetIoMuxCallback
+{
+public:
+	static const u32 MaxPeers = 16;
+
+	// Either 'host' or 'peers' is given.
+	static void start(NetIoMuxImpl *mux, const c8 *host, const c8 *serviceOrPort,
+		const NetEndpoint::Peer *peers, u32 count, u32 delayMs, NetIoMuxCallback *cb)
+	{
+		NetIoMuxConnectRace *r = new NetIoMuxConnectRace(mux, delayMs, cb);
+		if (host != 0)
+		{
+			r->mHost = host;
+			r->mService = serviceOrPort;
+		}
+		else
+		{
+			r->setPeers(peers, count);
+		}
+
+		// Start from a worker since resolving can block.
+		mux->asyncWakeup(r);
+	}
+
+	void onIoCompleted(NetIoMux::EIoType type, NetEndpoint::EError ec, NetEndpoint *sep, vptr tepOrPeer, const c8 *buf, u32 len)
+	{
+		NetIoMuxCompletion rec;
+		rec.Type = type;
+		rec.Error = ec;
+		rec.Endpoint = sep;
+		rec.TepOrPeer = tepOrPeer;
+		rec.Buffer = buf;
+		rec.Length = len;
+		rec.SegmentSize = 0;
+		onIoCompletedBatch(&rec, 1);
+	}
+
+	void onIoCompletedBatch(const NetIoMuxCompletion *records, u32 count)
+	{
+		for (u32 i = 0; i < count; ++i)
+		{
+			if (handle(records[i]))
+			{
+				// Nothing is outstanding once over.
+				xpfAssert(("Unexpected completions of a finished race.", i + 1 == count));
+				delete this;
+				return;
+			}
+		}
+	}
+
+private:
+	NetIoMuxConnectRace(NetIoMuxImpl *mux, u32 delayMs, NetIoMuxCallback *cb)
+		: mMux(mux), mCb(cb), mDelayMs(delayMs), mPeerCount(0), mNext(0)
+		, mInflight(0), mTimers(0), mTimerId(0), mTimerSeq(0)
+		, mStarting(true), mDone(false)
+	{
+		for (u32 i = 0; i < MaxPeers; ++i)
+			mAttempts[i] = 0;
+	}
+
+	virtual ~NetIoMuxConnectRace() {}
+
+	static int family(const NetEndpoint::Peer &peer)
+	{
+		return ((const struct sockaddr*)peer.Data)->sa_family;
+	}
+
+	// Order the candidates by alternating address families, starting
+	// with the family of the first one (RFC 8305, section 4).
+	void setPeers(const NetEndpoint::Peer *peers, u32 count)
+	{
+		if (count > MaxPeers)
+			count = MaxPeers;
+		if (count == 0)
+			return;
+
+		const int first = family(peers[0]);
+		u32 idx[2] = { 0, 0 }; // next candidate of the first/other family.
+		u32 turn = 0;
+		while (mPeerCount < count)
+		{
+			u32 &k = idx[turn];
+			while ((k < count) && ((family(peers[k]) == first) != (turn == 0)))
+				++k;
+			if (k < count)
+				mPeers[mPeerCount++] = peers[k++];
+			turn ^= 1;
+		}
+	}
+
+	// Start the next attempt which can be started, and schedule the one
+	// after it.
+	void launchLocked()
+	{
+		while (mNext < mPeerCount)
+		{
+			const u32 i = mNext++;
+			const NetEndpoint::Peer &peer = mPeers[i];
+			const u32 protocol = NetEndpoint::ProtocolTCP |
+				((family(peer) == AF_INET6) ? NetEndpoint::ProtocolIPv6 : NetEndpoint::ProtocolIPv4);
+
+			c8 host[XPF_NETENDPOINT_MAXADDRLEN];
+			c8 serv[16];
+			int ec = ::getnameinfo((const struct sockaddr*)peer.Data, (socklen_t)peer.Length,
+				host, sizeof(host), serv, sizeof(serv), NI_NUMERICHOST | NI_NUMERICSERV);
+			NetEndpoint *ep = (ec == 0) ? NetEndpoint::create(protocol) : 0;
+			if ((ep == 0) || (ep->getStatus() != NetEndpoint::ESTAT_INIT)) // e.g. no IPv6 support.
+			{
+				delete ep;
+				continue;
+			}
+
+			mAttempts[i] = ep;
+			++mInflight;
+			mMux->join(ep);
+			mMux->asyncConnect(ep, host, serv, 0, 0, this);
+			break;
+		}
+
+		if (mNext < mPeerCount)
+		{
+			++mTimers;
+			mTimerId = mMux->asyncTimer(mDelayMs, this, (vptr)++mTimerSeq);
+		}
+	}
+
+	void cancelTimerLocked()
+	{
+		if ((mTimerId != 0) && mMux->cancelTimer(mTimerId))
+			--mTimers;
+		mTimerId = 0; // A timer fired already is ignored.
+	}
+
+	// Returns true if the race is over and has nothing outstanding.
+	bool handle(const NetIoMuxCompletion &rec)
+	{
+		if ((rec.Type == NetIoMux::EIT_WAKEUP) && !mHost.empty())
+		{
+			// Nothing else is outstanding before the start.
+			NetEndpoint::Peer peers[MaxPeers];
+			u32 cnt = NetEndpoint::resolvePeers(NetEndpoint::ProtocolTCP | NetEndpoint::ProtocolIPv4 | NetEndpoint::ProtocolIPv6,
+				peers, MaxPeers, mHost.c_str(), mService.c_str());
+			setPeers(peers, cnt);
+		}
+
+		NetIoMuxCallback *cb = mCb;
+		NetEndpoint *winner = 0;
+		NetEndpoint::EError result = NetEndpoint::EE_SUCCESS;
+		bool report = false;
+		bool over = false;
+		{
+			ScopedSpinLock ml(mLock);
+			switch (rec.Type)
+			{
+			case NetIoMux::EIT_WAKEUP:
+				mStarting = false;
+				launchLocked();
+				break;
+
+			case NetIoMux::EIT_TIMER:
+				--mTimers;
+				if ((rec.TepOrPeer == (vptr)mTimerSeq) && (mTimerId != 0))
+				{
+					mTimerId = 0;
+					if (!mDone)
+						launchLocked();
+				}
+				break;
+
+			case NetIoMux::EIT_CONNECT:
+				for (u32 i = 0; i < mNext; ++i)
+				{
+					if (mAttempts[i] == rec.Endpoint)
+						mAttempts[i] = 0;
+				}
+				--mInflight;
+
+				if ((rec.Error == NetEndpoint::EE_SUCCESS) && !mDone)
+				{
+					mDone = true;
+					report = true;
+					winner = rec.Endpoint;
+					cancelTimerLocked();
+
+					// Cancel the others. Each of them is released by its completion.
+					for (u32 i = 0; i < mNext; ++i)
+					{
+						if (mAttempts[i] != 0)
+							mAttempts[i]->shutdown(NetEndpoint::ESD_BOTH);
+					}
+				}
+				else
+				{
+					mMux->depart(rec.Endpoint);
+					delete rec.Endpoint;
+
+					// Go on with the next one without waiting for the timer.
+					if (!mDone && (mNext < mPeerCount))
+					{
+						cancelTimerLocked();
+						launchLocked();
+					}
+				}
+				break;
+
+			default:
+				xpfAssert(("Unexpected completion.", false));
+				break;
+			}
+
+			if (!mDone && (mInflight == 0) && (mNext >= mPeerCount))
+			{
+				mDone = true;
+				report = true;
+				result = (mPeerCount == 0) ? NetEndpoint::EE_RESOLVE : NetEndpoint::EE_CONNECT;
+			}
+			over = mDone && !mStarting && (mInflight == 0) && (mTimers == 0);
+		}
+
+		// Members may be released by other workers from now on.
+		if (report && (cb != 0))
+		{
+			// Emitted like any completion of the mux, through the batch
+			// call which traced callbacks record.
+			NetIoMuxCompletion done;
+			done.Type = NetIoMux::EIT_CONNECT;
+			done.Error = result;
+			done.Endpoint = winner;
+			done.TepOrPeer = (winner != 0) ? rec.TepOrPeer : 0;
+			done.Buffer = 0;
+			done.Length = 0;
+			done.SegmentSize = 0;
+			cb->onIoCompletedBatch(&done, 1);
+		}
+		return over;
+	}
+
+	NetIoMuxImpl       *mMux;
+	NetIoMuxCallback   *mCb;
+	string              mHost;
+	string              mService;
+	u32                 mDelayMs;
+	NetEndpoint::Peer   mPeers[MaxPeers]; // candidates in the order of attempts.
+	NetEndpoint        *mAttempts[MaxPeers]; // attempts in flight.
+	u32                 mPeerCount;
+	u32                 mNext;     // the next candidate to attempt.
+	u32                 mInflight; // attempts not yet completed.
+	u32                 mTimers;   // timers not yet completed.
+	u64                 mTimerId;  // the timer to start the next attempt.
+	u32                 mTimerSeq;
+	bool                mStarting; // waiting for the start.
+	bool                mDone;     // the result is reported.
+	NetIoMuxSpinLock    mLock;
+};
+
+} // end of namespace xpf
@@ -30,27 +30,63 @@
 #endif
 
 #include "netiomux_syncfifo.hpp"
+#include "netiomux_opring.hpp"
+#include "netiomux_spinlock.hpp"
+#include "netiomux_fdwatch.hpp"
+#include "netiomux_filepool.hpp"
+#include "netiomux_timers.hpp"
+#include "netiomux_profiler.hpp"
+#include <xpf/atomic.h>
+#include <xpf/iobuffer.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <new>
 
 #define MAX_EVENTS_AT_ONCE (128)
 #define MAX_READY_LIST_LEN (10240)
+#define MAX_COALESCED_SENDS (64)
+#define MAX_COMPLETIONS_AT_ONCE (64)
+#define DEFAULT_TURN_OPS (16)
+#define DEFAULT_TURN_BYTES (256 * 1024)
+#define ASYNC_CONTEXT_ALIGN (64)
+#define MAX_GSO_SEGMENTS (64)
+#define MAX_GSO_BYTES (61440)
+
+// UDP segmentation offload options, missing in older headers.
+#ifndef SOL_UDP
+#define SOL_UDP (17)
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT (103)
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO (104)
+#endif
 
 #define ASYNC_OP_READ  (0)
 #define ASYNC_OP_WRITE (1)
 
+#define CONNECT_STAGE_INIT    (0) // connect() not yet called.
+#define CONNECT_STAGE_PENDING (1) // waiting for the handshake.
+#define CONNECT_STAGE_SENDING (2) // connected, sending the rest of initial data.
+
 namespace xpf
 {
 	// host info for connect
 	struct ConnectHostInfo
 	{
-		ConnectHostInfo(const c8 *h, const c8 *s)
+		ConnectHostInfo(const c8 *h, const c8 *s, const c8 *d, u32 dl)
+			: data(d), datalen(dl)
 		{
 			host = ::strdup(h);
 			service = ::strdup(s);
@@ -64,6 +100,17 @@ namespace xpf
 
 		c8 *host;
 		c8 *service;
+		const c8 *data; // initial data (TCP Fast Open), not owned.
+		u32 datalen;
+	};
+
+	// shared record of an asyncBroadcast() call
+	struct Broadcast
+	{
+		IoBufferChain chain;   // the payload shared by all sends.
+		u32 count;             // number of target endpoints.
+		volatile s32 pending;  // sends not yet completed.
+		volatile s32 failed;   // sends completed with errors.
 	};
 
 	// data record per operation
@@ -71,27 +118,63 @@ namespace xpf
 	{
 		Overlapped(NetEndpoint *ep, NetIoMux::EIoType iocode)
 			: iotype(iocode), sep(ep), tep(0), buffer(0), length(0)
-			, peer(0), cb(0), errorcode(0), provisioned(false) {}
+			, progress(0), quota(0), peer(0), cb(0), chain(0), iobuf(0)
+			, bcast(0), file(0), errorcode(0), provisioned(false), wmlow(false)
+			, connstage(CONNECT_STAGE_INIT), udata(0), segsize(0), holds(0) {}
 
 		NetIoMux::EIoType iotype;
 		NetEndpoint *sep;
 		NetEndpoint *tep;
 		c8	*buffer;
 		u32	length;
+		u32 progress; // bytes already sent by coalesced sends.
+		u32 quota;    // bytes charged to write watermarks.
 		NetEndpoint::Peer *peer;
 		NetIoMuxCallback *cb;
+		IoBufferChain *chain; // chain to send (owned copy).
+		IoBuffer *iobuf;      // buffer to receive into (referenced).
+		Broadcast *bcast;     // owned by the op completing the broadcast.
+		NetIoMuxFileJob *file; // file operation (owned).
 		int errorcode;
 		bool provisioned;
+		bool wmlow;   // write queue drained to low watermark by this op.
+		u8 connstage; // progress of a connect operation (CONNECT_STAGE_*).
+		vptr udata;   // user data of a timer.
+		u32 segsize;  // UDP segment size of a send or a GRO receive.
+		volatile s32 holds; // 2 while the high watermark crossed by this send is notified.
 	};
 
-	// data record per socket
-	struct AsyncContext
+	// data record per socket. Laid out to fit 2 cache lines: the lock
+	// and both operation rings (the hot part) come first. The rings hold
+	// a few operations inline and only spill to heap when deep.
+	struct __attribute__((aligned(ASYNC_CONTEXT_ALIGN))) AsyncContext
 	{
-		std::deque<Overlapped*>  rdqueue; // queued read operations
-		std::deque<Overlapped*>  wrqueue; // queued write operations
-		bool                     ready;
-		ThreadLock               lock;
-		NetEndpoint             *ep;
+		NetIoMuxSpinLock                  lock;
+		NetIoMuxOpRing<Overlapped, 2>     rdqueue;  // queued read operations
+		NetIoMuxOpRing<Overlapped, 4>     wrqueue;  // queued write operations
+		bool                              ready;
+		bool                              coalesce : 1; // send coalescing enabled.
+		bool                              gro : 1;      // UDP receive offload enabled.
+		bool                              blocked : 1;  // wrbytes has reached highwm.
+		u8                                prio : 2;     // NetIoMux::EPriority
+		bool                              lowheld : 1;  // low watermark crossed while notifying the high one.
+		u8                                notifying;    // high watermark notifications in progress.
+		u32                               wrbytes;  // bytes of queued write operations.
+		u32                               lowwm;    // low watermark of wrbytes.
+		u32                               highwm;   // high watermark of wrbytes (0: disabled).
+
+		static void* operator new(size_t size)
+		{
+			void *p = 0;
+			if (0 != posix_memalign(&p, ASYNC_CONTEXT_ALIGN, size))
+				throw std::bad_alloc();
+			return p;
+		}
+
+		static void operator delete(void *p)
+		{
+			::free(p);
+		}
 	};
 
 	class NetIoMuxImpl
@@ -99,22 +182,60 @@ namespace xpf
 	public:
 		NetIoMuxImpl()
 			: mEnable(true)
+			, mQueuedBytes(0)
+			, mMaxQueuedBytes(0)
+			, mFilePool(fileJobDone, (vptr)this)
 		{
+			mTurnOps = DEFAULT_TURN_OPS;
+			mTurnBytes = DEFAULT_TURN_BYTES;
 			xpfSAssert(sizeof(socklen_t) == sizeof(s32));
+			xpfSAssert(sizeof(AsyncContext) <= 2 * ASYNC_CONTEXT_ALIGN);
 
 			mEpollfd = epoll_create1(0);
 			xpfAssert(mEpollfd != -1);
 			if (mEpollfd == -1)
 				mEnable = false;
+
+			// A level-triggered eventfd to interrupt epoll_wait() for asyncWakeup().
+			mWakeupfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			xpfAssert(mWakeupfd != -1);
+			if ((mEpollfd != -1) && (mWakeupfd != -1))
+			{
+				epoll_event evt;
+				evt.events = EPOLLIN;
+				evt.data.ptr = (void*) &mWakeupfd;
+				int ec = epoll_ctl(mEpollfd, EPOLL_CTL_ADD, mWakeupfd, &evt);
+				xpfAssert(ec == 0);
+			}
 		}
 
 		~NetIoMuxImpl()
 		{
 			enable(false);
+			mFilePool.stop();
+
+			while (Overlapped *o = (Overlapped*)mTimers.pop())
+				releaseOp(o);
+
+			// Completions never dispatched (e.g. the operations failed
+			// by a depart() after the last runOnce()).
+			u32 pendingCnt = 0;
+			while (Overlapped *o = (Overlapped*)mCompletionList.pop_front(pendingCnt))
+			{
+				NetIoMuxCompletion rec;
+				rec.Error = NetEndpoint::EE_INVALID_OP;
+				if (o->bcast)
+					completeBroadcastPart(o, rec);
+				releaseOp(o);
+			}
 
 			if (mEpollfd != -1)
 				close(mEpollfd);
 			mEpollfd = -1;
+
+			if (mWakeupfd != -1)
+				close(mWakeupfd);
+			mWakeupfd = -1;
 		}
 
 		void enable(bool val)
@@ -136,77 +257,50 @@ namespace xpf
 			bool consumeSome = false;
 			u32 pendingCnt = 0;
 
-			// Process the completion queue. Emit the completion event.
-			Overlapped *co = (Overlapped*) mCompletionList.pop_front(pendingCnt);
-			if (co)
+			// Process the completion queue. Pop up to MAX_COMPLETIONS_AT_ONCE
+			// completed operations and emit them in batches.
+			Overlapped *ops[MAX_COMPLETIONS_AT_ONCE];
+			NetIoMuxCompletion records[MAX_COMPLETIONS_AT_ONCE];
+			u32 opCnt = 0;
+
+			// Expired timers join the completion queue first.
+			vptr timers[MAX_COMPLETIONS_AT_ONCE];
+			u32 expired = mTimers.expire(timers, MAX_COMPLETIONS_AT_ONCE);
+			for (u32 i = 0; i < expired; ++i)
+				mCompletionList.push_back((void*)timers[i]);
+			while (opCnt < MAX_COMPLETIONS_AT_ONCE)
 			{
+				Overlapped *co = (Overlapped*) mCompletionList.pop_front(pendingCnt);
+				if (!co)
+					break;
 				consumeSome = true;
-				switch (co->iotype)
+				// Left to appendWriteOp() while it notifies a watermark.
+				if ((co->holds != 0) && (xpfAtomicAdd(&co->holds, -1) == 2))
+					continue;
+				if (!fillCompletion(co, records[opCnt]))
 				{
-				case NetIoMux::EIT_RECV:
-					if (!co->provisioned)
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_INVALID_OP, co->sep, 0, co->buffer, 0);
-					else if (co->errorcode == 0)
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_SUCCESS, co->sep, 0, co->buffer, co->length);
-					else
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_RECV, co->sep, 0, co->buffer, 0);
-					break;
-				case NetIoMux::EIT_RECVFROM:
-					if (!co->provisioned)
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_INVALID_OP, co->sep, 0, co->buffer, 0);
-					else if (co->errorcode == 0)
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_SUCCESS, co->sep, (vptr)co->peer, co->buffer, co->length);
-					else
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_RECV, co->sep, 0, co->buffer, 0);
-					delete co->peer;
-					break;
-				case NetIoMux::EIT_SEND:
-					if (!co->provisioned)
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_INVALID_OP, co->sep, 0, co->buffer, 0);
-					else if (co->errorcode == 0)
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_SUCCESS, co->sep, 0, co->buffer, co->length);
-					else
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_SEND, co->sep, 0, co->buffer, 0);
-					break;
-				case NetIoMux::EIT_SENDTO:
-					if (!co->provisioned)
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_INVALID_OP, co->sep, (vptr)co->peer, co->buffer, 0);
-					else if (co->errorcode == 0)
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_SUCCESS, co->sep, (vptr)co->peer, co->buffer, co->length);
-					else
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_SEND, co->sep, (vptr)co->peer, co->buffer, 0);
-					delete co->peer;
-					break;
-				case NetIoMux::EIT_ACCEPT:
-					if (!co->provisioned)
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_INVALID_OP, co->sep, 0, 0, 0);
-					else if (co->errorcode == 0)
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_SUCCESS, co->sep, (vptr)co->tep, 0, 0);
-					else
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_ACCEPT, co->sep, 0, 0, 0);
-					delete co->peer;
-					break;
-				case NetIoMux::EIT_CONNECT:
-					if (!co->provisioned)
-						co->cb->onIoCompleted(co->iotype, (co->peer == 0)? NetEndpoint::EE_INVALID_OP : NetEndpoint::EE_RESOLVE, co->sep, 0, 0, 0);
-					else if (co->errorcode == 0)
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_SUCCESS, co->sep, (vptr)co->peer, 0, 0);
-					else
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_CONNECT, co->sep, 0, 0, 0);
-					delete co->peer;
-					break;
-				case NetIoMux::EIT_INVALID:
-				default:
-					xpfAssert(("Unrecognized iotype. Maybe a corrupted Overlapped.", false));
-					break;
+					releaseOp(co);
+				}
+				else if (co->bcast && !completeBroadcastPart(co, records[opCnt]))
+				{
+					// Not the last send of a broadcast: Nothing to emit.
+					if (co->wmlow)
+						co->cb->onWriteWatermark(co->sep, false);
+					releaseOp(co);
+				}
+				else
+				{
+					ops[opCnt++] = co;
 				}
-				delete co;
 			}
+			if (opCnt > 0)
+				dispatchCompletions(ops, records, opCnt);
 
 
 			// Consume ready list:
 			// Pop the front socket out of list, and
-			// process all r/w operations until EWOULDBLOCK.
+			// process r/w operations until EWOULDBLOCK or
+			// out of its turn budget.
 			// Re-arm the socket if there are more pending
 			// operations.
 			NetEndpoint *ep = (NetEndpoint*) mReadyList.pop_front(pendingCnt);
@@ -216,33 +310,75 @@ namespace xpf
 				AsyncContext *ctx = (AsyncContext*) ep->getAsyncContext();
 				if (!ctx) break;
 
-				ScopedThreadLock ml(ctx->lock);
+				ScopedSpinLock ml(ctx->lock);
 				xpfAssert(("Expecting ready flag on for all ", ctx->ready));
 				ctx->ready = false;
+
+				// Operations are charged by their requested bytes.
+				NetIoMuxTurnBudget budget(mTurnOps, mTurnBytes, ctx->prio);
+				bool exhausted = false;
 				while (!ctx->rdqueue.empty()) // process rqueue.
 				{
 					Overlapped *o = ctx->rdqueue.front();
 					if (!o) break;
 					consumeSome = true;
-					
+					if (budget.exhausted())
+					{
+						exhausted = true;
+						break;
+					}
+
+					const u32 charge = o->length;
 					if (performIoLocked(ep, o))
+					{
 						ctx->rdqueue.pop_front();
+						budget.charge(charge);
+					}
 					else
 						break;
 				} // end of while (true)
 
+				// Reads never starve the writes: At least one write is
+				// performed per turn even if reads used up the budget.
+				bool wrote = false;
 				while (!ctx->wrqueue.empty()) // process wrqueue
 				{
 					Overlapped *o = ctx->wrqueue.front();
 					if (!o) break;
 					consumeSome = true;
+					if (wrote && budget.exhausted())
+					{
+						exhausted = true;
+						break;
+					}
 
-					if (performIoLocked(ep, o))
+					const u32 charge = o->length - o->progress;
+					if (ctx->coalesce && (o->iotype == NetIoMux::EIT_SEND) && (o->chain == 0))
+					{
+						// Charges the budget with what it actually sent.
+						if (!performCoalescedSendLocked(ep, budget))
+							break;
+					}
+					else if (performIoLocked(ep, o))
+					{
 						ctx->wrqueue.pop_front();
+						budget.charge(charge);
+					}
 					else
 						break;
+					wrote = true;
 				} // end of while (true)
 
+				// Out of budget: Yield to the other ready endpoints by going
+				// to the tail of the ready list rather than waiting for
+				// readiness, as the rest may progress right away.
+				if (exhausted)
+				{
+					ctx->ready = true;
+					mReadyList.push_back((void*)ep, ctx->prio);
+					break;
+				}
+
 				bool rearm = false;
 				epoll_event evt;
 				evt.events = EPOLLET | EPOLLONESHOT;
@@ -267,7 +403,7 @@ namespace xpf
 			if (pendingCnt < MAX_READY_LIST_LEN)
 			{
 				epoll_event evts[MAX_EVENTS_AT_ONCE];
-				int nevts = epoll_wait(mEpollfd, evts, MAX_EVENTS_AT_ONCE, (consumeSome)? 0 : timeoutMs);
+				int nevts = epoll_wait(mEpollfd, evts, MAX_EVENTS_AT_ONCE, (consumeSome)? 0 : (int)mTimers.waitTime(timeoutMs));
 				xpfAssert(("Failed on calling epoll_wait", nevts != -1));
 				if (0 == nevts)
 				{
@@ -278,27 +414,40 @@ namespace xpf
 					for (int i=0; i<nevts; ++i)
 					{
 						uint32_t events = evts[i].events;
+						if (evts[i].data.ptr == (void*) &mWakeupfd)
+						{
+							// Wakeup requests are already in the completion list.
+							eventfd_t val;
+							eventfd_read(mWakeupfd, &val);
+							continue;
+						}
+
+						if (NetIoMuxFdWatchTable::isTag(evts[i].data.u64))
+						{
+							dispatchFd(evts[i].data.u64, events);
+							continue;
+						}
+
 						NetEndpoint *ep = (NetEndpoint*) evts[i].data.ptr;
 						AsyncContext *ctx = (AsyncContext*) ep->getAsyncContext();
 						
-						ScopedThreadLock ml(ctx->lock);
+						ScopedSpinLock ml(ctx->lock);
 						xpfAssert(("Expecting non-ready ep in epoll_wait.", ctx->ready == false));
 						ctx->ready = false;
 						
 						if ((events & (EPOLLERR | EPOLLHUP)))
 						{
-							for (std::deque<Overlapped*>::iterator it = ctx->rdqueue.begin();
-									it != ctx->rdqueue.end(); ++it)
+							for (u32 i = 0; i < ctx->rdqueue.size(); ++i)
 							{
-								Overlapped *o = (*it);
+								Overlapped *o = ctx->rdqueue.at(i);
 								o->errorcode = ECONNABORTED;
 								mCompletionList.push_back((void*)o);
 							}
-							for (std::deque<Overlapped*>::iterator it = ctx->wrqueue.begin();
-									it != ctx->wrqueue.end(); ++it)
+							for (u32 i = 0; i < ctx->wrqueue.size(); ++i)
 							{
-								Overlapped *o = (*it);
+								Overlapped *o = ctx->wrqueue.at(i);
 								o->errorcode = ECONNABORTED;
+								dischargeWriteLocked(ctx, o);
 								mCompletionList.push_back((void*)o);
 							}
 
@@ -312,7 +461,7 @@ namespace xpf
 						{
 							xpfAssert(("Expecting non-ready ep in epoll_wait.", ctx->ready == false));
 							ctx->ready = true;
-							mReadyList.push_back((void*)ep);
+							mReadyList.push_back((void*)ep, ctx->prio);
 						}
 
 					} // end of for (int i=0; i<nevts; ++i)
@@ -326,6 +475,161 @@ namespace xpf
 			return NetIoMux::ERS_NORMAL;
 		}
 
+		// Translate a completed operation to the record passed to callbacks.
+		static bool fillCompletion(const Overlapped *co, NetIoMuxCompletion &rec)
+		{
+			rec.Type = co->iotype;
+			rec.Error = NetEndpoint::EE_SUCCESS;
+			rec.Endpoint = co->sep;
+			rec.TepOrPeer = 0;
+			rec.Buffer = co->buffer;
+			rec.Length = 0;
+			rec.SegmentSize = 0;
+
+			switch (co->iotype)
+			{
+			case NetIoMux::EIT_RECV:
+			case NetIoMux::EIT_RECVFROM:
+				if (co->iobuf)
+					rec.TepOrPeer = (vptr)co->iobuf;
+				if (!co->provisioned)
+					rec.Error = NetEndpoint::EE_INVALID_OP;
+				else if (co->errorcode != 0)
+					rec.Error = NetEndpoint::EE_RECV;
+				else
+				{
+					rec.Length = co->length;
+					rec.SegmentSize = co->segsize;
+					if (co->iotype == NetIoMux::EIT_RECVFROM)
+						rec.TepOrPeer = (vptr)co->peer;
+				}
+				break;
+			case NetIoMux::EIT_SEND:
+			case NetIoMux::EIT_SENDTO:
+				if (co->iotype == NetIoMux::EIT_SENDTO)
+					rec.TepOrPeer = (vptr)co->peer;
+				if (!co->provisioned)
+					rec.Error = NetEndpoint::EE_INVALID_OP;
+				else if (co->errorcode != 0)
+					rec.Error = (co->errorcode == ENOBUFS) ? NetEndpoint::EE_QUEUE_FULL : NetEndpoint::EE_SEND;
+				else
+				{
+					rec.Length = co->length;
+					rec.SegmentSize = co->segsize;
+				}
+				break;
+			case NetIoMux::EIT_ACCEPT:
+				rec.Buffer = 0;
+				if (!co->provisioned)
+					rec.Error = NetEndpoint::EE_INVALID_OP;
+				else if (co->errorcode != 0)
+					rec.Error = NetEndpoint::EE_ACCEPT;
+				else
+					rec.TepOrPeer = (vptr)co->tep;
+				break;
+			case NetIoMux::EIT_CONNECT:
+				if (!co->provisioned)
+				{
+					rec.Buffer = 0;
+					rec.Error = (co->peer == 0) ? NetEndpoint::EE_INVALID_OP : NetEndpoint::EE_RESOLVE;
+				}
+				else if (co->errorcode != 0)
+				{
+					// EE_SEND if connected but the initial data failed.
+					rec.Error = (co->connstage == CONNECT_STAGE_SENDING) ? NetEndpoint::EE_SEND : NetEndpoint::EE_CONNECT;
+				}
+				else
+				{
+					rec.TepOrPeer = (vptr)co->peer;
+					rec.Length = co->length;
+				}
+				break;
+			case NetIoMux::EIT_WAKEUP:
+				rec.Buffer = 0;
+				break;
+			case NetIoMux::EIT_TIMER:
+				rec.TepOrPeer = co->udata;
+				break;
+			case NetIoMux::EIT_FILEREAD:
+			case NetIoMux::EIT_FILEWRITE:
+				rec.TepOrPeer = co->file->UserData;
+				if (co->errorcode == ENOBUFS)
+					rec.Error = NetEndpoint::EE_QUEUE_FULL;
+				else if (co->file->Error != 0)
+					rec.Error = NetEndpoint::EE_FILEIO;
+				else
+					rec.Length = co->file->Result;
+				break;
+			case NetIoMux::EIT_INVALID:
+			default:
+				xpfAssert(("Unrecognized iotype. Maybe a corrupted Overlapped.", false));
+				return false;
+			}
+			return true;
+		}
+
+		// Emit each run of consecutive records sharing the same callback
+		// as one batch, then release the operations.
+		void dispatchCompletions(Overlapped **ops, NetIoMuxCompletion *records, u32 count)
+		{
+			u32 start = 0;
+			while (start < count)
+			{
+				NetIoMuxCallback *cb = ops[start]->cb;
+				u32 end = start + 1;
+				while ((end < count) && (ops[end]->cb == cb))
+					++end;
+
+				// Low watermark notifications go first since the
+				// callback may be released by its completion.
+				for (u32 i = start; i < end; ++i)
+				{
+					if (ops[i]->wmlow)
+						cb->onWriteWatermark(ops[i]->sep, false);
+				}
+				mProfiler.emit(cb, &records[start], end - start);
+				start = end;
+			}
+
+			for (u32 i = 0; i < count; ++i)
+				releaseOp(ops[i]);
+		}
+
+		static void releaseOp(Overlapped *o)
+		{
+			delete o->peer;
+			delete o->chain;
+			delete o->bcast;
+			delete o->file;
+			if (o->iobuf)
+				o->iobuf->unref();
+			delete o;
+		}
+
+		// Account a completed send of a broadcast. Returns true and turns
+		// 'rec' into the aggregate EIT_BROADCAST record if it is the last
+		// one. Ops detach from the shared record here since it is released
+		// along with the last op, which may happen in another thread.
+		static bool completeBroadcastPart(Overlapped *co, NetIoMuxCompletion &rec)
+		{
+			Broadcast *b = co->bcast;
+			co->bcast = 0;
+			co->chain = 0;
+			if (rec.Error != NetEndpoint::EE_SUCCESS)
+				xpfAtomicAdd(&b->failed, 1);
+			if (xpfAtomicAdd(&b->pending, -1) != 1)
+				return false;
+
+			co->bcast = b;
+			rec.Type = NetIoMux::EIT_BROADCAST;
+			rec.Error = (b->failed == 0) ? NetEndpoint::EE_SUCCESS : NetEndpoint::EE_SEND;
+			rec.Endpoint = 0;
+			rec.TepOrPeer = 0;
+			rec.Buffer = 0;
+			rec.Length = b->count - (u32)b->failed;
+			return true;
+		}
+
 		void asyncRecv(NetEndpoint *ep, c8 *buf, u32 buflen, NetIoMuxCallback *cb)
 		{
 			AsyncContext *ctx = (AsyncContext*)ep->getAsyncContext();
@@ -337,7 +641,7 @@ namespace xpf
 				o->length = buflen;
 				o->cb = cb;
 
-				ScopedThreadLock ml(ctx->lock);
+				ScopedSpinLock ml(ctx->lock);
 				appendAsyncOpLocked(ep, o, ASYNC_OP_READ);
 			}
 		}
@@ -354,7 +658,7 @@ namespace xpf
 				o->cb = cb;
 				o->peer = new NetEndpoint::Peer;
 
-				ScopedThreadLock ml(ctx->lock);
+				ScopedSpinLock ml(ctx->lock);
 				appendAsyncOpLocked(ep, o, ASYNC_OP_READ);
 			}
 		}
@@ -370,12 +674,11 @@ namespace xpf
 				o->length = buflen;
 				o->cb = cb;
 
-				ScopedThreadLock ml(ctx->lock);
-				appendAsyncOpLocked(ep, o, ASYNC_OP_WRITE);
+				appendWriteOp(ep, o);
 			}
 		}
 
-		void asyncSendTo(NetEndpoint *ep, const NetEndpoint::Peer *peer, const c8 *buf, u32 buflen, NetIoMuxCallback *cb)
+		void asyncSendTo(NetEndpoint *ep, const NetEndpoint::Peer *peer, const c8 *buf, u32 buflen, u32 segmentSize, NetIoMuxCallback *cb)
 		{
 			AsyncContext *ctx = (AsyncContext*)ep->getAsyncContext();
 			xpfAssert(ctx != 0);
@@ -384,11 +687,44 @@ namespace xpf
 				Overlapped *o = new Overlapped(ep, NetIoMux::EIT_SENDTO);
 				o->buffer = (c8*)buf;
 				o->length = buflen;
+				o->segsize = (segmentSize < buflen) ? segmentSize : 0;
 				o->cb = cb;
 				o->peer = new NetEndpoint::Peer(*peer); // clone
 
-				ScopedThreadLock ml(ctx->lock);
-				appendAsyncOpLocked(ep, o, ASYNC_OP_WRITE);
+				appendWriteOp(ep, o);
+			}
+		}
+
+		void asyncRecv(NetEndpoint *ep, IoBuffer *buf, NetIoMuxCallback *cb)
+		{
+			AsyncContext *ctx = (AsyncContext*)ep->getAsyncContext();
+			xpfAssert(ctx != 0);
+			if (ctx)
+			{
+				Overlapped *o = new Overlapped(ep, NetIoMux::EIT_RECV);
+				buf->ref();
+				o->iobuf = buf;
+				o->buffer = buf->tail();
+				o->length = buf->tailroom();
+				o->cb = cb;
+
+				ScopedSpinLock ml(ctx->lock);
+				appendAsyncOpLocked(ep, o, ASYNC_OP_READ);
+			}
+		}
+
+		void asyncSend(NetEndpoint *ep, const IoBufferChain &chain, NetIoMuxCallback *cb)
+		{
+			AsyncContext *ctx = (AsyncContext*)ep->getAsyncContext();
+			xpfAssert(ctx != 0);
+			if (ctx)
+			{
+				Overlapped *o = new Overlapped(ep, NetIoMux::EIT_SEND);
+				o->chain = new IoBufferChain(chain);
+				o->length = chain.length();
+				o->cb = cb;
+
+				appendWriteOp(ep, o);
 			}
 		}
 
@@ -403,12 +739,12 @@ namespace xpf
 				o->peer = new NetEndpoint::Peer;
 				o->peer->Length = XPF_NETENDPOINT_MAXADDRLEN;
 
-				ScopedThreadLock ml(ctx->lock);
+				ScopedSpinLock ml(ctx->lock);
 				appendAsyncOpLocked(ep, o, ASYNC_OP_READ);
 			}
 		}
 
-		void asyncConnect(NetEndpoint *ep, const c8 *host, const c8 *serviceOrPort, NetIoMuxCallback *cb)
+		void asyncConnect(NetEndpoint *ep, const c8 *host, const c8 *serviceOrPort, const c8 *data, u32 len, NetIoMuxCallback *cb)
 		{
 			AsyncContext *ctx = (AsyncContext*)ep->getAsyncContext();
 			xpfAssert(ctx != 0);
@@ -416,13 +752,130 @@ namespace xpf
 			{
 				Overlapped *o = new Overlapped(ep, NetIoMux::EIT_CONNECT);
 				o->cb = cb;
-				o->buffer = (c8*) new ConnectHostInfo(host, serviceOrPort);
+				o->buffer = (c8*) new ConnectHostInfo(host, serviceOrPort, data, (data != 0) ? len : 0);
 
-				ScopedThreadLock ml(ctx->lock);
+				ScopedSpinLock ml(ctx->lock);
 				appendAsyncOpLocked(ep, o, ASYNC_OP_WRITE);
 			}
 		}
 
+		void asyncBroadcast(NetEndpoint *const *eps, u32 count, const IoBufferChain &chain, NetIoMuxCallback *cb)
+		{
+			Broadcast *b = new Broadcast;
+			b->chain = chain;
+			b->count = count;
+			b->pending = (count > 0) ? (s32)count : 1;
+			b->failed = 0;
+
+			if (count == 0)
+			{
+				Overlapped *o = new Overlapped(0, NetIoMux::EIT_SEND);
+				o->bcast = b;
+				o->cb = cb;
+				o->provisioned = true;
+				mCompletionList.push_back((void*)o);
+				return;
+			}
+
+			for (u32 i = 0; i < count; ++i)
+			{
+				NetEndpoint *ep = eps[i];
+				Overlapped *o = new Overlapped(ep, NetIoMux::EIT_SEND);
+				o->chain = &b->chain;
+				o->bcast = b;
+				o->length = b->chain.length();
+				o->cb = cb;
+
+				if (ep->getAsyncContext() == 0)
+					mCompletionList.push_back((void*)o); // unprovisioned: EE_INVALID_OP.
+				else
+					appendWriteOp(ep, o);
+			}
+		}
+
+		void asyncWakeup(NetIoMuxCallback *cb)
+		{
+			Overlapped *o = new Overlapped(0, NetIoMux::EIT_WAKEUP);
+			o->cb = cb;
+			o->provisioned = true;
+			postCompletion(o);
+		}
+
+		// Queue a completed op and interrupt a blocking runOnce().
+		// Safe to be called from any thread.
+		void postCompletion(Overlapped *o)
+		{
+			mCompletionList.push_back((void*)o);
+			interrupt();
+		}
+
+		// Interrupt a blocking runOnce().
+		void interrupt()
+		{
+			int ec = eventfd_write(mWakeupfd, 1);
+			xpfAssert(ec == 0);
+		}
+
+		u64 asyncTimer(u32 delayMs, NetIoMuxCallback *cb, vptr userData)
+		{
+			Overlapped *o = new Overlapped(0, NetIoMux::EIT_TIMER);
+			o->cb = cb;
+			o->udata = userData;
+			o->provisioned = true;
+
+			bool earliest = false;
+			u64 id = mTimers.schedule(delayMs, (vptr)o, earliest);
+			if (earliest)
+				interrupt(); // for blocking workers to shorten their wait.
+			return id;
+		}
+
+		bool cancelTimer(u64 id)
+		{
+			Overlapped *o = (Overlapped*)mTimers.cancel(id);
+			if (o == 0)
+				return false;
+			releaseOp(o);
+			return true;
+		}
+
+		void asyncFile(NetIoMux::EIoType type, s32 fd, c8 *buf, u32 len, u64 offset, NetIoMux::EFileSync sync, NetIoMuxCallback *cb, vptr userData)
+		{
+			Overlapped *o = new Overlapped(0, type);
+			o->buffer = buf;
+			o->cb = cb;
+			o->provisioned = true;
+
+			NetIoMuxFileJob *job = new NetIoMuxFileJob;
+			job->Type = type;
+			job->Fd = fd;
+			job->Offset = offset;
+			job->Buffer = buf;
+			job->Length = len;
+			job->Sync = sync;
+			job->UserData = userData;
+			job->Result = 0;
+			job->Error = 0;
+			job->Op = (vptr)o;
+			o->file = job;
+
+			if (!mFilePool.submit(job))
+			{
+				o->errorcode = ENOBUFS;
+				postCompletion(o);
+			}
+		}
+
+		void setFileIoThreads(u32 threads, u32 maxQueued)
+		{
+			mFilePool.configure(threads, maxQueued);
+		}
+
+		static void fileJobDone(vptr owner, NetIoMuxFileJob *job)
+		{
+			((NetIoMuxImpl*)owner)->postCompletion((Overlapped*)job->Op);
+		}
+
 		bool join(NetEndpoint *ep)
 		{
 			s32 sock = ep->getSocket();
@@ -430,7 +883,15 @@ namespace xpf
 			// bundle with an async context
 			AsyncContext *ctx = new AsyncContext;
 			ctx->ready = false;
-			ctx->ep = ep;
+			ctx->coalesce = false;
+			ctx->prio = NetIoMux::EPR_NORMAL;
+			ctx->gro = false;
+			ctx->blocked = false;
+			ctx->lowheld = false;
+			ctx->notifying = 0;
+			ctx->wrbytes = 0;
+			ctx->lowwm = 0;
+			ctx->highwm = 0;
 			ep->setAsyncContext((vptr)ctx);
 
 			// request the socket to be non-blocking
@@ -468,9 +929,35 @@ namespace xpf
 				{
 					mReadyList.erase((void*)ep); // Note: Acquire mReadyList's lock while holding ctx's lock.
 				}
+				if (ctx->wrbytes > 0)
+				{
+					xpfAtomicAdd64(&mQueuedBytes, (u64)0 - ctx->wrbytes);
+				}
+				// Pending operations fail as if the connection was aborted,
+				// and pending broadcast sends with EE_INVALID_OP so that
+				// their broadcasts can still complete. Their queued bytes
+				// were discharged above.
+				const bool pending = (ctx->rdqueue.size() + ctx->wrqueue.size()) > 0;
+				for (u32 i = 0; i < ctx->rdqueue.size(); ++i)
+				{
+					Overlapped *o = ctx->rdqueue.at(i);
+					o->provisioned = true;
+					o->errorcode = ECONNABORTED;
+					mCompletionList.push_back((void*)o);
+				}
+				for (u32 i = 0; i < ctx->wrqueue.size(); ++i)
+				{
+					Overlapped *o = ctx->wrqueue.at(i);
+					o->quota = 0;
+					o->provisioned = (o->bcast == 0);
+					o->errorcode = ECONNABORTED;
+					mCompletionList.push_back((void*)o);
+				}
 				delete ctx;
 				ep->setAsyncContext(0);
 				// since the whole context object has been deleted, there's no bother to call unlock.
+				if (pending)
+					interrupt();
 			}
 
 			// reset the socket to be blocking
@@ -481,6 +968,131 @@ namespace xpf
 			return (ec == 0);
 		}
 
+		bool watchFd(s32 fd, u32 events, NetIoMuxCallback *cb, vptr userData)
+		{
+			ScopedSpinLock ml(mFdWatches.lock());
+			NetIoMuxFdWatch *w = mFdWatches.insert(fd, events, cb, userData);
+			if (w == 0)
+				return false;
+			if (!armFdLocked(w, EPOLL_CTL_ADD))
+			{
+				mFdWatches.remove(fd);
+				return false;
+			}
+			return true;
+		}
+
+		bool modifyFd(s32 fd, u32 events)
+		{
+			ScopedSpinLock ml(mFdWatches.lock());
+			NetIoMuxFdWatch *w = mFdWatches.find(fd);
+			if (w == 0)
+				return false;
+			w->Events = events;
+			// A watch being dispatched is re-armed with new events afterward.
+			return (w->Dispatching) ? true : armFdLocked(w, EPOLL_CTL_MOD);
+		}
+
+		bool unwatchFd(s32 fd)
+		{
+			ScopedSpinLock ml(mFdWatches.lock());
+			if (mFdWatches.find(fd) == 0)
+				return false;
+			struct epoll_event dummy;
+			epoll_ctl(mEpollfd, EPOLL_CTL_DEL, fd, &dummy); // fails if fd has been closed.
+			return mFdWatches.remove(fd);
+		}
+
+		bool setSendCoalescing(NetEndpoint *ep, bool val)
+		{
+			AsyncContext *ctx = (AsyncContext*)ep->getAsyncContext();
+			xpfAssert(ctx != 0);
+			if (ctx == 0)
+				return false;
+
+			ScopedSpinLock ml(ctx->lock);
+			ctx->coalesce = val;
+			return true;
+		}
+
+		bool setReceiveOffload(NetEndpoint *ep, bool val)
+		{
+			AsyncContext *ctx = (AsyncContext*)ep->getAsyncContext();
+			xpfAssert(ctx != 0);
+			if ((ctx == 0) || ((ep->getProtocol() & NetEndpoint::ProtocolUDP) == 0))
+				return false;
+
+			int on = (val) ? 1 : 0;
+			if (0 != ::setsockopt(ep->getSocket(), SOL_UDP, UDP_GRO, &on, sizeof(on)))
+				return false;
+
+			ScopedSpinLock ml(ctx->lock);
+			ctx->gro = val;
+			return true;
+		}
+
+		bool setWriteWatermarks(NetEndpoint *ep, u32 lowBytes, u32 highBytes)
+		{
+			AsyncContext *ctx = (AsyncContext*)ep->getAsyncContext();
+			xpfAssert(ctx != 0);
+			xpfAssert(("Expecting lowBytes < highBytes.", (highBytes == 0) || (lowBytes < highBytes)));
+			if ((ctx == 0) || ((highBytes != 0) && (lowBytes >= highBytes)))
+				return false;
+
+			ScopedSpinLock ml(ctx->lock);
+			ctx->lowwm = lowBytes;
+			ctx->highwm = highBytes;
+			if (highBytes == 0)
+				ctx->blocked = false;
+			return true;
+		}
+
+		bool isWriteBlocked(NetEndpoint *ep) const
+		{
+			AsyncContext *ctx = (AsyncContext*)ep->getAsyncContext();
+			return (ctx) ? ctx->blocked : false;
+		}
+
+		u32 getQueuedWriteBytes(NetEndpoint *ep) const
+		{
+			AsyncContext *ctx = (AsyncContext*)ep->getAsyncContext();
+			return (ctx) ? ctx->wrbytes : 0;
+		}
+
+		void setTurnBudget(u32 ops, u32 bytes)
+		{
+			mTurnOps = ops;
+			mTurnBytes = bytes;
+		}
+
+		bool setPriority(NetEndpoint *ep, NetIoMux::EPriority prio)
+		{
+			AsyncContext *ctx = (AsyncContext*)ep->getAsyncContext();
+			xpfAssert(ctx != 0);
+			if ((ctx == 0) || (prio > NetIoMux::EPR_HIGH))
+				return false;
+
+			// Takes effect the next time it is queued as ready.
+			ScopedSpinLock ml(ctx->lock);
+			ctx->prio = (u8)prio;
+			return true;
+		}
+
+		NetIoMuxProfiler& profiler()
+		{
+			return mProfiler;
+		}
+
+		void setMaxQueuedBytes(u64 bytes)
+		{
+			mMaxQueuedBytes = bytes;
+		}
+
+		u64 getQueuedBytes() const
+		{
+			return mQueuedBytes;
+		}
+
 		static const char * getMultiplexerType(NetIoMux::EPlatformMultiplexer &epm)
 		{
 			epm = NetIoMux::EPM_EPOLL;
@@ -520,6 +1132,8 @@ namespace xpf
 					{
 						o->length = bytes;
 						o->errorcode = 0;
+						if (o->iobuf)
+							o->iobuf->commit((u32)bytes);
 					}
 					else if (errno != EWOULDBLOCK && errno != EAGAIN)
 					{
@@ -550,7 +1164,9 @@ namespace xpf
 						o->provisioned = true;
 					}
 
-					ssize_t bytes = ::recvfrom(ep->getSocket(), o->buffer, (size_t)o->length, MSG_DONTWAIT, (struct sockaddr*)o->peer->Data, (socklen_t*)&o->peer->Length);
+					ssize_t bytes = (ctx->gro)
+						? recvCoalesced(ep->getSocket(), o)
+						: ::recvfrom(ep->getSocket(), o->buffer, (size_t)o->length, MSG_DONTWAIT, (struct sockaddr*)o->peer->Data, (socklen_t*)&o->peer->Length);
 					if (bytes >= 0)
 					{
 						o->length = bytes;
@@ -627,10 +1243,16 @@ namespace xpf
 						o->provisioned = true;
 					}
 
-					ssize_t bytes = ::send(ep->getSocket(), o->buffer, (size_t)o->length, MSG_DONTWAIT);
+					if (o->chain)
+					{
+						completed = performChainSendLocked(ep, o);
+						break;
+					}
+
+					ssize_t bytes = ::send(ep->getSocket(), o->buffer + o->progress, (size_t)(o->length - o->progress), MSG_DONTWAIT);
 					if (bytes >=0 )
 					{
-						o->length = bytes;
+						o->length = o->progress + bytes;
 						o->errorcode = 0;
 					}
 					else if (errno != EWOULDBLOCK && errno != EAGAIN)
@@ -662,6 +1284,26 @@ namespace xpf
 						o->provisioned = true;
 					}
 
+					if (o->segsize != 0)
+					{
+						const int ec = sendSegments(ep->getSocket(), o);
+						if (ec == 0)
+						{
+							o->errorcode = 0;
+						}
+						else if (ec != EWOULDBLOCK && ec != EAGAIN)
+						{
+							o->length = 0;
+							o->errorcode = ec;
+							ep->setLastPlatformErrno(ec);
+						}
+						else
+						{
+							completed = false;
+						}
+						break;
+					}
+
 					ssize_t bytes = ::sendto(ep->getSocket(), o->buffer, (size_t)o->length, MSG_DONTWAIT,
 							(const struct sockaddr*)o->peer->Data, (socklen_t)o->peer->Length);
 					if (bytes >=0 )
@@ -708,6 +1350,10 @@ namespace xpf
 						// Note: resolving can be blockable.
 						ConnectHostInfo *chi = (ConnectHostInfo*)o->buffer;
 						bool resolved = NetEndpoint::resolvePeer(ep->getProtocol(), *o->peer, chi->host, chi->service);
+
+						// From now on, buffer/length refer to the initial data.
+						o->buffer = (c8*)chi->data;
+						o->length = chi->datalen;
 						delete chi;
 						if (!resolved)
 						{
@@ -718,51 +1364,7 @@ namespace xpf
 						o->provisioned = true;
 					}
 
-					if (o->length == 0) // not yet called connect
-					{
-						int ec = ::connect(ep->getSocket(), (const struct sockaddr*)o->peer->Data, (socklen_t)o->peer->Length);
-						if (ec == 0)
-						{
-							o->length = 0;
-							o->errorcode = 0;
-							ep->setStatus(NetEndpoint::ESTAT_CONNECTED);
-						}
-						else if (errno != EINPROGRESS)
-						{
-							o->length = 0;
-							o->errorcode = errno;
-							ep->setLastPlatformErrno(errno);
-							ep->setStatus(NetEndpoint::ESTAT_INIT);
-						}
-						else
-						{
-							xpfAssert(o->length == 0);
-							ep->setStatus(NetEndpoint::ESTAT_CONNECTING);
-							o->length = 1; // mark a connect() call in progress.
-							completed = false;
-						}
-					}
-					else // a connect() was called and waiting for result.
-					{
-						int val = 0;
-						socklen_t valsize = sizeof(int);
-						int ec = ::getsockopt(ep->getSocket(), SOL_SOCKET, SO_ERROR, &val, &valsize);
-						xpfAssert(ec == 0);
-						if (ec == 0 && val == 0)
-						{
-							o->errorcode = 0;
-							o->length = 0;
-							ep->setStatus(NetEndpoint::ESTAT_CONNECTED);
-						}
-						else
-						{
-							o->errorcode = errno;
-							ep->setLastPlatformErrno(errno);
-							delete o->peer;
-							o->peer = 0;
-							ep->setStatus(NetEndpoint::ESTAT_INIT);
-						}
-					}
+					completed = performConnectLocked(ep, o);
 				} while (0);
 				break;
 
@@ -772,11 +1374,477 @@ namespace xpf
 			} // end of switch (o->iotype)
 			
 			if (completed)
+			{
+				dischargeWriteLocked(ctx, o);
 				mCompletionList.push_back(o);
+			}
 			
 			return completed;
 		}
 	
+		// Drive a provisioned connect operation through its stages, which
+		// completes after the handshake and all of the initial data (if
+		// any) are sent. Return false if it has to wait for writability.
+		bool performConnectLocked(NetEndpoint *ep, Overlapped *o) // require ep->ctx locked.
+		{
+			const int sock = ep->getSocket();
+			if (o->connstage == CONNECT_STAGE_INIT)
+			{
+				int ec = -1;
+				if (!fastOpenConnect(sock, o))
+					ec = ::connect(sock, (const struct sockaddr*)o->peer->Data, (socklen_t)o->peer->Length);
+
+				if (ec == 0)
+				{
+					ep->setStatus(NetEndpoint::ESTAT_CONNECTED);
+					o->connstage = CONNECT_STAGE_SENDING;
+				}
+				else if (errno == EINPROGRESS)
+				{
+					ep->setStatus(NetEndpoint::ESTAT_CONNECTING);
+					o->connstage = CONNECT_STAGE_PENDING;
+					return false;
+				}
+				else
+				{
+					o->length = 0;
+					o->errorcode = errno;
+					ep->setLastPlatformErrno(errno);
+					ep->setStatus(NetEndpoint::ESTAT_INIT);
+					return true;
+				}
+			}
+			else if (o->connstage == CONNECT_STAGE_PENDING) // a connect() was called and waiting for result.
+			{
+				int val = 0;
+				socklen_t valsize = sizeof(int);
+				int ec = ::getsockopt(sock, SOL_SOCKET, SO_ERROR, &val, &valsize);
+				xpfAssert(ec == 0);
+				if (ec != 0 || val != 0)
+				{
+					o->length = 0;
+					o->errorcode = (ec != 0) ? errno : val;
+					ep->setLastPlatformErrno(o->errorcode);
+					ep->setStatus(NetEndpoint::ESTAT_INIT);
+					delete o->peer;
+					o->peer = 0;
+					return true;
+				}
+				ep->setStatus(NetEndpoint::ESTAT_CONNECTED);
+				o->connstage = CONNECT_STAGE_SENDING;
+			}
+
+			// Connected: send what is left of the initial data.
+			while (o->progress < o->length)
+			{
+				ssize_t bytes = ::send(sock, o->buffer + o->progress, (size_t)(o->length - o->progress), MSG_DONTWAIT);
+				if (bytes < 0)
+				{
+					if (errno == EWOULDBLOCK || errno == EAGAIN)
+						return false;
+
+					o->length = 0;
+					o->errorcode = errno;
+					ep->setLastPlatformErrno(errno);
+					return true;
+				}
+				o->progress += (u32)bytes;
+			}
+			o->errorcode = 0;
+			return true;
+		}
+
+		// Receive a datagram, or a train of datagrams coalesced by GRO, with
+		// recvmsg(). The size of each coalesced datagram (the last one may
+		// be shorter) is recorded in o->segsize.
+		static ssize_t recvCoalesced(int sock, Overlapped *o)
+		{
+			struct iovec iov;
+			iov.iov_base = o->buffer;
+			iov.iov_len = (size_t)o->length;
+
+			union
+			{
+				c8 buf[CMSG_SPACE(sizeof(int))];
+				struct cmsghdr align;
+			} control;
+
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_name = o->peer->Data;
+			msg.msg_namelen = (socklen_t)sizeof(o->peer->Data);
+			msg.msg_iov = &iov;
+			msg.msg_iovlen = 1;
+			msg.msg_control = control.buf;
+			msg.msg_controllen = sizeof(control.buf);
+
+			ssize_t bytes = ::recvmsg(sock, &msg, MSG_DONTWAIT);
+			if (bytes < 0)
+				return bytes;
+
+			o->peer->Length = (s32)msg.msg_namelen;
+			o->segsize = (u32)bytes;
+			for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != 0; cm = CMSG_NXTHDR(&msg, cm))
+			{
+				if ((cm->cmsg_level == SOL_UDP) && (cm->cmsg_type == UDP_GRO))
+				{
+					int segsize = 0;
+					memcpy(&segsize, CMSG_DATA(cm), sizeof(segsize));
+					if (segsize > 0)
+						o->segsize = (u32)segsize;
+				}
+			}
+			return bytes;
+		}
+
+		// Send o->buffer from o->progress as datagrams of o->segsize bytes.
+		// Trains of up to MAX_GSO_SEGMENTS datagrams are handed to the
+		// kernel in one sendmsg() with UDP_SEGMENT, or one by one if the
+		// host does not support it. Return 0 when all are sent, otherwise
+		// the errno which stopped the sending.
+		static int sendSegments(int sock, Overlapped *o)
+		{
+			static volatile s32 gsoState = -1; // -1: unknown, 0: unsupported, 1: supported.
+			if (gsoState < 0)
+			{
+				int val = 0;
+				socklen_t vlen = sizeof(val);
+				gsoState = (0 == ::getsockopt(sock, SOL_UDP, UDP_SEGMENT, &val, &vlen)) ? 1 : 0;
+			}
+
+			const u32 segsize = o->segsize;
+			u32 segsPerSend = (MAX_GSO_BYTES / segsize);
+			if (segsPerSend > MAX_GSO_SEGMENTS)
+				segsPerSend = MAX_GSO_SEGMENTS;
+			if ((gsoState == 0) || (segsPerSend < 2))
+				segsPerSend = 1;
+
+			while (o->progress < o->length)
+			{
+				u32 chunk = o->length - o->progress;
+				if (chunk > segsPerSend * segsize)
+					chunk = segsPerSend * segsize;
+
+				struct iovec iov;
+				iov.iov_base = o->buffer + o->progress;
+				iov.iov_len = (size_t)chunk;
+
+				union
+				{
+					c8 buf[CMSG_SPACE(sizeof(u16))];
+					struct cmsghdr align;
+				} control;
+
+				struct msghdr msg;
+				memset(&msg, 0, sizeof(msg));
+				msg.msg_name = o->peer->Data;
+				msg.msg_namelen = (socklen_t)o->peer->Length;
+				msg.msg_iov = &iov;
+				msg.msg_iovlen = 1;
+				if (chunk > segsize)
+				{
+					memset(&control, 0, sizeof(control));
+					msg.msg_control = control.buf;
+					msg.msg_controllen = sizeof(control.buf);
+					struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+					cm->cmsg_level = SOL_UDP;
+					cm->cmsg_type = UDP_SEGMENT;
+					cm->cmsg_len = CMSG_LEN(sizeof(u16));
+					const u16 gso = (u16)segsize;
+					memcpy(CMSG_DATA(cm), &gso, sizeof(gso));
+				}
+
+				ssize_t bytes = ::sendmsg(sock, &msg, MSG_DONTWAIT);
+				if (bytes < 0)
+				{
+					if ((errno == EIO) && (chunk > segsize))
+					{
+						// The device cannot checksum the segments.
+						gsoState = 0;
+						segsPerSend = 1;
+						continue;
+					}
+					return errno;
+				}
+				// Datagrams are sent as a whole.
+				o->progress += chunk;
+			}
+			return 0;
+		}
+
+		// Start a connect carrying the initial data in SYN with
+		// MSG_FASTOPEN. Bytes taken by the kernel are recorded in
+		// o->progress. Return false if there is no initial data or the
+		// host has disabled fast open, for the caller to connect() instead.
+		// Otherwise errno tells the result like a connect() call.
+		static bool fastOpenConnect(int sock, Overlapped *o)
+		{
+#ifdef MSG_FASTOPEN
+			if (o->length == 0)
+				return false;
+
+			ssize_t bytes = ::sendto(sock, o->buffer, (size_t)o->length, MSG_FASTOPEN | MSG_DONTWAIT,
+					(const struct sockaddr*)o->peer->Data, (socklen_t)o->peer->Length);
+			if (bytes >= 0)
+			{
+				// Queued along with SYN: The handshake is still in flight.
+				o->progress = (u32)bytes;
+				errno = EINPROGRESS;
+				return true;
+			}
+			return (errno != EOPNOTSUPP);
+#else
+			return false;
+#endif
+		}
+
+		// Send the rest of a chain from o->progress with sendmsg(). Unlike
+		// raw buffers, a chain completes only when it is fully sent (or
+		// fails). Return false if the socket would block before that.
+		bool performChainSendLocked(NetEndpoint *ep, Overlapped *o) // require ep->ctx locked.
+		{
+			while (o->progress < o->length)
+			{
+				struct iovec iov[MAX_COALESCED_SENDS];
+				int iovcnt = 0;
+				u32 skip = o->progress;
+				for (u32 i = 0; (i < o->chain->segmentCount()) && (iovcnt < MAX_COALESCED_SENDS); ++i)
+				{
+					const IoBufferChain::Segment &seg = o->chain->segment(i);
+					if (skip >= seg.Length)
+					{
+						skip -= seg.Length;
+						continue;
+					}
+					iov[iovcnt].iov_base = (void*)(seg.Buffer->data() + seg.Offset + skip);
+					iov[iovcnt].iov_len = (size_t)(seg.Length - skip);
+					skip = 0;
+					++iovcnt;
+				}
+
+				struct msghdr msg;
+				::memset(&msg, 0, sizeof(msg));
+				msg.msg_iov = iov;
+				msg.msg_iovlen = iovcnt;
+
+				ssize_t bytes = ::sendmsg(ep->getSocket(), &msg, MSG_DONTWAIT);
+				if (bytes < 0)
+				{
+					if (errno == EWOULDBLOCK || errno == EAGAIN)
+						return false;
+
+					o->length = 0;
+					o->errorcode = errno;
+					ep->setLastPlatformErrno(errno);
+					return true;
+				}
+				o->progress += (u32)bytes;
+			}
+			o->errorcode = 0;
+			return true;
+		}
+
+		// Flush consecutive EIT_SEND operations at the front of wrqueue with
+		// a single sendmsg(). Fully sent operations are moved to the completion
+		// list. The front operation is always gathered, the next ones only as
+		// long as 'budget' would not be exhausted by the previous ones, as if
+		// sent one by one; 'budget' is charged with the bytes sent per
+		// operation. Return false if the socket would block.
+		bool performCoalescedSendLocked(NetEndpoint *ep, NetIoMuxTurnBudget &budget) // require ep->ctx locked.
+		{
+			AsyncContext *ctx = (AsyncContext*) ep->getAsyncContext();
+			xpfAssert(ctx != 0);
+			if (ctx == 0)
+				return false;
+
+			struct iovec iov[MAX_COALESCED_SENDS];
+			int iovcnt = 0;
+			u64 gathered = 0;
+			for (u32 i = 0; (i < ctx->wrqueue.size()) && (iovcnt < MAX_COALESCED_SENDS); ++i)
+			{
+				Overlapped *o = ctx->wrqueue.at(i);
+				if ((o->iotype != NetIoMux::EIT_SEND) || (o->chain != 0))
+					break;
+				if ((iovcnt > 0) && !budget.outlasts((u32)iovcnt, gathered))
+					break;
+
+				if (false == o->provisioned)
+				{
+					if (NetEndpoint::ESTAT_CONNECTED != ep->getStatus())
+					{
+						if (iovcnt > 0)
+							break;
+
+						// Let the regular path report the invalid operation.
+						if (performIoLocked(ep, o))
+						{
+							ctx->wrqueue.pop_front();
+							budget.charge(0);
+						}
+						return true;
+					}
+					o->provisioned = true;
+				}
+
+				iov[iovcnt].iov_base = (void*)(o->buffer + o->progress);
+				iov[iovcnt].iov_len = (size_t)(o->length - o->progress);
+				gathered += iov[iovcnt].iov_len;
+				++iovcnt;
+			}
+			xpfAssert(iovcnt > 0);
+
+			struct msghdr msg;
+			::memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = iovcnt;
+
+			ssize_t bytes = ::sendmsg(ep->getSocket(), &msg, MSG_DONTWAIT);
+			if (bytes < 0)
+			{
+				if (errno == EWOULDBLOCK || errno == EAGAIN)
+					return false;
+
+				// Fail the front operation only. The rest will be
+				// retried (and most likely fail) one by one.
+				Overlapped *o = ctx->wrqueue.front();
+				o->length = 0;
+				o->errorcode = errno;
+				ep->setLastPlatformErrno(errno);
+				ctx->wrqueue.pop_front();
+				dischargeWriteLocked(ctx, o);
+				mCompletionList.push_back(o);
+				budget.charge(0);
+				return true;
+			}
+
+			// Distribute the sent bytes over the gathered operations.
+			size_t remains = (size_t)bytes;
+			for (int i = 0; i < iovcnt; ++i)
+			{
+				Overlapped *o = ctx->wrqueue.front();
+				if (remains < iov[i].iov_len)
+				{
+					o->progress += (u32)remains;
+					budget.charge((u32)remains);
+					return false; // partially sent, wait for next writable event.
+				}
+				remains -= iov[i].iov_len;
+				budget.charge((u32)iov[i].iov_len);
+				o->progress = o->length;
+				o->errorcode = 0;
+				ctx->wrqueue.pop_front();
+				dischargeWriteLocked(ctx, o);
+				mCompletionList.push_back(o);
+			}
+			return true;
+		}
+
+		// Charge a send operation to both the mux-wide cap and the write
+		// watermarks of its endpoint, then queue it. Operations exceeding the
+		// mux-wide cap are completed immediately with ENOBUFS.
+		void appendWriteOp(NetEndpoint *ep, Overlapped *o)
+		{
+			AsyncContext *ctx = (AsyncContext*)ep->getAsyncContext();
+
+			const u64 queued = xpfAtomicAdd64(&mQueuedBytes, (u64)o->length) + o->length;
+			if ((mMaxQueuedBytes != 0) && (queued > mMaxQueuedBytes))
+			{
+				xpfAtomicAdd64(&mQueuedBytes, (u64)0 - o->length);
+				o->provisioned = true;
+				o->errorcode = ENOBUFS;
+				o->length = 0;
+				mCompletionList.push_back(o);
+				return;
+			}
+			o->quota = o->length;
+
+			{
+				ScopedSpinLock ml(ctx->lock);
+				ctx->wrbytes += o->quota;
+				appendAsyncOpLocked(ep, o, ASYNC_OP_WRITE);
+				if ((ctx->highwm == 0) || ctx->blocked || (ctx->wrbytes < ctx->highwm))
+					return;
+				ctx->blocked = true;
+				ctx->notifying++;
+				// Other workers may perform 'o' once unlocked: Its
+				// completion (and with it 'o->cb') is held until the
+				// notification returns.
+				o->holds = 2;
+			}
+
+			// Notify without holding the lock. A low watermark crossed in
+			// the meantime is held back and notified after this one.
+			o->cb->onWriteWatermark(ep, true);
+			bool low = false;
+			{
+				ScopedSpinLock ml(ctx->lock);
+				if ((--ctx->notifying == 0) && ctx->lowheld)
+				{
+					ctx->lowheld = false;
+					low = true;
+				}
+			}
+			if (low)
+				o->cb->onWriteWatermark(ep, false);
+
+			// Emit the completion if it has come meanwhile.
+			if (xpfAtomicAdd(&o->holds, -1) == 1)
+				postCompletion(o);
+		}
+
+		// Release the bytes charged by a write operation which is leaving
+		// wrqueue. Mark the op if it drains the queue to the low watermark.
+		void dischargeWriteLocked(AsyncContext *ctx, Overlapped *o) // require ctx locked.
+		{
+			if (o->quota == 0)
+				return;
+
+			ctx->wrbytes -= o->quota;
+			xpfAtomicAdd64(&mQueuedBytes, (u64)0 - o->quota);
+			o->quota = 0;
+			if (ctx->blocked && (ctx->wrbytes <= ctx->lowwm))
+			{
+				ctx->blocked = false;
+				if (ctx->notifying > 0)
+					ctx->lowheld = true;
+				else
+					o->wmlow = true;
+			}
+		}
+
+		bool armFdLocked(NetIoMuxFdWatch *w, int op) // require mFdWatches locked.
+		{
+			epoll_event evt;
+			evt.events = EPOLLONESHOT;
+			evt.data.u64 = NetIoMuxFdWatchTable::tagOf(w);
+			if (w->Events & NetIoMux::EFE_READ)  evt.events |= EPOLLIN;
+			if (w->Events & NetIoMux::EFE_WRITE) evt.events |= EPOLLOUT;
+			return (0 == epoll_ctl(mEpollfd, op, w->Fd, &evt));
+		}
+
+		struct FdRearm
+		{
+			explicit FdRearm(NetIoMuxImpl *impl) : Impl(impl) {}
+			void operator () (NetIoMuxFdWatch *w) { Impl->armFdLocked(w, EPOLL_CTL_MOD); }
+			NetIoMuxImpl *Impl;
+		};
+
+		void dispatchFd(u64 tag, uint32_t events)
+		{
+			u32 ev = 0;
+			if (events & EPOLLIN)                ev |= NetIoMux::EFE_READ;
+			if (events & EPOLLOUT)               ev |= NetIoMux::EFE_WRITE;
+			if (events & (EPOLLERR | EPOLLHUP))  ev |= NetIoMux::EFE_HANGUP;
+
+			NetIoMuxFdWatch *w = mFdWatches.acquire(tag, ev);
+			if (w == 0)
+				return;
+
+			FdRearm rearm(this);
+			while ((ev = mFdWatches.next(w, rearm)) != 0)
+				w->Cb->onFdReady(w->Fd, ev, w->UserData);
+		}
+
 		void appendAsyncOpLocked(NetEndpoint *ep, Overlapped *o, u8 mode) // require ep->ctx locked.
 		{
 			AsyncContext *ctx = (ep == 0)? 0 : (AsyncContext*)ep->getAsyncContext();
@@ -802,14 +1870,23 @@ namespace xpf
 			if (!ctx->ready)
 			{
 				ctx->ready = true;
-				mReadyList.push_back((void*)ep);
+				mReadyList.push_back((void*)ep, ctx->prio);
 			}
 		}
 
 		NetIoMuxSyncFifo mCompletionList; // fifo of Overlapped.
-		NetIoMuxSyncFifo mReadyList;      // fifo of NetEndpoints.
+		NetIoMuxReadyList mReadyList;     // fifo of NetEndpoints by priority.
+		volatile u32 mTurnOps;            // per-turn budget of ready endpoints.
+		volatile u32 mTurnBytes;
 		bool mEnable;
 		int mEpollfd;
+		int mWakeupfd; // eventfd to interrupt epoll_wait().
+		NetIoMuxFdWatchTable mFdWatches; // descriptors registered by watchFd().
+		volatile u64 mQueuedBytes;    // bytes of queued write operations of all endpoints.
+		u64          mMaxQueuedBytes; // mux-wide cap of mQueuedBytes (0: unlimited).
+		NetIoMuxFilePool mFilePool;   // threads doing file I/O.
+		NetIoMuxTimerQueue mTimers;   // timers of asyncTimer().
+		NetIoMuxProfiler mProfiler;   // callback profiler of enableProfiler().
 	}; // end of class NetIoMuxImpl (epoll)
 
 } // end of namespace xpf
@@ -0,0 +1,161 @@
+/*******************************************************************************
+ * Copyright (c) 2013 matt@moregeek.com.tw
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ * 3. This notice may not be removed or altered from any source
+ *    distribution.
+ ********************************************************************************/
+
+#include <xpf/netiomux.h>
+#include <map>
+
+// NOTE: Include after netiomux_spinlock.hpp.
+
+namespace xpf
+{
+
+// A descriptor registered by NetIoMux::watchFd().
+struct NetIoMuxFdWatch
+{
+	s32               Fd;
+	u32               Gen;         // tells a re-registered fd from a stale event.
+	u32               Events;      // interested EFdEvent flags.
+	u32               Pending;     // reported events not yet dispatched.
+	NetIoMuxCallback *Cb;
+	vptr              UserData;
+	bool              Dispatching; // a worker is calling (or about to call) Cb.
+	bool              Removed;     // unwatched while dispatching.
+};
+
+// Registry of watched descriptors shared by the POSIX backends.
+//
+// The backend registers a watch with a tag (see tagOf()) instead of a
+// pointer so that events reported after unwatchFd() can be recognized
+// and dropped. The low bit of a tag is always set, which never happens
+// to pointers of NetEndpoints.
+//
+// Readiness is armed one-shot: only the worker which has acquired a
+// watch dispatches it, then re-arms it. Events reported meanwhile (by
+// another filter on kqueue) are merged into Pending and dispatched by
+// the same worker.
+class NetIoMuxFdWatchTable
+{
+public:
+	NetIoMuxFdWatchTable() : mNextGen(0) {}
+
+	~NetIoMuxFdWatchTable()
+	{
+		for (std::map<s32, NetIoMuxFdWatch*>::iterator it = mWatches.begin(); it != mWatches.end(); ++it)
+			delete it->second;
+		mWatches.clear();
+	}
+
+	static inline bool isTag(u64 data) { return ((data & 0x1) != 0); }
+
+	static inline u64 tagOf(const NetIoMuxFdWatch *w)
+	{
+		return ((u64)w->Gen << 32) | ((u64)(u32)w->Fd << 1) | 0x1;
+	}
+
+	NetIoMuxSpinLock& lock() { return mLock; }
+
+	NetIoMuxFdWatch* find(s32 fd) // require locked.
+	{
+		std::map<s32, NetIoMuxFdWatch*>::iterator it = mWatches.find(fd);
+		return (it == mWatches.end()) ? 0 : it->second;
+	}
+
+	// Returns 0 if 'fd' is being watched already.
+	NetIoMuxFdWatch* insert(s32 fd, u32 events, NetIoMuxCallback *cb, vptr userData) // require locked.
+	{
+		if ((fd < 0) || (find(fd) != 0))
+			return 0;
+
+		NetIoMuxFdWatch *w = new NetIoMuxFdWatch;
+		w->Fd = fd;
+		w->Gen = ++mNextGen;
+		w->Events = events;
+		w->Pending = 0;
+		w->Cb = cb;
+		w->UserData = userData;
+		w->Dispatching = false;
+		w->Removed = false;
+		mWatches[fd] = w;
+		return w;
+	}
+
+	// Detach the watch of 'fd'. It is deleted right away unless being
+	// dispatched, in which case the dispatching worker deletes it.
+	bool remove(s32 fd) // require locked.
+	{
+		std::map<s32, NetIoMuxFdWatch*>::iterator it = mWatches.find(fd);
+		if (it == mWatches.end())
+			return false;
+
+		NetIoMuxFdWatch *w = it->second;
+		mWatches.erase(it);
+		if (w->Dispatching)
+			w->Removed = true;
+		else
+			delete w;
+		return true;
+	}
+
+	// Claim the watch of 'tag' to dispatch 'events'. Returns 0 if the
+	// tag is stale or another worker is dispatching it already.
+	NetIoMuxFdWatch* acquire(u64 tag, u32 events)
+	{
+		ScopedSpinLock ml(mLock);
+		NetIoMuxFdWatch *w = find((s32)((u32)tag >> 1));
+		if ((w == 0) || (w->Gen != (u32)(tag >> 32)))
+			return 0;
+
+		w->Pending |= events;
+		if (w->Dispatching)
+			return 0;
+		w->Dispatching = true;
+		return w;
+	}
+
+	// Take the pending events of an acquired watch. Returns 0 once there
+	// are no more, after which the watch is released: deleted if removed
+	// meanwhile, or 'rearm' is called to arm it again.
+	template <typename REARM>
+	u32 next(NetIoMuxFdWatch *w, REARM &rearm)
+	{
+		ScopedSpinLock ml(mLock);
+		const u32 events = w->Pending;
+		w->Pending = 0;
+		if ((events != 0) && !w->Removed)
+			return events;
+
+		w->Dispatching = false;
+		if (w->Removed)
+			delete w;
+		else
+			rearm(w);
+		return 0;
+	}
+
+private:
+	NetIoMuxSpinLock                 mLock;
+	std::map<s32, NetIoMuxFdWatch*>  mWatches;
+	u32                              mNextGen;
+};
+
+} // end of namespace xpf
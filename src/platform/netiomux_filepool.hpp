@@ -0,0 +1,258 @@
+/*******************************************************************************
+ * Copyright (c) 2013 matt@moregeek.com.tw
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ * 3. This notice may not be removed or altered from any source
+ *    distribution.
+ ********************************************************************************/
+
+#include <xpf/netiomux.h>
+#include <xpf/thread.h>
+#include <xpf/threadlock.h>
+#include <xpf/threadevent.h>
+#include <deque>
+#include <vector>
+#include <string.h>
+
+#if defined(XPF_PLATFORM_WINDOWS)
+#  include <io.h>
+#else
+#  include <unistd.h>
+#  include <errno.h>
+#endif
+
+namespace xpf
+{
+
+// A file operation issued by NetIoMux::asyncFileRead()/asyncFileWrite().
+struct NetIoMuxFileJob
+{
+	u32  Type;     // EIT_FILEREAD or EIT_FILEWRITE
+	s32  Fd;
+	u64  Offset;
+	c8  *Buffer;
+	u32  Length;
+	u32  Sync;     // NetIoMux::EFileSync, for writes.
+	vptr UserData;
+	u32  Result;   // bytes transferred.
+	int  Error;    // platform error code. 0 on success.
+	vptr Op;       // the backend's operation record.
+};
+
+// A bounded pool of threads doing blocking file I/O for NetIoMux, so
+// that disk access never stalls the mux workers. Threads are started on
+// the first submitted job. Each finished job is passed to the 'complete'
+// function (from a pool thread) which posts it back to the mux.
+class NetIoMuxFilePool
+{
+public:
+	typedef void (*CompleteFn)(vptr owner, NetIoMuxFileJob *job);
+
+	NetIoMuxFilePool(CompleteFn complete, vptr owner)
+		: mComplete(complete), mOwner(owner)
+		, mMaxThreads(2), mMaxQueued(1024), mStopping(false)
+	{
+	}
+
+	~NetIoMuxFilePool()
+	{
+		stop();
+	}
+
+	// Takes effect before the first job is submitted.
+	void configure(u32 threads, u32 maxQueued)
+	{
+		ScopedThreadLock ml(mLock);
+		xpfAssert(("Configuring a running file I/O pool.", mWorkers.empty()));
+		mMaxThreads = (threads > 0) ? threads : 1;
+		mMaxQueued = maxQueued;
+	}
+
+	// Returns false if the queue is full or the pool is stopping.
+	bool submit(NetIoMuxFileJob *job)
+	{
+		ScopedThreadLock ml(mLock);
+		if (mStopping || ((mMaxQueued != 0) && (mJobs.size() >= mMaxQueued)))
+			return false;
+
+		if (mWorkers.empty())
+		{
+			for (u32 i = 0; i < mMaxThreads; ++i)
+			{
+				Worker *w = new Worker(this);
+				mWorkers.push_back(w);
+				w->start();
+			}
+		}
+		mJobs.push_back(job);
+		mEvent.set();
+		return true;
+	}
+
+	// Finish all queued jobs and join the threads.
+	void stop()
+	{
+		{
+			ScopedThreadLock ml(mLock);
+			mStopping = true;
+			mEvent.set();
+		}
+		for (u32 i = 0; i < mWorkers.size(); ++i)
+		{
+			mWorkers[i]->join();
+			delete mWorkers[i];
+		}
+		mWorkers.clear();
+	}
+
+private:
+	class Worker : public Thread
+	{
+	public:
+		explicit Worker(NetIoMuxFilePool *pool) : mPool(pool) {}
+		u32 run(u64 userdata)
+		{
+			mPool->work();
+			return 0;
+		}
+	private:
+		NetIoMuxFilePool *mPool;
+	};
+
+	void work()
+	{
+		while (true)
+		{
+			NetIoMuxFileJob *job = 0;
+			{
+				ScopedThreadLock ml(mLock);
+				if (!mJobs.empty())
+				{
+					job = mJobs.front();
+					mJobs.pop_front();
+				}
+				else if (mStopping)
+				{
+					return;
+				}
+				else
+				{
+					// Reset under the lock so that a job submitted
+					// right after this never misses its signal.
+					mEvent.reset();
+				}
+			}
+
+			if (job == 0)
+			{
+				mEvent.wait(100);
+				continue;
+			}
+			perform(job);
+			mComplete(mOwner, job);
+		}
+	}
+
+	static void perform(NetIoMuxFileJob *job)
+	{
+		job->Result = 0;
+		job->Error = 0;
+#if defined(XPF_PLATFORM_WINDOWS)
+		HANDLE h = (HANDLE)_get_osfhandle(job->Fd);
+		if (h == INVALID_HANDLE_VALUE)
+		{
+			job->Error = ERROR_INVALID_HANDLE;
+			return;
+		}
+		while (job->Result < job->Length)
+		{
+			OVERLAPPED ov;
+			::memset(&ov, 0, sizeof(ov));
+			const u64 off = job->Offset + job->Result;
+			ov.Offset = (DWORD)off;
+			ov.OffsetHigh = (DWORD)(off >> 32);
+			DWORD bytes = 0;
+			BOOL ret = (job->Type == NetIoMux::EIT_FILEREAD)
+				? ::ReadFile(h, job->Buffer + job->Result, job->Length - job->Result, &bytes, &ov)
+				: ::WriteFile(h, job->Buffer + job->Result, job->Length - job->Result, &bytes, &ov);
+			if (!ret)
+			{
+				if (GetLastError() != ERROR_HANDLE_EOF)
+					job->Error = GetLastError();
+				return;
+			}
+			job->Result += bytes;
+			if ((bytes == 0) || (job->Type == NetIoMux::EIT_FILEREAD))
+				break;
+		}
+		if ((job->Type == NetIoMux::EIT_FILEWRITE) && (job->Sync != NetIoMux::EFS_NONE))
+		{
+			if (!::FlushFileBuffers(h))
+				job->Error = GetLastError();
+		}
+#else
+		// Reads complete once anything has been read (short at EOF).
+		// Writes are retried until all bytes are written.
+		while (job->Result < job->Length)
+		{
+			const off_t off = (off_t)(job->Offset + job->Result);
+			ssize_t bytes = (job->Type == NetIoMux::EIT_FILEREAD)
+				? ::pread(job->Fd, job->Buffer + job->Result, job->Length - job->Result, off)
+				: ::pwrite(job->Fd, job->Buffer + job->Result, job->Length - job->Result, off);
+			if (bytes < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				job->Error = errno;
+				return;
+			}
+			job->Result += (u32)bytes;
+			if ((bytes == 0) || (job->Type == NetIoMux::EIT_FILEREAD))
+				break;
+		}
+		if (job->Type == NetIoMux::EIT_FILEWRITE)
+		{
+			int ec = 0;
+#if defined(XPF_PLATFORM_APPLE)
+			// No fdatasync() on Darwin.
+			if (job->Sync != NetIoMux::EFS_NONE)
+				ec = ::fsync(job->Fd);
+#else
+			if (job->Sync == NetIoMux::EFS_DATASYNC)
+				ec = ::fdatasync(job->Fd);
+			else if (job->Sync == NetIoMux::EFS_SYNC)
+				ec = ::fsync(job->Fd);
+#endif
+			if (ec != 0)
+				job->Error = errno;
+		}
+#endif
+	}
+
+	CompleteFn                    mComplete;
+	vptr                          mOwner;
+	u32                           mMaxThreads;
+	u32                           mMaxQueued; // 0: unlimited.
+	bool                          mStopping;
+	ThreadLock                    mLock;
+	ThreadEvent                   mEvent;     // set while there are jobs (or stopping).
+	std::deque<NetIoMuxFileJob*>  mJobs;
+	std::vector<Worker*>          mWorkers;
+};
+
+} // end of namespace xpf
@@ -22,6 +22,8 @@
  ********************************************************************************/ 
 
 #include <xpf/netiomux.h>
+#include <xpf/atomic.h>
+#include <xpf/iobuffer.h>
 #include <xpf/string.h>
 #include <xpf/lexicalcast.h>
 
@@ -37,10 +39,35 @@
 #include <Mswsock.h>
 #include <string.h>
 
+#include "netiomux_spinlock.hpp"
+#include "netiomux_filepool.hpp"
+#include "netiomux_timers.hpp"
+#include "netiomux_profiler.hpp"
+
 namespace xpf
 {
 
-#define IOMUX_OVERLAPPED_FIRED (0x1)
+#define IOMUX_OVERLAPPED_FIRED    (0x1)
+#define IOMUX_OVERLAPPED_REJECTED (0x2)
+
+// Shared record of an asyncBroadcast() call.
+struct IocpBroadcast
+{
+	IocpBroadcast() : Buffers(0), Count(0), Pending(0), Failed(0) {}
+	~IocpBroadcast() { delete[] Buffers; }
+	IoBufferChain Chain;   // the payload shared by all sends.
+	WSABUF       *Buffers; // one WSABUF per segment of Chain.
+	u32           Count;   // number of target endpoints.
+	volatile s32  Pending; // sends not yet completed.
+	volatile s32  Failed;  // sends completed with errors.
+};
+
+// message of a segmented UDP send
+struct IocpSegmentedSend
+{
+	WSAMSG Msg;
+	CHAR   Control[WSA_CMSG_SPACE(sizeof(DWORD))];
+};
 
 struct NetIoMuxOverlapped : public OVERLAPPED
 {
@@ -50,14 +77,32 @@ struct NetIoMuxOverlapped : public OVERLAPPED
 	SOCKET            AcceptingSocket;
 	NetEndpoint::Peer PeerData;
 	u32               Flags;
+	u32               Quota; // bytes charged to write watermarks.
+	IoBufferChain    *Chain;   // chain to send (owned copy).
+	WSABUF           *Buffers; // one WSABUF per segment of Chain.
+	IoBuffer         *IoBuf;   // buffer to receive into (referenced).
+	IocpBroadcast    *Broadcast; // owned by the op completing the broadcast.
+	NetIoMuxFileJob  *File;      // file operation (owned).
+	vptr              UserData;  // user data of a timer.
+	u32               SegmentSize; // UDP segment size of a send.
+	IocpSegmentedSend *Segmented;  // message of a segmented send (owned).
 };
 
 struct IocpAsyncContext
 {
 	IocpAsyncContext()
-		: pAcceptEx(0), pConnectEx(0) {}
+		: pAcceptEx(0), pConnectEx(0)
+		, Blocked(false), LowHeld(false), Notifying(0)
+		, WrBytes(0), LowWm(0), HighWm(0) {}
 	LPFN_ACCEPTEX  pAcceptEx;
 	LPFN_CONNECTEX pConnectEx;
+	bool           Blocked; // WrBytes has reached HighWm.
+	bool           LowHeld; // LowWm crossed while notifying HighWm.
+	u8             Notifying; // HighWm notifications in progress.
+	u32            WrBytes; // bytes of pending send operations.
+	u32            LowWm;
+	u32            HighWm;  // 0: disabled.
+	NetIoMuxSpinLock Lock;  // guards the write watermark states.
 };
 
 class NetIoMuxImpl
@@ -66,6 +111,9 @@ public:
 	NetIoMuxImpl()
 		: mhIocp(INVALID_HANDLE_VALUE)
 		, bEnable(true)
+		, mQueuedBytes(0)
+		, mMaxQueuedBytes(0)
+		, mFilePool(fileJobDone, (vptr)this)
 	{
 		if (!NetEndpoint::platformInit())
 			return;
@@ -77,6 +125,10 @@ public:
 	~NetIoMuxImpl()
 	{
 		enable(false);
+		mFilePool.stop();
+
+		while (NetIoMuxOverlapped *odata = (NetIoMuxOverlapped*)mTimers.pop())
+			recycleOverlapped(odata);
 
 		if (mhIocp != INVALID_HANDLE_VALUE)
 		{
@@ -104,7 +156,22 @@ public:
 		DWORD bytes = 0;
 		ULONG_PTR key = 0;
 		NetIoMuxOverlapped *odata = 0;
-		BOOL ret = ::GetQueuedCompletionStatus(mhIocp, &bytes, &key, (LPOVERLAPPED*)&odata, timeoutMs);
+
+		// Emit expired timers before waiting.
+		vptr timers[16];
+		u32 expired = mTimers.expire(timers, 16);
+		if (expired > 0)
+		{
+			for (u32 i = 0; i < expired; ++i)
+			{
+				odata = (NetIoMuxOverlapped*)timers[i];
+				emitCompletion(odata, NetIoMux::EIT_TIMER, NetEndpoint::EE_SUCCESS, 0, odata->UserData, 0, 0);
+				recycleOverlapped(odata);
+			}
+			return NetIoMux::ERS_NORMAL;
+		}
+
+		BOOL ret = ::GetQueuedCompletionStatus(mhIocp, &bytes, &key, (LPOVERLAPPED*)&odata, mTimers.waitTime(timeoutMs));
 		if (FALSE == ret)
 		{
 			if ((odata == 0) && (GetLastError() != ERROR_ABANDONED_WAIT_0))
@@ -113,6 +180,41 @@ public:
 		}
 
 		NetEndpoint *ep = (NetEndpoint*)key;
+		if (odata->IoType == NetIoMux::EIT_TIMER) // Posted by asyncTimer() to shorten the wait.
+		{
+			recycleOverlapped(odata);
+			return NetIoMux::ERS_NORMAL;
+		}
+
+		if (odata->IoType == NetIoMux::EIT_WAKEUP) // Posted by asyncWakeup().
+		{
+			emitCompletion(odata, NetIoMux::EIT_WAKEUP, NetEndpoint::EE_SUCCESS, 0, 0, 0, 0);
+			recycleOverlapped(odata);
+			return NetIoMux::ERS_NORMAL;
+		}
+
+		if (odata->File) // Posted by the file I/O pool.
+		{
+			const NetIoMuxFileJob *job = odata->File;
+			NetEndpoint::EError ec = NetEndpoint::EE_SUCCESS;
+			if (odata->Flags & IOMUX_OVERLAPPED_REJECTED)
+				ec = NetEndpoint::EE_QUEUE_FULL;
+			else if (job->Error != 0)
+				ec = NetEndpoint::EE_FILEIO;
+			emitCompletion(odata, (NetIoMux::EIoType)odata->IoType, ec, 0, job->UserData, job->Buffer,
+				(ec == NetEndpoint::EE_SUCCESS) ? job->Result : 0);
+			recycleOverlapped(odata);
+			return NetIoMux::ERS_NORMAL;
+		}
+
+		if (odata->Flags & IOMUX_OVERLAPPED_REJECTED) // Send operations exceeding the mux-wide cap.
+		{
+			emitCompletion(odata, (NetIoMux::EIoType)odata->IoType, NetEndpoint::EE_QUEUE_FULL, ep,
+				(odata->IoType == NetIoMux::EIT_SENDTO) ? (vptr)&odata->PeerData : 0, odata->Buffer.buf, 0);
+			recycleOverlapped(odata);
+			return NetIoMux::ERS_NORMAL;
+		}
+
 		bool isCompletion = ((odata->Flags & IOMUX_OVERLAPPED_FIRED) != 0);
 		if (isCompletion) // Completion status from overlapped functions.
 		{
@@ -121,7 +223,6 @@ public:
 		}
 
 		NetEndpoint::EStatus st = ep->getStatus();
-		NetIoMuxCallback *cb = odata->Callback;
 		NetIoMux::EIoType iotype = (NetIoMux::EIoType)odata->IoType;
 		bool deleteOverlapped = true;
 		switch (iotype)
@@ -135,14 +236,14 @@ public:
 					xpfAssert(("Unprovisioned netendpoint.", ctx != 0));
 					if (0 == ctx)
 					{
-						cb->onIoCompleted(iotype, NetEndpoint::EE_INVALID_OP, ep, 0, 0, 0);
+						emitCompletion(odata, iotype, NetEndpoint::EE_INVALID_OP, ep, 0, 0, 0);
 						break;
 					}
 
 					xpfAssert(("Invalid socket status.", NetEndpoint::ESTAT_LISTENING == st));
 					if (NetEndpoint::ESTAT_LISTENING != st)
 					{
-						cb->onIoCompleted(iotype, NetEndpoint::EE_INVALID_OP, ep, 0, 0, 0);
+						emitCompletion(odata, iotype, NetEndpoint::EE_INVALID_OP, ep, 0, 0, 0);
 						break;
 					}
 
@@ -155,7 +256,7 @@ public:
 					xpfAssert(("Unable to create socket for accepting peer", odata->AcceptingSocket != INVALID_SOCKET));
 					if (odata->AcceptingSocket == INVALID_SOCKET)
 					{
-						cb->onIoCompleted(iotype, NetEndpoint::EE_ACCEPT, ep, 0, 0, 0);
+						emitCompletion(odata, iotype, NetEndpoint::EE_ACCEPT, ep, 0, 0, 0);
 						break;
 					}
 
@@ -179,7 +280,7 @@ public:
 					else // error
 					{
 						ep->setStatus(NetEndpoint::ESTAT_LISTENING);
-						cb->onIoCompleted(iotype, NetEndpoint::EE_ACCEPT, ep, 0, 0, 0);
+						emitCompletion(odata, iotype, NetEndpoint::EE_ACCEPT, ep, 0, 0, 0);
 					}
 				} while(0);
 			}
@@ -189,7 +290,7 @@ public:
 				ep->setStatus(NetEndpoint::ESTAT_LISTENING);
 				if (ret == FALSE)
 				{
-					cb->onIoCompleted(iotype, NetEndpoint::EE_ACCEPT, ep, 0, 0, 0);
+					emitCompletion(odata, iotype, NetEndpoint::EE_ACCEPT, ep, 0, 0, 0);
 				}
 				else
 				{
@@ -202,7 +303,7 @@ public:
 
 					NetEndpoint *tep = new NetEndpoint(ep->getProtocol(), (int)odata->AcceptingSocket, NetEndpoint::ESTAT_CONNECTED);
 					join(tep);
-					cb->onIoCompleted(iotype, NetEndpoint::EE_SUCCESS, ep, (vptr)tep, 0, 0);
+					emitCompletion(odata, iotype, NetEndpoint::EE_SUCCESS, ep, (vptr)tep, 0, 0);
 				}
 			}
 			break;
@@ -216,14 +317,14 @@ public:
 					xpfAssert(("Unprovisioned netendpoint.", ctx != 0));
 					if (0 == ctx)
 					{
-						cb->onIoCompleted(iotype, NetEndpoint::EE_INVALID_OP, ep, 0, 0, 0);
+						emitCompletion(odata, iotype, NetEndpoint::EE_INVALID_OP, ep, 0, 0, 0);
 						break;
 					}
 
 					xpfAssert(("Invalid socket status.", NetEndpoint::ESTAT_INIT == st));
 					if (NetEndpoint::ESTAT_INIT != st)
 					{
-						cb->onIoCompleted(iotype, NetEndpoint::EE_INVALID_OP, ep, 0, 0, 0);
+						emitCompletion(odata, iotype, NetEndpoint::EE_INVALID_OP, ep, 0, 0, 0);
 						break;
 					}
 
@@ -232,7 +333,7 @@ public:
 					if (!NetEndpoint::resolvePeer(ep->getProtocol(), peer, 
 						odata->Buffer.buf, &odata->Buffer.buf[960]))
 					{
-						cb->onIoCompleted(iotype, NetEndpoint::EE_RESOLVE, ep, 0, 0, 0);
+						emitCompletion(odata, iotype, NetEndpoint::EE_RESOLVE, ep, 0, 0, 0);
 						::free(odata->Buffer.buf);
 						break;
 					}
@@ -256,7 +357,7 @@ public:
 					}
 					if (0 != ec)
 					{
-						cb->onIoCompleted(iotype, NetEndpoint::EE_BIND, ep, 0, 0, 0);
+						emitCompletion(odata, iotype, NetEndpoint::EE_BIND, ep, 0, 0, 0);
 						break;
 					}
 
@@ -265,10 +366,23 @@ public:
 					resetOverlapped(odata);
 					odata->Flags |= IOMUX_OVERLAPPED_FIRED;
 
+					// ConnectEx() sends the initial data right after the
+					// handshake, or along with SYN once TCP Fast Open is
+					// enabled on the socket (best-effort).
+					const c8 *data = (odata->Buffers) ? odata->Buffers[0].buf : 0;
+					const DWORD datalen = (odata->Buffers) ? odata->Buffers[0].len : 0;
+#ifdef TCP_FASTOPEN
+					if (datalen > 0)
+					{
+						DWORD on = 1;
+						::setsockopt(ep->getSocket(), IPPROTO_TCP, TCP_FASTOPEN, (const char*)&on, sizeof(on));
+					}
+#endif
+
 					// After socket has ensured to be bound, we can finally calls ConnectEx.
 					BOOL result = ctx->pConnectEx(ep->getSocket(), 
 						(const sockaddr*)peer.Data, peer.Length,
-						0, 0, 0, (LPWSAOVERLAPPED)odata);
+						(PVOID)data, datalen, 0, (LPWSAOVERLAPPED)odata);
 
 					if ((TRUE == result) || (ERROR_IO_PENDING == WSAGetLastError()))
 					{
@@ -277,7 +391,7 @@ public:
 					else // error
 					{
 						ep->setStatus(NetEndpoint::ESTAT_INIT);
-						cb->onIoCompleted(iotype, NetEndpoint::EE_CONNECT, ep, 0, 0, 0);
+						emitCompletion(odata, iotype, NetEndpoint::EE_CONNECT, ep, 0, 0, 0);
 					}
 				} while(0);
 			}
@@ -287,14 +401,15 @@ public:
 				if (ret == FALSE)
 				{
 					ep->setStatus(NetEndpoint::ESTAT_INIT);
-					cb->onIoCompleted(iotype, NetEndpoint::EE_CONNECT, ep, 0, 0, 0);
+					emitCompletion(odata, iotype, NetEndpoint::EE_CONNECT, ep, 0, 0, 0);
 				}
 				else
 				{
 					ep->setStatus(NetEndpoint::ESTAT_CONNECTED);
 					int ec = setsockopt(ep->getSocket(), SOL_SOCKET, SO_UPDATE_CONNECT_CONTEXT, NULL, 0);
 					xpfAssert(("Failed to update connected context on outgoing socket.", ec == 0));
-					cb->onIoCompleted(iotype, NetEndpoint::EE_SUCCESS, ep, 0, 0, 0);
+					emitCompletion(odata, iotype, NetEndpoint::EE_SUCCESS, ep, 0,
+						(odata->Buffers) ? odata->Buffers[0].buf : 0, (u32)bytes);
 				}
 			}
 			break;
@@ -307,7 +422,7 @@ public:
 					xpfAssert(("Invalid socket status.", NetEndpoint::ESTAT_CONNECTED == st));
 					if (NetEndpoint::ESTAT_CONNECTED != st)
 					{
-						cb->onIoCompleted(iotype, NetEndpoint::EE_INVALID_OP, ep, 0, odata->Buffer.buf, 0);
+						emitCompletion(odata, iotype, NetEndpoint::EE_INVALID_OP, ep, 0, odata->Buffer.buf, 0);
 						break;
 					}
 
@@ -323,15 +438,17 @@ public:
 					}
 					else // error
 					{
-						cb->onIoCompleted(iotype, NetEndpoint::EE_RECV, ep, 0, odata->Buffer.buf, 0);
+						emitCompletion(odata, iotype, NetEndpoint::EE_RECV, ep, 0, odata->Buffer.buf, 0);
 					}
 				} while (0);
 			}
 			else
 			{
-				cb->onIoCompleted(iotype,
+				if (ret && odata->IoBuf)
+					odata->IoBuf->commit(bytes);
+				emitCompletion(odata, iotype,
 					(ret) ? (NetEndpoint::EE_SUCCESS) : (NetEndpoint::EE_RECV),
-					ep, 0, odata->Buffer.buf, bytes);
+					ep, (vptr)odata->IoBuf, odata->Buffer.buf, bytes);
 			}
 			break;
 
@@ -343,7 +460,7 @@ public:
 					xpfAssert(("Invalid socket status.", NetEndpoint::ESTAT_CONNECTED == st));
 					if (NetEndpoint::ESTAT_CONNECTED != st)
 					{
-						cb->onIoCompleted(iotype, NetEndpoint::EE_INVALID_OP, ep, 0, odata->Buffer.buf, 0);
+						emitCompletion(odata, iotype, NetEndpoint::EE_INVALID_OP, ep, 0, odata->Buffer.buf, 0);
 						break;
 					}
 
@@ -360,13 +477,13 @@ public:
 					}
 					else // error
 					{
-						cb->onIoCompleted(iotype, NetEndpoint::EE_RECV, ep, 0, odata->Buffer.buf, 0);
+						emitCompletion(odata, iotype, NetEndpoint::EE_RECV, ep, 0, odata->Buffer.buf, 0);
 					}
 				} while (0);
 			}
 			else
 			{
-				cb->onIoCompleted(iotype,
+				emitCompletion(odata, iotype,
 					(ret) ? (NetEndpoint::EE_SUCCESS) : (NetEndpoint::EE_RECV),
 					ep, (vptr)&odata->PeerData, odata->Buffer.buf, bytes);
 			}
@@ -380,28 +497,29 @@ public:
 					xpfAssert(("Invalid socket status.", NetEndpoint::ESTAT_CONNECTED == st));
 					if (NetEndpoint::ESTAT_CONNECTED != st)
 					{
-						cb->onIoCompleted(iotype, NetEndpoint::EE_INVALID_OP, ep, 0, odata->Buffer.buf, 0);
+						emitCompletion(odata, iotype, NetEndpoint::EE_INVALID_OP, ep, 0, odata->Buffer.buf, 0);
 						break;
 					}
 
 					resetOverlapped(odata);
 					odata->Flags |= IOMUX_OVERLAPPED_FIRED;
 
-					int ec = WSASend(ep->getSocket(), &odata->Buffer, 1, 0, 0, 
-						(LPWSAOVERLAPPED)odata, 0);
+					int ec = (odata->Chain)
+						? WSASend(ep->getSocket(), odata->Buffers, odata->Chain->segmentCount(), 0, 0, (LPWSAOVERLAPPED)odata, 0)
+						: WSASend(ep->getSocket(), &odata->Buffer, 1, 0, 0, (LPWSAOVERLAPPED)odata, 0);
 					if ((0 == ec) || (ERROR_IO_PENDING == WSAGetLastError()))
 					{
 						deleteOverlapped = false;
 					}
 					else // error
 					{
-						cb->onIoCompleted(iotype, NetEndpoint::EE_SEND, ep, 0, odata->Buffer.buf, 0);
+						emitCompletion(odata, iotype, NetEndpoint::EE_SEND, ep, 0, odata->Buffer.buf, 0);
 					}
 				} while (0);
 			}
 			else
 			{
-				cb->onIoCompleted(iotype,
+				emitCompletion(odata, iotype,
 					(ret) ? (NetEndpoint::EE_SUCCESS) : (NetEndpoint::EE_SEND),
 					ep, 0, odata->Buffer.buf, bytes);
 			}
@@ -415,7 +533,7 @@ public:
 					xpfAssert(("Invalid socket status.", NetEndpoint::ESTAT_CONNECTED == st));
 					if (NetEndpoint::ESTAT_CONNECTED != st)
 					{
-						cb->onIoCompleted(iotype, NetEndpoint::EE_INVALID_OP, ep, 
+						emitCompletion(odata, iotype, NetEndpoint::EE_INVALID_OP, ep, 
 							(vptr)&odata->PeerData, odata->Buffer.buf, 0);
 						break;
 					}
@@ -424,23 +542,25 @@ public:
 					odata->Flags |= IOMUX_OVERLAPPED_FIRED;
 
 					const u32 proto = ep->getProtocol();
-					int ec = WSASendTo(ep->getSocket(), &odata->Buffer, 1, 0, 0,
-						(const sockaddr*)odata->PeerData.Data, odata->PeerData.Length, 
-						(LPWSAOVERLAPPED)odata, 0);
+					int ec = (odata->SegmentSize != 0)
+						? sendSegments(ep->getSocket(), odata)
+						: WSASendTo(ep->getSocket(), &odata->Buffer, 1, 0, 0,
+							(const sockaddr*)odata->PeerData.Data, odata->PeerData.Length, 
+							(LPWSAOVERLAPPED)odata, 0);
 					if ((0 == ec) || (ERROR_IO_PENDING == WSAGetLastError()))
 					{
 						deleteOverlapped = false;
 					}
 					else // error
 					{
-						cb->onIoCompleted(iotype, NetEndpoint::EE_SEND, ep, 
+						emitCompletion(odata, iotype, NetEndpoint::EE_SEND, ep, 
 							(vptr)&odata->PeerData, odata->Buffer.buf, 0);
 					}
 				} while (0);
 			}
 			else
 			{
-				cb->onIoCompleted(iotype,
+				emitCompletion(odata, iotype,
 					(ret) ? (NetEndpoint::EE_SUCCESS) : (NetEndpoint::EE_SEND),
 					ep, (vptr)&odata->PeerData, odata->Buffer.buf, bytes);
 			}
@@ -456,6 +576,78 @@ public:
 		return NetIoMux::ERS_NORMAL;
 	}
 
+	// Emit a completion through the batch interface. Each runOnce() dequeues
+	// a single completion packet, so batches carry one record on IOCP.
+	// Issue a segmented send with the segment size as ancillary data of
+	// WSASendMsg() (UDP send offload). Fails with WSAEOPNOTSUPP where the
+	// SDK does not know it, and with WSAEINVAL on hosts without it.
+	static int sendSegments(SOCKET sock, NetIoMuxOverlapped *odata)
+	{
+#ifdef UDP_SEND_MSG_SIZE
+		IocpSegmentedSend *ss = new IocpSegmentedSend;
+		::memset(ss, 0, sizeof(IocpSegmentedSend));
+		odata->Segmented = ss;
+		ss->Msg.name = (LPSOCKADDR)odata->PeerData.Data;
+		ss->Msg.namelen = odata->PeerData.Length;
+		ss->Msg.lpBuffers = &odata->Buffer;
+		ss->Msg.dwBufferCount = 1;
+		ss->Msg.Control.buf = ss->Control;
+		ss->Msg.Control.len = sizeof(ss->Control);
+
+		WSACMSGHDR *cm = WSA_CMSG_FIRSTHDR(&ss->Msg);
+		cm->cmsg_level = IPPROTO_UDP;
+		cm->cmsg_type = UDP_SEND_MSG_SIZE;
+		cm->cmsg_len = WSA_CMSG_LEN(sizeof(DWORD));
+		*(DWORD*)WSA_CMSG_DATA(cm) = (DWORD)odata->SegmentSize;
+
+		return WSASendMsg(sock, &ss->Msg, 0, 0, (LPWSAOVERLAPPED)odata, 0);
+#else
+		WSASetLastError(WSAEOPNOTSUPP);
+		return SOCKET_ERROR;
+#endif
+	}
+
+	void emitCompletion(NetIoMuxOverlapped *odata, NetIoMux::EIoType type, NetEndpoint::EError ec, NetEndpoint *sep, vptr tepOrPeer, const c8 *buf, u32 len)
+	{
+		// Release the bytes charged by send operations before the
+		// completion since the callback may be released by it.
+		if (sep)
+			dischargeWrite(sep, odata);
+
+		// Sends of a broadcast emit a single aggregate completion by the
+		// last one. Ops detach from the shared record (released along with
+		// the last op) and borrowed Chain/Buffers here.
+		if (odata->Broadcast)
+		{
+			IocpBroadcast *b = odata->Broadcast;
+			odata->Broadcast = 0;
+			odata->Chain = 0;
+			odata->Buffers = 0;
+			if ((type != NetIoMux::EIT_WAKEUP) && (ec != NetEndpoint::EE_SUCCESS))
+				xpfAtomicAdd(&b->Failed, 1);
+			if (xpfAtomicAdd(&b->Pending, -1) != 1)
+				return;
+
+			odata->Broadcast = b;
+			type = NetIoMux::EIT_BROADCAST;
+			ec = (b->Failed == 0) ? NetEndpoint::EE_SUCCESS : NetEndpoint::EE_SEND;
+			sep = 0;
+			tepOrPeer = 0;
+			buf = 0;
+			len = b->Count - (u32)b->Failed;
+		}
+
+		NetIoMuxCompletion rec;
+		rec.Type = type;
+		rec.Error = ec;
+		rec.Endpoint = sep;
+		rec.TepOrPeer = tepOrPeer;
+		rec.Buffer = buf;
+		rec.Length = len;
+		rec.SegmentSize = ((type == NetIoMux::EIT_SENDTO) && (ec == NetEndpoint::EE_SUCCESS)) ? odata->SegmentSize : 0;
+		mProfiler.emit(odata->Callback, &rec, 1);
+	}
+
 	void asyncRecv(NetEndpoint *ep, c8 *buf, u32 buflen, NetIoMuxCallback *cb)
 	{
 		NetIoMuxOverlapped *odata = obtainOverlapped();
@@ -468,6 +660,20 @@ public:
 		xpfAssert(("Failed on PostQueuedCompletionStatus()", ret != FALSE));
 	}
 
+	void asyncRecv(NetEndpoint *ep, IoBuffer *buf, NetIoMuxCallback *cb)
+	{
+		NetIoMuxOverlapped *odata = obtainOverlapped();
+		buf->ref();
+		odata->IoBuf = buf;
+		odata->Buffer.buf = buf->tail();
+		odata->Buffer.len = buf->tailroom();
+		odata->IoType = NetIoMux::EIT_RECV;
+		odata->Callback = cb;
+
+		BOOL ret = ::PostQueuedCompletionStatus(mhIocp, 0, (ULONG_PTR)ep, (LPOVERLAPPED)odata);
+		xpfAssert(("Failed on PostQueuedCompletionStatus()", ret != FALSE));
+	}
+
 	void asyncRecvFrom(NetEndpoint *ep, c8 *buf, u32 buflen, NetIoMuxCallback *cb)
 	{
 		NetIoMuxOverlapped *odata = obtainOverlapped();
@@ -488,20 +694,45 @@ public:
 		odata->Buffer.len = buflen;
 		odata->IoType = NetIoMux::EIT_SEND;
 		odata->Callback = cb;
+		chargeWrite(ep, odata);
+
+		BOOL ret = ::PostQueuedCompletionStatus(mhIocp, 0, (ULONG_PTR)ep, (LPOVERLAPPED)odata);
+		xpfAssert(("Failed on PostQueuedCompletionStatus()", ret != FALSE));
+	}
+
+	void asyncSend(NetEndpoint *ep, const IoBufferChain &chain, NetIoMuxCallback *cb)
+	{
+		NetIoMuxOverlapped *odata = obtainOverlapped();
+		const u32 segs = chain.segmentCount();
+		odata->Chain = new IoBufferChain(chain);
+		odata->Buffers = new WSABUF[(segs > 0) ? segs : 1];
+		for (u32 i = 0; i < segs; ++i)
+		{
+			const IoBufferChain::Segment &seg = odata->Chain->segment(i);
+			odata->Buffers[i].buf = seg.Buffer->data() + seg.Offset;
+			odata->Buffers[i].len = seg.Length;
+		}
+		odata->Buffer.buf = 0;
+		odata->Buffer.len = chain.length();
+		odata->IoType = NetIoMux::EIT_SEND;
+		odata->Callback = cb;
+		chargeWrite(ep, odata);
 
 		BOOL ret = ::PostQueuedCompletionStatus(mhIocp, 0, (ULONG_PTR)ep, (LPOVERLAPPED)odata);
 		xpfAssert(("Failed on PostQueuedCompletionStatus()", ret != FALSE));
 	}
 
-	void asyncSendTo(NetEndpoint *ep, const NetEndpoint::Peer *peer, const c8 *buf, u32 buflen, NetIoMuxCallback *cb)
+	void asyncSendTo(NetEndpoint *ep, const NetEndpoint::Peer *peer, const c8 *buf, u32 buflen, u32 segmentSize, NetIoMuxCallback *cb)
 	{
 		NetIoMuxOverlapped *odata = obtainOverlapped();
 		odata->Buffer.buf = (c8*)buf;
 		odata->Buffer.len = buflen;
+		odata->SegmentSize = (segmentSize < buflen) ? segmentSize : 0;
 		odata->IoType = NetIoMux::EIT_SENDTO;
 		odata->Callback = cb;
 		odata->PeerData.Length = peer->Length;
 		::memcpy(odata->PeerData.Data, peer->Data, peer->Length);
+		chargeWrite(ep, odata);
 
 		BOOL ret = ::PostQueuedCompletionStatus(mhIocp, 0, (ULONG_PTR)ep, (LPOVERLAPPED)odata);
 		xpfAssert(("Failed on PostQueuedCompletionStatus()", ret != FALSE));
@@ -535,7 +766,7 @@ public:
 		xpfAssert(("Failed on PostQueuedCompletionStatus()", ret != FALSE));
 	}
 
-	void asyncConnect(NetEndpoint *ep, const c8 *host, const c8 *serviceOrPort, NetIoMuxCallback *cb)
+	void asyncConnect(NetEndpoint *ep, const c8 *host, const c8 *serviceOrPort, const c8 *data, u32 len, NetIoMuxCallback *cb)
 	{
 		IocpAsyncContext *ctx = (IocpAsyncContext*)ep->getAsyncContext();
 		xpfAssert(("Unprovisioned netendpoint.", ctx != 0));
@@ -566,10 +797,140 @@ public:
 		::strncpy_s(&odata->Buffer.buf[960], 64, serviceOrPort, 64);
 		odata->Buffer.buf[1024 - 1] = '\0';
 
+		if ((data != 0) && (len > 0)) // initial data, sent by ConnectEx().
+		{
+			odata->Buffers = new WSABUF[1];
+			odata->Buffers[0].buf = (CHAR*)data;
+			odata->Buffers[0].len = len;
+		}
+
 		BOOL ret = ::PostQueuedCompletionStatus(mhIocp, 0, (ULONG_PTR)ep, (LPOVERLAPPED)odata);
 		xpfAssert(("Failed on PostQueuedCompletionStatus()", ret != FALSE));
 	}
 
+	void asyncBroadcast(NetEndpoint *const *eps, u32 count, const IoBufferChain &chain, NetIoMuxCallback *cb)
+	{
+		IocpBroadcast *b = new IocpBroadcast;
+		const u32 segs = chain.segmentCount();
+		b->Chain = chain;
+		b->Buffers = new WSABUF[(segs > 0) ? segs : 1];
+		for (u32 i = 0; i < segs; ++i)
+		{
+			const IoBufferChain::Segment &seg = b->Chain.segment(i);
+			b->Buffers[i].buf = seg.Buffer->data() + seg.Offset;
+			b->Buffers[i].len = seg.Length;
+		}
+		b->Count = count;
+		b->Pending = (count > 0) ? (s32)count : 1;
+
+		if (count == 0) // Complete it through the wakeup path.
+		{
+			NetIoMuxOverlapped *odata = obtainOverlapped();
+			odata->IoType = NetIoMux::EIT_WAKEUP;
+			odata->Callback = cb;
+			odata->Broadcast = b;
+			BOOL ret = ::PostQueuedCompletionStatus(mhIocp, 0, 0, (LPOVERLAPPED)odata);
+			xpfAssert(("Failed on PostQueuedCompletionStatus()", ret != FALSE));
+			return;
+		}
+
+		for (u32 i = 0; i < count; ++i)
+		{
+			NetEndpoint *ep = eps[i];
+			NetIoMuxOverlapped *odata = obtainOverlapped();
+			odata->Chain = &b->Chain;
+			odata->Buffers = b->Buffers;
+			odata->Broadcast = b;
+			odata->Buffer.buf = 0;
+			odata->Buffer.len = b->Chain.length();
+			odata->IoType = NetIoMux::EIT_SEND;
+			odata->Callback = cb;
+			if (ep->getAsyncContext() == 0) // unprovisioned.
+				odata->Flags |= IOMUX_OVERLAPPED_REJECTED;
+			else
+				chargeWrite(ep, odata);
+
+			BOOL ret = ::PostQueuedCompletionStatus(mhIocp, 0, (ULONG_PTR)ep, (LPOVERLAPPED)odata);
+			xpfAssert(("Failed on PostQueuedCompletionStatus()", ret != FALSE));
+		}
+	}
+
+	void asyncFile(NetIoMux::EIoType type, s32 fd, c8 *buf, u32 len, u64 offset, NetIoMux::EFileSync sync, NetIoMuxCallback *cb, vptr userData)
+	{
+		NetIoMuxOverlapped *odata = obtainOverlapped();
+		odata->IoType = type;
+		odata->Callback = cb;
+
+		NetIoMuxFileJob *job = new NetIoMuxFileJob;
+		job->Type = type;
+		job->Fd = fd;
+		job->Offset = offset;
+		job->Buffer = buf;
+		job->Length = len;
+		job->Sync = sync;
+		job->UserData = userData;
+		job->Result = 0;
+		job->Error = 0;
+		job->Op = (vptr)odata;
+		odata->File = job;
+
+		if (!mFilePool.submit(job))
+		{
+			odata->Flags |= IOMUX_OVERLAPPED_REJECTED;
+			fileJobDone((vptr)this, job);
+		}
+	}
+
+	u64 asyncTimer(u32 delayMs, NetIoMuxCallback *cb, vptr userData)
+	{
+		NetIoMuxOverlapped *odata = obtainOverlapped();
+		odata->IoType = NetIoMux::EIT_TIMER;
+		odata->Callback = cb;
+		odata->UserData = userData;
+
+		bool earliest = false;
+		u64 id = mTimers.schedule(delayMs, (vptr)odata, earliest);
+		if (earliest) // Interrupt a blocking worker to shorten its wait.
+		{
+			NetIoMuxOverlapped *kick = obtainOverlapped();
+			kick->IoType = NetIoMux::EIT_TIMER;
+			BOOL ret = ::PostQueuedCompletionStatus(mhIocp, 0, 0, (LPOVERLAPPED)kick);
+			xpfAssert(("Failed on PostQueuedCompletionStatus()", ret != FALSE));
+		}
+		return id;
+	}
+
+	bool cancelTimer(u64 id)
+	{
+		NetIoMuxOverlapped *odata = (NetIoMuxOverlapped*)mTimers.cancel(id);
+		if (odata == 0)
+			return false;
+		recycleOverlapped(odata);
+		return true;
+	}
+
+	void setFileIoThreads(u32 threads, u32 maxQueued)
+	{
+		mFilePool.configure(threads, maxQueued);
+	}
+
+	static void fileJobDone(vptr owner, NetIoMuxFileJob *job)
+	{
+		NetIoMuxImpl *impl = (NetIoMuxImpl*)owner;
+		BOOL ret = ::PostQueuedCompletionStatus(impl->mhIocp, 0, 0, (LPOVERLAPPED)job->Op);
+		xpfAssert(("Failed on PostQueuedCompletionStatus()", ret != FALSE));
+	}
+
+	void asyncWakeup(NetIoMuxCallback *cb)
+	{
+		NetIoMuxOverlapped *odata = obtainOverlapped();
+		odata->IoType = NetIoMux::EIT_WAKEUP;
+		odata->Callback = cb;
+
+		BOOL ret = ::PostQueuedCompletionStatus(mhIocp, 0, 0, (LPOVERLAPPED)odata);
+		xpfAssert(("Failed on PostQueuedCompletionStatus()", ret != FALSE));
+	}
+
 	bool join(NetEndpoint *ep)
 	{
 		bool joined = false;
@@ -593,6 +954,10 @@ public:
 		IocpAsyncContext *ctx = (IocpAsyncContext*)((ep) ? ep->getAsyncContext() : 0);
 		if (ctx)
 		{
+			// Closing the socket aborts the pending operations: They
+			// still complete through the port, which releases their
+			// buffers and discharges their queued bytes.
+			ep->setAsyncContext(0);
 			delete ctx;
 			ep->close();
 			return true;
@@ -600,6 +965,165 @@ public:
 		return false;
 	}
 
+	bool watchFd(s32 fd, u32 events, NetIoMuxCallback *cb, vptr userData)
+	{
+		// Not supported: IOCP reports completions rather than readiness.
+		return false;
+	}
+
+	bool modifyFd(s32 fd, u32 events)
+	{
+		return false;
+	}
+
+	bool unwatchFd(s32 fd)
+	{
+		return false;
+	}
+
+	bool setSendCoalescing(NetEndpoint *ep, bool val)
+	{
+		// Not supported: Each WSASend() is an individual overlapped
+		// operation which is already queued in kernel.
+		return false;
+	}
+
+	bool setReceiveOffload(NetEndpoint *ep, bool val)
+	{
+		// Not supported: Coalesced receives report their segment size
+		// only through WSARecvMsg(), which is not used here.
+		return false;
+	}
+
+	bool setWriteWatermarks(NetEndpoint *ep, u32 lowBytes, u32 highBytes)
+	{
+		IocpAsyncContext *ctx = (IocpAsyncContext*)ep->getAsyncContext();
+		xpfAssert(("Unprovisioned netendpoint.", ctx != 0));
+		xpfAssert(("Expecting lowBytes < highBytes.", (highBytes == 0) || (lowBytes < highBytes)));
+		if ((ctx == 0) || ((highBytes != 0) && (lowBytes >= highBytes)))
+			return false;
+
+		ScopedSpinLock ml(ctx->Lock);
+		ctx->LowWm = lowBytes;
+		ctx->HighWm = highBytes;
+		if (highBytes == 0)
+			ctx->Blocked = false;
+		return true;
+	}
+
+	bool isWriteBlocked(NetEndpoint *ep) const
+	{
+		IocpAsyncContext *ctx = (IocpAsyncContext*)ep->getAsyncContext();
+		return (ctx) ? ctx->Blocked : false;
+	}
+
+	u32 getQueuedWriteBytes(NetEndpoint *ep) const
+	{
+		IocpAsyncContext *ctx = (IocpAsyncContext*)ep->getAsyncContext();
+		return (ctx) ? ctx->WrBytes : 0;
+	}
+
+	void setTurnBudget(u32 ops, u32 bytes)
+	{
+		// Not applicable: Operations are performed by the kernel and
+		// workers only dispatch their completions.
+	}
+
+	bool setPriority(NetEndpoint *ep, NetIoMux::EPriority prio)
+	{
+		// Not supported: See setTurnBudget().
+		return false;
+	}
+
+	NetIoMuxProfiler& profiler()
+	{
+		return mProfiler;
+	}
+
+	void setMaxQueuedBytes(u64 bytes)
+	{
+		mMaxQueuedBytes = bytes;
+	}
+
+	u64 getQueuedBytes() const
+	{
+		return mQueuedBytes;
+	}
+
+	// Charge a send operation to both the mux-wide cap and the write
+	// watermarks of its endpoint. Operations exceeding the mux-wide cap
+	// are flagged and will be rejected by runOnce().
+	void chargeWrite(NetEndpoint *ep, NetIoMuxOverlapped *odata)
+	{
+		IocpAsyncContext *ctx = (IocpAsyncContext*)ep->getAsyncContext();
+		xpfAssert(("Unprovisioned netendpoint.", ctx != 0));
+		if (0 == ctx)
+			return;
+
+		const u32 bytes = odata->Buffer.len;
+		const u64 queued = (u64)xpfAtomicAdd64((volatile s64*)&mQueuedBytes, (s64)bytes) + bytes;
+		if ((mMaxQueuedBytes != 0) && (queued > mMaxQueuedBytes))
+		{
+			xpfAtomicAdd64((volatile s64*)&mQueuedBytes, -(s64)bytes);
+			odata->Flags |= IOMUX_OVERLAPPED_REJECTED;
+			return;
+		}
+		odata->Quota = bytes;
+
+		{
+			ScopedSpinLock ml(ctx->Lock);
+			ctx->WrBytes += bytes;
+			if ((ctx->HighWm == 0) || ctx->Blocked || (ctx->WrBytes < ctx->HighWm))
+				return;
+			ctx->Blocked = true;
+			ctx->Notifying++;
+		}
+
+		// Notify without holding the lock. A low watermark crossed in
+		// the meantime is held back and notified after this one.
+		odata->Callback->onWriteWatermark(ep, true);
+		bool low = false;
+		{
+			ScopedSpinLock ml(ctx->Lock);
+			if ((--ctx->Notifying == 0) && ctx->LowHeld)
+			{
+				ctx->LowHeld = false;
+				low = true;
+			}
+		}
+		if (low)
+			odata->Callback->onWriteWatermark(ep, false);
+	}
+
+	// Release the bytes charged by a finished send operation.
+	void dischargeWrite(NetEndpoint *ep, NetIoMuxOverlapped *odata)
+	{
+		if (odata->Quota == 0)
+			return;
+
+		IocpAsyncContext *ctx = (IocpAsyncContext*)ep->getAsyncContext();
+		xpfAtomicAdd64((volatile s64*)&mQueuedBytes, -(s64)odata->Quota);
+		if (0 == ctx)
+			return;
+
+		bool drained = false;
+		{
+			ScopedSpinLock ml(ctx->Lock);
+			ctx->WrBytes -= odata->Quota;
+			if (ctx->Blocked && (ctx->WrBytes <= ctx->LowWm))
+			{
+				ctx->Blocked = false;
+				if (ctx->Notifying > 0)
+					ctx->LowHeld = true;
+				else
+					drained = true;
+			}
+		}
+		odata->Quota = 0;
+		if (drained)
+			odata->Callback->onWriteWatermark(ep, false);
+	}
+
 	NetIoMuxOverlapped* obtainOverlapped()
 	{
 		// TODO: Pool management
@@ -610,6 +1134,13 @@ public:
 
 	void recycleOverlapped(NetIoMuxOverlapped *data)
 	{
+		delete data->Chain;
+		delete[] data->Buffers;
+		delete data->Broadcast;
+		delete data->File;
+		delete data->Segmented;
+		if (data->IoBuf)
+			data->IoBuf->unref();
 		delete data;
 	}
 
@@ -628,6 +1159,11 @@ public:
 private:
 	HANDLE			mhIocp;
 	bool            bEnable;
+	volatile u64    mQueuedBytes;    // bytes of pending send operations of all endpoints.
+	u64             mMaxQueuedBytes; // mux-wide cap of mQueuedBytes (0: unlimited).
+	NetIoMuxFilePool mFilePool;      // threads doing file I/O.
+	NetIoMuxTimerQueue mTimers;      // timers of asyncTimer().
+	NetIoMuxProfiler mProfiler;      // callback profiler of enableProfiler().
 }; // end of class NetIoMuxImpl (IOCP)
 
 } // end of namespace xpf
\ No newline at end of file
@@ -30,28 +30,51 @@
 #endif
 
 #include "netiomux_syncfifo.hpp"
+#include "netiomux_opring.hpp"
+#include "netiomux_spinlock.hpp"
+#include "netiomux_fdwatch.hpp"
+#include "netiomux_filepool.hpp"
+#include "netiomux_timers.hpp"
+#include "netiomux_profiler.hpp"
+#include <xpf/atomic.h>
+#include <xpf/iobuffer.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/event.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <new>
 
 #define MAX_EVENTS_AT_ONCE (128)
 #define MAX_READY_LIST_LEN (10240)
+#define MAX_COALESCED_SENDS (64)
+#define MAX_COMPLETIONS_AT_ONCE (64)
+#define DEFAULT_TURN_OPS (16)
+#define DEFAULT_TURN_BYTES (256 * 1024)
+#define ASYNC_CONTEXT_ALIGN (64)
+#define KQUEUE_WAKEUP_IDENT (0)
 
 #define ASYNC_OP_READ  (0)
 #define ASYNC_OP_WRITE (1)
 
+#define CONNECT_STAGE_INIT    (0) // connect() not yet called.
+#define CONNECT_STAGE_PENDING (1) // waiting for the handshake.
+#define CONNECT_STAGE_SENDING (2) // connected, sending the rest of initial data.
+
 namespace xpf
 {
 	// host info for connect
 	struct ConnectHostInfo
 	{
-		ConnectHostInfo(const c8 *h, const c8 *s)
+		ConnectHostInfo(const c8 *h, const c8 *s, const c8 *d, u32 dl)
+			: data(d), datalen(dl)
 		{
 			host = ::strdup(h);
 			service = ::strdup(s);
@@ -65,6 +88,17 @@ namespace xpf
 
 		c8 *host;
 		c8 *service;
+		const c8 *data; // initial data (TCP Fast Open), not owned.
+		u32 datalen;
+	};
+
+	// shared record of an asyncBroadcast() call
+	struct Broadcast
+	{
+		IoBufferChain chain;   // the payload shared by all sends.
+		u32 count;             // number of target endpoints.
+		volatile s32 pending;  // sends not yet completed.
+		volatile s32 failed;   // sends completed with errors.
 	};
 
 	// data record per operation
@@ -72,27 +106,62 @@ namespace xpf
 	{
 		Overlapped(NetEndpoint *ep, NetIoMux::EIoType iocode)
 			: iotype(iocode), sep(ep), tep(0), buffer(0), length(0)
-			, peer(0), cb(0), errorcode(0), provisioned(false) {}
+			, progress(0), quota(0), peer(0), cb(0), chain(0), iobuf(0)
+			, bcast(0), file(0), errorcode(0), provisioned(false), wmlow(false)
+			, connstage(CONNECT_STAGE_INIT), udata(0), segsize(0), holds(0) {}
 
 		NetIoMux::EIoType iotype;
 		NetEndpoint *sep;
 		NetEndpoint *tep;
 		c8	*buffer;
 		u32	length;
+		u32 progress; // bytes already sent by coalesced sends.
+		u32 quota;    // bytes charged to write watermarks.
 		NetEndpoint::Peer *peer;
 		NetIoMuxCallback *cb;
+		IoBufferChain *chain; // chain to send (owned copy).
+		IoBuffer *iobuf;      // buffer to receive into (referenced).
+		Broadcast *bcast;     // owned by the op completing the broadcast.
+		NetIoMuxFileJob *file; // file operation (owned).
 		int errorcode;
 		bool provisioned;
+		bool wmlow;   // write queue drained to low watermark by this op.
+		u8 connstage; // progress of a connect operation (CONNECT_STAGE_*).
+		vptr udata;   // user data of a timer.
+		u32 segsize;  // UDP segment size of a send.
+		volatile s32 holds; // 2 while the high watermark crossed by this send is notified.
 	};
 
-	// data record per socket
-	struct AsyncContext
+	// data record per socket. Laid out to fit 2 cache lines: the lock
+	// and both operation rings (the hot part) come first. The rings hold
+	// a few operations inline and only spill to heap when deep.
+	struct __attribute__((aligned(ASYNC_CONTEXT_ALIGN))) AsyncContext
 	{
-		std::deque<Overlapped*>  rdqueue; // queued read operations
-		std::deque<Overlapped*>  wrqueue; // queued write operations
-		bool                     ready;
-		ThreadLock               lock;
-		NetEndpoint             *ep;
+		NetIoMuxSpinLock                  lock;
+		NetIoMuxOpRing<Overlapped, 2>     rdqueue;  // queued read operations
+		NetIoMuxOpRing<Overlapped, 4>     wrqueue;  // queued write operations
+		bool                              ready;
+		bool                              coalesce : 1; // send coalescing enabled.
+		bool                              blocked : 1;  // wrbytes has reached highwm.
+		bool                              lowheld : 1;  // low watermark crossed while notifying the high one.
+		u8                                prio;         // NetIoMux::EPriority
+		u8                                notifying;    // high watermark notifications in progress.
+		u32                               wrbytes;  // bytes of queued write operations.
+		u32                               lowwm;    // low watermark of wrbytes.
+		u32                               highwm;   // high watermark of wrbytes (0: disabled).
+
+		static void* operator new(size_t size)
+		{
+			void *p = 0;
+			if (0 != posix_memalign(&p, ASYNC_CONTEXT_ALIGN, size))
+				throw std::bad_alloc();
+			return p;
+		}
+
+		static void operator delete(void *p)
+		{
+			::free(p);
+		}
 	};
 
 	class NetIoMuxImpl
@@ -100,18 +169,49 @@ namespace xpf
 	public:
 		NetIoMuxImpl()
 			: mEnable(true)
+			, mQueuedBytes(0)
+			, mMaxQueuedBytes(0)
+			, mFilePool(fileJobDone, (vptr)this)
 		{
+			mTurnOps = DEFAULT_TURN_OPS;
+			mTurnBytes = DEFAULT_TURN_BYTES;
 			xpfSAssert(sizeof(socklen_t) == sizeof(s32));
+			xpfSAssert(sizeof(AsyncContext) <= 2 * ASYNC_CONTEXT_ALIGN);
 
 			mKqueue = kqueue();
 			xpfAssert(mKqueue != -1);
 			if (mKqueue == -1)
 				mEnable = false;
+
+			// A user event to interrupt kevent() for asyncWakeup().
+			if (mKqueue != -1)
+			{
+				struct kevent change;
+				EV_SET(&change, KQUEUE_WAKEUP_IDENT, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, 0);
+				int ec = kevent(mKqueue, &change, 1, 0, 0, 0);
+				xpfAssert(ec == 0);
+			}
 		}
 
 		~NetIoMuxImpl()
 		{
 			enable(false);
+			mFilePool.stop();
+
+			while (Overlapped *o = (Overlapped*)mTimers.pop())
+				releaseOp(o);
+
+			// Completions never dispatched (e.g. the operations failed
+			// by a depart() after the last runOnce()).
+			u32 pendingCnt = 0;
+			while (Overlapped *o = (Overlapped*)mCompletionList.pop_front(pendingCnt))
+			{
+				NetIoMuxCompletion rec;
+				rec.Error = NetEndpoint::EE_INVALID_OP;
+				if (o->bcast)
+					completeBroadcastPart(o, rec);
+				releaseOp(o);
+			}
 
 			if (mKqueue != -1)
 				close(mKqueue);
@@ -137,77 +237,50 @@ namespace xpf
 			bool consumeSome = false;
 			u32 pendingCnt = 0;
 
-			// Process the completion queue. Emit the completion event.
-			Overlapped *co = (Overlapped*) mCompletionList.pop_front(pendingCnt);
-			if (co)
+			// Process the completion queue. Pop up to MAX_COMPLETIONS_AT_ONCE
+			// completed operations and emit them in batches.
+			Overlapped *ops[MAX_COMPLETIONS_AT_ONCE];
+			NetIoMuxCompletion records[MAX_COMPLETIONS_AT_ONCE];
+			u32 opCnt = 0;
+
+			// Expired timers join the completion queue first.
+			vptr timers[MAX_COMPLETIONS_AT_ONCE];
+			u32 expired = mTimers.expire(timers, MAX_COMPLETIONS_AT_ONCE);
+			for (u32 i = 0; i < expired; ++i)
+				mCompletionList.push_back((void*)timers[i]);
+			while (opCnt < MAX_COMPLETIONS_AT_ONCE)
 			{
+				Overlapped *co = (Overlapped*) mCompletionList.pop_front(pendingCnt);
+				if (!co)
+					break;
 				consumeSome = true;
-				switch (co->iotype)
+				// Left to appendWriteOp() while it notifies a watermark.
+				if ((co->holds != 0) && (xpfAtomicAdd(&co->holds, -1) == 2))
+					continue;
+				if (!fillCompletion(co, records[opCnt]))
 				{
-				case NetIoMux::EIT_RECV:
-					if (!co->provisioned)
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_INVALID_OP, co->sep, 0, co->buffer, 0);
-					else if (co->errorcode == 0)
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_SUCCESS, co->sep, 0, co->buffer, co->length);
-					else
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_RECV, co->sep, 0, co->buffer, 0);
-					break;
-				case NetIoMux::EIT_RECVFROM:
-					if (!co->provisioned)
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_INVALID_OP, co->sep, 0, co->buffer, 0);
-					else if (co->errorcode == 0)
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_SUCCESS, co->sep, (vptr)co->peer, co->buffer, co->length);
-					else
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_RECV, co->sep, 0, co->buffer, 0);
-					delete co->peer;
-					break;
-				case NetIoMux::EIT_SEND:
-					if (!co->provisioned)
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_INVALID_OP, co->sep, 0, co->buffer, 0);
-					else if (co->errorcode == 0)
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_SUCCESS, co->sep, 0, co->buffer, co->length);
-					else
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_SEND, co->sep, 0, co->buffer, 0);
-					break;
-				case NetIoMux::EIT_SENDTO:
-					if (!co->provisioned)
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_INVALID_OP, co->sep, (vptr)co->peer, co->buffer, 0);
-					else if (co->errorcode == 0)
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_SUCCESS, co->sep, (vptr)co->peer, co->buffer, co->length);
-					else
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_SEND, co->sep, (vptr)co->peer, co->buffer, 0);
-					delete co->peer;
-					break;
-				case NetIoMux::EIT_ACCEPT:
-					if (!co->provisioned)
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_INVALID_OP, co->sep, 0, 0, 0);
-					else if (co->errorcode == 0)
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_SUCCESS, co->sep, (vptr)co->tep, 0, 0);
-					else
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_ACCEPT, co->sep, 0, 0, 0);
-					delete co->peer;
-					break;
-				case NetIoMux::EIT_CONNECT:
-					if (!co->provisioned)
-						co->cb->onIoCompleted(co->iotype, (co->peer == 0) ? NetEndpoint::EE_INVALID_OP : NetEndpoint::EE_RESOLVE, co->sep, 0, 0, 0);
-					else if (co->errorcode == 0)
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_SUCCESS, co->sep, (vptr)co->peer, 0, 0);
-					else
-						co->cb->onIoCompleted(co->iotype, NetEndpoint::EE_CONNECT, co->sep, 0, 0, 0);
-					delete co->peer;
-					break;
-				case NetIoMux::EIT_INVALID:
-				default:
-					xpfAssert(("Unrecognized iotype. Maybe a corrupted Overlapped.", false));
-					break;
+					releaseOp(co);
+				}
+				else if (co->bcast && !completeBroadcastPart(co, records[opCnt]))
+				{
+					// Not the last send of a broadcast: Nothing to emit.
+					if (co->wmlow)
+						co->cb->onWriteWatermark(co->sep, false);
+					releaseOp(co);
+				}
+				else
+				{
+					ops[opCnt++] = co;
 				}
-				delete co;
 			}
+			if (opCnt > 0)
+				dispatchCompletions(ops, records, opCnt);
 
 
 			// Consume ready list:
 			// Pop the front socket out of list, and
-			// process all r/w operations until EWOULDBLOCK.
+			// process r/w operations until EWOULDBLOCK or
+			// out of its turn budget.
 			// Re-arm the socket if there are more pending
 			// operations.
 			NetEndpoint *ep = (NetEndpoint*) mReadyList.pop_front(pendingCnt);
@@ -217,33 +290,75 @@ namespace xpf
 				AsyncContext *ctx = (AsyncContext*) ep->getAsyncContext();
 				if (!ctx) break;
 
-				ScopedThreadLock ml(ctx->lock);
+				ScopedSpinLock ml(ctx->lock);
 				xpfAssert(("Expecting ready flag on for all ", ctx->ready));
 				ctx->ready = false;
+
+				// Operations are charged by their requested bytes.
+				NetIoMuxTurnBudget budget(mTurnOps, mTurnBytes, ctx->prio);
+				bool exhausted = false;
 				while (!ctx->rdqueue.empty()) // process rqueue.
 				{
 					Overlapped *o = ctx->rdqueue.front();
 					if (!o) break;
 					consumeSome = true;
-					
+					if (budget.exhausted())
+					{
+						exhausted = true;
+						break;
+					}
+
+					const u32 charge = o->length;
 					if (performIoLocked(ep, o))
+					{
 						ctx->rdqueue.pop_front();
+						budget.charge(charge);
+					}
 					else
 						break;
 				} // end of while (true)
 
+				// Reads never starve the writes: At least one write is
+				// performed per turn even if reads used up the budget.
+				bool wrote = false;
 				while (!ctx->wrqueue.empty()) // process wrqueue
 				{
 					Overlapped *o = ctx->wrqueue.front();
 					if (!o) break;
 					consumeSome = true;
+					if (wrote && budget.exhausted())
+					{
+						exhausted = true;
+						break;
+					}
 
-					if (performIoLocked(ep, o))
+					const u32 charge = o->length - o->progress;
+					if (ctx->coalesce && (o->iotype == NetIoMux::EIT_SEND) && (o->chain == 0))
+					{
+						// Charges the budget with what it actually sent.
+						if (!performCoalescedSendLocked(ep, budget))
+							break;
+					}
+					else if (performIoLocked(ep, o))
+					{
 						ctx->wrqueue.pop_front();
+						budget.charge(charge);
+					}
 					else
 						break;
+					wrote = true;
 				} // end of while (true)
 
+				// Out of budget: Yield to the other ready endpoints by going
+				// to the tail of the ready list rather than waiting for
+				// readiness, as the rest may progress right away.
+				if (exhausted)
+				{
+					ctx->ready = true;
+					mReadyList.push_back((void*)ep, ctx->prio);
+					break;
+				}
+
 				struct kevent changes[2] = {0};
 				int changeCnt = 0;
 
@@ -276,12 +391,13 @@ namespace xpf
 			// Will skip if the length of list is too large.
 			if (pendingCnt < MAX_READY_LIST_LEN)
 			{
+				const u32 waitMs = (consumeSome) ? 0 : mTimers.waitTime(timeoutMs);
 				timespec ts;
-				ts.tv_sec = 0;
-				ts.tv_nsec = (consumeSome) ? 0 : timeoutMs * 1000000;
+				ts.tv_sec = waitMs / 1000;
+				ts.tv_nsec = (waitMs % 1000) * 1000000;
 
 				struct kevent evts[MAX_EVENTS_AT_ONCE];
-				int nevts = kevent(mKqueue, 0, 0, evts, MAX_EVENTS_AT_ONCE, &ts);
+				int nevts = kevent(mKqueue, 0, 0, evts, MAX_EVENTS_AT_ONCE, (waitMs == 0xffffffff) ? 0 : &ts);
 				xpfAssert(("Failed on calling kevent", nevts != -1));
 				if (0 == nevts)
 				{
@@ -293,10 +409,19 @@ namespace xpf
 					{
 						short   filter = evts[i].filter;
 						u_short flags = evts[i].flags;
+						if (filter == EVFILT_USER) // Wakeup requests are already in the completion list.
+							continue;
+
+						if (NetIoMuxFdWatchTable::isTag((u64)(uintptr_t)evts[i].udata))
+						{
+							dispatchFd(evts[i]);
+							continue;
+						}
+
 						NetEndpoint *ep = (NetEndpoint*) evts[i].udata;
 						AsyncContext *ctx = (AsyncContext*) ep->getAsyncContext();
 						
-						ScopedThreadLock ml(ctx->lock);
+						ScopedSpinLock ml(ctx->lock);
 						xpfAssert(("Expecting non-ready ep in kqueue.", ctx->ready == false));
 						ctx->ready = false;
 						switch (filter)
@@ -304,10 +429,9 @@ namespace xpf
 						case EVFILT_READ:
 							if (flags & EV_EOF)
 							{
-								for (std::deque<Overlapped*>::iterator it = ctx->rdqueue.begin();
-										it != ctx->rdqueue.end(); ++it)
+								for (u32 i = 0; i < ctx->rdqueue.size(); ++i)
 								{
-									Overlapped *o = (*it);
+									Overlapped *o = ctx->rdqueue.at(i);
 									o->errorcode = ECONNABORTED;
 									mCompletionList.push_back((void*)o);
 								}
@@ -316,17 +440,17 @@ namespace xpf
 							else
 							{
 								ctx->ready = true;
-								mReadyList.push_back((void*)ep);
+								mReadyList.push_back((void*)ep, ctx->prio);
 							}
 							break;
 						case EVFILT_WRITE:
 							if (flags & EV_EOF)
 							{
-								for (std::deque<Overlapped*>::iterator it = ctx->wrqueue.begin();
-										it != ctx->wrqueue.end(); ++it)
+								for (u32 i = 0; i < ctx->wrqueue.size(); ++i)
 								{
-									Overlapped *o = (*it);
+									Overlapped *o = ctx->wrqueue.at(i);
 									o->errorcode = ECONNABORTED;
+									dischargeWriteLocked(ctx, o);
 									mCompletionList.push_back((void*)o);
 								}
 								ctx->wrqueue.clear();
@@ -334,7 +458,7 @@ namespace xpf
 							else
 							{
 								ctx->ready = true;
-								mReadyList.push_back((void*)ep);
+								mReadyList.push_back((void*)ep, ctx->prio);
 							}
 							break;
 						default:
@@ -352,6 +476,160 @@ namespace xpf
 			return NetIoMux::ERS_NORMAL;
 		}
 
+		// Translate a completed operation to the record passed to callbacks.
+		static bool fillCompletion(const Overlapped *co, NetIoMuxCompletion &rec)
+		{
+			rec.Type = co->iotype;
+			rec.Error = NetEndpoint::EE_SUCCESS;
+			rec.Endpoint = co->sep;
+			rec.TepOrPeer = 0;
+			rec.Buffer = co->buffer;
+			rec.Length = 0;
+			rec.SegmentSize = 0;
+
+			switch (co->iotype)
+			{
+			case NetIoMux::EIT_RECV:
+			case NetIoMux::EIT_RECVFROM:
+				if (co->iobuf)
+					rec.TepOrPeer = (vptr)co->iobuf;
+				if (!co->provisioned)
+					rec.Error = NetEndpoint::EE_INVALID_OP;
+				else if (co->errorcode != 0)
+					rec.Error = NetEndpoint::EE_RECV;
+				else
+				{
+					rec.Length = co->length;
+					if (co->iotype == NetIoMux::EIT_RECVFROM)
+						rec.TepOrPeer = (vptr)co->peer;
+				}
+				break;
+			case NetIoMux::EIT_SEND:
+			case NetIoMux::EIT_SENDTO:
+				if (co->iotype == NetIoMux::EIT_SENDTO)
+					rec.TepOrPeer = (vptr)co->peer;
+				if (!co->provisioned)
+					rec.Error = NetEndpoint::EE_INVALID_OP;
+				else if (co->errorcode != 0)
+					rec.Error = (co->errorcode == ENOBUFS) ? NetEndpoint::EE_QUEUE_FULL : NetEndpoint::EE_SEND;
+				else
+				{
+					rec.Length = co->length;
+					rec.SegmentSize = co->segsize;
+				}
+				break;
+			case NetIoMux::EIT_ACCEPT:
+				rec.Buffer = 0;
+				if (!co->provisioned)
+					rec.Error = NetEndpoint::EE_INVALID_OP;
+				else if (co->errorcode != 0)
+					rec.Error = NetEndpoint::EE_ACCEPT;
+				else
+					rec.TepOrPeer = (vptr)co->tep;
+				break;
+			case NetIoMux::EIT_CONNECT:
+				if (!co->provisioned)
+				{
+					rec.Buffer = 0;
+					rec.Error = (co->peer == 0) ? NetEndpoint::EE_INVALID_OP : NetEndpoint::EE_RESOLVE;
+				}
+				else if (co->errorcode != 0)
+				{
+					// EE_SEND if connected but the initial data failed.
+					rec.Error = (co->connstage == CONNECT_STAGE_SENDING) ? NetEndpoint::EE_SEND : NetEndpoint::EE_CONNECT;
+				}
+				else
+				{
+					rec.TepOrPeer = (vptr)co->peer;
+					rec.Length = co->length;
+				}
+				break;
+			case NetIoMux::EIT_WAKEUP:
+				rec.Buffer = 0;
+				break;
+			case NetIoMux::EIT_TIMER:
+				rec.TepOrPeer = co->udata;
+				break;
+			case NetIoMux::EIT_FILEREAD:
+			case NetIoMux::EIT_FILEWRITE:
+				rec.TepOrPeer = co->file->UserData;
+				if (co->errorcode == ENOBUFS)
+					rec.Error = NetEndpoint::EE_QUEUE_FULL;
+				else if (co->file->Error != 0)
+					rec.Error = NetEndpoint::EE_FILEIO;
+				else
+					rec.Length = co->file->Result;
+				break;
+			case NetIoMux::EIT_INVALID:
+			default:
+				xpfAssert(("Unrecognized iotype. Maybe a corrupted Overlapped.", false));
+				return false;
+			}
+			return true;
+		}
+
+		// Emit each run of consecutive records sharing the same callback
+		// as one batch, then release the operations.
+		void dispatchCompletions(Overlapped **ops, NetIoMuxCompletion *records, u32 count)
+		{
+			u32 start = 0;
+			while (start < count)
+			{
+				NetIoMuxCallback *cb = ops[start]->cb;
+				u32 end = start + 1;
+				while ((end < count) && (ops[end]->cb == cb))
+					++end;
+
+				// Low watermark notifications go first since the
+				// callback may be released by its completion.
+				for (u32 i = start; i < end; ++i)
+				{
+					if (ops[i]->wmlow)
+						cb->onWriteWatermark(ops[i]->sep, false);
+				}
+				mProfiler.emit(cb, &records[start], end - start);
+				start = end;
+			}
+
+			for (u32 i = 0; i < count; ++i)
+				releaseOp(ops[i]);
+		}
+
+		static void releaseOp(Overlapped *o)
+		{
+			delete o->peer;
+			delete o->chain;
+			delete o->bcast;
+			delete o->file;
+			if (o->iobuf)
+				o->iobuf->unref();
+			delete o;
+		}
+
+		// Account a completed send of a broadcast. Returns true and turns
+		// 'rec' into the aggregate EIT_BROADCAST record if it is the last
+		// one. Ops detach from the shared record here since it is released
+		// along with the last op, which may happen in another thread.
+		static bool completeBroadcastPart(Overlapped *co, NetIoMuxCompletion &rec)
+		{
+			Broadcast *b = co->bcast;
+			co->bcast = 0;
+			co->chain = 0;
+			if (rec.Error != NetEndpoint::EE_SUCCESS)
+				xpfAtomicAdd(&b->failed, 1);
+			if (xpfAtomicAdd(&b->pending, -1) != 1)
+				return false;
+
+			co->bcast = b;
+			rec.Type = NetIoMux::EIT_BROADCAST;
+			rec.Error = (b->failed == 0) ? NetEndpoint::EE_SUCCESS : NetEndpoint::EE_SEND;
+			rec.Endpoint = 0;
+			rec.TepOrPeer = 0;
+			rec.Buffer = 0;
+			rec.Length = b->count - (u32)b->failed;
+			return true;
+		}
+
 		void asyncRecv(NetEndpoint *ep, c8 *buf, u32 buflen, NetIoMuxCallback *cb)
 		{
 			AsyncContext *ctx = (AsyncContext*)ep->getAsyncContext();
@@ -363,7 +641,7 @@ namespace xpf
 				o->length = buflen;
 				o->cb = cb;
 
-				ScopedThreadLock ml(ctx->lock);
+				ScopedSpinLock ml(ctx->lock);
 				appendAsyncOpLocked(ep, o, ASYNC_OP_READ);
 			}
 		}
@@ -380,7 +658,7 @@ namespace xpf
 				o->cb = cb;
 				o->peer = new NetEndpoint::Peer;
 
-				ScopedThreadLock ml(ctx->lock);
+				ScopedSpinLock ml(ctx->lock);
 				appendAsyncOpLocked(ep, o, ASYNC_OP_READ);
 			}
 		}
@@ -396,12 +674,11 @@ namespace xpf
 				o->length = buflen;
 				o->cb = cb;
 
-				ScopedThreadLock ml(ctx->lock);
-				appendAsyncOpLocked(ep, o, ASYNC_OP_WRITE);
+				appendWriteOp(ep, o);
 			}
 		}
 
-		void asyncSendTo(NetEndpoint *ep, const NetEndpoint::Peer *peer, const c8 *buf, u32 buflen, NetIoMuxCallback *cb)
+		void asyncSendTo(NetEndpoint *ep, const NetEndpoint::Peer *peer, const c8 *buf, u32 buflen, u32 segmentSize, NetIoMuxCallback *cb)
 		{
 			AsyncContext *ctx = (AsyncContext*)ep->getAsyncContext();
 			xpfAssert(ctx != 0);
@@ -410,11 +687,44 @@ namespace xpf
 				Overlapped *o = new Overlapped(ep, NetIoMux::EIT_SENDTO);
 				o->buffer = (c8*)buf;
 				o->length = buflen;
+				o->segsize = (segmentSize < buflen) ? segmentSize : 0;
 				o->cb = cb;
 				o->peer = new NetEndpoint::Peer(*peer); // clone
 
-				ScopedThreadLock ml(ctx->lock);
-				appendAsyncOpLocked(ep, o, ASYNC_OP_WRITE);
+				appendWriteOp(ep, o);
+			}
+		}
+
+		void asyncRecv(NetEndpoint *ep, IoBuffer *buf, NetIoMuxCallback *cb)
+		{
+			AsyncContext *ctx = (AsyncContext*)ep->getAsyncContext();
+			xpfAssert(ctx != 0);
+			if (ctx)
+			{
+				Overlapped *o = new Overlapped(ep, NetIoMux::EIT_RECV);
+				buf->ref();
+				o->iobuf = buf;
+				o->buffer = buf->tail();
+				o->length = buf->tailroom();
+				o->cb = cb;
+
+				ScopedSpinLock ml(ctx->lock);
+				appendAsyncOpLocked(ep, o, ASYNC_OP_READ);
+			}
+		}
+
+		void asyncSend(NetEndpoint *ep, const IoBufferChain &chain, NetIoMuxCallback *cb)
+		{
+			AsyncContext *ctx = (AsyncContext*)ep->getAsyncContext();
+			xpfAssert(ctx != 0);
+			if (ctx)
+			{
+				Overlapped *o = new Overlapped(ep, NetIoMux::EIT_SEND);
+				o->chain = new IoBufferChain(chain);
+				o->length = chain.length();
+				o->cb = cb;
+
+				appendWriteOp(ep, o);
 			}
 		}
 
@@ -429,12 +739,12 @@ namespace xpf
 				o->peer = new NetEndpoint::Peer;
 				o->peer->Length = XPF_NETENDPOINT_MAXADDRLEN;
 
-				ScopedThreadLock ml(ctx->lock);
+				ScopedSpinLock ml(ctx->lock);
 				appendAsyncOpLocked(ep, o, ASYNC_OP_READ);
 			}
 		}
 
-		void asyncConnect(NetEndpoint *ep, const c8 *host, const c8 *serviceOrPort, NetIoMuxCallback *cb)
+		void asyncConnect(NetEndpoint *ep, const c8 *host, const c8 *serviceOrPort, const c8 *data, u32 len, NetIoMuxCallback *cb)
 		{
 			AsyncContext *ctx = (AsyncContext*)ep->getAsyncContext();
 			xpfAssert(ctx != 0);
@@ -442,13 +752,132 @@ namespace xpf
 			{
 				Overlapped *o = new Overlapped(ep, NetIoMux::EIT_CONNECT);
 				o->cb = cb;
-				o->buffer = (c8*) new ConnectHostInfo(host, serviceOrPort);
+				o->buffer = (c8*) new ConnectHostInfo(host, serviceOrPort, data, (data != 0) ? len : 0);
 
-				ScopedThreadLock ml(ctx->lock);
+				ScopedSpinLock ml(ctx->lock);
 				appendAsyncOpLocked(ep, o, ASYNC_OP_WRITE);
 			}
 		}
 
+		void asyncBroadcast(NetEndpoint *const *eps, u32 count, const IoBufferChain &chain, NetIoMuxCallback *cb)
+		{
+			Broadcast *b = new Broadcast;
+			b->chain = chain;
+			b->count = count;
+			b->pending = (count > 0) ? (s32)count : 1;
+			b->failed = 0;
+
+			if (count == 0)
+			{
+				Overlapped *o = new Overlapped(0, NetIoMux::EIT_SEND);
+				o->bcast = b;
+				o->cb = cb;
+				o->provisioned = true;
+				mCompletionList.push_back((void*)o);
+				return;
+			}
+
+			for (u32 i = 0; i < count; ++i)
+			{
+				NetEndpoint *ep = eps[i];
+				Overlapped *o = new Overlapped(ep, NetIoMux::EIT_SEND);
+				o->chain = &b->chain;
+				o->bcast = b;
+				o->length = b->chain.length();
+				o->cb = cb;
+
+				if (ep->getAsyncContext() == 0)
+					mCompletionList.push_back((void*)o); // unprovisioned: EE_INVALID_OP.
+				else
+					appendWriteOp(ep, o);
+			}
+		}
+
+		void asyncWakeup(NetIoMuxCallback *cb)
+		{
+			Overlapped *o = new Overlapped(0, NetIoMux::EIT_WAKEUP);
+			o->cb = cb;
+			o->provisioned = true;
+			postCompletion(o);
+		}
+
+		// Queue a completed op and interrupt a blocking runOnce().
+		// Safe to be called from any thread.
+		void postCompletion(Overlapped *o)
+		{
+			mCompletionList.push_back((void*)o);
+			interrupt();
+		}
+
+		// Interrupt a blocking runOnce().
+		void interrupt()
+		{
+			struct kevent change;
+			EV_SET(&change, KQUEUE_WAKEUP_IDENT, EVFILT_USER, 0, NOTE_TRIGGER, 0, 0);
+			int ec = kevent(mKqueue, &change, 1, 0, 0, 0);
+			xpfAssert(ec == 0);
+		}
+
+		u64 asyncTimer(u32 delayMs, NetIoMuxCallback *cb, vptr userData)
+		{
+			Overlapped *o = new Overlapped(0, NetIoMux::EIT_TIMER);
+			o->cb = cb;
+			o->udata = userData;
+			o->provisioned = true;
+
+			bool earliest = false;
+			u64 id = mTimers.schedule(delayMs, (vptr)o, earliest);
+			if (earliest)
+				interrupt(); // for blocking workers to shorten their wait.
+			return id;
+		}
+
+		bool cancelTimer(u64 id)
+		{
+			Overlapped *o = (Overlapped*)mTimers.cancel(id);
+			if (o == 0)
+				return false;
+			releaseOp(o);
+			return true;
+		}
+
+		void asyncFile(NetIoMux::EIoType type, s32 fd, c8 *buf, u32 len, u64 offset, NetIoMux::EFileSync sync, NetIoMuxCallback *cb, vptr userData)
+		{
+			Overlapped *o = new Overlapped(0, type);
+			o->buffer = buf;
+			o->cb = cb;
+			o->provisioned = true;
+
+			NetIoMuxFileJob *job = new NetIoMuxFileJob;
+			job->Type = type;
+			job->Fd = fd;
+			job->Offset = offset;
+			job->Buffer = buf;
+			job->Length = len;
+			job->Sync = sync;
+			job->UserData = userData;
+			job->Result = 0;
+			job->Error = 0;
+			job->Op = (vptr)o;
+			o->file = job;
+
+			if (!mFilePool.submit(job))
+			{
+				o->errorcode = ENOBUFS;
+				postCompletion(o);
+			}
+		}
+
+		void setFileIoThreads(u32 threads, u32 maxQueued)
+		{
+			mFilePool.configure(threads, maxQueued);
+		}
+
+		static void fileJobDone(vptr owner, NetIoMuxFileJob *job)
+		{
+			((NetIoMuxImpl*)owner)->postCompletion((Overlapped*)job->Op);
+		}
+
 		bool join(NetEndpoint *ep)
 		{
 			s32 sock = ep->getSocket();
@@ -456,7 +885,14 @@ namespace xpf
 			// bundle with an async context
 			AsyncContext *ctx = new AsyncContext;
 			ctx->ready = false;
-			ctx->ep = ep;
+			ctx->coalesce = false;
+			ctx->prio = NetIoMux::EPR_NORMAL;
+			ctx->blocked = false;
+			ctx->lowheld = false;
+			ctx->notifying = 0;
+			ctx->wrbytes = 0;
+			ctx->lowwm = 0;
+			ctx->highwm = 0;
 			ep->setAsyncContext((vptr)ctx);
 
 			// request the socket to be non-blocking
@@ -498,9 +934,35 @@ namespace xpf
 				{
 					mReadyList.erase((void*)ep); // Note: Acquire mReadyList's lock while holding ctx's lock.
 				}
+				if (ctx->wrbytes > 0)
+				{
+					xpfAtomicAdd64(&mQueuedBytes, (u64)0 - ctx->wrbytes);
+				}
+				// Pending operations fail as if the connection was aborted,
+				// and pending broadcast sends with EE_INVALID_OP so that
+				// their broadcasts can still complete. Their queued bytes
+				// were discharged above.
+				const bool pending = (ctx->rdqueue.size() + ctx->wrqueue.size()) > 0;
+				for (u32 i = 0; i < ctx->rdqueue.size(); ++i)
+				{
+					Overlapped *o = ctx->rdqueue.at(i);
+					o->provisioned = true;
+					o->errorcode = ECONNABORTED;
+					mCompletionList.push_back((void*)o);
+				}
+				for (u32 i = 0; i < ctx->wrqueue.size(); ++i)
+				{
+					Overlapped *o = ctx->wrqueue.at(i);
+					o->quota = 0;
+					o->provisioned = (o->bcast == 0);
+					o->errorcode = ECONNABORTED;
+					mCompletionList.push_back((void*)o);
+				}
 				delete ctx;
 				ep->setAsyncContext(0);
 				// since the whole context object has been deleted, there's no bother to call unlock.
+				if (pending)
+					interrupt();
 			}
 
 			// reset the socket to be blocking
@@ -511,6 +973,121 @@ namespace xpf
 			return (ec == 0);
 		}
 
+		bool watchFd(s32 fd, u32 events, NetIoMuxCallback *cb, vptr userData)
+		{
+			ScopedSpinLock ml(mFdWatches.lock());
+			NetIoMuxFdWatch *w = mFdWatches.insert(fd, events, cb, userData);
+			if (w == 0)
+				return false;
+			if (!armFdLocked(w))
+			{
+				disarmFd(fd);
+				mFdWatches.remove(fd);
+				return false;
+			}
+			return true;
+		}
+
+		bool modifyFd(s32 fd, u32 events)
+		{
+			ScopedSpinLock ml(mFdWatches.lock());
+			NetIoMuxFdWatch *w = mFdWatches.find(fd);
+			if (w == 0)
+				return false;
+			w->Events = events;
+			// A watch being dispatched is re-armed with new events afterward.
+			return (w->Dispatching) ? true : armFdLocked(w);
+		}
+
+		bool unwatchFd(s32 fd)
+		{
+			ScopedSpinLock ml(mFdWatches.lock());
+			if (mFdWatches.find(fd) == 0)
+				return false;
+			disarmFd(fd);
+			return mFdWatches.remove(fd);
+		}
+
+		bool setSendCoalescing(NetEndpoint *ep, bool val)
+		{
+			AsyncContext *ctx = (AsyncContext*)ep->getAsyncContext();
+			xpfAssert(ctx != 0);
+			if (ctx == 0)
+				return false;
+
+			ScopedSpinLock ml(ctx->lock);
+			ctx->coalesce = val;
+			return true;
+		}
+
+		bool setReceiveOffload(NetEndpoint *ep, bool val)
+		{
+			// Not supported: BSD hosts have no UDP receive offload.
+			return false;
+		}
+
+		bool setWriteWatermarks(NetEndpoint *ep, u32 lowBytes, u32 highBytes)
+		{
+			AsyncContext *ctx = (AsyncContext*)ep->getAsyncContext();
+			xpfAssert(ctx != 0);
+			xpfAssert(("Expecting lowBytes < highBytes.", (highBytes == 0) || (lowBytes < highBytes)));
+			if ((ctx == 0) || ((highBytes != 0) && (lowBytes >= highBytes)))
+				return false;
+
+			ScopedSpinLock ml(ctx->lock);
+			ctx->lowwm = lowBytes;
+			ctx->highwm = highBytes;
+			if (highBytes == 0)
+				ctx->blocked = false;
+			return true;
+		}
+
+		bool isWriteBlocked(NetEndpoint *ep) const
+		{
+			AsyncContext *ctx = (AsyncContext*)ep->getAsyncContext();
+			return (ctx) ? ctx->blocked : false;
+		}
+
+		u32 getQueuedWriteBytes(NetEndpoint *ep) const
+		{
+			AsyncContext *ctx = (AsyncContext*)ep->getAsyncContext();
+			return (ctx) ? ctx->wrbytes : 0;
+		}
+
+		void setTurnBudget(u32 ops, u32 bytes)
+		{
+			mTurnOps = ops;
+			mTurnBytes = bytes;
+		}
+
+		bool setPriority(NetEndpoint *ep, NetIoMux::EPriority prio)
+		{
+			AsyncContext *ctx = (AsyncContext*)ep->getAsyncContext();
+			xpfAssert(ctx != 0);
+			if ((ctx == 0) || (prio > NetIoMux::EPR_HIGH))
+				return false;
+
+			// Takes effect the next time it is queued as ready.
+			ScopedSpinLock ml(ctx->lock);
+			ctx->prio = (u8)prio;
+			return true;
+		}
+
+		NetIoMuxProfiler& profiler()
+		{
+			return mProfiler;
+		}
+
+		void setMaxQueuedBytes(u64 bytes)
+		{
+			mMaxQueuedBytes = bytes;
+		}
+
+		u64 getQueuedBytes() const
+		{
+			return mQueuedBytes;
+		}
+
 		static const char * getMultiplexerType(NetIoMux::EPlatformMultiplexer &epm)
 		{
 			epm = NetIoMux::EPM_KQUEUE;
@@ -550,6 +1127,8 @@ namespace xpf
 					{
 						o->length = bytes;
 						o->errorcode = 0;
+						if (o->iobuf)
+							o->iobuf->commit((u32)bytes);
 					}
 					else if (errno != EWOULDBLOCK && errno != EAGAIN)
 					{
@@ -657,10 +1236,16 @@ namespace xpf
 						o->provisioned = true;
 					}
 
-					ssize_t bytes = ::send(ep->getSocket(), o->buffer, (size_t)o->length, MSG_DONTWAIT);
+					if (o->chain)
+					{
+						complete = performChainSendLocked(ep, o);
+						break;
+					}
+
+					ssize_t bytes = ::send(ep->getSocket(), o->buffer + o->progress, (size_t)(o->length - o->progress), MSG_DONTWAIT);
 					if (bytes >=0 )
 					{
-						o->length = bytes;
+						o->length = o->progress + bytes;
 						o->errorcode = 0;
 					}
 					else if (errno != EWOULDBLOCK && errno != EAGAIN)
@@ -692,6 +1277,26 @@ namespace xpf
 						o->provisioned = true;
 					}
 
+					if (o->segsize != 0)
+					{
+						const int ec = sendSegments(ep->getSocket(), o);
+						if (ec == 0)
+						{
+							o->errorcode = 0;
+						}
+						else if (ec != EWOULDBLOCK && ec != EAGAIN)
+						{
+							o->length = 0;
+							o->errorcode = ec;
+							ep->setLastPlatformErrno(ec);
+						}
+						else
+						{
+							complete = false;
+						}
+						break;
+					}
+
 					ssize_t bytes = ::sendto(ep->getSocket(), o->buffer, (size_t)o->length, MSG_DONTWAIT,
 							(const struct sockaddr*)o->peer->Data, (socklen_t)o->peer->Length);
 					if (bytes >=0 )
@@ -738,6 +1343,10 @@ namespace xpf
 						// Note: resolving can be blockable.
 						ConnectHostInfo *chi = (ConnectHostInfo*)o->buffer;
 						bool resolved = NetEndpoint::resolvePeer(ep->getProtocol(), *o->peer, chi->host, chi->service);
+
+						// From now on, buffer/length refer to the initial data.
+						o->buffer = (c8*)chi->data;
+						o->length = chi->datalen;
 						delete chi;
 						if (!resolved)
 						{
@@ -748,51 +1357,7 @@ namespace xpf
 						o->provisioned = true;
 					}
 
-					if (o->length == 0) // not yet called connect
-					{
-						int ec = ::connect(ep->getSocket(), (const struct sockaddr*)o->peer->Data, (socklen_t)o->peer->Length);
-						if (ec == 0)
-						{
-							o->length = 0;
-							o->errorcode = 0;
-							ep->setStatus(NetEndpoint::ESTAT_CONNECTED);
-						}
-						else if (errno != EINPROGRESS)
-						{
-							o->length = 0;
-							o->errorcode = errno;
-							ep->setLastPlatformErrno(errno);
-							ep->setStatus(NetEndpoint::ESTAT_INIT);
-						}
-						else
-						{
-							xpfAssert(o->length == 0);
-							ep->setStatus(NetEndpoint::ESTAT_CONNECTING);
-							o->length = 1; // mark a connect() call in progress.
-							complete = false;
-						}
-					}
-					else // a connect() was called and waiting for result.
-					{
-						int val = 0;
-						socklen_t valsize = sizeof(int);
-						int ec = ::getsockopt(ep->getSocket(), SOL_SOCKET, SO_ERROR, &val, &valsize);
-						xpfAssert(ec == 0);
-						if (ec == 0 && val == 0)
-						{
-							o->errorcode = 0;
-							o->length = 0;
-							ep->setStatus(NetEndpoint::ESTAT_CONNECTED);
-						}
-						else
-						{
-							o->errorcode = errno;
-							ep->setLastPlatformErrno(errno);
-							delete o->peer;
-							o->peer = 0;
-							ep->setStatus(NetEndpoint::ESTAT_INIT);
-						}
-					}
+					complete = performConnectLocked(ep, o);
 				} while (0);
 				break;
 
@@ -802,11 +1367,431 @@ namespace xpf
 			} // end of switch (o->iotype)
 			
 			if (complete)
+			{
+				dischargeWriteLocked(ctx, o);
 				mCompletionList.push_back(o);
+			}
 			
 			return complete;
 		}
 	
+		// Drive a provisioned connect operation through its stages, which
+		// completes after the handshake and all of the initial data (if
+		// any) are sent. Return false if it has to wait for writability.
+		bool performConnectLocked(NetEndpoint *ep, Overlapped *o) // require ep->ctx locked.
+		{
+			const int sock = ep->getSocket();
+			if (o->connstage == CONNECT_STAGE_INIT)
+			{
+				int ec = -1;
+				if (!fastOpenConnect(sock, o))
+					ec = ::connect(sock, (const struct sockaddr*)o->peer->Data, (socklen_t)o->peer->Length);
+
+				if (ec == 0)
+				{
+					ep->setStatus(NetEndpoint::ESTAT_CONNECTED);
+					o->connstage = CONNECT_STAGE_SENDING;
+				}
+				else if (errno == EINPROGRESS)
+				{
+					ep->setStatus(NetEndpoint::ESTAT_CONNECTING);
+					o->connstage = CONNECT_STAGE_PENDING;
+					return false;
+				}
+				else
+				{
+					o->length = 0;
+					o->errorcode = errno;
+					ep->setLastPlatformErrno(errno);
+					ep->setStatus(NetEndpoint::ESTAT_INIT);
+					return true;
+				}
+			}
+			else if (o->connstage == CONNECT_STAGE_PENDING) // a connect() was called and waiting for result.
+			{
+				int val = 0;
+				socklen_t valsize = sizeof(int);
+				int ec = ::getsockopt(sock, SOL_SOCKET, SO_ERROR, &val, &valsize);
+				xpfAssert(ec == 0);
+				if (ec != 0 || val != 0)
+				{
+					o->length = 0;
+					o->errorcode = (ec != 0) ? errno : val;
+					ep->setLastPlatformErrno(o->errorcode);
+					ep->setStatus(NetEndpoint::ESTAT_INIT);
+					delete o->peer;
+					o->peer = 0;
+					return true;
+				}
+				ep->setStatus(NetEndpoint::ESTAT_CONNECTED);
+				o->connstage = CONNECT_STAGE_SENDING;
+			}
+
+			// Connected: send what is left of the initial data.
+			while (o->progress < o->length)
+			{
+				ssize_t bytes = ::send(sock, o->buffer + o->progress, (size_t)(o->length - o->progress), MSG_DONTWAIT);
+				if (bytes < 0)
+				{
+					if (errno == EWOULDBLOCK || errno == EAGAIN)
+						return false;
+
+					o->length = 0;
+					o->errorcode = errno;
+					ep->setLastPlatformErrno(errno);
+					return true;
+				}
+				o->progress += (u32)bytes;
+			}
+			o->errorcode = 0;
+			return true;
+		}
+
+		// Send o->buffer from o->progress as datagrams of o->segsize bytes,
+		// one by one as BSD hosts have no UDP segmentation offload. Return
+		// 0 when all are sent, otherwise the errno which stopped the sending.
+		static int sendSegments(int sock, Overlapped *o)
+		{
+			while (o->progress < o->length)
+			{
+				u32 chunk = o->length - o->progress;
+				if (chunk > o->segsize)
+					chunk = o->segsize;
+
+				ssize_t bytes = ::sendto(sock, o->buffer + o->progress, (size_t)chunk, MSG_DONTWAIT,
+						(const struct sockaddr*)o->peer->Data, (socklen_t)o->peer->Length);
+				if (bytes < 0)
+					return errno;
+				// Datagrams are sent as a whole.
+				o->progress += chunk;
+			}
+			return 0;
+		}
+
+		// Start a connect carrying the initial data in SYN: connectx() on
+		// Darwin, or sendto() on a TCP_FASTOPEN socket on FreeBSD. Bytes
+		// taken by the kernel are recorded in o->progress. Return false if
+		// there is no initial data or the host does not support or refuses
+		// fast open, for the caller to connect() instead. Otherwise errno
+		// tells the result like a connect() call.
+		static bool fastOpenConnect(int sock, Overlapped *o)
+		{
+			if (o->length == 0)
+				return false;
+
+#if defined(__APPLE__) && defined(CONNECT_DATA_IDEMPOTENT)
+			sa_endpoints_t sae;
+			::memset(&sae, 0, sizeof(sae));
+			sae.sae_dstaddr = (const struct sockaddr*)o->peer->Data;
+			sae.sae_dstaddrlen = (socklen_t)o->peer->Length;
+			struct iovec iov;
+			iov.iov_base = (void*)o->buffer;
+			iov.iov_len = (size_t)o->length;
+			size_t bytes = 0;
+			int ec = ::connectx(sock, &sae, SAE_ASSOCID_ANY, CONNECT_DATA_IDEMPOTENT, &iov, 1, &bytes, 0);
+			if (ec == 0 || errno == EINPROGRESS)
+			{
+				// The handshake is still in flight.
+				o->progress = (u32)bytes;
+				errno = EINPROGRESS;
+				return true;
+			}
+			return (errno != EOPNOTSUPP && errno != ENOTSUP);
+#elif defined(TCP_FASTOPEN)
+			int on = 1;
+			if (0 != ::setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN, &on, sizeof(on)))
+				return false;
+
+			ssize_t bytes = ::sendto(sock, o->buffer, (size_t)o->length, MSG_DONTWAIT,
+					(const struct sockaddr*)o->peer->Data, (socklen_t)o->peer->Length);
+			if (bytes >= 0)
+			{
+				// Queued along with SYN: The handshake is still in flight.
+				o->progress = (u32)bytes;
+				errno = EINPROGRESS;
+				return true;
+			}
+			if (errno == EINPROGRESS || errno == EAGAIN)
+			{
+				// SYN sent without the data, which goes once connected.
+				o->progress = 0;
+				errno = EINPROGRESS;
+				return true;
+			}
+			// Fast open refused (e.g. disabled by the host): Let the
+			// caller connect() and report its own result.
+			return false;
+#else
+			return false;
+#endif
+		}
+
+		// Send the rest of a chain from o->progress with sendmsg(). Unlike
+		// raw buffers, a chain completes only when it is fully sent (or
+		// fails). Return false if the socket would block before that.
+		bool performChainSendLocked(NetEndpoint *ep, Overlapped *o) // require ep->ctx locked.
+		{
+			while (o->progress < o->length)
+			{
+				struct iovec iov[MAX_COALESCED_SENDS];
+				int iovcnt = 0;
+				u32 skip = o->progress;
+				for (u32 i = 0; (i < o->chain->segmentCount()) && (iovcnt < MAX_COALESCED_SENDS); ++i)
+				{
+					const IoBufferChain::Segment &seg = o->chain->segment(i);
+					if (skip >= seg.Length)
+					{
+						skip -= seg.Length;
+						continue;
+					}
+					iov[iovcnt].iov_base = (void*)(seg.Buffer->data() + seg.Offset + skip);
+					iov[iovcnt].iov_len = (size_t)(seg.Length - skip);
+					skip = 0;
+					++iovcnt;
+				}
+
+				struct msghdr msg;
+				::memset(&msg, 0, sizeof(msg));
+				msg.msg_iov = iov;
+				msg.msg_iovlen = iovcnt;
+
+				ssize_t bytes = ::sendmsg(ep->getSocket(), &msg, MSG_DONTWAIT);
+				if (bytes < 0)
+				{
+					if (errno == EWOULDBLOCK || errno == EAGAIN)
+						return false;
+
+					o->length = 0;
+					o->errorcode = errno;
+					ep->setLastPlatformErrno(errno);
+					return true;
+				}
+				o->progress += (u32)bytes;
+			}
+			o->errorcode = 0;
+			return true;
+		}
+
+		// Flush consecutive EIT_SEND operations at the front of wrqueue with
+		// a single sendmsg(). Fully sent operations are moved to the completion
+		// list. The front operation is always gathered, the next ones only as
+		// long as 'budget' would not be exhausted by the previous ones, as if
+		// sent one by one; 'budget' is charged with the bytes sent per
+		// operation. Return false if the socket would block.
+		bool performCoalescedSendLocked(NetEndpoint *ep, NetIoMuxTurnBudget &budget) // require ep->ctx locked.
+		{
+			AsyncContext *ctx = (AsyncContext*) ep->getAsyncContext();
+			xpfAssert(ctx != 0);
+			if (ctx == 0)
+				return false;
+
+			struct iovec iov[MAX_COALESCED_SENDS];
+			int iovcnt = 0;
+			u64 gathered = 0;
+			for (u32 i = 0; (i < ctx->wrqueue.size()) && (iovcnt < MAX_COALESCED_SENDS); ++i)
+			{
+				Overlapped *o = ctx->wrqueue.at(i);
+				if ((o->iotype != NetIoMux::EIT_SEND) || (o->chain != 0))
+					break;
+				if ((iovcnt > 0) && !budget.outlasts((u32)iovcnt, gathered))
+					break;
+
+				if (false == o->provisioned)
+				{
+					if (NetEndpoint::ESTAT_CONNECTED != ep->getStatus())
+					{
+						if (iovcnt > 0)
+							break;
+
+						// Let the regular path report the invalid operation.
+						if (performIoLocked(ep, o))
+						{
+							ctx->wrqueue.pop_front();
+							budget.charge(0);
+						}
+						return true;
+					}
+					o->provisioned = true;
+				}
+
+				iov[iovcnt].iov_base = (void*)(o->buffer + o->progress);
+				iov[iovcnt].iov_len = (size_t)(o->length - o->progress);
+				gathered += iov[iovcnt].iov_len;
+				++iovcnt;
+			}
+			xpfAssert(iovcnt > 0);
+
+			struct msghdr msg;
+			::memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = iovcnt;
+
+			ssize_t bytes = ::sendmsg(ep->getSocket(), &msg, MSG_DONTWAIT);
+			if (bytes < 0)
+			{
+				if (errno == EWOULDBLOCK || errno == EAGAIN)
+					return false;
+
+				// Fail the front operation only. The rest will be
+				// retried (and most likely fail) one by one.
+				Overlapped *o = ctx->wrqueue.front();
+				o->length = 0;
+				o->errorcode = errno;
+				ep->setLastPlatformErrno(errno);
+				ctx->wrqueue.pop_front();
+				dischargeWriteLocked(ctx, o);
+				mCompletionList.push_back(o);
+				budget.charge(0);
+				return true;
+			}
+
+			// Distribute the sent bytes over the gathered operations.
+			size_t remains = (size_t)bytes;
+			for (int i = 0; i < iovcnt; ++i)
+			{
+				Overlapped *o = ctx->wrqueue.front();
+				if (remains < iov[i].iov_len)
+				{
+					o->progress += (u32)remains;
+					budget.charge((u32)remains);
+					return false; // partially sent, wait for next writable event.
+				}
+				remains -= iov[i].iov_len;
+				budget.charge((u32)iov[i].iov_len);
+				o->progress = o->length;
+				o->errorcode = 0;
+				ctx->wrqueue.pop_front();
+				dischargeWriteLocked(ctx, o);
+				mCompletionList.push_back(o);
+			}
+			return true;
+		}
+
+		// Charge a send operation to both the mux-wide cap and the write
+		// watermarks of its endpoint, then queue it. Operations exceeding the
+		// mux-wide cap are completed immediately with ENOBUFS.
+		void appendWriteOp(NetEndpoint *ep, Overlapped *o)
+		{
+			AsyncContext *ctx = (AsyncContext*)ep->getAsyncContext();
+
+			const u64 queued = xpfAtomicAdd64(&mQueuedBytes, (u64)o->length) + o->length;
+			if ((mMaxQueuedBytes != 0) && (queued > mMaxQueuedBytes))
+			{
+				xpfAtomicAdd64(&mQueuedBytes, (u64)0 - o->length);
+				o->provisioned = true;
+				o->errorcode = ENOBUFS;
+				o->length = 0;
+				mCompletionList.push_back(o);
+				return;
+			}
+			o->quota = o->length;
+
+			{
+				ScopedSpinLock ml(ctx->lock);
+				ctx->wrbytes += o->quota;
+				appendAsyncOpLocked(ep, o, ASYNC_OP_WRITE);
+				if ((ctx->highwm == 0) || ctx->blocked || (ctx->wrbytes < ctx->highwm))
+					return;
+				ctx->blocked = true;
+				ctx->notifying++;
+				// Other workers may perform 'o' once unlocked: Its
+				// completion (and with it 'o->cb') is held until the
+				// notification returns.
+				o->holds = 2;
+			}
+
+			// Notify without holding the lock. A low watermark crossed in
+			// the meantime is held back and notified after this one.
+			o->cb->onWriteWatermark(ep, true);
+			bool low = false;
+			{
+				ScopedSpinLock ml(ctx->lock);
+				if ((--ctx->notifying == 0) && ctx->lowheld)
+				{
+					ctx->lowheld = false;
+					low = true;
+				}
+			}
+			if (low)
+				o->cb->onWriteWatermark(ep, false);
+
+			// Emit the completion if it has come meanwhile.
+			if (xpfAtomicAdd(&o->holds, -1) == 1)
+				postCompletion(o);
+		}
+
+		// Release the bytes charged by a write operation which is leaving
+		// wrqueue. Mark the op if it drains the queue to the low watermark.
+		void dischargeWriteLocked(AsyncContext *ctx, Overlapped *o) // require ctx locked.
+		{
+			if (o->quota == 0)
+				return;
+
+			ctx->wrbytes -= o->quota;
+			xpfAtomicAdd64(&mQueuedBytes, (u64)0 - o->quota);
+			o->quota = 0;
+			if (ctx->blocked && (ctx->wrbytes <= ctx->lowwm))
+			{
+				ctx->blocked = false;
+				if (ctx->notifying > 0)
+					ctx->lowheld = true;
+				else
+					o->wmlow = true;
+			}
+		}
+
+		// Arm a one-shot filter per interested event and delete the others.
+		bool armFdLocked(NetIoMuxFdWatch *w) // require mFdWatches locked.
+		{
+			const short filters[2] = { EVFILT_READ, EVFILT_WRITE };
+			const u32   interests[2] = { NetIoMux::EFE_READ, NetIoMux::EFE_WRITE };
+			bool ret = true;
+			for (u32 i = 0; i < 2; ++i)
+			{
+				struct kevent change;
+				const bool wanted = ((w->Events & interests[i]) != 0);
+				EV_SET(&change, w->Fd, filters[i], (wanted) ? (EV_ADD | EV_ONESHOT | EV_ENABLE) : EV_DELETE,
+					0, 0, (void*)(uintptr_t)NetIoMuxFdWatchTable::tagOf(w));
+				int ec = kevent(mKqueue, &change, 1, 0, 0, 0);
+				if (wanted && (ec != 0))
+					ret = false;
+			}
+			return ret;
+		}
+
+		void disarmFd(s32 fd)
+		{
+			// Each fails if the filter is not armed or fd has been closed.
+			struct kevent change;
+			EV_SET(&change, fd, EVFILT_READ, EV_DELETE, 0, 0, 0);
+			kevent(mKqueue, &change, 1, 0, 0, 0);
+			EV_SET(&change, fd, EVFILT_WRITE, EV_DELETE, 0, 0, 0);
+			kevent(mKqueue, &change, 1, 0, 0, 0);
+		}
+
+		struct FdRearm
+		{
+			explicit FdRearm(NetIoMuxImpl *impl) : Impl(impl) {}
+			void operator () (NetIoMuxFdWatch *w) { Impl->armFdLocked(w); }
+			NetIoMuxImpl *Impl;
+		};
+
+		void dispatchFd(const struct kevent &evt)
+		{
+			u32 ev = 0;
+			if (evt.filter == EVFILT_READ)  ev |= NetIoMux::EFE_READ;
+			if (evt.filter == EVFILT_WRITE) ev |= NetIoMux::EFE_WRITE;
+			if (evt.flags & (EV_EOF | EV_ERROR)) ev |= NetIoMux::EFE_HANGUP;
+
+			NetIoMuxFdWatch *w = mFdWatches.acquire((u64)(uintptr_t)evt.udata, ev);
+			if (w == 0)
+				return;
+
+			FdRearm rearm(this);
+			while ((ev = mFdWatches.next(w, rearm)) != 0)
+				w->Cb->onFdReady(w->Fd, ev, w->UserData);
+		}
+
 		void appendAsyncOpLocked(NetEndpoint *ep, Overlapped *o, u8 mode) // require ep->ctx locked.
 		{
 			AsyncContext *ctx = (ep == 0)? 0 : (AsyncContext*)ep->getAsyncContext();
@@ -832,14 +1817,22 @@ namespace xpf
 			if (!ctx->ready)
 			{
 				ctx->ready = true;
-				mReadyList.push_back((void*)ep);
+				mReadyList.push_back((void*)ep, ctx->prio);
 			}
 		}
 
 		NetIoMuxSyncFifo mCompletionList; // fifo of Overlapped.
-		NetIoMuxSyncFifo mReadyList;      // fifo of NetEndpoints.
+		NetIoMuxReadyList mReadyList;     // fifo of NetEndpoints by priority.
+		volatile u32 mTurnOps;            // per-turn budget of ready endpoints.
+		volatile u32 mTurnBytes;
 		bool mEnable;
 		int  mKqueue;
+		NetIoMuxFdWatchTable mFdWatches; // descriptors registered by watchFd().
+		volatile u64 mQueuedBytes;    // bytes of queued write operations of all endpoints.
+		u64          mMaxQueuedBytes; // mux-wide cap of mQueuedBytes (0: unlimited).
+		NetIoMuxFilePool mFilePool;   // threads doing file I/O.
+		NetIoMuxTimerQueue mTimers;   // timers of asyncTimer().
+		NetIoMuxProfiler mProfiler;   // callback profiler of enableProfiler().
 	}; // end of class NetIoMuxImpl (kqueue)
 
 } // end of namespace xpf
@@ -0,0 +1,623 @@
+/*******************************************************************************
+ * Copyright (c) 2013 matt@moregeek.com.tw
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ * 3. This notice may not be removed or altered from any source
+ *    distribution.
+ ********************************************************************************/
+
+#include <xpf/netiomux.h>
+#include <xpf/lexicalcast.h>
+#include <xpf/atomic.h>
+
+#include <string>
+#include <deque>
+#include <map>
+#include <vector>
+#include <string.h>
+
+// NOTE: Requires the NetIoMuxImpl of the platform being included beforehand.
+
+#define MEMORY_PIPE_CAPACITY (256 * 1024)
+#define MEMORY_MAX_DISPATCH  (64)
+
+namespace xpf
+{
+
+struct NetIoMuxMemoryOp
+{
+	NetIoMux::EIoType  Type;
+	c8                *Buffer;
+	u32                Length;
+	NetIoMuxCallback  *Cb;
+	std::string        Target; // "name:port" of a connect.
+};
+
+// State of an in-memory endpoint, kept in its async context slot. It
+// lives from the first join (or the connect creating it, for accepted
+// endpoints) until the endpoint is closed.
+struct NetIoMuxMemoryContext
+{
+	NetEndpoint                    *Ep;
+	NetIoMuxMemoryContext          *Peer;     // the other end of the pipe, or 0.
+	NetIoMuxMemory                 *Engine;   // engine of the joined mux, or 0.
+	std::string                     Inbound;  // bytes sent by the peer from InHead.
+	u32                             InHead;
+	bool                            PeerShut; // no more bytes will come after Inbound.
+	bool                            ShutWrite;
+	bool                            Ready;    // in the ready list of Engine.
+	std::deque<NetIoMuxMemoryOp>    Reads;    // receives and accepts.
+	std::deque<NetIoMuxMemoryOp>    Writes;   // sends and connects.
+	std::deque<NetEndpoint*>        Backlog;  // connected but not accepted yet (listeners).
+	std::string                     Name;     // registered "name:port" (joined listeners).
+
+	explicit NetIoMuxMemoryContext(NetEndpoint *ep)
+		: Ep(ep), Peer(0), Engine(0), InHead(0)
+		, PeerShut(false), ShutWrite(false), Ready(false) {}
+
+	u32 inboundBytes() const { return (u32)Inbound.size() - InHead; }
+};
+
+// The in-memory transport of a NetIoMux. Operations on in-memory
+// endpoints are queued on their contexts, which are put in the ready
+// list of the engine of their mux whenever they may progress. Workers
+// of the mux perform them in runOnce() before polling the platform
+// multiplexer, and a worker blocked in it is woken by an asyncWakeup()
+// when work arrives from other threads. All contexts are guarded by a
+// process-wide lock since a pipe spans two muxes. Muxes without joined
+// in-memory endpoints go straight to the platform multiplexer.
+class NetIoMuxMemory : public NetIoMuxCallback
+{
+public:
+	explicit NetIoMuxMemory(NetIoMuxImpl *impl)
+		: mImpl(impl), mEnabled(true), mJoined(0), mWaiters(0), mKicked(false), mRandom(0)
+	{
+		memset(&mFaults, 0, sizeof(mFaults));
+	}
+
+	virtual ~NetIoMuxMemory()
+	{
+		ScopedSpinLock ml(lock());
+		for (u32 i = 0; i < (u32)mReady.size(); ++i)
+			mReady[i]->Ready = false;
+		mReady.clear();
+	}
+
+	static inline bool isMemory(const NetEndpoint *ep)
+	{
+		return (ep != 0) && ((ep->getProtocol() & NetEndpoint::ProtocolMemory) != 0);
+	}
+
+	void enable(bool val)
+	{
+		mEnabled = val;
+	}
+
+	void setFaults(const NetIoMux::MemoryFaults &faults)
+	{
+		ScopedSpinLock ml(lock());
+		mFaults = faults;
+		mRandom = (faults.Seed != 0) ? faults.Seed : 0x9e3779b9;
+	}
+
+	bool join(NetEndpoint *ep)
+	{
+		ScopedSpinLock ml(lock());
+		NetIoMuxMemoryContext *ctx = context(ep);
+		if (ctx->Engine != 0)
+			return false;
+
+		if (ep->getStatus() == NetEndpoint::ESTAT_LISTENING)
+		{
+			std::string name = makeName(ep->getAddress(), lexical_cast<c8>(ep->getPort()).c_str());
+			if (registry().find(name) != registry().end())
+				return false;
+			registry()[name] = ctx;
+			ctx->Name = name;
+		}
+		ctx->Engine = this;
+
+		// Workers blocked in the platform multiplexer did not count
+		// themselves as waiters while nothing was joined.
+		if ((xpfAtomicAdd(&mJoined, 1) == 0) && !mKicked)
+		{
+			mKicked = true;
+			mImpl->asyncWakeup(this);
+		}
+		markReadyLocked(ctx);
+		return true;
+	}
+
+	bool depart(NetEndpoint *ep)
+	{
+		ScopedSpinLock ml(lock());
+		NetIoMuxMemoryContext *ctx = (NetIoMuxMemoryContext*)ep->getAsyncContext();
+		if ((ctx == 0) || (ctx->Engine != this))
+			return false;
+
+		detachLocked(ctx);
+		return true;
+	}
+
+	void submit(NetEndpoint *ep, NetIoMux::EIoType type, c8 *buf, u32 len, NetIoMuxCallback *cb, const c8 *target = 0)
+	{
+		ScopedSpinLock ml(lock());
+		NetIoMuxMemoryContext *ctx = (NetIoMuxMemoryContext*)ep->getAsyncContext();
+		xpfAssert(("In-memory endpoint not joined.", (ctx != 0) && (ctx->Engine != 0)));
+		if ((ctx == 0) || (ctx->Engine == 0))
+			return;
+
+		NetIoMuxMemoryOp op;
+		op.Type = type;
+		op.Buffer = buf;
+		op.Length = len;
+		op.Cb = cb;
+		if (target)
+			op.Target = target;
+
+		if ((type == NetIoMux::EIT_RECV) || (type == NetIoMux::EIT_ACCEPT))
+			ctx->Reads.push_back(op);
+		else
+			ctx->Writes.push_back(op);
+		markReadyLocked(ctx);
+	}
+
+	// Fail an operation not supported on in-memory endpoints with
+	// EE_INVALID_OP. It completes on the next pass like any other.
+	void reject(NetEndpoint *ep, NetIoMux::EIoType type, NetIoMuxCallback *cb)
+	{
+		ScopedSpinLock ml(lock());
+		NetIoMuxMemoryContext *ctx = (NetIoMuxMemoryContext*)ep->getAsyncContext();
+		xpfAssert(("In-memory endpoint not joined.", (ctx != 0) && (ctx->Engine != 0)));
+		if ((ctx == 0) || (ctx->Engine == 0))
+			return;
+
+		ctx->Engine->rejectLocked(ep, type, cb);
+	}
+
+	// Fail a broadcast to endpoints of which some are in-memory ones.
+	void rejectBroadcast(NetIoMuxCallback *cb)
+	{
+		ScopedSpinLock ml(lock());
+		rejectLocked(0, NetIoMux::EIT_BROADCAST, cb);
+	}
+
+	void connect(NetEndpoint *ep, const c8 *host, const c8 *serviceOrPort, const c8 *data, u32 len, NetIoMuxCallback *cb)
+	{
+		std::string target = makeName(host, serviceOrPort);
+		submit(ep, NetIoMux::EIT_CONNECT, (c8*)data, len, cb, target.c_str());
+	}
+
+	void run()
+	{
+		while (mEnabled)
+		{
+			if (NetIoMux::ERS_DISABLED == runOnce(10))
+				break;
+		}
+	}
+
+	// Perform in-memory operations if any are ready, otherwise wait on
+	// the platform multiplexer.
+	NetIoMux::ERunningStaus runOnce(u32 timeoutMs)
+	{
+		if (!mEnabled || (0 == mJoined))
+			return mImpl->runOnce(timeoutMs);
+
+		lock().lock();
+		const bool work = !mReady.empty() || !mRecords.empty();
+		if (!work)
+			mWaiters++;
+		lock().unlock();
+
+		if (work)
+		{
+			dispatch();
+			// Do not starve the sockets of the same mux.
+			return mImpl->runOnce(0);
+		}
+
+		NetIoMux::ERunningStaus ret = mImpl->runOnce(timeoutMs);
+		lock().lock();
+		mWaiters--;
+		lock().unlock();
+		return ret;
+	}
+
+	// The wakeup posted to a blocked worker.
+	void onIoCompleted(NetIoMux::EIoType type, NetEndpoint::EError ec, NetEndpoint *sep, vptr tepOrPeer, const c8 *buf, u32 len)
+	{
+		lock().lock();
+		mKicked = false;
+		lock().unlock();
+
+		// Once the last endpoint has departed, workers no longer
+		// dispatch: Emit all completions left.
+		while (dispatch() && (0 == mJoined)) {}
+	}
+
+	static void shutdown(NetEndpoint *ep, NetEndpoint::EShutdownDir dir)
+	{
+		if (dir == NetEndpoint::ESD_READ)
+			return;
+
+		ScopedSpinLock ml(lock());
+		NetIoMuxMemoryContext *ctx = context(ep);
+		ctx->ShutWrite = true;
+		if (ctx->Peer)
+		{
+			ctx->Peer->PeerShut = true;
+			markReadyLocked(ctx->Peer);
+		}
+		// Fail the pending sends.
+		markReadyLocked(ctx);
+	}
+
+	static void close(NetEndpoint *ep)
+	{
+		std::deque<NetEndpoint*> orphans;
+		{
+			ScopedSpinLock ml(lock());
+			NetIoMuxMemoryContext *ctx = (NetIoMuxMemoryContext*)ep->getAsyncContext();
+			if (ctx == 0)
+				return;
+
+			if (ctx->Engine)
+				detachLocked(ctx);
+			if (ctx->Peer)
+			{
+				ctx->Peer->Peer = 0;
+				ctx->Peer->PeerShut = true;
+				markReadyLocked(ctx->Peer);
+			}
+			orphans.swap(ctx->Backlog);
+			ep->setAsyncContext(0);
+			delete ctx;
+		}
+
+		// Connections never accepted are closed along with the listener.
+		for (u32 i = 0; i < (u32)orphans.size(); ++i)
+			delete orphans[i];
+	}
+
+private:
+	static NetIoMuxSpinLock& lock()
+	{
+		static NetIoMuxSpinLock sLock;
+		return sLock;
+	}
+
+	// Joined in-memory listeners by "name:port".
+	static std::map<std::string, NetIoMuxMemoryContext*>& registry()
+	{
+		static std::map<std::string, NetIoMuxMemoryContext*> sRegistry;
+		return sRegistry;
+	}
+
+	static std::string makeName(const c8 *host, const c8 *serviceOrPort)
+	{
+		std::string name((host) ? host : "localhost");
+		name.push_back(':');
+		name.append(lexical_cast<c8>(lexical_cast<u32, c8>(serviceOrPort)).c_str());
+		return name;
+	}
+
+	static NetIoMuxMemoryContext* context(NetEndpoint *ep) // require lock().
+	{
+		NetIoMuxMemoryContext *ctx = (NetIoMuxMemoryContext*)ep->getAsyncContext();
+		if (ctx == 0)
+		{
+			ctx = new NetIoMuxMemoryContext(ep);
+			ep->setAsyncContext((vptr)ctx);
+		}
+		return ctx;
+	}
+
+	// Leave the engine: Unregister the listener and drop the pending
+	// operations, as departing a socket does.
+	static void detachLocked(NetIoMuxMemoryContext *ctx) // require lock().
+	{
+		NetIoMuxMemory *engine = ctx->Engine;
+		if (ctx->Ready)
+		{
+			for (u32 i = 0; i < (u32)engine->mReady.size(); ++i)
+			{
+				if (engine->mReady[i] == ctx)
+				{
+					engine->mReady.erase(engine->mReady.begin() + i);
+					break;
+				}
+			}
+			ctx->Ready = false;
+		}
+		if (!ctx->Name.empty())
+		{
+			registry().erase(ctx->Name);
+			ctx->Name.clear();
+		}
+		ctx->Reads.clear();
+		ctx->Writes.clear();
+		ctx->Engine = 0;
+
+		// Completions left are emitted by the wakeup.
+		if ((xpfAtomicAdd(&engine->mJoined, -1) == 1) && !engine->mRecords.empty() && !engine->mKicked)
+		{
+			engine->mKicked = true;
+			engine->mImpl->asyncWakeup(engine);
+		}
+	}
+
+	static void markReadyLocked(NetIoMuxMemoryContext *ctx) // require lock().
+	{
+		NetIoMuxMemory *engine = ctx->Engine;
+		if ((engine == 0) || ctx->Ready)
+			return;
+
+		ctx->Ready = true;
+		engine->mReady.push_back(ctx);
+		if ((engine->mWaiters > 0) && !engine->mKicked)
+		{
+			engine->mKicked = true;
+			engine->mImpl->asyncWakeup(engine);
+		}
+	}
+
+	// Fault injection: Whether the attempt finds the pipe not ready.
+	bool stallLocked()
+	{
+		if (mFaults.StallPercent == 0)
+			return false;
+		// xorshift32
+		mRandom ^= mRandom << 13;
+		mRandom ^= mRandom >> 17;
+		mRandom ^= mRandom << 5;
+		return ((mRandom % 100) < mFaults.StallPercent);
+	}
+
+	void complete(const NetIoMuxMemoryOp &op, NetEndpoint::EError ec, NetEndpoint *ep, vptr tep, u32 len)
+	{
+		NetIoMuxCompletion rec;
+		rec.Type = op.Type;
+		rec.Error = ec;
+		rec.Endpoint = ep;
+		rec.TepOrPeer = tep;
+		rec.Buffer = op.Buffer;
+		rec.Length = len;
+		rec.SegmentSize = 0;
+		mRecords.push_back(rec);
+		mCallbacks.push_back(op.Cb);
+	}
+
+	void rejectLocked(NetEndpoint *ep, NetIoMux::EIoType type, NetIoMuxCallback *cb) // require lock().
+	{
+		NetIoMuxMemoryOp op;
+		op.Type = type;
+		op.Buffer = 0;
+		op.Length = 0;
+		op.Cb = cb;
+		complete(op, NetEndpoint::EE_INVALID_OP, ep, 0, 0);
+		// Without joined endpoints the completion is emitted by the
+		// wakeup, as runOnce() no longer dispatches.
+		if (((mWaiters > 0) || (0 == mJoined)) && !mKicked)
+		{
+			mKicked = true;
+			mImpl->asyncWakeup(this);
+		}
+	}
+
+	void connectLocked(NetIoMuxMemoryContext *ctx, const NetIoMuxMemoryOp &op)
+	{
+		std::map<std::string, NetIoMuxMemoryContext*>::iterator it = registry().find(op.Target);
+		if ((it == registry().end()) || (ctx->Ep->getStatus() != NetEndpoint::ESTAT_INIT))
+		{
+			complete(op, (it == registry().end()) ? NetEndpoint::EE_CONNECT : NetEndpoint::EE_INVALID_OP, ctx->Ep, 0, 0);
+			return;
+		}
+
+		// Create the accepted end and queue it to the listener.
+		NetIoMuxMemoryContext *listener = it->second;
+		NetEndpoint *tep = new NetEndpoint(ctx->Ep->getProtocol());
+		tep->setStatus(NetEndpoint::ESTAT_CONNECTED);
+		NetIoMuxMemoryContext *tctx = context(tep);
+		tctx->Peer = ctx;
+		ctx->Peer = tctx;
+		ctx->Ep->setStatus(NetEndpoint::ESTAT_CONNECTED);
+		listener->Backlog.push_back(tep);
+		markReadyLocked(listener);
+
+		// Initial data goes with the connection.
+		u32 len = (op.Length < MEMORY_PIPE_CAPACITY) ? op.Length : MEMORY_PIPE_CAPACITY;
+		tctx->Inbound.append(op.Buffer, len);
+		complete(op, NetEndpoint::EE_SUCCESS, ctx->Ep, 0, len);
+	}
+
+	// Progress the queued operations of 'ctx' as far as possible.
+	void performLocked(NetIoMuxMemoryContext *ctx)
+	{
+		bool stalled = false;
+
+		while (!ctx->Reads.empty() && !stalled)
+		{
+			const NetIoMuxMemoryOp &op = ctx->Reads.front();
+			if (op.Type == NetIoMux::EIT_ACCEPT)
+			{
+				if (ctx->Backlog.empty())
+					break;
+				if (stallLocked())
+				{
+					stalled = true;
+					break;
+				}
+				NetEndpoint *tep = ctx->Backlog.front();
+				ctx->Backlog.pop_front();
+				// Accepted endpoints are joined as sockets are.
+				NetIoMuxMemoryContext *tctx = context(tep);
+				tctx->Engine = this;
+				xpfAtomicAdd(&mJoined, 1);
+				markReadyLocked(tctx);
+				complete(op, NetEndpoint::EE_SUCCESS, ctx->Ep, (vptr)tep, 0);
+			}
+			else if (op.Type == NetIoMux::EIT_RECV)
+			{
+				u32 avail = ctx->inboundBytes();
+				if ((avail == 0) && !ctx->PeerShut)
+					break;
+				if (stallLocked())
+				{
+					stalled = true;
+					break;
+				}
+				u32 len = (op.Length < avail) ? op.Length : avail;
+				if ((mFaults.MaxRecvBytes != 0) && (len > mFaults.MaxRecvBytes))
+					len = mFaults.MaxRecvBytes;
+				memcpy(op.Buffer, ctx->Inbound.data() + ctx->InHead, len);
+				ctx->InHead += len;
+				if (ctx->InHead == ctx->Inbound.size())
+				{
+					ctx->Inbound.clear();
+					ctx->InHead = 0;
+				}
+				else if (ctx->InHead >= MEMORY_PIPE_CAPACITY / 2)
+				{
+					ctx->Inbound.erase(0, ctx->InHead);
+					ctx->InHead = 0;
+				}
+				// Room is made for the sends of the peer.
+				if ((len > 0) && ctx->Peer)
+					markReadyLocked(ctx->Peer);
+				complete(op, NetEndpoint::EE_SUCCESS, ctx->Ep, 0, len);
+			}
+			else
+			{
+				complete(op, NetEndpoint::EE_INVALID_OP, ctx->Ep, 0, 0);
+			}
+			ctx->Reads.pop_front();
+		}
+
+		while (!ctx->Writes.empty() && !stalled)
+		{
+			const NetIoMuxMemoryOp &op = ctx->Writes.front();
+			if (op.Type == NetIoMux::EIT_CONNECT)
+			{
+				connectLocked(ctx, op);
+			}
+			else if (op.Type == NetIoMux::EIT_SEND)
+			{
+				NetIoMuxMemoryContext *peer = ctx->Peer;
+				if ((peer == 0) || ctx->ShutWrite)
+				{
+					complete(op, NetEndpoint::EE_SEND, ctx->Ep, 0, 0);
+				}
+				else
+				{
+					const u32 room = MEMORY_PIPE_CAPACITY - peer->inboundBytes();
+					if ((room == 0) && (op.Length > 0))
+						break; // until the peer receives.
+					if (stallLocked())
+					{
+						stalled = true;
+						break;
+					}
+					u32 len = (op.Length < room) ? op.Length : room;
+					if ((mFaults.MaxSendBytes != 0) && (len > mFaults.MaxSendBytes))
+						len = mFaults.MaxSendBytes;
+					peer->Inbound.append(op.Buffer, len);
+					if (len > 0)
+						markReadyLocked(peer);
+					complete(op, NetEndpoint::EE_SUCCESS, ctx->Ep, 0, len);
+				}
+			}
+			else
+			{
+				complete(op, NetEndpoint::EE_INVALID_OP, ctx->Ep, 0, 0);
+			}
+			ctx->Writes.pop_front();
+		}
+
+		// Stalled operations are retried by the next pass.
+		if (stalled)
+			markReadyLocked(ctx);
+	}
+
+	// Perform the ready contexts and emit the completions. Return
+	// whether completions are left for the next pass.
+	bool dispatch()
+	{
+		NetIoMuxCompletion records[MEMORY_MAX_DISPATCH];
+		NetIoMuxCallback *callbacks[MEMORY_MAX_DISPATCH];
+		u32 count = 0;
+
+		lock().lock();
+		std::vector<NetIoMuxMemoryContext*> ready;
+		ready.swap(mReady);
+		for (u32 i = 0; i < (u32)ready.size(); ++i)
+		{
+			ready[i]->Ready = false;
+			performLocked(ready[i]);
+		}
+		count = (u32)mRecords.size();
+		if (count > MEMORY_MAX_DISPATCH)
+			count = MEMORY_MAX_DISPATCH;
+		for (u32 i = 0; i < count; ++i)
+		{
+			records[i] = mRecords[i];
+			callbacks[i] = mCallbacks[i];
+		}
+		mRecords.erase(mRecords.begin(), mRecords.begin() + count);
+		// Completions left over are emitted by the next pass.
+		mCallbacks.erase(mCallbacks.begin(), mCallbacks.begin() + count);
+		const bool more = !mRecords.empty();
+		lock().unlock();
+
+		// Runs of completions sharing a callback go as one batch.
+		u32 begin = 0;
+		for (u32 i = 1; i <= count; ++i)
+		{
+			if ((i == count) || (callbacks[i] != callbacks[begin]))
+			{
+				mImpl->profiler().emit(callbacks[begin], &records[begin], i - begin);
+				begin = i;
+			}
+		}
+		return more;
+	}
+
+	NetIoMuxImpl                          *mImpl;
+	volatile bool                          mEnabled;
+	volatile s32                           mJoined;  // in-memory endpoints joined.
+	u32                                    mWaiters; // workers polling the platform multiplexer.
+	bool                                   mKicked;  // a wakeup is posted.
+	NetIoMux::MemoryFaults                 mFaults;
+	u32                                    mRandom;
+	std::vector<NetIoMuxMemoryContext*>    mReady;
+	std::vector<NetIoMuxCompletion>        mRecords;   // completions to emit.
+	std::vector<NetIoMuxCallback*>         mCallbacks;
+};
+
+// Hooks of NetEndpoint.
+void netIoMuxMemoryShutdown(NetEndpoint *ep, NetEndpoint::EShutdownDir dir)
+{
+	NetIoMuxMemory::shutdown(ep, dir);
+}
+
+void netIoMuxMemoryClose(NetEndpoint *ep)
+{
+	NetIoMuxMemory::close(ep);
+}
+
+} // end of namespace xpf
@@ -0,0 +1,114 @@
+/*******************************************************************************
+ * Copyright (c) 2013 matt@moregeek.com.tw
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ * 3. This notice may not be removed or altered from any source
+ *    distribution.
+ ********************************************************************************/
+
+#include <xpf/platform.h>
+#include <stdlib.h>
+
+namespace xpf
+{
+
+// A FIFO of pointers to pending operations of a socket. The first
+// INLINE_CAP elements are kept in an inline ring so that an idle or
+// lightly loaded socket costs no heap allocation. Deeper queues spill
+// to a heap ring (of power-of-2 capacity) which is released once the
+// queue drains.
+// Not thread-safe: guarded by the lock of the owning context.
+template < typename T, u32 INLINE_CAP >
+class NetIoMuxOpRing
+{
+public:
+	NetIoMuxOpRing()
+		: mRing(mInline), mHead(0), mCount(0), mCapacity(INLINE_CAP)
+	{
+		xpfSAssert(((INLINE_CAP & (INLINE_CAP - 1)) == 0)); // power of 2
+	}
+
+	~NetIoMuxOpRing()
+	{
+		release();
+	}
+
+	inline bool empty() const { return (mCount == 0); }
+	inline u32  size() const  { return mCount; }
+	inline T*   front() const { return mRing[mHead]; }
+	inline T*   at(u32 i) const { return mRing[(mHead + i) & (mCapacity - 1)]; }
+
+	void push_back(T *p)
+	{
+		if (xpfUnlikely(mCount == mCapacity))
+			grow();
+		mRing[(mHead + mCount) & (mCapacity - 1)] = p;
+		++mCount;
+	}
+
+	void pop_front()
+	{
+		xpfAssert(("Popping an empty ring.", mCount > 0));
+		mHead = (mHead + 1) & (mCapacity - 1);
+		if (--mCount == 0)
+			release();
+	}
+
+	void clear()
+	{
+		mCount = 0;
+		release();
+	}
+
+private:
+	// Non-copyable
+	NetIoMuxOpRing(const NetIoMuxOpRing& that) {}
+	NetIoMuxOpRing& operator = (const NetIoMuxOpRing& that) { return *this; }
+
+	void grow()
+	{
+		const u32 cap = mCapacity << 1;
+		T **ring = (T**) ::malloc(sizeof(T*) * cap);
+		xpfAssert(("Out of memory.", ring != 0));
+		for (u32 i = 0; i < mCount; ++i)
+			ring[i] = at(i);
+		if (mRing != mInline)
+			::free(mRing);
+		mRing = ring;
+		mHead = 0;
+		mCapacity = cap;
+	}
+
+	// Return to the inline ring. Only called when empty.
+	inline void release()
+	{
+		if (mRing != mInline)
+			::free(mRing);
+		mRing = mInline;
+		mHead = 0;
+		mCapacity = INLINE_CAP;
+	}
+
+	T   **mRing;
+	T    *mInline[INLINE_CAP];
+	u32   mHead;
+	u32   mCount;
+	u32   mCapacity;
+};
+
+} // end of namespace xpf
@@ -0,0 +1,160 @@
+/*******************************************************************************
+ * Copyright (c) 2013 matt@moregeek.com.tw
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ * 3. This notice may not be removed or altered from any source
+ *    distribution.
+ ********************************************************************************/
+
+#include <xpf/netiomux.h>
+#include <xpf/atomic.h>
+#include <string.h>
+
+// NOTE: Requires netiomux_spinlock.hpp and netiomux_timers.hpp being
+//       included beforehand.
+
+#define PROFILE_IO_TYPES    (NetIoMux::EIT_TIMER + 1)
+#define PROFILE_SLOW_RECORDS (64)
+
+namespace xpf
+{
+
+// Callback profiler of NetIoMux::enableProfiler(). Backends emit their
+// completions through emit(). While disabled it passes the batch on as
+// is; while enabled it calls the callback per record between a pair of
+// clock reads and accounts the duration to the I/O type of the record.
+// Counters are updated atomically so that workers do not contend on a
+// lock, but slow callbacks which are rare by definition.
+class NetIoMuxProfiler
+{
+public:
+	NetIoMuxProfiler()
+		: mEnabled(false)
+		, mThresholdUs(1000)
+		, mSlowNext(0)
+	{
+		reset();
+	}
+
+	void enable(bool val, u32 slowThresholdUs)
+	{
+		mThresholdUs = slowThresholdUs;
+		mEnabled = val;
+	}
+
+	void emit(NetIoMuxCallback *cb, const NetIoMuxCompletion *records, u32 count)
+	{
+		if (!mEnabled)
+		{
+			cb->onIoCompletedBatch(records, count);
+			return;
+		}
+
+		for (u32 i = 0; i < count; ++i)
+		{
+			// Copy out the identity: The callback may release the
+			// endpoint or the records.
+			const NetIoMux::EIoType type = records[i].Type;
+			const NetEndpoint::EError ec = records[i].Error;
+			NetEndpoint *ep = records[i].Endpoint;
+
+			const u64 begin = netIoMuxNowUs();
+			cb->onIoCompletedBatch(&records[i], 1);
+			account(type, ec, ep, begin, netIoMuxNowUs() - begin);
+		}
+	}
+
+	bool get(NetIoMux::EIoType type, NetIoMux::ProfileStats &stats) const
+	{
+		if (((u32)type >= PROFILE_IO_TYPES) || (type == NetIoMux::EIT_INVALID))
+			return false;
+		stats = mStats[type];
+		return true;
+	}
+
+	// Copy the latest slow callbacks, oldest first.
+	u32 getSlow(NetIoMux::SlowCallback *out, u32 max)
+	{
+		ScopedSpinLock lock(mSlowLock);
+		const u32 have = (mSlowNext < PROFILE_SLOW_RECORDS) ? mSlowNext : PROFILE_SLOW_RECORDS;
+		const u32 n = (max < have) ? max : have;
+		for (u32 i = 0; i < n; ++i)
+			out[i] = mSlow[(mSlowNext - n + i) % PROFILE_SLOW_RECORDS];
+		return n;
+	}
+
+	void reset()
+	{
+		ScopedSpinLock lock(mSlowLock);
+		memset(mStats, 0, sizeof(mStats));
+		memset(mSlow, 0, sizeof(mSlow));
+		mSlowNext = 0;
+	}
+
+private:
+	// Non-copyable
+	NetIoMuxProfiler(const NetIoMuxProfiler& that) {}
+	NetIoMuxProfiler& operator = (const NetIoMuxProfiler& that) { return *this; }
+
+	void account(NetIoMux::EIoType type, NetEndpoint::EError ec, NetEndpoint *ep, u64 begin, u64 us)
+	{
+		if ((u32)type >= PROFILE_IO_TYPES)
+			return;
+
+		NetIoMux::ProfileStats &s = mStats[type];
+		xpfAtomicAdd64(&s.Count, 1);
+		xpfAtomicAdd64(&s.TotalUs, us);
+		xpfAtomicAdd64(&s.Histogram[bucketOf(us)], 1);
+		for (u64 m = s.MaxUs; us > m; m = s.MaxUs)
+		{
+			if (xpfAtomicCAS64(&s.MaxUs, m, us) == m)
+				break;
+		}
+
+		if (us >= mThresholdUs)
+		{
+			xpfAtomicAdd64(&s.SlowCount, 1);
+			ScopedSpinLock lock(mSlowLock);
+			NetIoMux::SlowCallback &r = mSlow[mSlowNext % PROFILE_SLOW_RECORDS];
+			r.Type = type;
+			r.Error = ec;
+			r.Endpoint = ep;
+			r.TimeUs = begin;
+			r.DurationUs = us;
+			++mSlowNext;
+		}
+	}
+
+	// Bucket i counts durations of [2^i, 2^(i+1)) us, bucket 0 also 0 us.
+	static u32 bucketOf(u64 us)
+	{
+		u32 b = 0;
+		while ((us >>= 1) != 0)
+			++b;
+		return (b < NetIoMux::PROFILE_BUCKETS) ? b : NetIoMux::PROFILE_BUCKETS - 1;
+	}
+
+	volatile bool           mEnabled;
+	volatile u32            mThresholdUs;
+	NetIoMux::ProfileStats  mStats[PROFILE_IO_TYPES];
+	NetIoMuxSpinLock        mSlowLock;
+	NetIoMux::SlowCallback  mSlow[PROFILE_SLOW_RECORDS];
+	u32                     mSlowNext;
+};
+
+} // end of namespace xpf
@@ -0,0 +1,93 @@
+/*******************************************************************************
+ * Copyright (c) 2013 matt@moregeek.com.tw
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ * 3. This notice may not be removed or altered from any source
+ *    distribution.
+ ********************************************************************************/
+
+#include <xpf/platform.h>
+#include <xpf/atomic.h>
+#include <xpf/thread.h>
+
+namespace xpf
+{
+
+// A recursive spin lock for per-socket contexts. It is 16 bytes and
+// needs no heap allocation, whereas a ThreadLock allocates a recursive
+// mutex. Critical sections guarded by it are short, so contenders spin
+// for a while before yielding their time slice.
+class NetIoMuxSpinLock
+{
+public:
+	NetIoMuxSpinLock()
+		: mOwner(Thread::INVALID_THREAD_ID), mDepth(0) {}
+
+	void lock()
+	{
+		const ThreadID me = Thread::getThreadID();
+		if (mOwner == me)
+		{
+			++mDepth;
+			return;
+		}
+
+		u32 spins = 0;
+		while (xpfAtomicCAS64(&mOwner, Thread::INVALID_THREAD_ID, me) != Thread::INVALID_THREAD_ID)
+		{
+			if (++spins >= 64)
+			{
+				Thread::yield();
+				spins = 0;
+			}
+		}
+		mDepth = 1;
+	}
+
+	void unlock()
+	{
+		xpfAssert(("Unlocking a spin lock not owned.", mOwner == Thread::getThreadID()));
+		if (--mDepth == 0)
+		{
+			const ThreadID me = mOwner;
+			xpfAtomicCAS64(&mOwner, me, Thread::INVALID_THREAD_ID); // full barrier
+		}
+	}
+
+private:
+	// Non-copyable
+	NetIoMuxSpinLock(const NetIoMuxSpinLock& that) {}
+	NetIoMuxSpinLock& operator = (const NetIoMuxSpinLock& that) { return *this; }
+
+	volatile ThreadID mOwner;
+	u32               mDepth;
+};
+
+class ScopedSpinLock
+{
+public:
+	explicit ScopedSpinLock(NetIoMuxSpinLock &lock) : mLock(&lock) { mLock->lock(); }
+	~ScopedSpinLock() { mLock->unlock(); }
+private:
+	// Non-copyable
+	ScopedSpinLock(const ScopedSpinLock& that) {}
+	ScopedSpinLock& operator = (const ScopedSpinLock& that) { return *this; }
+	NetIoMuxSpinLock *mLock;
+};
+
+} // end of namespace xpf
@@ -86,5 +86,132 @@ private:
     std::deque<void*> mList;
 };
 
+// What a ready endpoint may perform in one turn of a worker (see
+// NetIoMux::setTurnBudget()). EPR_HIGH endpoints get 4 times the
+// budget of EPR_NORMAL ones and EPR_LOW endpoints a quarter of it.
+struct NetIoMuxTurnBudget
+{
+	u32 Ops;    // 0: unlimited.
+	u32 Bytes;  // 0: unlimited.
+	u32 UsedOps;
+	u32 UsedBytes;
+
+	NetIoMuxTurnBudget(u32 ops, u32 bytes, u8 prio)
+		: Ops(ops), Bytes(bytes), UsedOps(0), UsedBytes(0)
+	{
+		if (prio == NetIoMux::EPR_HIGH)
+		{
+			Ops *= 4;
+			Bytes *= 4;
+		}
+		else if (prio == NetIoMux::EPR_LOW)
+		{
+			Ops = (Ops == 0) ? 0 : ((Ops > 4) ? Ops / 4 : 1);
+			Bytes = (Bytes == 0) ? 0 : ((Bytes > 4) ? Bytes / 4 : 1);
+		}
+	}
+
+	inline bool exhausted() const
+	{
+		return ((Ops != 0) && (UsedOps >= Ops)) || ((Bytes != 0) && (UsedBytes >= Bytes));
+	}
+
+	// Whether the budget outlasts 'ops' more operations of 'bytes' in
+	// total, i.e. whether another operation may follow them.
+	inline bool outlasts(u32 ops, u64 bytes) const
+	{
+		return ((Ops == 0) || (UsedOps + ops < Ops)) && ((Bytes == 0) || (UsedBytes + bytes < Bytes));
+	}
+
+	inline void charge(u32 bytes)
+	{
+		UsedOps++;
+		UsedBytes += bytes;
+	}
+};
+
+// Ready list of endpoints in the priority classes of NetIoMux::EPriority.
+// Classes are served by weighted round robin: In a round, up to 4
+// endpoints of EPR_HIGH, 2 of EPR_NORMAL and 1 of EPR_LOW are popped,
+// so that no class starves.
+class NetIoMuxReadyList
+{
+public:
+	NetIoMuxReadyList() : mCount(0)
+	{
+		refill();
+	}
+
+	void* pop_front(u32 & count)
+	{
+		ScopedThreadLock ml(mLock);
+		if (mCount == 0)
+		{
+			count = 0;
+			return 0;
+		}
+
+		for (;;)
+		{
+			for (s32 c = NetIoMux::EPR_HIGH; c >= NetIoMux::EPR_LOW; --c)
+			{
+				if (mLists[c].empty() || (mCredits[c] == 0))
+					continue;
+				void *ret = mLists[c].front();
+				mLists[c].pop_front();
+				mCredits[c]--;
+				count = --mCount;
+				return ret;
+			}
+			refill();
+		}
+	}
+
+	void push_back(void *data, u8 prio)
+	{
+		if (data)
+		{
+			xpfAssert(("Unexpected priority class.", prio <= NetIoMux::EPR_HIGH));
+			ScopedThreadLock ml(mLock);
+			mLists[prio].push_back(data);
+			mCount++;
+		}
+	}
+
+	// Note: O(N)
+	bool erase(void *data)
+	{
+		ScopedThreadLock ml(mLock);
+		if (data == 0)
+			return false;
+		for (u32 c = 0; c <= NetIoMux::EPR_HIGH; ++c)
+		{
+			for (std::deque<void*>::iterator it = mLists[c].begin();
+					it != mLists[c].end(); ++it)
+			{
+				if (*it == data)
+				{
+					mLists[c].erase(it);
+					mCount--;
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+private:
+	void refill()
+	{
+		for (u32 c = 0; c <= NetIoMux::EPR_HIGH; ++c)
+			mCredits[c] = 1u << c;
+	}
+
+	ThreadLock mLock;
+	std::deque<void*> mLists[NetIoMux::EPR_HIGH + 1];
+	u32 mCredits[NetIoMux::EPR_HIGH + 1];
+	u32 mCount;
+};
+
 } // end of namespace xpf
 
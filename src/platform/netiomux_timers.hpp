@@ -0,0 +1,170 @@
+/*******************************************************************************
+ * Copyright (c) 2013 matt@moregeek.com.tw
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ * 3. This notice may not be removed or altered from any source
+ *    distribution.
+ ********************************************************************************/
+
+#include <xpf/platform.h>
+#include <map>
+
+#if defined(XPF_PLATFORM_WINDOWS)
+#  include <Windows.h>
+#else
+#  include <time.h>
+#endif
+
+// NOTE: Requires netiomux_spinlock.hpp being included beforehand.
+
+namespace xpf
+{
+
+// Milliseconds of a monotonic clock.
+static inline u64 netIoMuxNowMs()
+{
+#if defined(XPF_PLATFORM_WINDOWS)
+	return (u64)::GetTickCount64();
+#else
+	struct timespec ts;
+	::clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((u64)ts.tv_sec * 1000) + ((u64)ts.tv_nsec / 1000000);
+#endif
+}
+
+// Microseconds of a monotonic clock.
+static inline u64 netIoMuxNowUs()
+{
+#if defined(XPF_PLATFORM_WINDOWS)
+	LARGE_INTEGER freq, now;
+	::QueryPerformanceFrequency(&freq);
+	::QueryPerformanceCounter(&now);
+	return (u64)((now.QuadPart / freq.QuadPart) * 1000000 + ((now.QuadPart % freq.QuadPart) * 1000000) / freq.QuadPart);
+#else
+	struct timespec ts;
+	::clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((u64)ts.tv_sec * 1000000) + ((u64)ts.tv_nsec / 1000);
+#endif
+}
+
+// One-shot timers of NetIoMux::asyncTimer(). Each timer carries an
+// opaque operation record of the backend, which is handed back once the
+// timer expires or is cancelled. Workers poll expire() and bound their
+// waiting with waitTime().
+class NetIoMuxTimerQueue
+{
+public:
+	NetIoMuxTimerQueue() : mNextId(0), mCount(0) {}
+
+	// Schedule 'op' to expire 'delayMs' later. Returns the timer id
+	// (never 0). 'earliest' is set if it is due before all other timers,
+	// in which case a blocking worker has to be interrupted.
+	u64 schedule(u32 delayMs, vptr op, bool &earliest)
+	{
+		const u64 deadline = netIoMuxNowMs() + delayMs;
+
+		ScopedSpinLock ml(mLock);
+		const u64 id = ++mNextId;
+		earliest = mOrder.empty() || (deadline < mOrder.begin()->first.first);
+		mOrder[Key(deadline, id)] = op;
+		mDeadlines[id] = deadline;
+		mCount = (u32)mDeadlines.size();
+		return id;
+	}
+
+	// Remove a timer not yet expired and return its op, or 0 if there
+	// is no such timer.
+	vptr cancel(u64 id)
+	{
+		ScopedSpinLock ml(mLock);
+		std::map<u64, u64>::iterator it = mDeadlines.find(id);
+		if (it == mDeadlines.end())
+			return 0;
+
+		std::map<Key, vptr>::iterator oit = mOrder.find(Key(it->second, id));
+		xpfAssert(("Timer queue out of sync.", oit != mOrder.end()));
+		vptr op = oit->second;
+		mOrder.erase(oit);
+		mDeadlines.erase(it);
+		mCount = (u32)mDeadlines.size();
+		return op;
+	}
+
+	// Pop up to 'maxOps' expired timers, earliest first.
+	u32 expire(vptr *ops, u32 maxOps)
+	{
+		if (mCount == 0)
+			return 0;
+
+		const u64 now = netIoMuxNowMs();
+		u32 cnt = 0;
+		ScopedSpinLock ml(mLock);
+		while ((cnt < maxOps) && !mOrder.empty())
+		{
+			std::map<Key, vptr>::iterator it = mOrder.begin();
+			if (it->first.first > now)
+				break;
+			ops[cnt++] = it->second;
+			mDeadlines.erase(it->first.second);
+			mOrder.erase(it);
+		}
+		mCount = (u32)mDeadlines.size();
+		return cnt;
+	}
+
+	// 'timeoutMs' shortened to the time left before the earliest timer.
+	u32 waitTime(u32 timeoutMs)
+	{
+		if (mCount == 0)
+			return timeoutMs;
+
+		const u64 now = netIoMuxNowMs();
+		ScopedSpinLock ml(mLock);
+		if (mOrder.empty())
+			return timeoutMs;
+		const u64 deadline = mOrder.begin()->first.first;
+		const u64 left = (deadline > now) ? (deadline - now) : 0;
+		return (left < timeoutMs) ? (u32)left : timeoutMs;
+	}
+
+	// Pop any remaining timer regardless of its deadline. For releasing
+	// them at destruction. Returns 0 if none.
+	vptr pop()
+	{
+		ScopedSpinLock ml(mLock);
+		if (mOrder.empty())
+			return 0;
+		std::map<Key, vptr>::iterator it = mOrder.begin();
+		vptr op = it->second;
+		mDeadlines.erase(it->first.second);
+		mOrder.erase(it);
+		mCount = (u32)mDeadlines.size();
+		return op;
+	}
+
+private:
+	typedef std::pair<u64, u64> Key; // (deadline, id)
+
+	NetIoMuxSpinLock    mLock;
+	std::map<Key, vptr> mOrder;     // ops ordered by deadline.
+	std::map<u64, u64>  mDeadlines; // deadline of each timer id.
+	u64                 mNextId;
+	volatile u32        mCount;     // number of timers, read without lock.
+};
+
+} // end of namespace xpf
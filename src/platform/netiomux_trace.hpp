@@ -0,0 +1,334 @@
+/*******************************************************************************
+ * Copyright (c) 2013 matt@moregeek.com.tw
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ * 3. This notice may not be removed or altered from any source
+ *    distribution.
+ ********************************************************************************/ 
+
+#include <xpf/netiomux.h>
+#include <xpf/nettrace.h>
+#include <xpf/thread.h>
+#include <xpf/threadlock.h>
+#include <xpf/threadevent.h>
+
+#include <map>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+
+// NOTE: Requires netiomux_spinlock.hpp and netiomux_timers.hpp being
+//       included beforehand.
+
+#define TRACE_FLUSH_RECORDS (256)
+#define TRACE_MAX_RECORDS   (0x3fffffff / 32)
+
+namespace xpf
+{
+
+class NetIoMuxTracer;
+
+// An operation being traced. It stands in for the callback of the
+// operation, records the completion and passes it on.
+class NetIoMuxTraceOp : public NetIoMuxCallback
+{
+public:
+	virtual ~NetIoMuxTraceOp() {}
+	void onIoCompleted(NetIoMux::EIoType type, NetEndpoint::EError ec, NetEndpoint *sep, vptr tepOrPeer, const c8 *buf, u32 len);
+	void onIoCompletedBatch(const NetIoMuxCompletion *records, u32 count);
+	// Notifications that are not completions go straight to the callback.
+	void onWriteWatermark(NetEndpoint *ep, bool aboveHigh) { Cb->onWriteWatermark(ep, aboveHigh); }
+	void onFdReady(s32 fd, u32 events, vptr userData) { Cb->onFdReady(fd, events, userData); }
+
+	NetIoMuxTracer    *Tracer;
+	NetIoMuxCallback  *Cb;
+	NetIoMuxTraceOp   *Prev;
+	NetIoMuxTraceOp   *Next;
+	u64                SubmitUs;
+	u32                EndpointId;
+	u32                Requested;
+};
+
+// Trace recording of NetIoMux (see NetIoMux::startTrace()). Records are
+// buffered by the completing workers and written to the ring file by a
+// writer thread, once TRACE_FLUSH_RECORDS are pending or every 100ms.
+class NetIoMuxTracer
+{
+public:
+	NetIoMuxTracer()
+		: mActive(false), mFile(0), mStartUs(0), mCapacity(0)
+		, mWritten(0), mNextId(0), mOps(0), mWriter(0)
+	{
+	}
+
+	~NetIoMuxTracer()
+	{
+		stop();
+		// Operations never completed (failed by a depart() but never
+		// dispatched by runOnce()).
+		while (mOps)
+		{
+			NetIoMuxTraceOp *op = mOps;
+			mOps = op->Next;
+			delete op;
+		}
+	}
+
+	bool start(const c8 *path, u32 capacity)
+	{
+		ScopedThreadLock cl(mControlLock);
+		// Keep the ring file addressable by fseek().
+		if (mActive || (capacity == 0) || (capacity > TRACE_MAX_RECORDS))
+			return false;
+
+		mFile = ::fopen(path, "wb");
+		if (mFile == 0)
+			return false;
+
+		mCapacity = capacity;
+		mWritten = 0;
+		mPending.clear();
+		mPending.reserve(TRACE_FLUSH_RECORDS);
+		if (!writeHeader())
+		{
+			::fclose(mFile);
+			mFile = 0;
+			return false;
+		}
+		{
+			ScopedSpinLock ml(mLock);
+			mIds.clear();
+			mNextId = 0;
+			mStartUs = netIoMuxNowUs();
+			mActive = true;
+		}
+		mEvent.reset();
+		mWriter = new Writer(this);
+		mWriter->start();
+		return true;
+	}
+
+	void stop()
+	{
+		ScopedThreadLock cl(mControlLock);
+		{
+			ScopedSpinLock ml(mLock);
+			if (!mActive)
+				return;
+			mActive = false;
+		}
+		// The writer drains the pending records before leaving.
+		mEvent.set();
+		mWriter->join();
+		delete mWriter;
+		mWriter = 0;
+		::fclose(mFile);
+		mFile = 0;
+	}
+
+	// Returns the callback to submit the operation with: 'cb' itself
+	// unless tracing.
+	inline NetIoMuxCallback* wrap(NetEndpoint *ep, u32 requested, NetIoMuxCallback *cb)
+	{
+		if (!mActive)
+			return cb;
+
+		NetIoMuxTraceOp *op = new NetIoMuxTraceOp;
+		op->Tracer = this;
+		op->Cb = cb;
+		op->Prev = 0;
+		op->Requested = requested;
+
+		ScopedSpinLock ml(mLock);
+		op->EndpointId = (ep) ? idOf(ep) : 0;
+		op->SubmitUs = netIoMuxNowUs();
+		op->Next = mOps;
+		if (mOps)
+			mOps->Prev = op;
+		mOps = op;
+		return op;
+	}
+
+	void forget(NetEndpoint *ep)
+	{
+		if (!mActive)
+			return;
+		ScopedSpinLock ml(mLock);
+		mIds.erase(ep);
+	}
+
+	// Record the completion of 'op' and release it. Returns the
+	// callback to pass the completion on to.
+	NetIoMuxCallback* complete(NetIoMuxTraceOp *op, const NetIoMuxCompletion &c)
+	{
+		const u64 now = netIoMuxNowUs();
+		NetIoMuxCallback *cb = op->Cb;
+		bool kick = false;
+
+		{
+			ScopedSpinLock ml(mLock);
+			if (op->Prev)
+				op->Prev->Next = op->Next;
+			else
+				mOps = op->Next;
+			if (op->Next)
+				op->Next->Prev = op->Prev;
+
+			// Skip operations submitted before the trace started.
+			if (mActive && (op->SubmitUs >= mStartUs))
+			{
+				NetTraceRecord r;
+				r.TimeUs = op->SubmitUs - mStartUs;
+				r.LatencyUs = (u32)(now - op->SubmitUs);
+				r.EndpointId = (op->EndpointId != 0) ? op->EndpointId : ((c.Endpoint) ? idOf(c.Endpoint) : 0);
+				r.PeerId = ((c.Type == NetIoMux::EIT_ACCEPT) && (c.TepOrPeer != 0)) ? idOf((NetEndpoint*)c.TepOrPeer) : 0;
+				r.Requested = op->Requested;
+				r.Length = c.Length;
+				r.Type = (u8)c.Type;
+				r.Error = (u8)c.Error;
+				r.Reserved = 0;
+				mPending.push_back(r);
+				kick = (mPending.size() == TRACE_FLUSH_RECORDS);
+			}
+		}
+		// Wake the writer outside of the spin lock.
+		if (kick)
+			mEvent.set();
+		delete op;
+		return cb;
+	}
+
+private:
+	class Writer : public Thread
+	{
+	public:
+		explicit Writer(NetIoMuxTracer *tracer) : mTracer(tracer) {}
+		u32 run(u64 userdata)
+		{
+			mTracer->write();
+			return 0;
+		}
+	private:
+		NetIoMuxTracer *mTracer;
+	};
+
+	// Body of the writer thread. Takes the pending records under the
+	// spin lock and writes them to the file without holding it.
+	void write()
+	{
+		std::vector<NetTraceRecord> records;
+		records.reserve(TRACE_FLUSH_RECORDS);
+		bool active = true;
+		while (active)
+		{
+			mEvent.wait(100);
+			// Reset before taking the records so that a kick after
+			// the swap is never lost.
+			mEvent.reset();
+			{
+				ScopedSpinLock ml(mLock);
+				records.swap(mPending);
+				active = mActive;
+			}
+			if (!records.empty())
+			{
+				flush(records);
+				records.clear();
+			}
+		}
+	}
+
+	u32 idOf(const NetEndpoint *ep) // require mLock.
+	{
+		std::map<const NetEndpoint*, u32>::iterator it = mIds.find(ep);
+		if (it != mIds.end())
+			return it->second;
+		const u32 id = ++mNextId;
+		mIds[ep] = id;
+		return id;
+	}
+
+	bool writeHeader() // writer thread, or while it is not running.
+	{
+		NetTraceHeader h;
+		memset(&h, 0, sizeof(h));
+		h.Magic = NetTraceHeader::MAGIC;
+		h.Version = NetTraceHeader::VERSION;
+		h.RecordSize = (u16)sizeof(NetTraceRecord);
+		h.Capacity = mCapacity;
+		h.Written = mWritten;
+		return (0 == ::fseek(mFile, 0, SEEK_SET)) && (1 == ::fwrite(&h, sizeof(h), 1, mFile));
+	}
+
+	// Write the records to their slots in the ring.
+	void flush(const std::vector<NetTraceRecord> &records) // writer thread.
+	{
+		u32 done = 0;
+		while (done < (u32)records.size())
+		{
+			const u32 slot = (u32)(mWritten % mCapacity);
+			u32 n = (u32)records.size() - done;
+			if (n > mCapacity - slot)
+				n = mCapacity - slot;
+			const long offset = (long)(sizeof(NetTraceHeader) + (u64)slot * sizeof(NetTraceRecord));
+			if ((0 != ::fseek(mFile, offset, SEEK_SET)) || (n != ::fwrite(&records[done], sizeof(NetTraceRecord), n, mFile)))
+				break;
+			mWritten += n;
+			done += n;
+		}
+		writeHeader();
+		::fflush(mFile);
+	}
+
+	NetIoMuxSpinLock                         mLock;
+	ThreadLock                               mControlLock; // serializes start() and stop().
+	volatile bool                            mActive;
+	FILE                                    *mFile;     // touched by the writer only while it runs.
+	u64                                      mStartUs;
+	u32                                      mCapacity;
+	u64                                      mWritten;
+	std::vector<NetTraceRecord>              mPending;
+	std::map<const NetEndpoint*, u32>        mIds;
+	u32                                      mNextId;
+	NetIoMuxTraceOp                         *mOps; // operations in flight.
+	Writer                                  *mWriter;
+	ThreadEvent                              mEvent;    // kicks the writer.
+};
+
+inline void NetIoMuxTraceOp::onIoCompleted(NetIoMux::EIoType type, NetEndpoint::EError ec, NetEndpoint *sep, vptr tepOrPeer, const c8 *buf, u32 len)
+{
+	NetIoMuxCompletion c;
+	c.Type = type;
+	c.Error = ec;
+	c.Endpoint = sep;
+	c.TepOrPeer = tepOrPeer;
+	c.Buffer = buf;
+	c.Length = len;
+	c.SegmentSize = 0;
+	onIoCompletedBatch(&c, 1);
+}
+
+inline void NetIoMuxTraceOp::onIoCompletedBatch(const NetIoMuxCompletion *records, u32 count)
+{
+	// Each traced operation has its own callback: 'count' is 1.
+	const NetIoMuxCompletion c = records[0];
+	NetIoMuxCallback *cb = Tracer->complete(this, c);
+	cb->onIoCompletedBatch(&c, 1);
+}
+
+} // end of namespace xpf
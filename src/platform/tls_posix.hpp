@@ -37,10 +37,10 @@ struct TlsIndex
 };
 
 vptr
-TlsCreate()
+TlsCreate(TlsDestructor dtor)
 {
 	pthread_key_t idx;
-	if (0 != pthread_key_create(&idx, 0))
+	if (0 != pthread_key_create(&idx, (void (*)(void*))dtor))
 	{
 		xpfAssert(("Failed on pthread_key_create().", false));
 		return 0;
@@ -38,13 +38,14 @@ namespace xpf {
 struct TlsIndex
 {
 	DWORD Index;
+	bool  Fiber; // allocated by FlsAlloc() for its destructor.
 };
 
 vptr XPF_API
-TlsCreate()
+TlsCreate(TlsDestructor dtor)
 {
-	DWORD idx = TlsAlloc();
-	if (idx == TLS_OUT_OF_INDEXES)
+	DWORD idx = (dtor) ? FlsAlloc((PFLS_CALLBACK_FUNCTION)dtor) : TlsAlloc();
+	if (idx == ((dtor) ? FLS_OUT_OF_INDEXES : TLS_OUT_OF_INDEXES))
 	{
 		DWORD errorcode = GetLastError();
 		xpfAssert(("Failed on TlsAlloc()", false));
@@ -53,6 +54,7 @@ TlsCreate()
 
 	TlsIndex *ret = new TlsIndex;
 	ret->Index = idx;
+	ret->Fiber = (dtor != 0);
 	return (vptr)ret;
 }
 
@@ -64,7 +66,7 @@ TlsDelete(vptr index)
 		return;
 	
 	TlsIndex *idx = (TlsIndex*)index;
-	if (TlsFree(idx->Index) == 0)
+	if (((idx->Fiber) ? FlsFree(idx->Index) : TlsFree(idx->Index)) == 0)
 	{
 		DWORD errorcode = GetLastError();
 		xpfAssert(("Failed on TlsFree()", false));
@@ -80,7 +82,7 @@ TlsGet(vptr index)
 		return 0;
 
 	TlsIndex *idx = (TlsIndex*)index;
-	LPVOID data = TlsGetValue(idx->Index);
+	LPVOID data = (idx->Fiber) ? FlsGetValue(idx->Index) : TlsGetValue(idx->Index);
 	if (data == 0)
 	{
 		DWORD errorcode = GetLastError();
@@ -97,7 +99,7 @@ TlsSet(vptr index, vptr data)
 		return;
 
 	TlsIndex *idx = (TlsIndex*)index;
-	if (TlsSetValue(idx->Index, (LPVOID)data) == 0)
+	if (((idx->Fiber) ? FlsSetValue(idx->Index, (PVOID)data) : TlsSetValue(idx->Index, (LPVOID)data)) == 0)
 	{
 		DWORD errorcode = GetLastError();
 		xpfAssert(("Failed on TlsSetValue()", false));
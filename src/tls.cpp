@@ -22,6 +22,7 @@
  ********************************************************************************/
 
 #include <xpf/platform.h>
+#include <xpf/tls.h>
 
 #ifdef XPF_PLATFORM_WINDOWS
 #include "platform/tls_windows.hpp"
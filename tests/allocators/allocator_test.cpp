@@ -22,10 +22,16 @@
  ********************************************************************************/
 
 #include <xpf/allocators.h>
+#include <xpf/thread.h>
+#include <xpf/threadlock.h>
+#include <xpf/atomic.h>
 #include <stdlib.h>
 #include <time.h>
 #include <stdio.h>
+#include <string.h>
 #include <deque>
+#include <list>
+#include <vector>
 
 #ifdef XPF_PLATFORM_WINDOWS
 #include <Windows.h>
@@ -309,6 +315,271 @@ bool test(bool sysalloc = false)
 	return true;
 }
 
+#define MT_THREADS (4)
+#define MT_LIVE    (512)
+#define MT_BATCH   (64)
+
+static volatile u32 _g_mt_phase = 0;
+
+// Allocates and frees blocks of 8 to 1024 bytes at random, and hands
+// one of every 8 blocks over to the next worker to be freed there.
+class MtWorker : public Thread
+{
+public:
+	MtWorker() : Pool(0), PoolLock(0), Next(0), Ops(0), Failed(false) {}
+
+	void post(void **ptrs, u32 count)
+	{
+		ScopedThreadLock sl(InboxLock);
+		Inbox.insert(Inbox.end(), ptrs, ptrs + count);
+	}
+
+	u32 run(u64 udata)
+	{
+		void *live[MT_LIVE];
+		void *out[MT_BATCH];
+		u32 outCnt = 0;
+		u32 seed = (u32)udata;
+		::memset(live, 0, sizeof(live));
+
+		for (u32 i = 0; (i < Ops) && !Failed; ++i)
+		{
+			seed = seed * 1103515245 + 12345;
+			const u32 slot = (seed >> 8) % MT_LIVE;
+			if (live[slot])
+			{
+				if ((seed & 0x7) == 0)
+				{
+					out[outCnt++] = live[slot];
+					if (outCnt == MT_BATCH)
+					{
+						Next->post(out, outCnt);
+						outCnt = 0;
+					}
+				}
+				else
+				{
+					release(live[slot]);
+				}
+				live[slot] = 0;
+			}
+
+			const u32 size = 8 + ((seed >> 16) % 1017);
+			live[slot] = obtain(size);
+			if (NULL == live[slot])
+				Failed = true;
+
+			if ((i & 0xff) == 0)
+				drainInbox();
+		}
+
+		if (outCnt > 0)
+			Next->post(out, outCnt);
+		for (u32 i = 0; i < MT_LIVE; ++i)
+		{
+			if (live[i])
+				release(live[i]);
+		}
+
+		// Take in the last hand-overs once all workers are done with
+		// posting, and flush once all are done with freeing.
+		xpfAtomicAdd(&_g_mt_phase, 1);
+		while (_g_mt_phase < MT_THREADS)
+			Thread::yield();
+		drainInbox();
+		xpfAtomicAdd(&_g_mt_phase, 1);
+		while (_g_mt_phase < 2 * MT_THREADS)
+			Thread::yield();
+		if (Pool)
+			Pool->flushThreadCache();
+		return 0;
+	}
+
+	BuddyAllocator    *Pool; // NULL for sysalloc.
+	ThreadLock        *PoolLock; // guards a Pool which is not EF_CONCURRENT, or NULL.
+	MtWorker          *Next;
+	u32                Ops;
+	bool               Failed;
+
+private:
+	void* obtain(u32 size)
+	{
+		u8 *p;
+		if (PoolLock)
+		{
+			ScopedThreadLock sl(*PoolLock);
+			p = (u8*)Pool->alloc(size);
+		}
+		else
+		{
+			p = (u8*)((Pool) ? Pool->alloc(size) : ::malloc(size));
+		}
+		if (p)
+		{
+			*(u32*)p = size;
+			p[size - 1] = (u8)size;
+		}
+		return p;
+	}
+
+	void release(void *ptr)
+	{
+		u8 *p = (u8*)ptr;
+		const u32 size = *(u32*)p;
+		if ((size < 8) || (size > 1024) || (p[size - 1] != (u8)size))
+			Failed = true;
+		if (PoolLock)
+		{
+			ScopedThreadLock sl(*PoolLock);
+			Pool->free(p);
+		}
+		else if (Pool)
+		{
+			Pool->free(p);
+		}
+		else
+		{
+			::free(p);
+		}
+	}
+
+	void drainInbox()
+	{
+		std::vector<void*> ptrs;
+		{
+			ScopedThreadLock sl(InboxLock);
+			ptrs.swap(Inbox);
+		}
+		for (u32 i = 0; i < ptrs.size(); ++i)
+			release(ptrs[i]);
+	}
+
+	ThreadLock         InboxLock;
+	std::vector<void*> Inbox;
+};
+
+// Allocates and frees blocks and one more it is given, then leaves
+// without flushing its thread cache.
+class LeavingWorker : public Thread
+{
+public:
+	LeavingWorker(BuddyAllocator *pool, void *given) : Pool(pool), Given(given) {}
+
+	u32 run(u64 udata)
+	{
+		void *ptrs[16];
+		for (u32 i = 0; i < 16; ++i)
+			ptrs[i] = Pool->alloc(16 + i * 60);
+		for (u32 i = 0; i < 16; ++i)
+			Pool->free(ptrs[i]);
+		Pool->free(Given);
+		return 0;
+	}
+
+private:
+	BuddyAllocator *Pool;
+	void           *Given;
+};
+
+// Run MT_THREADS workers of 'ops' operations each on 'pool' (or
+// sysalloc), serialized by 'lock' if given. Returns false if any of
+// them failed.
+bool testMt(BuddyAllocator *pool, u32 ops, ThreadLock *lock = 0)
+{
+	MtWorker workers[MT_THREADS];
+	_g_mt_phase = 0;
+	for (u32 i = 0; i < MT_THREADS; ++i)
+	{
+		workers[i].Pool = pool;
+		workers[i].PoolLock = lock;
+		workers[i].Next = &workers[(i + 1) % MT_THREADS];
+		workers[i].Ops = ops;
+		workers[i].setData(i + 1);
+	}
+	for (u32 i = 0; i < MT_THREADS; ++i)
+		workers[i].start();
+
+	bool ret = true;
+	for (u32 i = 0; i < MT_THREADS; ++i)
+	{
+		workers[i].join();
+		ret = ret && !workers[i].Failed;
+	}
+	return ret;
+}
+
+#define OBJ_SIZE  (48)
+#define OBJ_LIVE  (4096)
+
+// Allocate and free objects of the same size at random.
+void testObjects(PoolAllocator *objs, BuddyAllocator *pool, u32 ops)
+{
+	void *live[OBJ_LIVE];
+	::memset(live, 0, sizeof(live));
+	for (u32 i = 0; i < ops; ++i)
+	{
+		const u32 slot = (u32)rand() % OBJ_LIVE;
+		if (live[slot])
+		{
+			if (objs)
+				objs->free(live[slot]);
+			else if (pool)
+				pool->free(live[slot]);
+			else
+				::free(live[slot]);
+		}
+		live[slot] = (objs) ? objs->alloc(OBJ_SIZE) : ((pool) ? pool->alloc(OBJ_SIZE) : ::malloc(OBJ_SIZE));
+		xpfAssert(live[slot] != 0);
+		if (_g_memop)
+			::memset(live[slot], (int)slot, OBJ_SIZE);
+	}
+	for (u32 i = 0; i < OBJ_LIVE; ++i)
+	{
+		if (objs)
+			objs->free(live[i]);
+		else if (pool)
+			pool->free(live[i]);
+		else
+			::free(live[i]);
+	}
+}
+
+#define PAIR_WINDOW (16)
+
+// Alloc/free pairs of 'size' bytes over a window of live blocks, freed
+// with (dealloc()) or without (free()) size hints. Returns the time
+// cost in ms.
+u32 testPairs(BuddyAllocator *pool, u32 size, u32 pairs, bool hint)
+{
+	void *live[PAIR_WINDOW];
+	for (u32 i = 0; i < PAIR_WINDOW; ++i)
+		live[i] = (pool) ? pool->alloc(size + i) : ::malloc(size + i);
+
+	StopWatch sw;
+	for (u32 i = 0; i < pairs; ++i)
+	{
+		const u32 slot = i % PAIR_WINDOW;
+		if (!pool)
+			::free(live[slot]);
+		else if (hint)
+			pool->dealloc(live[slot], size + slot);
+		else
+			pool->free(live[slot]);
+		live[slot] = (pool) ? pool->alloc(size + slot) : ::malloc(size + slot);
+		xpfAssert(live[slot] != 0);
+	}
+	const u32 ret = sw.click();
+
+	for (u32 i = 0; i < PAIR_WINDOW; ++i)
+	{
+		if (pool)
+			pool->free(live[i]);
+		else
+			::free(live[i]);
+	}
+	return ret;
+}
+
 int main()
 {
 	unsigned int seed = (unsigned int)time(NULL);
@@ -400,6 +671,222 @@ int main()
 	xpfAssert((stack->used() == 0) && (stack->hwm() == 0));
 	LinearAllocator::destory();
 
+	// Concurrent BuddyAllocator: Blocks are freed by other threads and
+	// all spans are given back once the threads have flushed.
+	size = BuddyAllocator::create(POOLSIZE, 1, BuddyAllocator::EF_CONCURRENT);
+	xpfAssert(0 != size);
+	{
+		BuddyAllocator *pool = BuddyAllocator::instance(1);
+		ret = testMt(pool, 200000);
+		printf("Concurrent: used = %u, hwm = %u\n", pool->used(), pool->hwm());
+		xpfAssert(ret && (pool->used() == 0) && (pool->hwm() > 0));
+
+		char *p = (char*)pool->alloc(100);
+		xpfAssert((p != 0) && (pool->realloc(p, 120) == p));
+		::memset(p, 0x5a, 120);
+		char *q = (char*)pool->realloc(p, 600);
+		xpfAssert((q != 0) && (q != p) && (q[0] == 0x5a) && (q[119] == 0x5a));
+		p = (char*)pool->calloc(4, 1024);
+		xpfAssert((p != 0) && (p[4095] == 0));
+		pool->free(q);
+		pool->dealloc(p, 4096);
+		pool->flushThreadCache();
+		xpfAssert(pool->used() == 0);
+
+		p = (char*)pool->alloc(POOLSIZE);
+		xpfAssert(p != 0);
+		pool->free(p);
+
+		// A thread leaving without a flush gives its cache back, and
+		// the block it freed for this thread.
+		LeavingWorker leaving(pool, pool->alloc(64));
+		leaving.start();
+		leaving.join();
+		pool->flushThreadCache();
+		xpfAssert(pool->used() == 0);
+	}
+	BuddyAllocator::destory(1);
+
+	// Growable BuddyAllocator: Arenas are mapped as the pool fills up
+	// and given back once they have stayed entirely free.
+	size = BuddyAllocator::create(1 << 20, 1, BuddyAllocator::EF_GROWABLE);
+	xpfAssert(size == (1 << 20));
+	{
+		BuddyAllocator *pool = BuddyAllocator::instance(1);
+		pool->setGrowthPolicy(4, 50);
+		void *blocks[64];
+		for (u32 i = 0; i < 64; ++i)
+		{
+			blocks[i] = pool->alloc(1 << 16);
+			xpfAssert(blocks[i] != 0);
+			::memset(blocks[i], (int)i, 1 << 16);
+		}
+		xpfAssert((pool->alloc(16) == 0) && (pool->available() == 0) && (pool->alloc((1 << 20) + 1) == 0));
+		xpfAssert((pool->arenaCount() == 4) && (pool->capacity() == (4 << 20)) && (pool->used() == (4 << 20)));
+		for (u32 i = 0; i < 64; ++i)
+		{
+			xpfAssert(((char*)blocks[i])[(1 << 16) - 1] == (char)i);
+			if (i & 0x1)
+				pool->free(blocks[i]);
+			else
+				pool->dealloc(blocks[i], 1 << 16);
+		}
+		xpfAssert((pool->used() == 0) && (pool->hwm() == (4 << 20)) && (pool->arenaCount() == 4));
+		Thread::sleep(100);
+		pool->free(pool->alloc(16));
+		xpfAssert((pool->arenaCount() == 1) && (pool->capacity() == (1 << 20)) && (pool->available() == (1 << 20)));
+
+		// A block moves to another arena when its own cannot fit it.
+		char *p = (char*)pool->alloc(1 << 16);
+		char *q = (char*)pool->alloc(1 << 19);
+		::memset(p, 0x5a, 1 << 16);
+		char *r = (char*)pool->realloc(p, 1 << 20);
+		xpfAssert((r != 0) && (r[0] == 0x5a) && (r[(1 << 16) - 1] == 0x5a) && (pool->arenaCount() == 2));
+		pool->free(q);
+		pool->free(r);
+		xpfAssert(pool->used() == 0);
+	}
+	BuddyAllocator::destory(1);
+
+	// Concurrent and growable: Thread caches take spans from any arena.
+	size = BuddyAllocator::create(1 << 20, 1, BuddyAllocator::EF_CONCURRENT | BuddyAllocator::EF_GROWABLE);
+	xpfAssert(0 != size);
+	{
+		BuddyAllocator *pool = BuddyAllocator::instance(1);
+		ret = testMt(pool, 200000);
+		printf("Concurrent growable: arenas = %u, hwm = %u\n", pool->arenaCount(), pool->hwm());
+		xpfAssert(ret && (pool->used() == 0) && (pool->arenaCount() > 1));
+	}
+	BuddyAllocator::destory(1);
+
+	// Bulks mapped from the system, on huge pages where possible.
+	size = BuddyAllocator::create(4 << 20, 1, EB_HUGEPAGES | EB_POPULATE | BuddyAllocator::EF_GROWABLE);
+	xpfAssert(size == (4 << 20));
+	{
+		BuddyAllocator *pool = BuddyAllocator::instance(1);
+		pool->setGrowthPolicy(2, 0);
+		char *p = (char*)pool->alloc(4 << 20);
+		char *q = (char*)pool->alloc(1 << 20);
+		xpfAssert((p != 0) && (q != 0) && (pool->arenaCount() == 2) && (pool->alloc(4 << 20) == 0));
+		::memset(p, 0x5a, 4 << 20);
+		::memset(q, 0x5a, 1 << 20);
+		pool->free(q);
+		xpfAssert(pool->arenaCount() == 1);
+		pool->free(p);
+	}
+	BuddyAllocator::destory(1);
+
+	size = LinearAllocator::create(1 << 20, 1, EB_MAPPED | EB_LOCKED);
+	if (0 != size)
+	{
+		void *p = LinearAllocator::instance(1)->alloc(1000);
+		xpfAssert((size == (1 << 20)) && (p != 0));
+		LinearAllocator::instance(1)->free(p);
+	}
+	else
+	{
+		printf("Skipped locked LinearAllocator: over the limit of locked memory.\n");
+	}
+	LinearAllocator::destory(1);
+
+	size = PoolAllocator::create(1000, 20, 1, EB_MAPPED);
+	xpfAssert((size == 984) && (PoolAllocator::instance(1)->alloc(20) != 0));
+	PoolAllocator::destory(1);
+
+#if defined(XPF_MODEL_64)
+	// 64-bit sizes: Pools beyond 4 Gb, where they can be mapped.
+	{
+		const u64 big = BuddyAllocator::create((u64)1 << 32, 1);
+		BuddyAllocator *pool = BuddyAllocator::instance(1);
+		if (big == ((u64)1 << 32))
+		{
+			char *p = (char*)pool->alloc((u64)3 << 30);
+			xpfAssert((p != 0) && (pool->used() == big) && (pool->alloc(16) == 0));
+			pool->free(p);
+			char *a = (char*)pool->alloc((u64)1 << 31);
+			char *b = (char*)pool->alloc((u64)1 << 31);
+			xpfAssert((a != 0) && (b == a + ((u64)1 << 31)) && (pool->available() == 0));
+			b[((u64)1 << 31) - 1] = 0x5a;
+			pool->dealloc(a, (u64)1 << 31);
+			xpfAssert((pool->realloc(b, ((u64)1 << 31) + 1) == 0) && (pool->available() == ((u64)1 << 31)));
+			pool->free(b);
+			xpfAssert((pool->used() == 0) && (pool->hwm() == big));
+		}
+		else
+		{
+			printf("Skipped 4 Gb BuddyAllocator: out of memory.\n");
+		}
+		BuddyAllocator::destory(1);
+
+		// Cells beyond 2 Gb take 16 bytes records.
+		const u64 wide = LinearAllocator::create((u64)3 << 30, 1);
+		LinearAllocator *stack = LinearAllocator::instance(1);
+		if (wide == ((u64)3 << 30))
+		{
+			char *a = (char*)stack->alloc(32);
+			char *b = (char*)stack->alloc((u64)1 << 31);
+			xpfAssert((a != 0) && (b != 0) && (stack->used() == 48 + ((u64)1 << 31) + 16));
+			char *c = (char*)stack->alloc(64);
+			xpfAssert((c != 0) && ((u64)(c - a) > ((u64)1 << 31)));
+			::memset(c, 0x5a, 64);
+			stack->free(b);
+			stack->free(c);
+			xpfAssert(stack->used() == 48);
+			stack->free(a);
+			xpfAssert((stack->used() == 0) && (stack->reset() == 48 + ((u64)1 << 31) + 96));
+		}
+		else
+		{
+			printf("Skipped 3 Gb LinearAllocator: out of memory.\n");
+		}
+		LinearAllocator::destory(1);
+	}
+#endif
+
+	// PoolAllocator: Objects of 20 bytes are promoted to 24 bytes.
+	size = PoolAllocator::create(1000, 20);
+	{
+		PoolAllocator *objs = PoolAllocator::instance();
+		xpfAssert((size == 984) && (objs != 0) && (objs->objectSize() == 24) && (objs->available() == 24));
+		void *ptrs[41];
+		for (u32 i = 0; i < 41; ++i)
+		{
+			ptrs[i] = objs->alloc(20);
+			xpfAssert((ptrs[i] != 0) && (0 == ((vptr)ptrs[i] & 0x7)));
+			::memset(ptrs[i], (int)i, 24);
+		}
+		xpfAssert((objs->alloc(8) == 0) && (objs->available() == 0) && (objs->used() == 984));
+		xpfAssert((objs->alloc(25) == 0) && (objs->realloc(ptrs[0], 24) == ptrs[0]) && (objs->realloc(ptrs[0], 25) == 0));
+		objs->free(ptrs[7]);
+		objs->dealloc(ptrs[9], 24);
+		xpfAssert((objs->used() == 936) && (objs->hwm() == 984));
+		xpfAssert((objs->alloc(24) == ptrs[9]) && (objs->calloc(2, 12) == ptrs[7]) && (((char*)ptrs[7])[23] == 0));
+		for (u32 i = 0; i < 41; ++i)
+		{
+			xpfAssert((i == 7) || (((char*)ptrs[i])[23] == (char)i));
+			objs->free(ptrs[i]);
+		}
+		xpfAssert((objs->used() == 0) && (objs->reset() == 984) && (objs->hwm() == 0));
+	}
+	PoolAllocator::destory();
+
+	// std::allocator compatibility: A list allocates nodes of one size.
+	PoolAllocator::create(1 << 20, 2 * sizeof(void*) + sizeof(int), 2);
+	{
+		std::list<int, Allocator<int, AllocInstOf<PoolAllocator, 2> > > verifyingList;
+		for (int i = 0; i < 20000; i++)
+			verifyingList.push_back(i);
+		int i = 0;
+		while (!verifyingList.empty())
+		{
+			xpfAssert( ( "std::allocator compatibility", i == verifyingList.front() ) );
+			i++;
+			verifyingList.pop_front();
+		}
+		xpfAssert(PoolAllocator::instance(2)->used() == 0);
+	}
+	PoolAllocator::destory(2);
+
 	// done sanity test.
 
 	_g_log = false;
@@ -438,6 +925,88 @@ int main()
 			break;
 	}
 
+	printf("\n==== Alloc/free pairs ====\n");
+	{
+		const u32 sizes[] = { 16, 100, 1000, 4000, 60000, 1000000, 0 };
+		BuddyAllocator::create(POOLSIZE);
+		for (u32 i = 0; sizes[i] != 0; ++i)
+		{
+			const u32 t1 = testPairs(BuddyAllocator::instance(), sizes[i], 2000000, true);
+			const u32 t2 = testPairs(BuddyAllocator::instance(), sizes[i], 2000000, false);
+			const u32 t3 = testPairs(0, sizes[i], 2000000, false);
+			printf("%7u bytes: dealloc = %u ms, free = %u ms, sysalloc = %u ms\n", sizes[i], t1, t2, t3);
+		}
+		xpfAssert(BuddyAllocator::instance()->used() == 0);
+		BuddyAllocator::destory();
+	}
+
+	printf("\n==== Object benchmark (%u bytes) ====\n", OBJ_SIZE);
+	{
+		PoolAllocator::create(OBJ_LIVE * OBJ_SIZE, OBJ_SIZE);
+		BuddyAllocator::create(OBJ_LIVE * 64);
+		_g_memop = true;
+
+		srand(seed);
+		StopWatch sw;
+		testObjects(PoolAllocator::instance(), 0, 4000000);
+		u32 timeCost1 = sw.click();
+		printf("Time cost of pool = %u ms (%u bytes in use at peak)\n", timeCost1, PoolAllocator::instance()->hwm());
+
+		srand(seed);
+		sw.click();
+		testObjects(0, BuddyAllocator::instance(), 4000000);
+		u32 timeCost2 = sw.click();
+		printf("Time cost of buddy = %u ms (%u bytes in use at peak)\n", timeCost2, BuddyAllocator::instance()->hwm());
+
+		srand(seed);
+		sw.click();
+		testObjects(0, 0, 4000000);
+		u32 timeCost3 = sw.click();
+		printf("Time cost of sysalloc = %u ms\n", timeCost3);
+
+		PoolAllocator::destory();
+		BuddyAllocator::destory();
+	}
+
+	printf("\n==== Multi-threaded benchmark (%u threads) ====\n", MT_THREADS);
+	{
+		size = BuddyAllocator::create(POOLSIZE, 1, BuddyAllocator::EF_CONCURRENT);
+		xpfAssert(0 != size);
+
+		StopWatch sw;
+		ret = testMt(BuddyAllocator::instance(1), 2000000);
+		u32 timeCost1 = sw.click();
+		xpfAssert(ret);
+		printf("Time cost of concurrent buddy = %u ms\n", timeCost1);
+		BuddyAllocator::destory(1);
+
+		size = BuddyAllocator::create(POOLSIZE, 1);
+		xpfAssert(0 != size);
+
+		ThreadLock lock;
+		sw.click();
+		ret = testMt(BuddyAllocator::instance(1), 2000000, &lock);
+		u32 timeCost3 = sw.click();
+		xpfAssert(ret);
+		printf("Time cost of buddy behind a lock = %u ms\n", timeCost3);
+		BuddyAllocator::destory(1);
+
+		sw.click();
+		ret = testMt(0, 2000000);
+		u32 timeCost2 = sw.click();
+		xpfAssert(ret);
+		printf("Time cost of sysalloc = %u ms\n", timeCost2);
+
+		if (timeCost2 > timeCost1)
+		{
+			printf("Improved: %f%%\n", (double)(timeCost2 - timeCost1)*100.00/(double)timeCost2);
+		}
+		else
+		{
+			printf("Worse than sysalloc.\n");
+		}
+	}
+
 	
 	return 0;
 }
@@ -0,0 +1,374 @@
+/*******************************************************************************
+* Copyright (c) 2013 matt@moregeek.com.tw
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+* 1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+* 2. Altered source versions must be plainly marked as such, and must not be
+*    misrepresented as being the original software.
+*
+* 3. This notice may not be removed or altered from any source
+*    distribution.
+********************************************************************************/
+
+#include <xpf/iobuffer.h>
+#include <xpf/netiomux.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace xpf;
+
+#define NUM_CLIENTS  (4)
+#define PAYLOAD_SIZE (8192)
+#define PORT         "50129"
+
+class TestCallback : public NetIoMuxCallback
+{
+public:
+	TestCallback()
+		: Sent(0), Received(0), Errors(0), Peer(0), RecvBuf(0), RecvLen(0)
+		, Broadcasts(0), BroadcastError(NetEndpoint::EE_SUCCESS), Delivered(0) {}
+
+	void onIoCompleted(NetIoMux::EIoType type, NetEndpoint::EError ec, NetEndpoint *sep, vptr tepOrPeer, const c8 *buf, u32 len)
+	{
+		if (type == NetIoMux::EIT_BROADCAST)
+		{
+			if ((sep != 0) || (buf != 0))
+				Errors++;
+			BroadcastError = ec;
+			Delivered = len;
+			Broadcasts++;
+			return;
+		}
+
+		if (ec != NetEndpoint::EE_SUCCESS)
+		{
+			printf("Operation %d failed: %d\n", type, ec);
+			Errors++;
+			return;
+		}
+
+		if (type == NetIoMux::EIT_SEND)
+		{
+			if (buf != 0)
+				Errors++;
+			Sent += len;
+		}
+		else if (type == NetIoMux::EIT_RECV)
+		{
+			Peer = (IoBuffer*)tepOrPeer;
+			RecvBuf = buf;
+			RecvLen = len;
+			Received++;
+		}
+	}
+
+	u32 Sent;
+	u32 Received;
+	u32 Errors;
+	IoBuffer *Peer;
+	const c8 *RecvBuf;
+	u32 RecvLen;
+	u32 Broadcasts;
+	NetEndpoint::EError BroadcastError;
+	u32 Delivered;
+};
+
+// Counts the operations failed by a depart().
+class AbortCallback : public NetIoMuxCallback
+{
+public:
+	AbortCallback() : Aborted(0), Type(NetIoMux::EIT_INVALID), Error(NetEndpoint::EE_SUCCESS) {}
+
+	void onIoCompleted(NetIoMux::EIoType type, NetEndpoint::EError ec, NetEndpoint *sep, vptr tepOrPeer, const c8 *buf, u32 len)
+	{
+		Type = type;
+		Error = ec;
+		Aborted++;
+	}
+
+	u32 Aborted;
+	NetIoMux::EIoType Type;
+	NetEndpoint::EError Error;
+};
+
+bool test_refcount()
+{
+	IoBuffer *buf = IoBuffer::create(100);
+	xpfAssert(buf->getRefCount() == 1);
+	xpfAssert(buf->length() == 0);
+	xpfAssert(buf->tailroom() == 100);
+	xpfAssert((((vptr)buf->data()) & 0xf) == 0);
+
+	::memcpy(buf->tail(), "0123456789", 10);
+	buf->commit(10);
+	xpfAssert(buf->length() == 10);
+	xpfAssert(buf->tailroom() == 90);
+
+	{
+		IoBufferChain c1;
+		c1.append(buf);
+		xpfAssert(buf->getRefCount() == 2);
+		IoBufferChain c2(c1);
+		xpfAssert(buf->getRefCount() == 3);
+		IoBufferChain c3;
+		c3 = c2;
+		xpfAssert(buf->getRefCount() == 4);
+		c2.clear();
+		xpfAssert(buf->getRefCount() == 3);
+	}
+	xpfAssert(buf->getRefCount() == 1);
+	return buf->unref();
+}
+
+bool test_chain()
+{
+	IoBuffer *a = IoBuffer::create("abcdef", 6);
+	IoBuffer *b = IoBuffer::create("ghij", 4);
+
+	IoBufferChain chain;
+	chain.append(a, 0, 3);
+	chain.append(a, 3, 3); // contiguous: merged into the previous segment.
+	chain.append(b);
+	chain.append(a, 1, 2);
+	xpfAssert(chain.segmentCount() == 3);
+	xpfAssert(chain.length() == 12);
+
+	c8 out[16] = {0};
+	xpfAssert(chain.copyTo(out, 16) == 12);
+	xpfAssert(0 == ::memcmp(out, "abcdefghijbc", 12));
+
+	IoBufferChain mid = chain.slice(4, 5);
+	xpfAssert(mid.length() == 5);
+	xpfAssert(mid.segmentCount() == 2);
+	::memset(out, 0, sizeof(out));
+	xpfAssert(mid.copyTo(out, 16) == 5);
+	xpfAssert(0 == ::memcmp(out, "efghi", 5));
+	xpfAssert(mid.copyTo(out, 2, 3) == 2);
+	xpfAssert(0 == ::memcmp(out, "hi", 2));
+
+	chain.trimFront(7);
+	xpfAssert(chain.length() == 5);
+	xpfAssert(chain.segmentCount() == 2);
+	::memset(out, 0, sizeof(out));
+	chain.copyTo(out, 16);
+	xpfAssert(0 == ::memcmp(out, "hijbc", 5));
+
+	IoBufferChain joined;
+	joined.append(mid);
+	joined.append(chain);
+	xpfAssert(joined.length() == 10);
+	xpfAssert(a->getRefCount() == 5); // chain, mid, joined x2
+	xpfAssert(b->getRefCount() == 5); // chain, mid, joined x2
+
+	chain.clear();
+	mid.clear();
+	joined.clear();
+	xpfAssert(a->getRefCount() == 1);
+	xpfAssert(b->getRefCount() == 1);
+	a->unref();
+	b->unref();
+	return true;
+}
+
+bool test_pool()
+{
+	BuddyAllocator::create(1 << 20, 0);
+	BuddyAllocator *pool = BuddyAllocator::instance(0);
+
+	IoBuffer *buf = IoBuffer::create(1000, pool);
+	xpfAssert(pool->used() > 1000);
+	xpfAssert((c8*)buf->data() - (c8*)buf == IoBuffer::HeaderSize);
+	buf->unref();
+	xpfAssert(pool->used() == 0);
+
+	BuddyAllocator::destory(0);
+	return true;
+}
+
+bool test_mux()
+{
+	BuddyAllocator::create(1 << 20, 0);
+	BuddyAllocator *pool = BuddyAllocator::instance(0);
+
+	NetIoMux *mux = new NetIoMux();
+	TestCallback cb;
+
+	NetEndpoint *listener = NetEndpoint::create(NetEndpoint::ProtocolIPv4 | NetEndpoint::ProtocolTCP,
+		"localhost", PORT);
+	xpfAssert(listener != 0);
+
+	NetEndpoint *clients[NUM_CLIENTS];
+	NetEndpoint *servers[NUM_CLIENTS];
+	for (u32 i = 0; i < NUM_CLIENTS; ++i)
+	{
+		clients[i] = NetEndpoint::create(NetEndpoint::ProtocolIPv4 | NetEndpoint::ProtocolTCP);
+		bool connected = clients[i]->connect("localhost", PORT);
+		xpfAssert(connected);
+		servers[i] = listener->accept();
+		xpfAssert(servers[i] != 0);
+		mux->join(servers[i]);
+	}
+
+	// Fan out one payload to all clients, each prefixed with its own header.
+	IoBuffer *payload = IoBuffer::create(PAYLOAD_SIZE, pool);
+	for (u32 i = 0; i < PAYLOAD_SIZE; ++i)
+		payload->data()[i] = (c8)rand();
+	payload->commit(PAYLOAD_SIZE);
+
+	for (u32 i = 0; i < NUM_CLIENTS; ++i)
+	{
+		c8 hdr[8];
+		::memset(hdr, '0' + i, sizeof(hdr));
+		IoBuffer *header = IoBuffer::create(hdr, sizeof(hdr), pool);
+
+		IoBufferChain chain;
+		chain.append(header);
+		chain.append(payload);
+		mux->asyncSend(servers[i], chain, &cb);
+		header->unref(); // The mux holds its own reference.
+	}
+	xpfAssert(payload->getRefCount() == NUM_CLIENTS + 1);
+	payload->unref();
+
+	const u32 perClient = 8 + PAYLOAD_SIZE;
+	for (u32 i = 0; (i < 500) && (cb.Sent < perClient * NUM_CLIENTS) && (cb.Errors == 0); ++i)
+		mux->runOnce(10);
+	printf("[Mux] Sent %u bytes to %u clients.\n", cb.Sent, NUM_CLIENTS);
+	xpfAssert(cb.Sent == perClient * NUM_CLIENTS);
+
+	// All buffers are released by the mux after completions.
+	xpfAssert(pool->used() == 0);
+
+	bool verified = true;
+	for (u32 i = 0; i < NUM_CLIENTS; ++i)
+	{
+		c8 buf[perClient];
+		u32 received = 0;
+		while (received < perClient)
+		{
+			s32 bytes = clients[i]->recv(buf + received, perClient - received);
+			if (bytes <= 0)
+				break;
+			received += (u32)bytes;
+		}
+		if ((received != perClient) || (buf[0] != (c8)('0' + i)) || (buf[7] != (c8)('0' + i)))
+			verified = false;
+	}
+
+	// Receive into the tail room of a partially filled buffer.
+	IoBuffer *rbuf = IoBuffer::create(64, pool);
+	::memcpy(rbuf->tail(), "pre", 3);
+	rbuf->commit(3);
+	mux->asyncRecv(servers[0], rbuf, &cb);
+	xpfAssert(rbuf->getRefCount() == 2);
+	clients[0]->send("hello", 5);
+	for (u32 i = 0; (i < 500) && (cb.Received == 0) && (cb.Errors == 0); ++i)
+		mux->runOnce(10);
+	xpfAssert(cb.Received == 1);
+	xpfAssert(cb.Peer == rbuf);
+	xpfAssert(cb.RecvBuf == rbuf->data() + 3);
+	xpfAssert(cb.RecvLen == 5);
+	xpfAssert(rbuf->length() == 8);
+	xpfAssert(0 == ::memcmp(rbuf->data(), "prehello", 8));
+	xpfAssert(rbuf->getRefCount() == 1);
+	rbuf->unref();
+	xpfAssert(pool->used() == 0);
+
+	// Broadcast one payload to all clients and an endpoint never joined.
+	IoBuffer *msg = IoBuffer::create("broadcast", 9, pool);
+	NetEndpoint *targets[NUM_CLIENTS + 1];
+	for (u32 i = 0; i < NUM_CLIENTS; ++i)
+		targets[i] = servers[i];
+	mux->asyncBroadcast(targets, NUM_CLIENTS, msg, &cb);
+	targets[NUM_CLIENTS] = clients[0]; // not joined.
+	mux->asyncBroadcast(targets, NUM_CLIENTS + 1, msg, &cb);
+	msg->unref();
+	for (u32 i = 0; (i < 500) && (cb.Broadcasts < 2); ++i)
+		mux->runOnce(10);
+	printf("[Mux] %u broadcasts, last one delivered to %u endpoints.\n", cb.Broadcasts, cb.Delivered);
+	xpfAssert(cb.Broadcasts == 2);
+	xpfAssert(cb.Delivered == NUM_CLIENTS);
+	xpfAssert(cb.BroadcastError == NetEndpoint::EE_SEND);
+	xpfAssert(pool->used() == 0);
+
+	for (u32 i = 0; i < NUM_CLIENTS; ++i)
+	{
+		c8 buf[18];
+		u32 received = 0;
+		while (received < sizeof(buf))
+		{
+			s32 bytes = clients[i]->recv(buf + received, sizeof(buf) - received);
+			if (bytes <= 0)
+				break;
+			received += (u32)bytes;
+		}
+		if ((received != sizeof(buf)) || (0 != ::memcmp(buf, "broadcastbroadcast", sizeof(buf))))
+			verified = false;
+	}
+
+	// An empty broadcast completes right away.
+	mux->asyncBroadcast(0, 0, IoBufferChain(), &cb);
+	for (u32 i = 0; (i < 500) && (cb.Broadcasts < 3); ++i)
+		mux->runOnce(10);
+	xpfAssert(cb.Broadcasts == 3);
+	xpfAssert(cb.Delivered == 0);
+	xpfAssert(cb.BroadcastError == NetEndpoint::EE_SUCCESS);
+
+	// A receive still pending on departure fails and drops its reference.
+	AbortCallback acb;
+	IoBuffer *pending = IoBuffer::create(64, pool);
+	mux->asyncRecv(servers[0], pending, &acb);
+	xpfAssert(pending->getRefCount() == 2);
+
+	for (u32 i = 0; i < NUM_CLIENTS; ++i)
+	{
+		delete clients[i]; // Close actively from clients to keep PORT out of TIME_WAIT.
+		mux->depart(servers[i]);
+		delete servers[i];
+	}
+	for (u32 i = 0; (i < 500) && (acb.Aborted == 0); ++i)
+		mux->runOnce(10);
+	xpfAssert(acb.Aborted == 1);
+	xpfAssert(acb.Type == NetIoMux::EIT_RECV);
+	xpfAssert(acb.Error == NetEndpoint::EE_RECV);
+	xpfAssert(pending->getRefCount() == 1);
+	pending->unref();
+	xpfAssert(pool->used() == 0);
+	delete listener;
+	delete mux;
+	BuddyAllocator::destory(0);
+
+	return verified && (cb.Errors == 0);
+}
+
+int main()
+{
+	printf("Testing refcount ... ");
+	bool ok = test_refcount();
+	printf("%s\n", ok ? "ok" : "failed");
+
+	printf("Testing chain ... ");
+	ok = test_chain() && ok;
+	printf("%s\n", ok ? "ok" : "failed");
+
+	printf("Testing pool ... ");
+	ok = test_pool() && ok;
+	printf("%s\n", ok ? "ok" : "failed");
+
+	printf("Testing mux ...\n");
+	ok = test_mux() && ok;
+	printf("%s\n", ok ? "All tests passed." : "Test failed.");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,191 @@
+/*******************************************************************************
+* Copyright (c) 2013 matt@moregeek.com.tw
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+* 1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+* 2. Altered source versions must be plainly marked as such, and must not be
+*    misrepresented as being the original software.
+*
+* 3. This notice may not be removed or altered from any source
+*    distribution.
+********************************************************************************/
+
+#include <xpf/netawait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace xpf;
+
+#ifdef XPF_HAS_NETAWAIT
+
+#define NUM_CLIENTS  (100)
+#define NUM_MESSAGES (20)
+#define MSG_SIZE     (64)
+#define PORT         "50127"
+
+struct TestContext
+{
+	NetIoMux    *Mux;
+	NetEndpoint *Listener;
+	u32          Sessions; // alive server sessions.
+	u32          Finished; // finished clients.
+	u32          Echoed;
+	u32          Verified;
+	u32          Errors;
+	u32          PeakFrameBytes;
+};
+
+static void track_frames(TestContext *ctx)
+{
+	u32 used = BuddyAllocator::instance(XPF_NETAWAIT_FRAME_SLOT)->used();
+	if (used > ctx->PeakFrameBytes)
+		ctx->PeakFrameBytes = used;
+}
+
+NetTask session(TestContext *ctx, NetEndpoint *ep)
+{
+	ctx->Sessions++;
+	c8 buf[MSG_SIZE];
+	while (true)
+	{
+		s32 bytes = co_await awaitRecv(ctx->Mux, ep, buf, MSG_SIZE);
+		if (bytes <= 0)
+			break;
+		if ((co_await awaitSend(ctx->Mux, ep, buf, (u32)bytes)) != bytes)
+		{
+			ctx->Errors++;
+			break;
+		}
+		ctx->Echoed++;
+	}
+	ctx->Mux->depart(ep);
+	delete ep;
+	ctx->Sessions--;
+}
+
+NetTask server(TestContext *ctx)
+{
+	for (u32 i = 0; i < NUM_CLIENTS; ++i)
+	{
+		NetEndpoint::EError ec;
+		NetEndpoint *ep = co_await awaitAccept(ctx->Mux, ctx->Listener, &ec);
+		if (ep == 0)
+		{
+			printf("[Serv] accept failed: %d\n", ec);
+			ctx->Errors++;
+			continue;
+		}
+		session(ctx, ep);
+		track_frames(ctx);
+	}
+}
+
+NetTask client(TestContext *ctx)
+{
+	NetEndpoint *ep = NetEndpoint::create(NetEndpoint::ProtocolIPv4 | NetEndpoint::ProtocolTCP);
+	ctx->Mux->join(ep);
+
+	NetEndpoint::EError ec;
+	if (!(co_await awaitConnect(ctx->Mux, ep, "localhost", PORT, &ec)))
+	{
+		printf("[Client] connect failed: %d\n", ec);
+		ctx->Errors++;
+	}
+	else
+	{
+		c8 out[MSG_SIZE], in[MSG_SIZE];
+		for (u32 i = 0; i < NUM_MESSAGES; ++i)
+		{
+			for (u32 j = 0; j < MSG_SIZE; ++j)
+				out[j] = (c8)rand();
+			if ((co_await awaitSend(ctx->Mux, ep, out, MSG_SIZE)) != MSG_SIZE)
+			{
+				ctx->Errors++;
+				break;
+			}
+
+			// Stream socket: the echo may come back in pieces.
+			u32 received = 0;
+			while (received < MSG_SIZE)
+			{
+				s32 bytes = co_await awaitRecv(ctx->Mux, ep, &in[received], MSG_SIZE - received);
+				if (bytes <= 0)
+					break;
+				received += bytes;
+			}
+			if ((received != MSG_SIZE) || (0 != memcmp(in, out, MSG_SIZE)))
+			{
+				ctx->Errors++;
+				break;
+			}
+			ctx->Verified++;
+			co_await awaitWakeup(ctx->Mux);
+		}
+		ep->shutdown(NetEndpoint::ESD_WRITE);
+	}
+
+	ctx->Mux->depart(ep);
+	delete ep;
+	ctx->Finished++;
+}
+
+int main(int argc, char *argv[])
+{
+	BuddyAllocator::create(4 * 1024 * 1024, XPF_NETAWAIT_FRAME_SLOT);
+
+	TestContext ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.Mux = new NetIoMux();
+	ctx.Listener = NetEndpoint::create(NetEndpoint::ProtocolIPv4 | NetEndpoint::ProtocolTCP, "localhost", PORT);
+	xpfAssert(ctx.Listener != 0);
+	ctx.Mux->join(ctx.Listener);
+
+	server(&ctx);
+	for (u32 i = 0; i < NUM_CLIENTS; ++i)
+	{
+		client(&ctx);
+		track_frames(&ctx);
+	}
+
+	// Everything runs on this single thread.
+	for (u32 i = 0; (i < 100000) && ((ctx.Finished < NUM_CLIENTS) || (ctx.Sessions > 0)); ++i)
+		ctx.Mux->runOnce(10);
+
+	const u32 leftBytes = BuddyAllocator::instance(XPF_NETAWAIT_FRAME_SLOT)->used();
+	printf("%u messages echoed, %u verified, %u errors.\n", ctx.Echoed, ctx.Verified, ctx.Errors);
+	printf("Peak frame memory: %u bytes for %u coroutines, %u bytes left.\n",
+		ctx.PeakFrameBytes, NUM_CLIENTS * 2 + 1, leftBytes);
+	const bool passed = (ctx.Echoed == NUM_CLIENTS * NUM_MESSAGES)
+		&& (ctx.Verified == NUM_CLIENTS * NUM_MESSAGES)
+		&& (ctx.Errors == 0) && (ctx.Sessions == 0) && (leftBytes == 0);
+
+	ctx.Mux->depart(ctx.Listener);
+	delete ctx.Listener;
+	delete ctx.Mux;
+	BuddyAllocator::destory(XPF_NETAWAIT_FRAME_SLOT);
+
+	printf("co_await networking test %s.\n", (passed) ? "passed" : "failed");
+	return (passed) ? 0 : 1;
+}
+
+#else // XPF_HAS_NETAWAIT
+
+int main(int argc, char *argv[])
+{
+	printf("C++20 coroutines are not supported by the compiler. Skipped.\n");
+	return 0;
+}
+
+#endif // XPF_HAS_NETAWAIT
@@ -0,0 +1,226 @@
+/*******************************************************************************
+* Copyright (c) 2013 matt@moregeek.com.tw
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+* 1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+* 2. Altered source versions must be plainly marked as such, and must not be
+*    misrepresented as being the original software.
+*
+* 3. This notice may not be removed or altered from any source
+*    distribution.
+********************************************************************************/
+
+#include <xpf/netconnpool.h>
+#include <xpf/thread.h>
+#include <stdio.h>
+
+using namespace xpf;
+
+#define HOST        "127.0.0.1"
+#define PORT        "50135"
+#define PORT_CLOSED "50136"
+
+// Records checkout results.
+class Checkouts : public NetConnPoolCallback
+{
+public:
+	Checkouts() : Count(0), Ec(NetEndpoint::EE_SUCCESS), Ep(0), UserData(0) {}
+
+	void onCheckout(NetConnPool *pool, NetEndpoint::EError ec, NetEndpoint *ep, vptr userData)
+	{
+		Count++;
+		Ec = ec;
+		Ep = ep;
+		UserData = userData;
+	}
+
+	u32                  Count;
+	NetEndpoint::EError  Ec;
+	NetEndpoint         *Ep;
+	vptr                 UserData;
+};
+
+static bool waitFor(NetIoMux *mux, Checkouts &co, u32 count)
+{
+	for (u32 i = 0; (i < 500) && (co.Count < count); ++i)
+		mux->runOnce(10);
+	return (co.Count == count);
+}
+
+// Check 'ep' reaches 'server' and the other way around.
+static bool exchange(NetEndpoint *ep, NetEndpoint *server)
+{
+	c8 buf[4];
+	return (server != 0) && (ep->send("ping", 4) == 4) && (server->recv(buf, 4) == 4)
+		&& (server->send("pong", 4) == 4) && (ep->recv(buf, 4) == 4);
+}
+
+bool test_reuse(NetIoMux *mux, NetEndpoint *listener)
+{
+	NetConnPool pool(mux);
+	Checkouts co;
+
+	// The first checkout connects.
+	pool.checkout(HOST, PORT, &co, 1);
+	bool ok = waitFor(mux, co, 1) && (co.Ec == NetEndpoint::EE_SUCCESS) && (co.UserData == 1);
+	if (!ok)
+		return false;
+	NetEndpoint *ep = co.Ep;
+	NetEndpoint *server = listener->accept();
+	ok = exchange(ep, server);
+	pool.checkin(ep);
+	ok = ok && (pool.getIdleCount() == 1) && (pool.getConnectionCount() == 1);
+
+	// The second one reuses the idle connection at once.
+	pool.checkout(HOST, PORT, &co, 2);
+	ok = ok && (co.Count == 2) && (co.Ep == ep) && (co.UserData == 2) && exchange(ep, server);
+	ok = ok && (pool.getReuseCount() == 1) && (pool.getConnectCount() == 1);
+	pool.checkin(ep);
+
+	// A connection closed by the peer fails the health check, so a new
+	// one is made.
+	delete server;
+	Thread::sleep(50);
+	pool.checkout(HOST, PORT, &co, 3);
+	ok = ok && waitFor(mux, co, 3) && (co.Ec == NetEndpoint::EE_SUCCESS);
+	ok = ok && (pool.getReuseCount() == 1) && (pool.getConnectCount() == 2) && (pool.getConnectionCount() == 1);
+	server = listener->accept();
+	ok = ok && exchange(co.Ep, server);
+	pool.checkin(co.Ep);
+	delete server;
+
+	printf("[Reuse] %u connects, %u reuses.\n", (u32)pool.getConnectCount(), (u32)pool.getReuseCount());
+	return ok;
+}
+
+bool test_limit(NetIoMux *mux, NetEndpoint *listener)
+{
+	NetConnPool pool(mux, 2);
+	Checkouts co;
+	NetEndpoint *eps[2];
+	NetEndpoint *servers[2];
+	bool ok = true;
+
+	for (u32 i = 0; i < 2; ++i)
+	{
+		pool.checkout(HOST, PORT, &co, i);
+		ok = ok && waitFor(mux, co, i + 1) && (co.Ec == NetEndpoint::EE_SUCCESS);
+		eps[i] = co.Ep;
+		servers[i] = listener->accept();
+	}
+	if (!ok)
+		return false;
+
+	// The third checkout waits for a connection to be checked in.
+	pool.checkout(HOST, PORT, &co, 2);
+	for (u32 i = 0; i < 10; ++i)
+		mux->runOnce(5);
+	ok = (co.Count == 2) && (pool.getWaiterCount() == 1) && (pool.getConnectionCount() == 2);
+	pool.checkin(eps[0]);
+	ok = ok && (co.Count == 3) && (co.Ep == eps[0]) && (co.UserData == 2) && (pool.getWaiterCount() == 0);
+
+	// A discarded connection makes room for a new one.
+	pool.checkout(HOST, PORT, &co, 3);
+	ok = ok && (pool.getWaiterCount() == 1);
+	pool.discard(eps[1]);
+	ok = ok && waitFor(mux, co, 4) && (co.Ec == NetEndpoint::EE_SUCCESS) && (co.UserData == 3);
+	ok = ok && (pool.getConnectCount() == 3) && (pool.getConnectionCount() == 2);
+	NetEndpoint *server = listener->accept();
+	ok = ok && exchange(co.Ep, server);
+	pool.checkin(co.Ep);
+	pool.checkin(eps[0]);
+	ok = ok && (pool.getIdleCount() == 2);
+
+	delete server;
+	delete servers[0];
+	delete servers[1];
+	printf("[Limit] %u connects, %u reuses.\n", (u32)pool.getConnectCount(), (u32)pool.getReuseCount());
+	return ok;
+}
+
+bool test_eviction(NetIoMux *mux, NetEndpoint *listener)
+{
+	NetConnPool pool(mux, 8, 1, 100);
+	Checkouts co;
+	NetEndpoint *eps[2];
+	NetEndpoint *servers[2];
+	bool ok = true;
+
+	for (u32 i = 0; i < 2; ++i)
+	{
+		pool.checkout(HOST, PORT, &co, i);
+		ok = ok && waitFor(mux, co, i + 1) && (co.Ec == NetEndpoint::EE_SUCCESS);
+		eps[i] = co.Ep;
+		servers[i] = listener->accept();
+	}
+	if (!ok)
+		return false;
+
+	// Only one idle connection is kept.
+	pool.checkin(eps[0]);
+	pool.checkin(eps[1]);
+	ok = (pool.getIdleCount() == 1) && (pool.getConnectionCount() == 1);
+
+	// And it is closed by the timer.
+	for (u32 i = 0; (i < 100) && (pool.getConnectionCount() != 0); ++i)
+		mux->runOnce(10);
+	ok = ok && (pool.getIdleCount() == 0) && (pool.getConnectionCount() == 0);
+
+	// The servers see both closed.
+	c8 buf[4];
+	ok = ok && (servers[0]->recv(buf, 4) == 0) && (servers[1]->recv(buf, 4) == 0);
+	delete servers[0];
+	delete servers[1];
+	printf("[Eviction] %s.\n", ok ? "Idle connections closed" : "failed");
+	return ok;
+}
+
+bool test_failure(NetIoMux *mux)
+{
+	NetConnPool pool(mux);
+	Checkouts co;
+	pool.checkout(HOST, PORT_CLOSED, &co, 5);
+	return waitFor(mux, co, 1) && (co.Ec == NetEndpoint::EE_CONNECT) && (co.Ep == 0)
+		&& (co.UserData == 5) && (pool.getConnectionCount() == 0) && (pool.getWaiterCount() == 0);
+}
+
+int main()
+{
+	NetIoMux *mux = new NetIoMux();
+	NetEndpoint *listener = NetEndpoint::create(NetEndpoint::ProtocolIPv4 | NetEndpoint::ProtocolTCP, HOST, PORT);
+	xpfAssert(listener != 0);
+	bool ok = true;
+
+	bool r = test_reuse(mux, listener);
+	printf("Testing reuse ... %s\n", r ? "ok" : "failed");
+	ok = ok && r;
+
+	r = test_limit(mux, listener);
+	printf("Testing connection limit ... %s\n", r ? "ok" : "failed");
+	ok = ok && r;
+
+	r = test_eviction(mux, listener);
+	printf("Testing idle eviction ... %s\n", r ? "ok" : "failed");
+	ok = ok && r;
+
+	r = test_failure(mux);
+	printf("Testing connect failure ... %s\n", r ? "ok" : "failed");
+	ok = ok && r;
+
+	delete listener;
+	delete mux;
+
+	printf("%s\n", ok ? "All tests passed." : "Test failed.");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,165 @@
+/*******************************************************************************
+* Copyright (c) 2013 matt@moregeek.com.tw
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+* 1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+* 2. Altered source versions must be plainly marked as such, and must not be
+*    misrepresented as being the original software.
+*
+* 3. This notice may not be removed or altered from any source
+*    distribution.
+********************************************************************************/
+
+#include <xpf/netcoroutine.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace xpf;
+
+#define NUM_CLIENTS  (20)
+#define NUM_MESSAGES (50)
+#define MSG_SIZE     (128)
+#define PORT         "50126"
+
+struct TestContext
+{
+	NetEndpoint *Listener;
+	u32          Echoed;   // messages echoed by server coroutines.
+	u32          Verified; // messages verified by client coroutines.
+	u32          Errors;
+};
+
+// Echo one connection until the peer shuts down.
+void session_body(NetCoScheduler *sched, vptr data)
+{
+	NetEndpoint *ep = (NetEndpoint*)data;
+	TestContext *ctx = (TestContext*)ep->getUserData();
+	c8 buf[MSG_SIZE];
+	while (true)
+	{
+		s32 bytes = sched->recv(ep, buf, MSG_SIZE);
+		if (bytes <= 0)
+			break;
+		if (sched->send(ep, buf, (u32)bytes) != bytes)
+		{
+			ctx->Errors++;
+			break;
+		}
+		ctx->Echoed++;
+	}
+	sched->getMux()->depart(ep);
+	delete ep;
+}
+
+void server_body(NetCoScheduler *sched, vptr data)
+{
+	TestContext *ctx = (TestContext*)data;
+	for (u32 i = 0; i < NUM_CLIENTS; ++i)
+	{
+		NetEndpoint::EError ec;
+		NetEndpoint *ep = sched->accept(ctx->Listener, &ec);
+		if (ep == 0)
+		{
+			printf("[Serv] accept() failed: %d\n", ec);
+			ctx->Errors++;
+			continue;
+		}
+		ep->setUserData((vptr)ctx);
+		sched->spawn(session_body, (vptr)ep, 65536);
+	}
+}
+
+void client_body(NetCoScheduler *sched, vptr data)
+{
+	TestContext *ctx = (TestContext*)data;
+	NetEndpoint *ep = NetEndpoint::create(NetEndpoint::ProtocolIPv4 | NetEndpoint::ProtocolTCP);
+	sched->getMux()->join(ep);
+
+	NetEndpoint::EError ec;
+	if (!sched->connect(ep, "localhost", PORT, &ec))
+	{
+		printf("[Client] connect() failed: %d\n", ec);
+		ctx->Errors++;
+	}
+	else
+	{
+		c8 out[MSG_SIZE], in[MSG_SIZE];
+		for (u32 i = 0; i < NUM_MESSAGES; ++i)
+		{
+			for (u32 j = 0; j < MSG_SIZE; ++j)
+				out[j] = (c8)rand();
+			if (sched->send(ep, out, MSG_SIZE) != MSG_SIZE)
+			{
+				ctx->Errors++;
+				break;
+			}
+
+			// Stream socket: the echo may come back in pieces.
+			u32 received = 0;
+			while (received < MSG_SIZE)
+			{
+				s32 bytes = sched->recv(ep, &in[received], MSG_SIZE - received);
+				if (bytes <= 0)
+					break;
+				received += bytes;
+			}
+			if ((received != MSG_SIZE) || (0 != memcmp(in, out, MSG_SIZE)))
+			{
+				ctx->Errors++;
+				break;
+			}
+			ctx->Verified++;
+			if (i % 10 == 0)
+				sched->yield();
+		}
+		ep->shutdown(NetEndpoint::ESD_WRITE);
+	}
+
+	sched->getMux()->depart(ep);
+	delete ep;
+}
+
+int main(int argc, char *argv[])
+{
+	NetIoMux *mux = new NetIoMux();
+	NetCoScheduler *sched = new NetCoScheduler(mux);
+
+	TestContext ctx;
+	ctx.Echoed = ctx.Verified = ctx.Errors = 0;
+	ctx.Listener = NetEndpoint::create(NetEndpoint::ProtocolIPv4 | NetEndpoint::ProtocolTCP, "localhost", PORT);
+	xpfAssert(ctx.Listener != 0);
+	mux->join(ctx.Listener);
+
+	sched->spawn(server_body, (vptr)&ctx, 65536);
+	for (u32 i = 0; i < NUM_CLIENTS; ++i)
+		sched->spawn(client_body, (vptr)&ctx, 65536);
+
+	// Everything runs on this single thread.
+	sched->run();
+
+	printf("%u messages echoed, %u verified, %u errors, %u coroutines left.\n",
+		ctx.Echoed, ctx.Verified, ctx.Errors, sched->count());
+	const bool passed = (ctx.Echoed == NUM_CLIENTS * NUM_MESSAGES)
+		&& (ctx.Verified == NUM_CLIENTS * NUM_MESSAGES)
+		&& (ctx.Errors == 0) && (sched->count() == 0);
+
+	delete sched;
+	mux->depart(ctx.Listener);
+	delete ctx.Listener;
+	delete mux;
+
+	printf("Coroutine networking test %s.\n", (passed) ? "passed" : "failed");
+	return (passed) ? 0 : 1;
+}
@@ -0,0 +1,283 @@
+/*******************************************************************************
+* Copyright (c) 2013 matt@moregeek.com.tw
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+* 1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+* 2. Altered source versions must be plainly marked as such, and must not be
+*    misrepresented as being the original software.
+*
+* 3. This notice may not be removed or altered from any source
+*    distribution.
+********************************************************************************/
+
+#include <xpf/netframing.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+using namespace xpf;
+
+#define NUM_FRAMES (2000)
+#define PORT       "50130"
+
+// Collects emitted frames and the final status.
+class Collector : public NetFrameCallback
+{
+public:
+	Collector() : Ended(false), Ec(NetEndpoint::EE_SUCCESS), StopAfter(0) {}
+
+	void onFrame(NetFrameReader *reader, NetEndpoint::EError ec, const c8 *frame, u32 len)
+	{
+		if (ec != NetEndpoint::EE_SUCCESS)
+		{
+			xpfAssert(frame == 0);
+			Ended = true;
+			Ec = ec;
+			return;
+		}
+		Frames.push_back(std::string(frame, len));
+		if ((StopAfter != 0) && (Frames.size() == StopAfter))
+			reader->stop();
+	}
+
+	std::vector<std::string> Frames;
+	bool                     Ended;
+	NetEndpoint::EError      Ec;
+	u32                      StopAfter;
+};
+
+static void encode(std::string &out, NetFrameReader::EFraming type, const std::string &payload)
+{
+	const u32 len = (u32)payload.size();
+	switch (type)
+	{
+	case NetFrameReader::EF_VARINT:
+		{
+			u32 v = len;
+			do
+			{
+				u8 b = (u8)(v & 0x7f);
+				v >>= 7;
+				if (v)
+					b |= 0x80;
+				out.push_back((c8)b);
+			} while (v);
+		}
+		break;
+	case NetFrameReader::EF_U16:
+		out.push_back((c8)(len >> 8));
+		out.push_back((c8)len);
+		break;
+	case NetFrameReader::EF_U32:
+		out.push_back((c8)(len >> 24));
+		out.push_back((c8)(len >> 16));
+		out.push_back((c8)(len >> 8));
+		out.push_back((c8)len);
+		break;
+	default:
+		break;
+	}
+	out += payload;
+	if (type == NetFrameReader::EF_DELIMITER)
+		out += "\r\n";
+}
+
+static std::vector<std::string> make_payloads(NetFrameReader::EFraming type)
+{
+	static const u32 sizes[] = { 0, 1, 5, 127, 128, 300, 1000, 70000 };
+	std::vector<std::string> ret;
+	for (u32 i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+	{
+		if ((type == NetFrameReader::EF_U16) && (sizes[i] > 0xffff))
+			continue;
+		std::string p;
+		for (u32 j = 0; j < sizes[i]; ++j)
+			p.push_back((c8)('a' + ((i + j) % 26))); // never contains "\r\n".
+		ret.push_back(p);
+	}
+	return ret;
+}
+
+static void setup(NetFrameReader &reader, NetFrameReader::EFraming type)
+{
+	if (type == NetFrameReader::EF_DELIMITER)
+		reader.setDelimited("\r\n", 2);
+	else
+		reader.setLengthPrefixed(type);
+}
+
+bool test_feed(NetFrameReader::EFraming type, u32 step)
+{
+	std::vector<std::string> payloads = make_payloads(type);
+	std::string stream;
+	for (u32 i = 0; i < (u32)payloads.size(); ++i)
+		encode(stream, type, payloads[i]);
+
+	Collector col;
+	NetFrameReader reader(0, &col, 16);
+	setup(reader, type);
+	for (u32 off = 0; off < (u32)stream.size(); off += step)
+	{
+		u32 n = (u32)stream.size() - off;
+		if (n > step)
+			n = step;
+		if (reader.feed(stream.data() + off, n) < 0)
+			return false;
+	}
+	return (col.Frames == payloads) && !col.Ended && (reader.getBufferedBytes() == 0);
+}
+
+bool test_malformed()
+{
+	// A varint longer than 5 bytes.
+	Collector c1;
+	NetFrameReader r1(0, &c1);
+	r1.setLengthPrefixed(NetFrameReader::EF_VARINT);
+	const c8 bad[] = { (c8)0xff, (c8)0xff, (c8)0xff, (c8)0xff, (c8)0xff, 0x01 };
+	if ((r1.feed(bad, sizeof(bad)) != -1) || !c1.Ended || (c1.Ec != NetEndpoint::EE_RECV))
+		return false;
+	if (r1.feed("x", 1) != -1) // stays failed.
+		return false;
+
+	// A frame exceeding the maximum frame size.
+	Collector c2;
+	NetFrameReader r2(0, &c2);
+	r2.setLengthPrefixed(NetFrameReader::EF_U32, 1024);
+	const c8 big[] = { 0, 0, 0x04, 0x01 };
+	if ((r2.feed(big, sizeof(big)) != -1) || (c2.Ec != NetEndpoint::EE_RECV))
+		return false;
+
+	// A delimited frame exceeding the maximum frame size.
+	Collector c3;
+	NetFrameReader r3(0, &c3, 16);
+	r3.setDelimited("\r\n", 2, 100);
+	std::string line(200, 'x');
+	return (r3.feed(line.data(), (u32)line.size()) == -1) && (c3.Ec == NetEndpoint::EE_RECV);
+}
+
+bool test_stop()
+{
+	std::string stream;
+	for (u32 i = 0; i < 10; ++i)
+		encode(stream, NetFrameReader::EF_U16, "frame");
+
+	Collector col;
+	col.StopAfter = 3;
+	NetFrameReader reader(0, &col);
+	reader.setLengthPrefixed(NetFrameReader::EF_U16);
+	if (reader.feed(stream.data(), (u32)stream.size()) != 3)
+		return false;
+	if (reader.getBufferedBytes() != 7 * 7)
+		return false;
+
+	// Feeding again resumes with the buffered frames.
+	col.StopAfter = 0;
+	return (reader.feed(0, 0) == 7) && (col.Frames.size() == 10) && (reader.getBufferedBytes() == 0);
+}
+
+bool test_network()
+{
+	NetEndpoint *listener = NetEndpoint::create(NetEndpoint::ProtocolIPv4 | NetEndpoint::ProtocolTCP,
+		"localhost", PORT);
+	xpfAssert(listener != 0);
+	NetEndpoint *client = NetEndpoint::create(NetEndpoint::ProtocolIPv4 | NetEndpoint::ProtocolTCP);
+	bool connected = client->connect("localhost", PORT);
+	xpfAssert(connected);
+	NetEndpoint *server = listener->accept();
+	xpfAssert(server != 0);
+
+	// Many small frames sent at once.
+	std::vector<std::string> payloads;
+	std::string stream;
+	for (u32 i = 0; i < NUM_FRAMES; ++i)
+	{
+		std::string p(1 + (rand() % 100), (c8)('A' + (i % 26)));
+		payloads.push_back(p);
+		encode(stream, NetFrameReader::EF_U16, p);
+	}
+
+	// Async mode: the server reads via the mux.
+	NetIoMux *mux = new NetIoMux();
+	mux->join(server);
+	Collector scol;
+	NetFrameReader sreader(server, &scol);
+	sreader.setLengthPrefixed(NetFrameReader::EF_U16);
+	sreader.start(mux);
+	client->send(stream.data(), (s32)stream.size());
+	for (u32 i = 0; (i < 500) && (scol.Frames.size() < NUM_FRAMES); ++i)
+		mux->runOnce(10);
+	printf("[Async] %u frames in %u receives.\n", (u32)sreader.getFrameCount(), (u32)sreader.getRecvCount());
+	bool ok = (scol.Frames == payloads) && (sreader.getRecvCount() < NUM_FRAMES / 10);
+
+	// Sync mode: the client reads what the server echoes back.
+	std::string echo;
+	for (u32 i = 0; i < 100; ++i)
+		encode(echo, NetFrameReader::EF_DELIMITER, payloads[i]);
+	server->send(echo.data(), (s32)echo.size());
+	Collector ccol;
+	NetFrameReader creader(client, &ccol);
+	creader.setDelimited("\r\n", 2);
+	while (ccol.Frames.size() < 100)
+	{
+		if (creader.pump() < 0)
+			break;
+	}
+	printf("[Sync] %u frames in %u receives.\n", (u32)creader.getFrameCount(), (u32)creader.getRecvCount());
+	ok = ok && (ccol.Frames.size() == 100);
+	for (u32 i = 0; ok && (i < 100); ++i)
+		ok = (ccol.Frames[i] == payloads[i]);
+
+	// Peer shutdown ends the async reader.
+	delete client;
+	for (u32 i = 0; (i < 500) && !scol.Ended; ++i)
+		mux->runOnce(10);
+	ok = ok && scol.Ended && (scol.Ec == NetEndpoint::EE_SHUTDOWN) && !sreader.isRunning();
+
+	mux->depart(server);
+	delete server;
+	delete listener;
+	delete mux;
+	return ok;
+}
+
+int main()
+{
+	static const c8 *names[] = { "varint", "u16", "u32", "delimiter" };
+	bool ok = true;
+	for (u32 t = NetFrameReader::EF_VARINT; t <= NetFrameReader::EF_DELIMITER; ++t)
+	{
+		const bool r = test_feed((NetFrameReader::EFraming)t, 1) &&
+			test_feed((NetFrameReader::EFraming)t, 7) &&
+			test_feed((NetFrameReader::EFraming)t, 0x100000);
+		printf("Testing %s framing ... %s\n", names[t], r ? "ok" : "failed");
+		ok = ok && r;
+	}
+
+	bool r = test_malformed();
+	printf("Testing malformed frames ... %s\n", r ? "ok" : "failed");
+	ok = ok && r;
+
+	r = test_stop();
+	printf("Testing stop ... %s\n", r ? "ok" : "failed");
+	ok = ok && r;
+
+	r = test_network();
+	printf("Testing network ... %s\n", r ? "ok" : "failed");
+	ok = ok && r;
+
+	printf("%s\n", ok ? "All tests passed." : "Test failed.");
+	return ok ? 0 : 1;
+}
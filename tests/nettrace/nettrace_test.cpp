@@ -0,0 +1,323 @@
+/*******************************************************************************
+* Copyright (c) 2013 matt@moregeek.com.tw
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+* 1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+* 2. Altered source versions must be plainly marked as such, and must not be
+*    misrepresented as being the original software.
+*
+* 3. This notice may not be removed or altered from any source
+*    distribution.
+********************************************************************************/
+
+#include <xpf/nettrace.h>
+#include <xpf/thread.h>
+#include <xpf/lexicalcast.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+using namespace xpf;
+
+#define HOST        "127.0.0.1"
+#define PORT        "50138"
+#define TRACE_FILE  "nettrace_test.trc"
+#define CLIENTS     (4)
+
+// Runs a mux until it is disabled.
+class MuxThread : public Thread
+{
+public:
+	explicit MuxThread(NetIoMux *mux) : mMux(mux) {}
+	u32 run(u64 udata) { mMux->run(); return 0; }
+private:
+	NetIoMux *mMux;
+};
+
+// Counts whatever its connections receive and closes them at the end
+// of the stream.
+class SinkServer : public NetIoMuxCallback
+{
+public:
+	explicit SinkServer(NetIoMux *mux) : Mux(mux), Bytes(0), Closed(0) {}
+
+	void onIoCompleted(NetIoMux::EIoType type, NetEndpoint::EError ec, NetEndpoint *sep, vptr tepOrPeer, const c8 *buf, u32 len)
+	{
+		if (type == NetIoMux::EIT_ACCEPT)
+		{
+			if (ec == NetEndpoint::EE_SUCCESS)
+			{
+				NetEndpoint *tep = (NetEndpoint*)tepOrPeer;
+				tep->setUserData((vptr)new c8[65536]);
+				Mux->asyncRecv(tep, (c8*)tep->getUserData(), 65536, this);
+			}
+			Mux->asyncAccept(sep, this);
+		}
+		else if (type == NetIoMux::EIT_RECV)
+		{
+			if ((ec == NetEndpoint::EE_SUCCESS) && (len > 0))
+			{
+				Bytes += len;
+				Mux->asyncRecv(sep, (c8*)sep->getUserData(), 65536, this);
+				return;
+			}
+			Mux->depart(sep);
+			delete[] (c8*)sep->getUserData();
+			delete sep;
+			Closed++;
+		}
+	}
+
+	NetIoMux       *Mux;
+	volatile u64    Bytes;
+	volatile u32    Closed;
+};
+
+// Takes the result of a connect.
+class ConnectWaiter : public NetIoMuxCallback
+{
+public:
+	ConnectWaiter() : Ep(0), Error(NetEndpoint::EE_SUCCESS), Done(false) {}
+
+	void onIoCompleted(NetIoMux::EIoType type, NetEndpoint::EError ec, NetEndpoint *sep, vptr tepOrPeer, const c8 *buf, u32 len)
+	{
+		if (type != NetIoMux::EIT_CONNECT)
+			return;
+		Ep = sep;
+		Error = ec;
+		Done = true;
+	}
+
+	NetEndpoint            *Ep;
+	NetEndpoint::EError     Error;
+	volatile bool           Done;
+};
+
+static bool waitClosed(SinkServer &server, u32 count)
+{
+	for (u32 i = 0; (i < 500) && (server.Closed < count); ++i)
+		Thread::sleep(10);
+	return (server.Closed == count);
+}
+
+// Blocking clients sending chunks of various sizes with pauses.
+static u64 generate(u32 clients)
+{
+	static const u32 sizes[] = { 100, 2000, 50, 1400, 9000, 300 };
+	static c8 data[9000];
+	u64 total = 0;
+
+	std::vector<NetEndpoint*> eps;
+	for (u32 i = 0; i < clients; ++i)
+	{
+		NetEndpoint *ep = NetEndpoint::create(NetEndpoint::ProtocolIPv4 | NetEndpoint::ProtocolTCP);
+		if (!ep->connect(HOST, PORT))
+		{
+			delete ep;
+			continue;
+		}
+		eps.push_back(ep);
+	}
+	for (u32 round = 0; round < 6; ++round)
+	{
+		for (u32 i = 0; i < (u32)eps.size(); ++i)
+		{
+			const u32 len = sizes[(round + i) % 6];
+			if (eps[i]->send(data, len) == (s32)len)
+				total += len;
+		}
+		Thread::sleep(20);
+	}
+	for (u32 i = 0; i < (u32)eps.size(); ++i)
+	{
+		eps[i]->shutdown(NetEndpoint::ESD_WRITE);
+		c8 buf[16];
+		while (eps[i]->recv(buf, sizeof(buf)) > 0) {}
+		delete eps[i];
+	}
+	return total;
+}
+
+bool test_record(NetIoMux *mux, SinkServer &server, NetTraceReader &trace, u64 &total)
+{
+	if (!mux->startTrace(TRACE_FILE))
+		return false;
+	total = generate(CLIENTS);
+	bool ok = waitClosed(server, CLIENTS);
+	mux->stopTrace();
+
+	ok = ok && trace.open(TRACE_FILE) && (trace.getOverwrittenCount() == 0);
+	// The accept pending since before the trace is not recorded.
+	u32 accepts = 0, eofs = 0;
+	u64 received = 0;
+	for (u32 i = 0; ok && (i < trace.getCount()); ++i)
+	{
+		const NetTraceRecord &r = trace.getRecord(i);
+		if ((r.Type == NetIoMux::EIT_ACCEPT) && (r.Error == NetEndpoint::EE_SUCCESS))
+		{
+			accepts++;
+			ok = (r.PeerId != 0) && (r.PeerId != r.EndpointId);
+		}
+		else if (r.Type == NetIoMux::EIT_RECV)
+		{
+			ok = (r.Requested == 65536) && (r.EndpointId != 0);
+			received += r.Length;
+			eofs += (r.Length == 0) ? 1 : 0;
+		}
+	}
+	printf("Recorded %u records, %u accepts, %llu bytes.\n", trace.getCount(), accepts, received);
+	return ok && (accepts == CLIENTS - 1) && (eofs == CLIENTS) && (received == total);
+}
+
+bool test_replay(NetIoMux *mux, SinkServer &server, const NetTraceReader &trace, u64 total)
+{
+	NetIoMux *replayMux = new NetIoMux();
+	NetTraceReplay *replay = new NetTraceReplay(replayMux);
+	u64 before = server.Bytes;
+	u32 closed = server.Closed;
+
+	bool ok = (replay->load(trace) == CLIENTS) && replay->start(HOST, PORT, 2.0f);
+	for (u32 i = 0; ok && (i < 1000) && !replay->isDone(); ++i)
+		replayMux->runOnce(10);
+	ok = ok && replay->isDone() && waitClosed(server, closed + CLIENTS);
+	printf("Replayed %u connections, %llu bytes, max lag %u us.\n",
+		replay->getConnectionCount(), replay->getSentBytes(), replay->getMaxLagUs());
+	ok = ok && (replay->getErrorCount() == 0) && (replay->getSentBytes() == total) && (server.Bytes - before == total);
+
+	delete replay;
+	delete replayMux;
+	return ok;
+}
+
+bool test_ring(NetIoMux *mux, SinkServer &server)
+{
+	u32 closed = server.Closed;
+	if (!mux->startTrace(TRACE_FILE, 8))
+		return false;
+	generate(CLIENTS);
+	bool ok = waitClosed(server, closed + CLIENTS);
+	mux->stopTrace();
+
+	// Only the latest records are kept, oldest first.
+	NetTraceReader trace;
+	ok = ok && trace.open(TRACE_FILE) && (trace.getCount() == 8) && (trace.getOverwrittenCount() > 0);
+	for (u32 i = 1; ok && (i < trace.getCount()); ++i)
+	{
+		const NetTraceRecord &a = trace.getRecord(i - 1);
+		const NetTraceRecord &b = trace.getRecord(i);
+		ok = (a.TimeUs + a.LatencyUs <= b.TimeUs + b.LatencyUs + 1000);
+	}
+	return ok;
+}
+
+bool test_connect_any(NetIoMux *mux, SinkServer &server)
+{
+	u32 closed = server.Closed;
+	if (!mux->startTrace(TRACE_FILE))
+		return false;
+	ConnectWaiter waiter;
+	mux->asyncConnectAny(HOST, PORT, &waiter);
+	for (u32 i = 0; (i < 500) && !waiter.Done; ++i)
+		Thread::sleep(10);
+	mux->stopTrace();
+
+	bool ok = waiter.Done && (waiter.Error == NetEndpoint::EE_SUCCESS) && (waiter.Ep != 0);
+	if (waiter.Ep)
+	{
+		mux->depart(waiter.Ep);
+		delete waiter.Ep;
+		ok = ok && waitClosed(server, closed + 1);
+	}
+
+	// The race is recorded as a connect.
+	NetTraceReader trace;
+	bool recorded = false;
+	ok = ok && trace.open(TRACE_FILE);
+	for (u32 i = 0; ok && (i < trace.getCount()); ++i)
+		recorded = recorded || (trace.getRecord(i).Type == NetIoMux::EIT_CONNECT);
+	return ok && recorded;
+}
+
+// Replay a trace file against a server: nettrace_test <file> <host> <port> [speed]
+int replay_file(int argc, char *argv[])
+{
+	NetTraceReader trace;
+	if (!trace.open(argv[1]))
+	{
+		printf("Failed to read %s.\n", argv[1]);
+		return 1;
+	}
+
+	NetIoMux *mux = new NetIoMux();
+	NetTraceReplay *replay = new NetTraceReplay(mux);
+	f32 speed = (argc > 4) ? (f32)atof(argv[4]) : 1.0f;
+	u32 conns = replay->load(trace);
+	printf("Replaying %u connections of %u records at %.2fx ...\n", conns, trace.getCount(), speed);
+	bool ok = replay->start(argv[2], argv[3], speed);
+	while (ok && !replay->isDone())
+		mux->runOnce(100);
+	printf("Sent %llu bytes, received %llu bytes, %u errors, max lag %u us.\n",
+		replay->getSentBytes(), replay->getRecvBytes(), replay->getErrorCount(), replay->getMaxLagUs());
+	ok = ok && (replay->getErrorCount() == 0);
+
+	delete replay;
+	delete mux;
+	return (ok) ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc >= 4)
+		return replay_file(argc, argv);
+
+	NetIoMux *mux = new NetIoMux();
+	NetEndpoint *listener = NetEndpoint::create(NetEndpoint::ProtocolIPv4 | NetEndpoint::ProtocolTCP, HOST, PORT);
+	xpfAssert(listener != 0);
+	SinkServer server(mux);
+	mux->join(listener);
+	mux->asyncAccept(listener, &server);
+	MuxThread *worker = new MuxThread(mux);
+	worker->start();
+	bool ok = true;
+
+	NetTraceReader trace;
+	u64 total = 0;
+	bool r = test_record(mux, server, trace, total);
+	printf("Testing trace recording ... %s\n", r ? "ok" : "failed");
+	ok = ok && r;
+
+	r = test_replay(mux, server, trace, total);
+	printf("Testing trace replay ... %s\n", r ? "ok" : "failed");
+	ok = ok && r;
+
+	r = test_ring(mux, server);
+	printf("Testing trace ring ... %s\n", r ? "ok" : "failed");
+	ok = ok && r;
+
+	r = test_connect_any(mux, server);
+	printf("Testing traced connect race ... %s\n", r ? "ok" : "failed");
+	ok = ok && r;
+
+	mux->disable();
+	worker->join();
+	delete worker;
+	mux->depart(listener);
+	delete listener;
+	delete mux;
+	::remove(TRACE_FILE);
+
+	printf("%s\n", ok ? "All tests passed." : "Test failed.");
+	return ok ? 0 : 1;
+}
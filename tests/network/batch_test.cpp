@@ -0,0 +1,138 @@
+/*******************************************************************************
+* Copyright (c) 2013 matt@moregeek.com.tw
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+* 1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+* 2. Altered source versions must be plainly marked as such, and must not be
+*    misrepresented as being the original software.
+*
+* 3. This notice may not be removed or altered from any source
+*    distribution.
+********************************************************************************/
+
+#include "batch_test.h"
+#include "async_server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_FRAMES (1000)
+#define FRAME_SIZE (32)
+
+using namespace xpf;
+
+TestBatch::TestBatch()
+	: mData(0)
+	, mCompleted(0)
+	, mBatches(0)
+	, mMaxBatch(0)
+	, mErrors(0)
+{
+	mMux = new NetIoMux();
+	mData = new c8[NUM_FRAMES * FRAME_SIZE];
+}
+
+TestBatch::~TestBatch()
+{
+	delete mMux;
+	mMux = 0;
+	delete[] mData;
+	mData = 0;
+}
+
+bool TestBatch::run()
+{
+	NetEndpoint *listeningEp = NetEndpoint::create(NetEndpoint::ProtocolIPv4 | NetEndpoint::ProtocolTCP,
+		"localhost", "50128");
+	xpfAssert(listeningEp != 0);
+
+	NetEndpoint *client = NetEndpoint::create(NetEndpoint::ProtocolIPv4 | NetEndpoint::ProtocolTCP);
+	bool connected = client->connect("localhost", "50128");
+	xpfAssert(connected);
+	NetEndpoint *server = listeningEp->accept();
+	xpfAssert(server != 0);
+
+	mMux->join(server);
+
+	const u32 total = NUM_FRAMES * FRAME_SIZE;
+	for (u32 i = 0; i < total; ++i)
+		mData[i] = (c8)rand();
+	for (u32 i = 0; i < NUM_FRAMES; ++i)
+		mMux->asyncSend(server, &mData[i * FRAME_SIZE], FRAME_SIZE, this);
+
+	WorkerThread *worker = new WorkerThread(mMux);
+	worker->start();
+
+	bool verified = true;
+	c8 buf[4096];
+	u32 received = 0;
+	while (received < total)
+	{
+		s32 bytes = client->recv(buf, 4096);
+		if (bytes <= 0)
+		{
+			verified = false;
+			break;
+		}
+		if (0 != memcmp(buf, &mData[received], bytes))
+			verified = false;
+		received += bytes;
+	}
+	printf("[Batch] Received %u of %u bytes.\n", received, total);
+
+	for (u32 i = 0; (i < 500) && (mCompleted < NUM_FRAMES); ++i)
+		Thread::sleep(10);
+	printf("[Batch] %u completions in %u batches (max %u), %u errors.\n",
+		mCompleted, mBatches, mMaxBatch, mErrors);
+
+	mMux->disable();
+	worker->join();
+	delete worker;
+
+	mMux->depart(server);
+	delete server;
+	delete client;
+	delete listeningEp;
+
+	return verified && (mCompleted == NUM_FRAMES) && (mErrors == 0);
+}
+
+void TestBatch::onIoCompleted(
+	NetIoMux::EIoType type,
+	NetEndpoint::EError ec,
+	NetEndpoint *sep,
+	vptr tepOrPeer,
+	const c8 *buf,
+	u32 len)
+{
+	// All completions are expected to come through onIoCompletedBatch().
+	mErrors++;
+}
+
+void TestBatch::onIoCompletedBatch(const NetIoMuxCompletion *records, u32 count)
+{
+	// Batches of one endpoint are emitted in order by a single worker.
+	for (u32 i = 0; i < count; ++i)
+	{
+		const NetIoMuxCompletion &r = records[i];
+		if ((r.Type != NetIoMux::EIT_SEND) || (r.Error != NetEndpoint::EE_SUCCESS) ||
+			(r.Length != FRAME_SIZE) || (r.Buffer != &mData[mCompleted * FRAME_SIZE]))
+			mErrors++;
+		mCompleted++;
+	}
+	mBatches++;
+	if (count > mMaxBatch)
+		mMaxBatch = count;
+}
@@ -0,0 +1,54 @@
+/*******************************************************************************
+* Copyright (c) 2013 matt@moregeek.com.tw
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+* 1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+* 2. Altered source versions must be plainly marked as such, and must not be
+*    misrepresented as being the original software.
+*
+* 3. This notice may not be removed or altered from any source
+*    distribution.
+********************************************************************************/
+
+#ifndef _XPF_TEST_BATCH_HDR_
+#define _XPF_TEST_BATCH_HDR_
+
+#include <xpf/platform.h>
+#include <xpf/netiomux.h>
+#include <xpf/thread.h>
+
+class TestBatch : public xpf::NetIoMuxCallback
+{
+public:
+	TestBatch();
+	virtual ~TestBatch();
+
+	// Queue lots of sends before the worker starts and verify
+	// they are delivered in order through the batch callback.
+	bool run();
+
+	// async callbacks (** multi-thread accessing)
+	void onIoCompleted(xpf::NetIoMux::EIoType type, xpf::NetEndpoint::EError ec, xpf::NetEndpoint *sep, xpf::vptr tepOrPeer, const xpf::c8 *buf, xpf::u32 len);
+	void onIoCompletedBatch(const xpf::NetIoMuxCompletion *records, xpf::u32 count);
+
+private:
+	xpf::NetIoMux    *mMux;
+	xpf::c8          *mData;
+	volatile xpf::u32 mCompleted;
+	volatile xpf::u32 mBatches;
+	volatile xpf::u32 mMaxBatch;
+	volatile xpf::u32 mErrors;
+};
+
+#endif // _XPF_TEST_BATCH_HDR_
@@ -0,0 +1,131 @@
+/*******************************************************************************
+* Copyright (c) 2013 matt@moregeek.com.tw
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+* 1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+* 2. Altered source versions must be plainly marked as such, and must not be
+*    misrepresented as being the original software.
+*
+* 3. This notice may not be removed or altered from any source
+*    distribution.
+********************************************************************************/
+
+#include "coalesce_test.h"
+#include "async_server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_FRAMES (1000)
+
+using namespace xpf;
+
+TestCoalesce::TestCoalesce()
+	: mData(0)
+	, mCompleted(0)
+	, mErrors(0)
+{
+	mMux = new NetIoMux();
+	mData = new c8[NUM_FRAMES * 64];
+}
+
+TestCoalesce::~TestCoalesce()
+{
+	delete mMux;
+	mMux = 0;
+	delete[] mData;
+	mData = 0;
+}
+
+bool TestCoalesce::run()
+{
+	NetEndpoint *listeningEp = NetEndpoint::create(NetEndpoint::ProtocolIPv4 | NetEndpoint::ProtocolTCP,
+		"localhost", "50124");
+	xpfAssert(listeningEp != 0);
+
+	NetEndpoint *client = NetEndpoint::create(NetEndpoint::ProtocolIPv4 | NetEndpoint::ProtocolTCP);
+	bool connected = client->connect("localhost", "50124");
+	xpfAssert(connected);
+	NetEndpoint *server = listeningEp->accept();
+	xpfAssert(server != 0);
+
+	mMux->join(server);
+	bool supported = mMux->setSendCoalescing(server);
+	printf("[Coalesce] Send coalescing %s.\n", (supported) ? "enabled" : "not supported");
+
+	// Queue all frames before any worker thread starts so that
+	// they are all pending in the write queue.
+	u32 total = 0;
+	for (u32 i = 0; i < NUM_FRAMES; ++i)
+	{
+		mSizes[i] = 20 + (rand() % 41); // 20 ~ 60 bytes
+		for (u32 j = 0; j < mSizes[i]; ++j)
+			mData[total + j] = (c8)rand();
+		mMux->asyncSend(server, &mData[total], mSizes[i], this);
+		total += mSizes[i];
+	}
+
+	WorkerThread *worker = new WorkerThread(mMux);
+	worker->start();
+
+	bool verified = true;
+	c8 buf[4096];
+	u32 received = 0;
+	while (received < total)
+	{
+		s32 bytes = client->recv(buf, 4096);
+		if (bytes <= 0)
+		{
+			verified = false;
+			break;
+		}
+		if (0 != memcmp(buf, &mData[received], bytes))
+			verified = false;
+		received += bytes;
+	}
+	printf("[Coalesce] Received %u of %u bytes.\n", received, total);
+
+	for (u32 i = 0; (i < 500) && (mCompleted < NUM_FRAMES); ++i)
+		Thread::sleep(10);
+	printf("[Coalesce] %u completions, %u errors.\n", mCompleted, mErrors);
+
+	mMux->disable();
+	worker->join();
+	delete worker;
+
+	mMux->depart(server);
+	delete server;
+	delete client;
+	delete listeningEp;
+
+	return verified && (mCompleted == NUM_FRAMES) && (mErrors == 0);
+}
+
+void TestCoalesce::onIoCompleted(
+	NetIoMux::EIoType type,
+	NetEndpoint::EError ec,
+	NetEndpoint *sep,
+	vptr tepOrPeer,
+	const c8 *buf,
+	u32 len)
+{
+	xpfAssert(type == NetIoMux::EIT_SEND);
+
+	// Completions of one endpoint are emitted in order by a single worker.
+	const u32 idx = mCompleted;
+	if ((ec != NetEndpoint::EE_SUCCESS) || (len != mSizes[idx]))
+		mErrors++;
+	mCompleted++;
+}
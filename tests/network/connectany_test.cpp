@@ -0,0 +1,181 @@
+/*******************************************************************************
+* Copyright (c) 2013 matt@moregeek.com.tw
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+* 1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+* 2. Altered source versions must be plainly marked as such, and must not be
+*    misrepresented as being the original software.
+*
+* 3. This notice may not be removed or altered from any source
+*    distribution.
+********************************************************************************/
+
+#include "connectany_test.h"
+#include "async_server.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef XPF_PLATFORM_WINDOWS
+#include <Windows.h>
+#else
+#include <time.h>
+#endif
+
+#define PORT_REFUSED  "50132"
+#define PORT_STALLED  "50133"
+#define PORT_CLOSED   "50134"
+
+using namespace xpf;
+
+static u64 nowMs()
+{
+#ifdef XPF_PLATFORM_WINDOWS
+	return (u64)::GetTickCount64();
+#else
+	struct timespec ts;
+	::clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((u64)ts.tv_sec * 1000) + ((u64)ts.tv_nsec / 1000000);
+#endif
+}
+
+TestConnectAny::TestConnectAny()
+	: mDone(false)
+	, mError(NetEndpoint::EE_SUCCESS)
+	, mWinner(0)
+	, mHasPeer(false)
+{
+	mMux = new NetIoMux();
+}
+
+TestConnectAny::~TestConnectAny()
+{
+	delete mMux;
+	mMux = 0;
+}
+
+u32 TestConnectAny::race(const c8 *port, u32 delayMs, bool byName)
+{
+	mDone = false;
+	mWinner = 0;
+	mHasPeer = false;
+
+	u64 start = nowMs();
+	if (byName)
+	{
+		mMux->asyncConnectAny("localhost", port, this, delayMs);
+	}
+	else
+	{
+		NetEndpoint::Peer peers[2];
+		bool resolved = NetEndpoint::resolvePeer(NetEndpoint::ProtocolTCP | NetEndpoint::ProtocolIPv6, peers[0], "::1", port)
+			&& NetEndpoint::resolvePeer(NetEndpoint::ProtocolTCP | NetEndpoint::ProtocolIPv4, peers[1], "127.0.0.1", port);
+		xpfAssert(resolved);
+		mMux->asyncConnectAny(peers, 2, this, delayMs);
+	}
+
+	while (!mDone && (nowMs() - start < 10000))
+		Thread::sleep(1);
+	return (u32)(nowMs() - start);
+}
+
+bool TestConnectAny::verifyWinner(NetEndpoint *listener)
+{
+	if (mWinner == 0)
+		return false;
+
+	bool ok = mHasPeer && (mWinner->getStatus() == NetEndpoint::ESTAT_CONNECTED)
+		&& ((mWinner->getProtocol() & NetEndpoint::ProtocolIPv4) != 0);
+
+	// The winner is a usable connection to the listener.
+	NetEndpoint *server = listener->accept();
+	mMux->depart(mWinner);
+	ok = ok && (server != 0) && (mWinner->send("ping", 4) == 4);
+	c8 buf[4];
+	ok = ok && (server->recv(buf, 4) == 4) && (0 == memcmp(buf, "ping", 4));
+
+	delete server;
+	delete mWinner;
+	mWinner = 0;
+	return ok;
+}
+
+bool TestConnectAny::run()
+{
+	WorkerThread *worker = new WorkerThread(mMux);
+	worker->start();
+	bool passed = true;
+
+	// Only IPv4 listens: The refused IPv6 attempt lets the IPv4 one go
+	// without waiting for the attempt delay.
+	NetEndpoint *v4 = NetEndpoint::create(NetEndpoint::ProtocolIPv4 | NetEndpoint::ProtocolTCP, "127.0.0.1", PORT_REFUSED);
+	xpfAssert(v4 != 0);
+	u32 elapsed = race(PORT_REFUSED, 5000);
+	bool ok = mDone && (mError == NetEndpoint::EE_SUCCESS) && (elapsed < 1000) && verifyWinner(v4);
+	printf("[ConnectAny] IPv6 refused: %s in %u ms.\n", (ok) ? "IPv4 won" : "failed", elapsed);
+	passed = passed && ok;
+
+	// By host name.
+	elapsed = race(PORT_REFUSED, 250, true);
+	ok = mDone && (mError == NetEndpoint::EE_SUCCESS) && verifyWinner(v4);
+	printf("[ConnectAny] Connect to localhost: %s in %u ms.\n", (ok) ? "succeeded" : "failed", elapsed);
+	passed = passed && ok;
+	delete v4;
+
+	// The IPv6 listener has a full accept queue and drops SYNs: The
+	// IPv4 attempt starts after the delay and wins.
+	NetEndpoint *v6 = NetEndpoint::create(NetEndpoint::ProtocolIPv6 | NetEndpoint::ProtocolTCP, "::1", PORT_STALLED, 0, 0);
+	v4 = NetEndpoint::create(NetEndpoint::ProtocolIPv4 | NetEndpoint::ProtocolTCP, "127.0.0.1", PORT_STALLED);
+	xpfAssert((v6 != 0) && (v4 != 0));
+	NetEndpoint *filler = NetEndpoint::create(NetEndpoint::ProtocolIPv6 | NetEndpoint::ProtocolTCP);
+	bool filled = filler->connect("::1", PORT_STALLED);
+	elapsed = race(PORT_STALLED, 100);
+	ok = filled && mDone && (mError == NetEndpoint::EE_SUCCESS) && (elapsed >= 100) && (elapsed < 1000) && verifyWinner(v4);
+	printf("[ConnectAny] IPv6 stalled: %s in %u ms.\n", (ok) ? "IPv4 won" : "failed", elapsed);
+	passed = passed && ok;
+
+	// Nobody listens.
+	elapsed = race(PORT_CLOSED, 100);
+	ok = mDone && (mError == NetEndpoint::EE_CONNECT) && (mWinner == 0);
+	printf("[ConnectAny] Nobody listens: %s in %u ms.\n", (ok) ? "failed as expected" : "did not fail properly", elapsed);
+	passed = passed && ok;
+
+	// Let the cancelled attempts drain before closing the listeners.
+	Thread::sleep(100);
+	delete filler;
+	delete v6;
+	delete v4;
+
+	mMux->disable();
+	worker->join();
+	delete worker;
+
+	return passed;
+}
+
+void TestConnectAny::onIoCompleted(
+	NetIoMux::EIoType type,
+	NetEndpoint::EError ec,
+	NetEndpoint *sep,
+	vptr tepOrPeer,
+	const c8 *buf,
+	u32 len)
+{
+	xpfAssert(type == NetIoMux::EIT_CONNECT);
+
+	mError = ec;
+	mWinner = sep;
+	mHasPeer = (tepOrPeer != 0);
+	mDone = true;
+}
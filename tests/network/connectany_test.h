@@ -0,0 +1,57 @@
+/*******************************************************************************
+* Copyright (c) 2013 matt@moregeek.com.tw
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+* 1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+* 2. Altered source versions must be plainly marked as such, and must not be
+*    misrepresented as being the original software.
+*
+* 3. This notice may not be removed or altered from any source
+*    distribution.
+********************************************************************************/
+
+#ifndef _XPF_TEST_CONNECTANY_HDR_
+#define _XPF_TEST_CONNECTANY_HDR_
+
+#include <xpf/platform.h>
+#include <xpf/netiomux.h>
+
+class TestConnectAny : public xpf::NetIoMuxCallback
+{
+public:
+	TestConnectAny();
+	virtual ~TestConnectAny();
+
+	// Race IPv6 and IPv4 loopback addresses where the IPv6 one refuses
+	// or stalls, and verify the IPv4 attempt wins in time. Also verify
+	// connecting by host name and the failure of all attempts.
+	bool run();
+
+	void onIoCompleted(xpf::NetIoMux::EIoType type, xpf::NetEndpoint::EError ec, xpf::NetEndpoint *sep, xpf::vptr tepOrPeer, const xpf::c8 *buf, xpf::u32 len);
+
+private:
+	// Start a race and wait for its result. Returns the elapsed time.
+	xpf::u32 race(const xpf::c8 *port, xpf::u32 delayMs, bool byName = false);
+
+	// Verify the winner reaches 'listener' and release it.
+	bool verifyWinner(xpf::NetEndpoint *listener);
+
+	xpf::NetIoMux             *mMux;
+	volatile bool              mDone;
+	xpf::NetEndpoint::EError   mError;
+	xpf::NetEndpoint          *mWinner;
+	bool                       mHasPeer;
+};
+
+#endif // _XPF_TEST_CONNECTANY_HDR_
@@ -0,0 +1,223 @@
+/*******************************************************************************
+* Copyright (c) 2013 matt@moregeek.com.tw
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+* 1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+* 2. Altered source versions must be plainly marked as such, and must not be
+*    misrepresented as being the original software.
+*
+* 3. This notice may not be removed or altered from any source
+*    distribution.
+********************************************************************************/
+
+#include "fairness_test.h"
+#include <xpf/thread.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#define PORT      "50139"
+#define RECV_SIZE (1024)
+#define RECVS     (100)
+
+using namespace xpf;
+
+TestFairness::TestFairness()
+	: mErrors(0), mSendAt(0)
+{
+	mMux = new NetIoMux();
+	mBuf = new c8[RECV_SIZE];
+}
+
+TestFairness::~TestFairness()
+{
+	delete mMux;
+	mMux = 0;
+	delete[] mBuf;
+	mBuf = 0;
+}
+
+NetEndpoint* TestFairness::makeBusy(NetEndpoint *listener, u32 bytes, NetIoMux::EPriority prio)
+{
+	NetEndpoint *client = NetEndpoint::create(NetEndpoint::ProtocolIPv4 | NetEndpoint::ProtocolTCP);
+	bool connected = client->connect("localhost", PORT);
+	xpfAssert(connected);
+	NetEndpoint *server = listener->accept();
+	xpfAssert(server != 0);
+
+	static c8 data[RECVS * RECV_SIZE];
+	s32 sent = client->send(data, (s32)bytes);
+	xpfAssert(sent == (s32)bytes);
+	mEndpoints.push_back(client);
+	mEndpoints.push_back(server);
+
+	mMux->join(server);
+	bool supported = mMux->setPriority(server, prio);
+	xpfAssert(supported);
+	return server;
+}
+
+void TestFairness::pump(u32 completions)
+{
+	for (u32 i = 0; (i < 1000) && (mOrder.size() < completions); ++i)
+		mMux->runOnce(10);
+}
+
+void TestFairness::cleanup()
+{
+	// Clients and joined server ends alternate.
+	for (u32 i = 0; i < (u32)mEndpoints.size(); ++i)
+	{
+		if (i % 2)
+			mMux->depart(mEndpoints[i]);
+		delete mEndpoints[i];
+	}
+	mEndpoints.clear();
+	mOrder.clear();
+}
+
+u32 TestFairness::firstOf(NetEndpoint *ep) const
+{
+	for (u32 i = 0; i < (u32)mOrder.size(); ++i)
+		if (mOrder[i] == ep)
+			return i;
+	return (u32)mOrder.size();
+}
+
+u32 TestFairness::countOf(NetEndpoint *ep, u32 within) const
+{
+	u32 cnt = 0;
+	for (u32 i = 0; (i < within) && (i < (u32)mOrder.size()); ++i)
+		if (mOrder[i] == ep)
+			cnt++;
+	return cnt;
+}
+
+bool TestFairness::run()
+{
+	NetIoMux::EPlatformMultiplexer epm;
+	NetIoMux::getMultiplexerType(epm);
+	if (epm == NetIoMux::EPM_IOCP)
+	{
+		printf("[Fairness] Not applicable to IOCP.\n");
+		return true;
+	}
+
+	NetEndpoint *listener = NetEndpoint::create(NetEndpoint::ProtocolIPv4 | NetEndpoint::ProtocolTCP, "localhost", PORT);
+	xpfAssert(listener != 0);
+	bool passed = true;
+
+	// A fire-hose endpoint with 100 receives queued ahead of a light
+	// one: Without a budget the light one waits for all of them.
+	for (u32 round = 0; round < 2; ++round)
+	{
+		const bool limited = (round == 1);
+		mMux->setTurnBudget((limited) ? 16 : 0, 0);
+		NetEndpoint *hose = makeBusy(listener, RECVS * RECV_SIZE, NetIoMux::EPR_NORMAL);
+		NetEndpoint *light = makeBusy(listener, RECV_SIZE, NetIoMux::EPR_NORMAL);
+		Thread::sleep(50);
+		for (u32 i = 0; i < RECVS; ++i)
+			mMux->asyncRecv(hose, mBuf, RECV_SIZE, this);
+		mMux->asyncRecv(light, mBuf, RECV_SIZE, this);
+		pump(RECVS + 1);
+
+		const u32 first = firstOf(light);
+		bool ok = (mOrder.size() == RECVS + 1) && (mErrors == 0)
+			&& ((limited) ? (first == 16) : (first == RECVS));
+		printf("[Fairness] %s budget: the light endpoint completed after %u receives of the busy one: %s.\n",
+			(limited) ? "With" : "Without", first, (ok) ? "ok" : "failed");
+		passed = passed && ok;
+		cleanup();
+	}
+
+	// A send queued behind 100 receives on the same endpoint: Reads
+	// using up the budget must not hold the write for the whole queue.
+	mMux->setTurnBudget(16, 0);
+	NetEndpoint *duplex = makeBusy(listener, RECVS * RECV_SIZE, NetIoMux::EPR_NORMAL);
+	Thread::sleep(50);
+	for (u32 i = 0; i < RECVS; ++i)
+		mMux->asyncRecv(duplex, mBuf, RECV_SIZE, this);
+	mSendAt = RECVS + 1;
+	mMux->asyncSend(duplex, mBuf, RECV_SIZE, this);
+	pump(RECVS + 1);
+
+	bool ok = (mOrder.size() == RECVS + 1) && (mErrors == 0) && (mSendAt < RECVS);
+	printf("[Fairness] A send queued behind %u receives completed after %u of them: %s.\n",
+		RECVS, mSendAt, (ok) ? "ok" : "failed");
+	passed = passed && ok;
+	cleanup();
+
+	// A fire-hose endpoint coalescing 100 sends ahead of a light one:
+	// The vectored send is cut at the budget and charged per operation.
+	mMux->setTurnBudget(16, 0);
+	NetEndpoint *sender = makeBusy(listener, RECV_SIZE, NetIoMux::EPR_NORMAL);
+	NetEndpoint *light = makeBusy(listener, RECV_SIZE, NetIoMux::EPR_NORMAL);
+	bool supported = mMux->setSendCoalescing(sender);
+	xpfAssert(supported);
+	Thread::sleep(50);
+	for (u32 i = 0; i < RECVS; ++i)
+		mMux->asyncSend(sender, mBuf, RECV_SIZE, this);
+	mMux->asyncRecv(light, mBuf, RECV_SIZE, this);
+	pump(RECVS + 1);
+
+	const u32 first = firstOf(light);
+	ok = (mOrder.size() == RECVS + 1) && (mErrors == 0) && (first == 16);
+	printf("[Fairness] Coalesced sends: the light endpoint completed after %u sends of the busy one: %s.\n",
+		first, (ok) ? "ok" : "failed");
+	passed = passed && ok;
+	cleanup();
+
+	// Endpoints of the three classes, each with 100 receives queued
+	// and one operation per turn: High ones are served 4 operations
+	// a turn and twice as often as normal ones, which are served twice
+	// as often as low ones.
+	mMux->setTurnBudget(1, 0);
+	NetEndpoint *low = makeBusy(listener, RECVS * RECV_SIZE, NetIoMux::EPR_LOW);
+	NetEndpoint *normal = makeBusy(listener, RECVS * RECV_SIZE, NetIoMux::EPR_NORMAL);
+	NetEndpoint *high = makeBusy(listener, RECVS * RECV_SIZE, NetIoMux::EPR_HIGH);
+	Thread::sleep(50);
+	for (u32 i = 0; i < RECVS; ++i)
+	{
+		mMux->asyncRecv(low, mBuf, RECV_SIZE, this);
+		mMux->asyncRecv(normal, mBuf, RECV_SIZE, this);
+		mMux->asyncRecv(high, mBuf, RECV_SIZE, this);
+	}
+	pump(3 * RECVS);
+
+	const u32 window = 100;
+	const u32 h = countOf(high, window), n = countOf(normal, window), l = countOf(low, window);
+	ok = (mOrder.size() == 3 * RECVS) && (mErrors == 0) && (h > n) && (n > l) && (l > 0);
+	printf("[Fairness] Priority classes: %u high, %u normal, %u low in the first %u completions: %s.\n",
+		h, n, l, window, (ok) ? "ok" : "failed");
+	passed = passed && ok;
+	cleanup();
+
+	delete listener;
+	return passed;
+}
+
+void TestFairness::onIoCompleted(
+	NetIoMux::EIoType type,
+	NetEndpoint::EError ec,
+	NetEndpoint *sep,
+	vptr tepOrPeer,
+	const c8 *buf,
+	u32 len)
+{
+	if ((type == NetIoMux::EIT_SEND) && (ec == NetEndpoint::EE_SUCCESS) && (len == RECV_SIZE))
+		mSendAt = (u32)mOrder.size();
+	else if ((type != NetIoMux::EIT_RECV) || (ec != NetEndpoint::EE_SUCCESS) || (len != RECV_SIZE))
+		mErrors++;
+	mOrder.push_back(sep);
+}
@@ -0,0 +1,63 @@
+/*******************************************************************************
+* Copyright (c) 2013 matt@moregeek.com.tw
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+* 1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+* 2. Altered source versions must be plainly marked as such, and must not be
+*    misrepresented as being the original software.
+*
+* 3. This notice may not be removed or altered from any source
+*    distribution.
+********************************************************************************/
+
+#ifndef _XPF_TEST_FAIRNESS_HDR_
+#define _XPF_TEST_FAIRNESS_HDR_
+
+#include <xpf/platform.h>
+#include <xpf/netiomux.h>
+#include <vector>
+
+class TestFairness : public xpf::NetIoMuxCallback
+{
+public:
+	TestFairness();
+	virtual ~TestFairness();
+
+	// Queue many receives on busy endpoints and verify the order in
+	// which the mux completes them follows the turn budgets and the
+	// priority classes, coalesced sends included.
+	bool run();
+
+	void onIoCompleted(xpf::NetIoMux::EIoType type, xpf::NetEndpoint::EError ec, xpf::NetEndpoint *sep, xpf::vptr tepOrPeer, const xpf::c8 *buf, xpf::u32 len);
+
+private:
+	// Connect a pair of endpoints over the loopback, join the server
+	// end and have 'bytes' waiting to be received on it.
+	xpf::NetEndpoint* makeBusy(xpf::NetEndpoint *listener, xpf::u32 bytes, xpf::NetIoMux::EPriority prio);
+	void pump(xpf::u32 completions);
+	void cleanup();
+
+	// Index of the first completion of 'ep', or the count if none.
+	xpf::u32 firstOf(xpf::NetEndpoint *ep) const;
+	xpf::u32 countOf(xpf::NetEndpoint *ep, xpf::u32 within) const;
+
+	xpf::NetIoMux                    *mMux;
+	xpf::c8                          *mBuf;
+	std::vector<xpf::NetEndpoint*>    mEndpoints;
+	std::vector<xpf::NetEndpoint*>    mOrder;   // endpoints in completion order.
+	xpf::u32                          mErrors;
+	xpf::u32                          mSendAt;  // completions before the send.
+};
+
+#endif // _XPF_TEST_FAIRNESS_HDR_
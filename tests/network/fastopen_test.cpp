@@ -0,0 +1,148 @@
+/*******************************************************************************
+* Copyright (c) 2013 matt@moregeek.com.tw
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+* 1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+* 2. Altered source versions must be plainly marked as such, and must not be
+*    misrepresented as being the original software.
+*
+* 3. This notice may not be removed or altered from any source
+*    distribution.
+********************************************************************************/
+
+#include "fastopen_test.h"
+#include "async_server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DATA_SIZE   (1000)
+#define NUM_ROUNDS  (8)
+#define FASTOPEN_Q  (16)
+
+using namespace xpf;
+
+TestFastOpen::TestFastOpen()
+	: mData(0)
+	, mCompleted(0)
+	, mError(NetEndpoint::EE_SUCCESS)
+	, mBuffer(0)
+	, mLength(0)
+{
+	mMux = new NetIoMux();
+	mData = new c8[DATA_SIZE];
+}
+
+TestFastOpen::~TestFastOpen()
+{
+	delete mMux;
+	mMux = 0;
+	delete[] mData;
+	mData = 0;
+}
+
+bool TestFastOpen::run()
+{
+	NetEndpoint *listeningEp = NetEndpoint::create(NetEndpoint::ProtocolIPv4 | NetEndpoint::ProtocolTCP,
+		"localhost", "50131", 0, 10, FASTOPEN_Q);
+	xpfAssert(listeningEp != 0);
+	if (listeningEp == 0)
+		return false;
+
+	WorkerThread *worker = new WorkerThread(mMux);
+	worker->start();
+
+	bool passed = true;
+	u32 delivered = 0;
+	for (u32 round = 0; round < NUM_ROUNDS; ++round)
+	{
+		for (u32 i = 0; i < DATA_SIZE; ++i)
+			mData[i] = (c8)rand();
+
+		// The first connection fetches a cookie from the listener, which
+		// lets later ones carry the data in SYN where enabled.
+		NetEndpoint *client = NetEndpoint::create(NetEndpoint::ProtocolIPv4 | NetEndpoint::ProtocolTCP);
+		mMux->join(client);
+		mCompleted = 0;
+		mMux->asyncConnect(client, "localhost", "50131", mData, DATA_SIZE, this);
+
+		NetEndpoint *server = listeningEp->accept();
+		xpfAssert(server != 0);
+
+		c8 buf[DATA_SIZE];
+		u32 received = 0;
+		while ((server != 0) && (received < DATA_SIZE))
+		{
+			s32 bytes = server->recv(&buf[received], DATA_SIZE - received);
+			if (bytes <= 0)
+				break;
+			received += bytes;
+		}
+
+		bool ok = waitCompletion() && (mError == NetEndpoint::EE_SUCCESS)
+			&& (mBuffer == mData) && (mLength == DATA_SIZE)
+			&& (received == DATA_SIZE) && (0 == memcmp(buf, mData, DATA_SIZE))
+			&& (client->getStatus() == NetEndpoint::ESTAT_CONNECTED);
+		if (ok)
+			delivered++;
+		passed = passed && ok;
+
+		mMux->depart(client);
+		delete client;
+		delete server;
+	}
+	printf("[FastOpen] %u of %u connections delivered their initial data.\n", delivered, NUM_ROUNDS);
+
+	// Nobody listens on the port after closing the listener.
+	delete listeningEp;
+	NetEndpoint *client = NetEndpoint::create(NetEndpoint::ProtocolIPv4 | NetEndpoint::ProtocolTCP);
+	mMux->join(client);
+	mCompleted = 0;
+	mMux->asyncConnect(client, "localhost", "50131", mData, DATA_SIZE, this);
+	bool refused = waitCompletion() && (mError == NetEndpoint::EE_CONNECT) && (mLength == 0);
+	printf("[FastOpen] Connection to a closed port %s (ec %d, len %u).\n", (refused) ? "failed as expected" : "did not fail properly", (int)mError, mLength);
+	passed = passed && refused;
+	mMux->depart(client);
+	delete client;
+
+	mMux->disable();
+	worker->join();
+	delete worker;
+
+	return passed;
+}
+
+bool TestFastOpen::waitCompletion()
+{
+	for (u32 i = 0; (i < 500) && (mCompleted == 0); ++i)
+		Thread::sleep(10);
+	return (mCompleted == 1);
+}
+
+void TestFastOpen::onIoCompleted(
+	NetIoMux::EIoType type,
+	NetEndpoint::EError ec,
+	NetEndpoint *sep,
+	vptr tepOrPeer,
+	const c8 *buf,
+	u32 len)
+{
+	xpfAssert(type == NetIoMux::EIT_CONNECT);
+
+	mError = ec;
+	mBuffer = buf;
+	mLength = len;
+	mCompleted++;
+}
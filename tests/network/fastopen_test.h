@@ -0,0 +1,57 @@
+/*******************************************************************************
+* Copyright (c) 2013 matt@moregeek.com.tw
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+* 1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+* 2. Altered source versions must be plainly marked as such, and must not be
+*    misrepresented as being the original software.
+*
+* 3. This notice may not be removed or altered from any source
+*    distribution.
+********************************************************************************/
+
+#ifndef _XPF_TEST_FASTOPEN_HDR_
+#define _XPF_TEST_FASTOPEN_HDR_
+
+#include <xpf/platform.h>
+#include <xpf/netiomux.h>
+#include <xpf/thread.h>
+
+class TestFastOpen : public xpf::NetIoMuxCallback
+{
+public:
+	TestFastOpen();
+	virtual ~TestFastOpen();
+
+	// Make a few connections carrying initial data to a listener with
+	// a fast open queue on loopback, and verify that each of them
+	// completes with the data sent and received intact. Also verify
+	// a refused connection fails with EE_CONNECT.
+	bool run();
+
+	void onIoCompleted(xpf::NetIoMux::EIoType type, xpf::NetEndpoint::EError ec, xpf::NetEndpoint *sep, xpf::vptr tepOrPeer, const xpf::c8 *buf, xpf::u32 len);
+
+private:
+	// Wait for the completion of the current connect.
+	bool waitCompletion();
+
+	xpf::NetIoMux        *mMux;
+	xpf::c8              *mData;
+	volatile xpf::u32     mCompleted;
+	xpf::NetEndpoint::EError mError;
+	const xpf::c8        *mBuffer;
+	xpf::u32              mLength;
+};
+
+#endif // _XPF_TEST_FASTOPEN_HDR_
@@ -0,0 +1,196 @@
+/*******************************************************************************
+* Copyright (c) 2013 matt@moregeek.com.tw
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+* 1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+* 2. Altered source versions must be plainly marked as such, and must not be
+*    misrepresented as being the original software.
+*
+* 3. This notice may not be removed or altered from any source
+*    distribution.
+********************************************************************************/
+#include "fdwatch_test.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifndef XPF_PLATFORM_WINDOWS
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+#ifdef XPF_PLATFORM_LINUX
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#endif
+
+#define TAG_PIPE_READ  ((vptr)1)
+#define TAG_PIPE_WRITE ((vptr)2)
+#define TAG_EVENTFD    ((vptr)3)
+#define TAG_TIMERFD    ((vptr)4)
+#define NUM_TICKS      (5)
+
+using namespace xpf;
+
+TestFdWatch::TestFdWatch()
+	: mReadBytes(0)
+	, mWriteReady(0)
+	, mHangups(0)
+	, mEventfdCount(0)
+	, mTicks(0)
+	, mErrors(0)
+{
+	mMux = new NetIoMux();
+	mPipe[0] = mPipe[1] = -1;
+}
+
+TestFdWatch::~TestFdWatch()
+{
+	delete mMux;
+	mMux = 0;
+}
+
+bool TestFdWatch::pump(volatile u32 *counter, u32 target)
+{
+	for (u32 i = 0; (i < 200) && (*counter < target); ++i)
+		mMux->runOnce(10);
+	return (*counter == target);
+}
+
+bool TestFdWatch::run()
+{
+#ifdef XPF_PLATFORM_WINDOWS
+	if (!mMux->watchFd(0, NetIoMux::EFE_READ, this))
+	{
+		printf("[FdWatch] Not supported by this platform. Skipped.\n");
+		return true;
+	}
+	return false;
+#else
+	bool ok = true;
+
+	// Read interest on a pipe: The callback drains it.
+	int ec = pipe(mPipe);
+	xpfAssert(ec == 0);
+	fcntl(mPipe[0], F_SETFL, fcntl(mPipe[0], F_GETFL) | O_NONBLOCK);
+	ok = ok && mMux->watchFd(mPipe[0], NetIoMux::EFE_READ, this, TAG_PIPE_READ);
+	ok = ok && !mMux->watchFd(mPipe[0], NetIoMux::EFE_READ, this); // watched already.
+	for (u32 i = 0; i < 3; ++i)
+	{
+		ssize_t n = write(mPipe[1], "0123456789", 10);
+		xpfAssert(n == 10);
+		ok = pump(&mReadBytes, (i + 1) * 10) && ok;
+	}
+	printf("[FdWatch] %u bytes read from pipe.\n", mReadBytes);
+
+	// Write interest: Ready right away. The callback pauses it.
+	ok = ok && mMux->watchFd(mPipe[1], NetIoMux::EFE_WRITE, this, TAG_PIPE_WRITE);
+	ok = pump(&mWriteReady, 1) && ok;
+	mMux->runOnce(10);
+	ok = ok && (mWriteReady == 1);
+	ok = ok && mMux->modifyFd(mPipe[1], NetIoMux::EFE_WRITE); // resume.
+	ok = pump(&mWriteReady, 2) && ok;
+	ok = ok && mMux->unwatchFd(mPipe[1]) && !mMux->unwatchFd(mPipe[1]);
+
+	// Closing the write end hangs up the read end.
+	close(mPipe[1]);
+	ok = pump(&mHangups, 1) && ok;
+	printf("[FdWatch] Pipe hang up %s.\n", (mHangups == 1) ? "reported" : "missing");
+	close(mPipe[0]);
+
+#ifdef XPF_PLATFORM_LINUX
+	// eventfd: The callback consumes its counter.
+	int efd = eventfd(0, EFD_NONBLOCK);
+	ok = ok && mMux->watchFd(efd, NetIoMux::EFE_READ, this, TAG_EVENTFD);
+	eventfd_write(efd, 3);
+	ok = pump(&mEventfdCount, 3) && ok;
+	mMux->unwatchFd(efd);
+	close(efd);
+
+	// Periodic timerfd: The callback unwatches it after NUM_TICKS ticks.
+	int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	struct itimerspec its;
+	its.it_value.tv_sec = 0;
+	its.it_value.tv_nsec = 5000000;
+	its.it_interval = its.it_value;
+	timerfd_settime(tfd, 0, &its, 0);
+	ok = ok && mMux->watchFd(tfd, NetIoMux::EFE_READ, this, TAG_TIMERFD);
+	ok = pump(&mTicks, NUM_TICKS) && ok;
+	mMux->runOnce(20);
+	ok = ok && (mTicks == NUM_TICKS) && !mMux->unwatchFd(tfd);
+	close(tfd);
+	printf("[FdWatch] eventfd count %u, timerfd ticks %u.\n", mEventfdCount, mTicks);
+#endif
+
+	return ok && (mErrors == 0);
+#endif
+}
+
+void TestFdWatch::onIoCompleted(
+	NetIoMux::EIoType type,
+	NetEndpoint::EError ec,
+	NetEndpoint *sep,
+	vptr tepOrPeer,
+	const c8 *buf,
+	u32 len)
+{
+	// No socket operations are issued in this test.
+	mErrors++;
+}
+
+void TestFdWatch::onFdReady(s32 fd, u32 events, vptr userData)
+{
+#ifndef XPF_PLATFORM_WINDOWS
+	if (userData == TAG_PIPE_READ)
+	{
+		if (events & NetIoMux::EFE_HANGUP)
+		{
+			mHangups++;
+			mMux->unwatchFd(fd);
+			return;
+		}
+		c8 buf[64];
+		ssize_t n = 0;
+		while ((n = read(fd, buf, sizeof(buf))) > 0)
+			mReadBytes += (u32)n;
+	}
+	else if (userData == TAG_PIPE_WRITE)
+	{
+		if (events != NetIoMux::EFE_WRITE)
+			mErrors++;
+		mWriteReady++;
+		mMux->modifyFd(fd, 0); // pause.
+	}
+#ifdef XPF_PLATFORM_LINUX
+	else if (userData == TAG_EVENTFD)
+	{
+		eventfd_t val = 0;
+		if (0 == eventfd_read(fd, &val))
+			mEventfdCount += (u32)val;
+	}
+	else if (userData == TAG_TIMERFD)
+	{
+		u64 expirations = 0;
+		if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+			mTicks++;
+		if (mTicks == NUM_TICKS)
+			mMux->unwatchFd(fd);
+	}
+#endif
+	else
+	{
+		mErrors++;
+	}
+#endif
+}
@@ -0,0 +1,57 @@
+/*******************************************************************************
+* Copyright (c) 2013 matt@moregeek.com.tw
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+* 1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+* 2. Altered source versions must be plainly marked as such, and must not be
+*    misrepresented as being the original software.
+*
+* 3. This notice may not be removed or altered from any source
+*    distribution.
+********************************************************************************/
+
+#ifndef _XPF_TEST_FDWATCH_HDR_
+#define _XPF_TEST_FDWATCH_HDR_
+
+#include <xpf/platform.h>
+#include <xpf/netiomux.h>
+
+class TestFdWatch : public xpf::NetIoMuxCallback
+{
+public:
+	TestFdWatch();
+	virtual ~TestFdWatch();
+
+	// Watch pipes (and eventfd/timerfd on Linux) and
+	// service them from the mux loop.
+	bool run();
+
+	void onIoCompleted(xpf::NetIoMux::EIoType type, xpf::NetEndpoint::EError ec, xpf::NetEndpoint *sep, xpf::vptr tepOrPeer, const xpf::c8 *buf, xpf::u32 len);
+	void onFdReady(xpf::s32 fd, xpf::u32 events, xpf::vptr userData);
+
+private:
+	// Run the mux until '*counter' reaches 'target'.
+	bool pump(volatile xpf::u32 *counter, xpf::u32 target);
+
+	xpf::NetIoMux    *mMux;
+	xpf::s32          mPipe[2];
+	volatile xpf::u32 mReadBytes;
+	volatile xpf::u32 mWriteReady;
+	volatile xpf::u32 mHangups;
+	volatile xpf::u32 mEventfdCount;
+	volatile xpf::u32 mTicks;
+	volatile xpf::u32 mErrors;
+};
+
+#endif // _XPF_TEST_FDWATCH_HDR_
@@ -0,0 +1,184 @@
+/*******************************************************************************
+* Copyright (c) 2013 matt@moregeek.com.tw
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+* 1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+* 2. Altered source versions must be plainly marked as such, and must not be
+*    misrepresented as being the original software.
+*
+* 3. This notice may not be removed or altered from any source
+*    distribution.
+********************************************************************************/
+#include "fileio_test.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#ifdef XPF_PLATFORM_WINDOWS
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <unistd.h>
+#endif
+
+#define NUM_CHUNKS (64)
+#define CHUNK_SIZE (4096)
+
+using namespace xpf;
+
+TestFileIo::TestFileIo()
+	: mLoopThread(Thread::getThreadID())
+	, mCompleted(0)
+	, mBytes(0)
+	, mFailed(0)
+	, mRejected(0)
+	, mErrors(0)
+{
+	mMux = new NetIoMux();
+	mData = new c8[NUM_CHUNKS * CHUNK_SIZE];
+	mReadBack = new c8[NUM_CHUNKS * CHUNK_SIZE];
+}
+
+TestFileIo::~TestFileIo()
+{
+	delete mMux;
+	mMux = 0;
+	delete[] mData;
+	delete[] mReadBack;
+	mData = mReadBack = 0;
+}
+
+bool TestFileIo::pump(NetIoMux *mux, u32 target)
+{
+	for (u32 i = 0; (i < 500) && (mCompleted < target); ++i)
+		mux->runOnce(10);
+	return (mCompleted == target);
+}
+
+bool TestFileIo::run()
+{
+#ifdef XPF_PLATFORM_WINDOWS
+	c8 path[L_tmpnam];
+	tmpnam(path);
+	s32 fd = _open(path, _O_RDWR | _O_CREAT | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+	c8 path[] = "/tmp/xpf_fileio_XXXXXX";
+	s32 fd = mkstemp(path);
+#endif
+	xpfAssert(fd >= 0);
+
+	const u32 total = NUM_CHUNKS * CHUNK_SIZE;
+	for (u32 i = 0; i < total; ++i)
+		mData[i] = (c8)rand();
+
+	// Write the chunks in reverse order: Offsets are absolute.
+	for (u32 i = 0; i < NUM_CHUNKS; ++i)
+	{
+		const u32 c = NUM_CHUNKS - 1 - i;
+		mMux->asyncFileWrite(fd, &mData[c * CHUNK_SIZE], CHUNK_SIZE, (u64)c * CHUNK_SIZE,
+			NetIoMux::EFS_NONE, this, (vptr)c);
+	}
+	bool ok = pump(mMux, NUM_CHUNKS) && (mBytes == total);
+
+	// Sync only.
+	mMux->asyncFileWrite(fd, 0, 0, 0, NetIoMux::EFS_DATASYNC, this);
+	ok = pump(mMux, NUM_CHUNKS + 1) && ok;
+	printf("[FileIo] %u bytes written and synced.\n", mBytes);
+
+	// Read back, plus one read at the end of file.
+	::memset(mReadBack, 0, total);
+	mBytes = 0;
+	for (u32 c = 0; c < NUM_CHUNKS; ++c)
+		mMux->asyncFileRead(fd, &mReadBack[c * CHUNK_SIZE], CHUNK_SIZE, (u64)c * CHUNK_SIZE, this, (vptr)c);
+	c8 eof[16];
+	mMux->asyncFileRead(fd, eof, sizeof(eof), total, this, (vptr)NUM_CHUNKS);
+	ok = pump(mMux, 2 * NUM_CHUNKS + 2) && ok;
+	ok = ok && (mBytes == total) && (0 == ::memcmp(mData, mReadBack, total));
+	printf("[FileIo] %u bytes read back %s.\n", mBytes, (0 == ::memcmp(mData, mReadBack, total)) ? "identical" : "corrupted");
+
+	// A bad descriptor fails with EE_FILEIO.
+	mMux->asyncFileRead(-1, eof, sizeof(eof), 0, this, (vptr)NUM_CHUNKS);
+	ok = pump(mMux, 2 * NUM_CHUNKS + 3) && (mFailed == 1) && ok;
+
+	// A single thread with a queue of 2 rejects a burst.
+	NetIoMux *bounded = new NetIoMux();
+	bounded->setFileIoThreads(1, 2);
+	const u32 base = mCompleted;
+	for (u32 i = 0; i < 32; ++i)
+		bounded->asyncFileWrite(fd, 0, 0, 0, NetIoMux::EFS_SYNC, this);
+	ok = pump(bounded, base + 32) && ok;
+	printf("[FileIo] %u of 32 queued syncs rejected.\n", mRejected);
+	ok = ok && (mRejected > 0) && (mRejected < 32);
+	delete bounded;
+
+#ifdef XPF_PLATFORM_WINDOWS
+	_close(fd);
+	_unlink(path);
+#else
+	close(fd);
+	unlink(path);
+#endif
+	return ok && (mErrors == 0);
+}
+
+void TestFileIo::onIoCompleted(
+	NetIoMux::EIoType type,
+	NetEndpoint::EError ec,
+	NetEndpoint *sep,
+	vptr tepOrPeer,
+	const c8 *buf,
+	u32 len)
+{
+	// Completed by the thread running the mux rather than I/O threads.
+	if ((Thread::getThreadID() != mLoopThread) || (sep != 0))
+		mErrors++;
+	mCompleted++;
+
+	if (ec == NetEndpoint::EE_QUEUE_FULL)
+	{
+		mRejected++;
+		return;
+	}
+	if (ec == NetEndpoint::EE_FILEIO)
+	{
+		mFailed++;
+		return;
+	}
+	if (ec != NetEndpoint::EE_SUCCESS)
+	{
+		mErrors++;
+		return;
+	}
+
+	const u32 c = (u32)tepOrPeer;
+	if (buf == 0) // sync only.
+	{
+		if (len != 0)
+			mErrors++;
+	}
+	else if (c == NUM_CHUNKS) // end of file.
+	{
+		if (len != 0)
+			mErrors++;
+	}
+	else if ((len != CHUNK_SIZE) ||
+		((type == NetIoMux::EIT_FILEWRITE) && (buf != &mData[c * CHUNK_SIZE])) ||
+		((type == NetIoMux::EIT_FILEREAD) && (buf != &mReadBack[c * CHUNK_SIZE])))
+	{
+		mErrors++;
+	}
+	mBytes += len;
+}
@@ -0,0 +1,58 @@
+/*******************************************************************************
+* Copyright (c) 2013 matt@moregeek.com.tw
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+* 1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+* 2. Altered source versions must be plainly marked as such, and must not be
+*    misrepresented as being the original software.
+*
+* 3. This notice may not be removed or altered from any source
+*    distribution.
+********************************************************************************/
+
+#ifndef _XPF_TEST_FILEIO_HDR_
+#define _XPF_TEST_FILEIO_HDR_
+
+#include <xpf/platform.h>
+#include <xpf/netiomux.h>
+#include <xpf/thread.h>
+
+class TestFileIo : public xpf::NetIoMuxCallback
+{
+public:
+	TestFileIo();
+	virtual ~TestFileIo();
+
+	// Write chunks of a temp file, sync and read them back through
+	// the mux. Also verify errors and the bounded queue.
+	bool run();
+
+	void onIoCompleted(xpf::NetIoMux::EIoType type, xpf::NetEndpoint::EError ec, xpf::NetEndpoint *sep, xpf::vptr tepOrPeer, const xpf::c8 *buf, xpf::u32 len);
+
+private:
+	// Run the mux until 'target' completions have been received.
+	bool pump(xpf::NetIoMux *mux, xpf::u32 target);
+
+	xpf::NetIoMux *mMux;
+	xpf::c8       *mData;
+	xpf::c8       *mReadBack;
+	xpf::ThreadID  mLoopThread;
+	xpf::u32       mCompleted;
+	xpf::u32       mBytes;
+	xpf::u32       mFailed;
+	xpf::u32       mRejected;
+	xpf::u32       mErrors;
+};
+
+#endif // _XPF_TEST_FILEIO_HDR_
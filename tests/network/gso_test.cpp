@@ -0,0 +1,199 @@
+/*******************************************************************************
+* Copyright (c) 2013 matt@moregeek.com.tw
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+* 1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+* 2. Altered source versions must be plainly marked as such, and must not be
+*    misrepresented as being the original software.
+*
+* 3. This notice may not be removed or altered from any source
+*    distribution.
+********************************************************************************/
+
+#include "gso_test.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef XPF_PLATFORM_WINDOWS
+#include <WinSock2.h>
+#include <WS2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+#define SENDER_PORT   "50137"
+#define SEGMENT_SIZE  (1200)
+#define NUM_SEGMENTS  (64)
+#define LAST_SEGMENT  (100)  // size of the short last datagram.
+#define PAYLOAD_BYTES (SEGMENT_SIZE * (NUM_SEGMENTS - 1) + LAST_SEGMENT)
+#define RECV_BUF_SIZE (65536)
+
+using namespace xpf;
+
+TestGso::TestGso()
+	: mSender(0)
+	, mReceiver(0)
+	, mSent(false)
+	, mSentSegSize(0)
+	, mDatagrams(0)
+	, mRecvs(0)
+	, mCoalesced(0)
+	, mErrors(0)
+{
+	mMux = new NetIoMux();
+	mPayload = new c8[PAYLOAD_BYTES];
+	mRecvBuf = new c8[RECV_BUF_SIZE];
+
+	// Every datagram starts with its index.
+	for (u32 i = 0; i < PAYLOAD_BYTES; ++i)
+		mPayload[i] = (c8)((i / SEGMENT_SIZE) + (i % SEGMENT_SIZE));
+	for (u32 i = 0; i < NUM_SEGMENTS; ++i)
+		mPayload[i * SEGMENT_SIZE] = (c8)i;
+}
+
+TestGso::~TestGso()
+{
+	delete mMux;
+	mMux = 0;
+	delete[] mPayload;
+	delete[] mRecvBuf;
+}
+
+bool TestGso::transfer(bool offload)
+{
+	mSent = false;
+	mSentSegSize = 0;
+	mDatagrams = 0;
+	mRecvs = 0;
+	mCoalesced = 0;
+
+	// Datagrams go to the connected peer of the sender.
+	NetEndpoint::Peer peer;
+	socklen_t plen = (socklen_t)XPF_NETENDPOINT_MAXADDRLEN;
+	::getsockname(mReceiver->getSocket(), (struct sockaddr*)peer.Data, &plen);
+	peer.Length = (s32)plen;
+
+	mMux->asyncRecvFrom(mReceiver, mRecvBuf, RECV_BUF_SIZE, this);
+	mMux->asyncSendSegments(mSender, &peer, mPayload, PAYLOAD_BYTES, SEGMENT_SIZE, this);
+	for (u32 i = 0; (i < 300) && (!mSent || (mDatagrams < NUM_SEGMENTS)) && (mErrors == 0); ++i)
+		mMux->runOnce(10);
+
+	printf("[GSO] %s offload: %u datagrams in %u receives (%u coalesced).\n", (offload) ? "With" : "Without",
+		mDatagrams, mRecvs, mCoalesced);
+	return mSent && (mSentSegSize == SEGMENT_SIZE) && (mDatagrams == NUM_SEGMENTS) && (mErrors == 0);
+}
+
+bool TestGso::run()
+{
+	const u32 proto = NetEndpoint::ProtocolUDP | NetEndpoint::ProtocolIPv4;
+
+	// Async UDP needs connected endpoints: Bind the sender to a known
+	// port and connect the receiver to it, then the other way around.
+	mSender = NetEndpoint::create(proto);
+	mReceiver = NetEndpoint::create(proto);
+	struct sockaddr_in sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons((u16)50137);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	bool ok = (0 == ::bind(mSender->getSocket(), (const struct sockaddr*)&sa, sizeof(sa)))
+		&& mReceiver->connect("127.0.0.1", SENDER_PORT);
+	socklen_t salen = sizeof(sa);
+	ok = ok && (0 == ::getsockname(mReceiver->getSocket(), (struct sockaddr*)&sa, &salen));
+	c8 port[16];
+	sprintf(port, "%u", (u32)ntohs(sa.sin_port));
+	ok = ok && mSender->connect("127.0.0.1", port);
+	if (!ok)
+	{
+		printf("[GSO] Cannot set up UDP endpoints.\n");
+		return false;
+	}
+	mMux->join(mSender);
+	mMux->join(mReceiver);
+
+	bool passed = transfer(false);
+
+	if (mMux->setReceiveOffload(mReceiver))
+		passed = transfer(true) && passed;
+	else
+		printf("[GSO] Receive offload is not supported. Skipped.\n");
+
+	mMux->depart(mSender);
+	mMux->depart(mReceiver);
+	delete mSender;
+	delete mReceiver;
+	return passed;
+}
+
+void TestGso::verify(const c8 *buf, u32 len, u32 segsize)
+{
+	if (segsize == 0)
+		segsize = len;
+	if (len > segsize)
+		mCoalesced++;
+
+	for (u32 off = 0; off < len; off += segsize)
+	{
+		const u32 dlen = (len - off < segsize) ? (len - off) : segsize;
+		const u32 idx = mDatagrams++;
+		const u32 expected = (idx == NUM_SEGMENTS - 1) ? LAST_SEGMENT : SEGMENT_SIZE;
+		if ((idx >= NUM_SEGMENTS) || (dlen != expected) || (0 != memcmp(buf + off, mPayload + idx * SEGMENT_SIZE, dlen)))
+		{
+			mErrors++;
+			return;
+		}
+	}
+}
+
+void TestGso::onIoCompletedBatch(const NetIoMuxCompletion *records, u32 count)
+{
+	for (u32 i = 0; i < count; ++i)
+	{
+		const NetIoMuxCompletion &r = records[i];
+		if (r.Error != NetEndpoint::EE_SUCCESS)
+		{
+			printf("[GSO] Operation %u failed with %u.\n", (u32)r.Type, (u32)r.Error);
+			mErrors++;
+			continue;
+		}
+
+		if (r.Type == NetIoMux::EIT_SENDTO)
+		{
+			mSent = (r.Length == PAYLOAD_BYTES);
+			mSentSegSize = r.SegmentSize;
+		}
+		else if (r.Type == NetIoMux::EIT_RECVFROM)
+		{
+			mRecvs++;
+			verify(r.Buffer, r.Length, r.SegmentSize);
+			if (mDatagrams < NUM_SEGMENTS)
+				mMux->asyncRecvFrom(mReceiver, mRecvBuf, RECV_BUF_SIZE, this);
+		}
+	}
+}
+
+void TestGso::onIoCompleted(
+	NetIoMux::EIoType type,
+	NetEndpoint::EError ec,
+	NetEndpoint *sep,
+	vptr tepOrPeer,
+	const c8 *buf,
+	u32 len)
+{
+	// All completions are taken by onIoCompletedBatch().
+	mErrors++;
+}
@@ -0,0 +1,62 @@
+/*******************************************************************************
+* Copyright (c) 2013 matt@moregeek.com.tw
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+* 1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+* 2. Altered source versions must be plainly marked as such, and must not be
+*    misrepresented as being the original software.
+*
+* 3. This notice may not be removed or altered from any source
+*    distribution.
+********************************************************************************/
+
+#ifndef _XPF_TEST_GSO_HDR_
+#define _XPF_TEST_GSO_HDR_
+
+#include <xpf/platform.h>
+#include <xpf/netiomux.h>
+
+class TestGso : public xpf::NetIoMuxCallback
+{
+public:
+	TestGso();
+	virtual ~TestGso();
+
+	// Send trains of datagrams with asyncSendSegments() and receive them
+	// with and without receive offload, verifying every datagram.
+	bool run();
+
+	void onIoCompleted(xpf::NetIoMux::EIoType type, xpf::NetEndpoint::EError ec, xpf::NetEndpoint *sep, xpf::vptr tepOrPeer, const xpf::c8 *buf, xpf::u32 len);
+	void onIoCompletedBatch(const xpf::NetIoMuxCompletion *records, xpf::u32 count);
+
+private:
+	// Send one train and receive all of it. Returns false on errors.
+	bool transfer(bool offload);
+	// Verify the datagrams in a received buffer.
+	void verify(const xpf::c8 *buf, xpf::u32 len, xpf::u32 segsize);
+
+	xpf::NetIoMux     *mMux;
+	xpf::NetEndpoint  *mSender;
+	xpf::NetEndpoint  *mReceiver;
+	xpf::c8           *mPayload;
+	xpf::c8           *mRecvBuf;
+	volatile bool      mSent;
+	xpf::u32           mSentSegSize;
+	xpf::u32           mDatagrams;  // datagrams received.
+	xpf::u32           mRecvs;      // receive completions.
+	xpf::u32           mCoalesced;  // receives carrying more than one datagram.
+	xpf::u32           mErrors;
+};
+
+#endif // _XPF_TEST_GSO_HDR_
@@ -25,6 +25,18 @@
 #include <xpf/string.h>
 #include "async_client.h"
 #include "async_server.h"
+#include "coalesce_test.h"
+#include "watermark_test.h"
+#include "batch_test.h"
+#include "fdwatch_test.h"
+#include "fileio_test.h"
+#include "fastopen_test.h"
+#include "timer_test.h"
+#include "connectany_test.h"
+#include "gso_test.h"
+#include "memory_test.h"
+#include "fairness_test.h"
+#include "profiler_test.h"
 #include "sync_client.h"
 #include "sync_server.h"
 
@@ -106,6 +118,114 @@ int test_async()
 	return 0;
 }
 
+int test_coalesce()
+{
+	TestCoalesce *t = new TestCoalesce;
+	bool ret = t->run();
+	delete t;
+	printf("Send coalescing test %s.\n", (ret) ? "passed" : "failed");
+	return (ret) ? 0 : 1;
+}
+
+int test_watermark()
+{
+	TestWatermark *t = new TestWatermark;
+	bool ret = t->run();
+	delete t;
+	printf("Write watermark test %s.\n", (ret) ? "passed" : "failed");
+	return (ret) ? 0 : 1;
+}
+
+int test_batch()
+{
+	TestBatch *t = new TestBatch;
+	bool ret = t->run();
+	delete t;
+	printf("Batched completion test %s.\n", (ret) ? "passed" : "failed");
+	return (ret) ? 0 : 1;
+}
+
+int test_fdwatch()
+{
+	TestFdWatch *t = new TestFdWatch;
+	bool ret = t->run();
+	delete t;
+	printf("Fd readiness test %s.\n", (ret) ? "passed" : "failed");
+	return (ret) ? 0 : 1;
+}
+
+int test_fileio()
+{
+	TestFileIo *t = new TestFileIo;
+	bool ret = t->run();
+	delete t;
+	printf("File I/O test %s.\n", (ret) ? "passed" : "failed");
+	return (ret) ? 0 : 1;
+}
+
+int test_fastopen()
+{
+	TestFastOpen *t = new TestFastOpen;
+	bool ret = t->run();
+	delete t;
+	printf("TCP Fast Open test %s.\n", (ret) ? "passed" : "failed");
+	return (ret) ? 0 : 1;
+}
+
+int test_timer()
+{
+	TestTimer *t = new TestTimer;
+	bool ret = t->run();
+	delete t;
+	printf("Timer test %s.\n", (ret) ? "passed" : "failed");
+	return (ret) ? 0 : 1;
+}
+
+int test_connectany()
+{
+	TestConnectAny *t = new TestConnectAny;
+	bool ret = t->run();
+	delete t;
+	printf("Dual-stack connect test %s.\n", (ret) ? "passed" : "failed");
+	return (ret) ? 0 : 1;
+}
+
+int test_gso()
+{
+	TestGso *t = new TestGso;
+	bool ret = t->run();
+	delete t;
+	printf("UDP segmentation test %s.\n", (ret) ? "passed" : "failed");
+	return (ret) ? 0 : 1;
+}
+
+int test_memory()
+{
+	TestMemory *t = new TestMemory;
+	bool ret = t->run();
+	delete t;
+	printf("In-memory transport test %s.\n", (ret) ? "passed" : "failed");
+	return (ret) ? 0 : 1;
+}
+
+int test_fairness()
+{
+	TestFairness *t = new TestFairness;
+	bool ret = t->run();
+	delete t;
+	printf("Fair scheduling test %s.\n", (ret) ? "passed" : "failed");
+	return (ret) ? 0 : 1;
+}
+
+int test_profiler()
+{
+	TestProfiler *t = new TestProfiler;
+	bool ret = t->run();
+	delete t;
+	printf("Callback profiler test %s.\n", (ret) ? "passed" : "failed");
+	return (ret) ? 0 : 1;
+}
+
 int main(int argc, char *argv[])
 {
 	srand((unsigned int)time(0));
@@ -115,6 +235,66 @@ int main(int argc, char *argv[])
 		printf("==== Running async test ====\n");
 		test_async();
 	}
+	else if ((argc >= 2) && (xpf::string(argv[1]) == "coalesce"))
+	{
+		printf("==== Running send coalescing test ====\n");
+		return test_coalesce();
+	}
+	else if ((argc >= 2) && (xpf::string(argv[1]) == "watermark"))
+	{
+		printf("==== Running write watermark test ====\n");
+		return test_watermark();
+	}
+	else if ((argc >= 2) && (xpf::string(argv[1]) == "batch"))
+	{
+		printf("==== Running batched completion test ====\n");
+		return test_batch();
+	}
+	else if ((argc >= 2) && (xpf::string(argv[1]) == "fdwatch"))
+	{
+		printf("==== Running fd readiness test ====\n");
+		return test_fdwatch();
+	}
+	else if ((argc >= 2) && (xpf::string(argv[1]) == "fileio"))
+	{
+		printf("==== Running file I/O test ====\n");
+		return test_fileio();
+	}
+	else if ((argc >= 2) && (xpf::string(argv[1]) == "fastopen"))
+	{
+		printf("==== Running TCP Fast Open test ====\n");
+		return test_fastopen();
+	}
+	else if ((argc >= 2) && (xpf::string(argv[1]) == "timer"))
+	{
+		printf("==== Running timer test ====\n");
+		return test_timer();
+	}
+	else if ((argc >= 2) && (xpf::string(argv[1]) == "connectany"))
+	{
+		printf("==== Running dual-stack connect test ====\n");
+		return test_connectany();
+	}
+	else if ((argc >= 2) && (xpf::string(argv[1]) == "gso"))
+	{
+		printf("==== Running UDP segmentation test ====\n");
+		return test_gso();
+	}
+	else if ((argc >= 2) && (xpf::string(argv[1]) == "memory"))
+	{
+		printf("==== Running in-memory transport test ====\n");
+		return test_memory();
+	}
+	else if ((argc >= 2) && (xpf::string(argv[1]) == "fairness"))
+	{
+		printf("==== Running fair scheduling test ====\n");
+		return test_fairness();
+	}
+	else if ((argc >= 2) && (xpf::string(argv[1]) == "profiler"))
+	{
+		printf("==== Running callback profiler test ====\n");
+		return test_profiler();
+	}
 	else
 	{
 		printf("==== Running sync test ====\n");
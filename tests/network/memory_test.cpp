@@ -0,0 +1,308 @@
+/*******************************************************************************
+* Copyright (c) 2013 matt@moregeek.com.tw
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+* 1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+* 2. Altered source versions must be plainly marked as such, and must not be
+*    misrepresented as being the original software.
+*
+* 3. This notice may not be removed or altered from any source
+*    distribution.
+********************************************************************************/
+
+#include "memory_test.h"
+#include "async_server.h"
+#include <xpf/iobuffer.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef XPF_PLATFORM_WINDOWS
+#include <Windows.h>
+#else
+#include <time.h>
+#endif
+
+#define MEMORY_NAME   "bench"
+#define MEMORY_PORT   (7000)
+#define CHUNK_SIZE    (64 * 1024)
+
+using namespace xpf;
+
+// Counts the zero-copy operations failed on in-memory endpoints.
+class RejectCounter : public NetIoMuxCallback
+{
+public:
+	RejectCounter() : Recvs(0), Sends(0), Broadcasts(0) {}
+	void onIoCompleted(NetIoMux::EIoType type, NetEndpoint::EError ec, NetEndpoint *sep, vptr tepOrPeer, const c8 *buf, u32 len)
+	{
+		if (ec != NetEndpoint::EE_INVALID_OP)
+			return;
+		if (type == NetIoMux::EIT_RECV)
+			Recvs++;
+		else if (type == NetIoMux::EIT_SEND)
+			Sends++;
+		else if ((type == NetIoMux::EIT_BROADCAST) && (sep == 0) && (len == 0))
+			Broadcasts++;
+	}
+	u32 Recvs;
+	u32 Sends;
+	u32 Broadcasts;
+};
+
+static u64 nowMs()
+{
+#ifdef XPF_PLATFORM_WINDOWS
+	return (u64)::GetTickCount64();
+#else
+	struct timespec ts;
+	::clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((u64)ts.tv_sec * 1000) + ((u64)ts.tv_nsec / 1000000);
+#endif
+}
+
+TestMemory::TestMemory()
+	: mListener(0)
+	, mClient(0)
+	, mServer(0)
+	, mTotal(0)
+	, mSentBytes(0)
+	, mRecvBytes(0)
+	, mPartialSends(0)
+	, mRecvs(0)
+	, mErrors(0)
+	, mConnectError(NetEndpoint::EE_SUCCESS)
+	, mConnected(false)
+	, mServerEof(false)
+	, mReplied(false)
+	, mServerDone(false)
+{
+	mServerMux = new NetIoMux();
+	mClientMux = new NetIoMux();
+	mPayload = new c8[4 * 1024 * 1024];
+	mRecvBuf = new c8[CHUNK_SIZE];
+	for (u32 i = 0; i < 4 * 1024 * 1024; ++i)
+		mPayload[i] = (c8)((i % 251) ^ (i >> 16));
+}
+
+TestMemory::~TestMemory()
+{
+	delete mServerMux;
+	delete mClientMux;
+	delete[] mPayload;
+	delete[] mRecvBuf;
+}
+
+void TestMemory::sendMore()
+{
+	u32 len = mTotal - mSentBytes;
+	if (len > CHUNK_SIZE)
+		len = CHUNK_SIZE;
+	mClientMux->asyncSend(mClient, mPayload + mSentBytes, len, this);
+}
+
+bool TestMemory::transfer(const c8 *name, u32 port)
+{
+	mSentBytes = mRecvBytes = mPartialSends = mRecvs = mErrors = 0;
+	mConnectError = NetEndpoint::EE_SUCCESS;
+	mConnected = mServerEof = mReplied = mServerDone = false;
+	mServer = 0;
+
+	mClient = NetEndpoint::create(NetEndpoint::ProtocolTCP | NetEndpoint::ProtocolMemory);
+	bool ok = mClientMux->join(mClient);
+	mServerMux->asyncAccept(mListener, this);
+	mClientMux->asyncConnect(mClient, name, port, this);
+
+	u64 start = nowMs();
+	while (ok && !(mReplied && mServerDone) && (mConnectError == NetEndpoint::EE_SUCCESS) && (nowMs() - start < 20000))
+		mClientMux->runOnce(10);
+
+	ok = ok && mReplied && mServerDone && mServerEof && (mErrors == 0) && (mRecvBytes == mTotal);
+	delete mClient;
+	mClient = 0;
+	delete mServer;
+	mServer = 0;
+	return ok;
+}
+
+bool TestMemory::run()
+{
+	WorkerThread *worker = new WorkerThread(mServerMux);
+	worker->start();
+	bool passed = true;
+
+	mListener = NetEndpoint::create(NetEndpoint::ProtocolTCP | NetEndpoint::ProtocolMemory, MEMORY_NAME, "7000");
+	xpfAssert(mListener != 0);
+	bool ok = mServerMux->join(mListener);
+
+	// Clean pipes.
+	mTotal = 4 * 1024 * 1024;
+	u64 start = nowMs();
+	ok = ok && transfer(MEMORY_NAME, MEMORY_PORT);
+	u64 elapsed = nowMs() - start;
+	printf("[Memory] Streamed %u bytes in %u ms (%u recvs): %s.\n",
+		mTotal, (u32)elapsed, mRecvs, (ok) ? "verified" : "failed");
+	passed = passed && ok;
+
+	// Partial writes and reads, and half of the attempts stalled.
+	NetIoMux::MemoryFaults faults = { 1000, 333, 50, 1 };
+	mClientMux->setMemoryFaults(faults);
+	mServerMux->setMemoryFaults(faults);
+	mTotal = 1024 * 1024;
+	ok = transfer(MEMORY_NAME, MEMORY_PORT) && (mPartialSends > 0) && (mRecvs >= mTotal / 333);
+	printf("[Memory] With faults: %u partial sends, %u recvs: %s.\n",
+		mPartialSends, mRecvs, (ok) ? "verified" : "failed");
+	passed = passed && ok;
+
+	// Nobody listens on the name.
+	mConnected = false;
+	mConnectError = NetEndpoint::EE_SUCCESS;
+	mClient = NetEndpoint::create(NetEndpoint::ProtocolTCP | NetEndpoint::ProtocolMemory);
+	mClientMux->join(mClient);
+	mClientMux->asyncConnect(mClient, "nowhere", MEMORY_PORT, this);
+	start = nowMs();
+	while (!mConnected && (nowMs() - start < 5000))
+		mClientMux->runOnce(10);
+	ok = mConnected && (mConnectError == NetEndpoint::EE_CONNECT);
+	printf("[Memory] Connect to an unknown name: %s.\n", (ok) ? "failed as expected" : "did not fail properly");
+	passed = passed && ok;
+
+	// Zero-copy variants are not supported.
+	RejectCounter rejects;
+	IoBuffer *iobuf = IoBuffer::create(64);
+	IoBufferChain chain;
+	chain.append(iobuf);
+	mClientMux->asyncRecv(mClient, iobuf, &rejects);
+	mClientMux->asyncSend(mClient, chain, &rejects);
+	mClientMux->asyncBroadcast(&mClient, 1, chain, &rejects);
+	start = nowMs();
+	while (((rejects.Recvs + rejects.Sends + rejects.Broadcasts) < 3) && (nowMs() - start < 5000))
+		mClientMux->runOnce(10);
+	ok = (rejects.Recvs == 1) && (rejects.Sends == 1) && (rejects.Broadcasts == 1) && (iobuf->length() == 0);
+	printf("[Memory] Zero-copy receive, send and broadcast: %s.\n", (ok) ? "failed as expected" : "did not fail properly");
+	passed = passed && ok;
+
+	// Per-endpoint settings of socket endpoints are not supported.
+	ok = !mClientMux->setSendCoalescing(mClient, true)
+		&& !mClientMux->setReceiveOffload(mClient, true)
+		&& !mClientMux->setWriteWatermarks(mClient, 1024, 4096)
+		&& !mClientMux->isWriteBlocked(mClient)
+		&& (mClientMux->getQueuedWriteBytes(mClient) == 0)
+		&& !mClientMux->setPriority(mClient, NetIoMux::EPR_HIGH);
+	printf("[Memory] Per-endpoint settings: %s.\n", (ok) ? "rejected" : "not rejected");
+	passed = passed && ok;
+	chain.clear();
+	iobuf->unref();
+	delete mClient;
+	mClient = 0;
+
+	mServerMux->disable();
+	worker->join();
+	delete worker;
+	delete mListener;
+	mListener = 0;
+
+	return passed;
+}
+
+void TestMemory::onIoCompleted(
+	NetIoMux::EIoType type,
+	NetEndpoint::EError ec,
+	NetEndpoint *sep,
+	vptr tepOrPeer,
+	const c8 *buf,
+	u32 len)
+{
+	switch (type)
+	{
+	case NetIoMux::EIT_ACCEPT:
+		if (ec != NetEndpoint::EE_SUCCESS)
+		{
+			mErrors++;
+			break;
+		}
+		mServer = (NetEndpoint*)tepOrPeer;
+		mServerMux->asyncRecv(mServer, mRecvBuf, CHUNK_SIZE, this);
+		break;
+
+	case NetIoMux::EIT_CONNECT:
+		mConnected = true;
+		mConnectError = ec;
+		if (ec == NetEndpoint::EE_SUCCESS)
+			sendMore();
+		break;
+
+	case NetIoMux::EIT_RECV:
+		if (ec != NetEndpoint::EE_SUCCESS)
+		{
+			mErrors++;
+		}
+		else if (sep == mServer)
+		{
+			if (len == 0)
+			{
+				// The client has shut down: Reply.
+				mServerEof = true;
+				mServerMux->asyncSend(mServer, "done", 4, this);
+				break;
+			}
+			if ((mRecvBytes + len > mTotal) || (0 != memcmp(buf, mPayload + mRecvBytes, len)))
+				mErrors++;
+			mRecvBytes += len;
+			mRecvs++;
+			mServerMux->asyncRecv(mServer, mRecvBuf, CHUNK_SIZE, this);
+		}
+		else
+		{
+			mReplied = (len == 4) && (0 == memcmp(buf, "done", 4));
+			if (!mReplied)
+				mErrors++;
+		}
+		break;
+
+	case NetIoMux::EIT_SEND:
+		if (ec != NetEndpoint::EE_SUCCESS)
+		{
+			mErrors++;
+		}
+		else if (sep == mServer)
+		{
+			mServerDone = true;
+		}
+		else
+		{
+			// Resend whatever the pipe did not take.
+			u32 requested = mTotal - mSentBytes;
+			if (requested > CHUNK_SIZE)
+				requested = CHUNK_SIZE;
+			if (len < requested)
+				mPartialSends++;
+			mSentBytes += len;
+			if (mSentBytes < mTotal)
+			{
+				sendMore();
+			}
+			else
+			{
+				mClient->shutdown(NetEndpoint::ESD_WRITE);
+				mClientMux->asyncRecv(mClient, mReply, sizeof(mReply), this);
+			}
+		}
+		break;
+
+	default:
+		mErrors++;
+		break;
+	}
+}
@@ -0,0 +1,68 @@
+/*******************************************************************************
+* Copyright (c) 2013 matt@moregeek.com.tw
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+* 1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+* 2. Altered source versions must be plainly marked as such, and must not be
+*    misrepresented as being the original software.
+*
+* 3. This notice may not be removed or altered from any source
+*    distribution.
+********************************************************************************/
+
+#ifndef _XPF_TEST_MEMORY_HDR_
+#define _XPF_TEST_MEMORY_HDR_
+
+#include <xpf/platform.h>
+#include <xpf/netiomux.h>
+
+class TestMemory : public xpf::NetIoMuxCallback
+{
+public:
+	TestMemory();
+	virtual ~TestMemory();
+
+	// Stream data between in-memory endpoints of two muxes, with and
+	// without injected faults, verifying every byte.
+	bool run();
+
+	void onIoCompleted(xpf::NetIoMux::EIoType type, xpf::NetEndpoint::EError ec, xpf::NetEndpoint *sep, xpf::vptr tepOrPeer, const xpf::c8 *buf, xpf::u32 len);
+
+private:
+	// Connect, send mTotal bytes, shut down and wait for the reply.
+	bool transfer(const xpf::c8 *name, xpf::u32 port);
+	void sendMore();
+
+	xpf::NetIoMux     *mServerMux; // run by a worker thread.
+	xpf::NetIoMux     *mClientMux; // pumped by the test.
+	xpf::NetEndpoint  *mListener;
+	xpf::NetEndpoint  *mClient;
+	xpf::NetEndpoint  *mServer;    // the accepted end.
+	xpf::c8           *mPayload;
+	xpf::c8           *mRecvBuf;
+	xpf::c8            mReply[8];
+	xpf::u32           mTotal;
+	xpf::u32           mSentBytes;
+	xpf::u32           mRecvBytes;
+	xpf::u32           mPartialSends;
+	xpf::u32           mRecvs;
+	xpf::u32           mErrors;
+	xpf::NetEndpoint::EError mConnectError;
+	volatile bool      mConnected;
+	volatile bool      mServerEof;
+	volatile bool      mReplied;
+	volatile bool      mServerDone;
+};
+
+#endif // _XPF_TEST_MEMORY_HDR_
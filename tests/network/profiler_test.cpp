@@ -0,0 +1,166 @@
+/*******************************************************************************
+* Copyright (c) 2013 matt@moregeek.com.tw
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+* 1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+* 2. Altered source versions must be plainly marked as such, and must not be
+*    misrepresented as being the original software.
+*
+* 3. This notice may not be removed or altered from any source
+*    distribution.
+********************************************************************************/
+
+#include "profiler_test.h"
+#include <xpf/thread.h>
+
+#include <stdio.h>
+
+#define SLOW_THRESHOLD_US (20000)
+#define SLOW_SLEEP_MS     (30)
+
+using namespace xpf;
+
+TestProfiler::TestProfiler()
+	: mListener(0)
+	, mClient(0)
+	, mServer(0)
+	, mCompleted(0)
+	, mErrors(0)
+{
+	mMux = new NetIoMux();
+}
+
+TestProfiler::~TestProfiler()
+{
+	delete mClient;
+	delete mServer;
+	delete mListener;
+	delete mMux;
+	mMux = 0;
+}
+
+bool TestProfiler::pump(u32 target)
+{
+	for (u32 i = 0; (i < 500) && (mCompleted < target); ++i)
+		mMux->runOnce(10);
+	return (mCompleted == target);
+}
+
+bool TestProfiler::run()
+{
+	bool passed = true;
+
+	// A pair of in-memory endpoints, connected before profiling.
+	mListener = NetEndpoint::create(NetEndpoint::ProtocolTCP | NetEndpoint::ProtocolMemory, "profiler", "7100");
+	mClient = NetEndpoint::create(NetEndpoint::ProtocolTCP | NetEndpoint::ProtocolMemory);
+	passed = passed && mMux->join(mListener) && mMux->join(mClient);
+	mMux->asyncAccept(mListener, this);
+	mMux->asyncConnect(mClient, "profiler", 7100, this);
+	passed = passed && pump(2) && (mServer != 0);
+	if (!passed)
+		return false;
+
+	// Timers: Every other callback is slow.
+	mCompleted = 0;
+	mMux->enableProfiler(true, SLOW_THRESHOLD_US);
+	for (u32 i = 0; i < 8; ++i)
+		mMux->asyncTimer(1, this, (vptr)(i + 1));
+	passed = passed && pump(8);
+
+	NetIoMux::ProfileStats ts;
+	passed = passed && mMux->getProfile(NetIoMux::EIT_TIMER, ts);
+	u64 histTotal = 0, histSlow = 0;
+	for (u32 i = 0; i < NetIoMux::PROFILE_BUCKETS; ++i)
+	{
+		histTotal += ts.Histogram[i];
+		if ((1ULL << i) >= SLOW_THRESHOLD_US / 2)
+			histSlow += ts.Histogram[i];
+	}
+	printf("[Profiler] Timers: %u calls, %u slow, total %u us, max %u us.\n",
+		(u32)ts.Count, (u32)ts.SlowCount, (u32)ts.TotalUs, (u32)ts.MaxUs);
+	passed = passed && (ts.Count == 8) && (ts.SlowCount == 4) && (histTotal == 8) && (histSlow == 4)
+		&& (ts.MaxUs >= SLOW_SLEEP_MS * 1000) && (ts.TotalUs >= 4 * SLOW_SLEEP_MS * 1000);
+
+	// A slow receive is attributed to the server endpoint.
+	mCompleted = 0;
+	mMux->asyncRecv(mServer, mRecvBuf, sizeof(mRecvBuf), this);
+	mMux->asyncSend(mClient, "ping", 4, this);
+	passed = passed && pump(2);
+
+	NetIoMux::ProfileStats rs, ss;
+	passed = passed && mMux->getProfile(NetIoMux::EIT_RECV, rs) && mMux->getProfile(NetIoMux::EIT_SEND, ss);
+	passed = passed && (rs.Count == 1) && (rs.SlowCount == 1) && (ss.Count == 1) && (ss.SlowCount == 0);
+
+	NetIoMux::SlowCallback slow[16];
+	u32 n = mMux->getSlowCallbacks(slow, 16);
+	printf("[Profiler] %u slow callbacks recorded, the latest of type %d took %u us.\n",
+		n, (n > 0) ? (int)slow[n - 1].Type : -1, (n > 0) ? (u32)slow[n - 1].DurationUs : 0);
+	passed = passed && (n == 5) && (slow[0].Type == NetIoMux::EIT_TIMER) && (slow[0].Endpoint == 0)
+		&& (slow[4].Type == NetIoMux::EIT_RECV) && (slow[4].Endpoint == mServer)
+		&& (slow[4].Error == NetEndpoint::EE_SUCCESS) && (slow[4].DurationUs >= SLOW_SLEEP_MS * 1000)
+		&& (slow[4].TimeUs > slow[0].TimeUs);
+	passed = passed && (mMux->getSlowCallbacks(slow, 2) == 2) && (slow[1].Type == NetIoMux::EIT_RECV);
+
+	// Nothing is accounted while disabled, and a reset clears all.
+	mCompleted = 0;
+	mMux->enableProfiler(false);
+	mMux->asyncTimer(1, this, (vptr)2);
+	passed = passed && pump(1);
+	passed = passed && mMux->getProfile(NetIoMux::EIT_TIMER, ts) && (ts.Count == 8);
+	mMux->resetProfile();
+	passed = passed && mMux->getProfile(NetIoMux::EIT_TIMER, ts) && (ts.Count == 0) && (ts.MaxUs == 0);
+	passed = passed && (mMux->getSlowCallbacks(slow, 16) == 0);
+	passed = passed && !mMux->getProfile(NetIoMux::EIT_INVALID, ts);
+
+	return passed && (mErrors == 0);
+}
+
+void TestProfiler::onIoCompleted(
+	NetIoMux::EIoType type,
+	NetEndpoint::EError ec,
+	NetEndpoint *sep,
+	vptr tepOrPeer,
+	const c8 *buf,
+	u32 len)
+{
+	if (ec != NetEndpoint::EE_SUCCESS)
+	{
+		mErrors++;
+		return;
+	}
+
+	switch (type)
+	{
+	case NetIoMux::EIT_ACCEPT:
+		mServer = (NetEndpoint*)tepOrPeer;
+		break;
+	case NetIoMux::EIT_TIMER:
+		// Timers of even numbers block the worker.
+		if (((u64)tepOrPeer % 2) == 0)
+			Thread::sleep(SLOW_SLEEP_MS);
+		break;
+	case NetIoMux::EIT_RECV:
+		if ((sep != mServer) || (len != 4))
+			mErrors++;
+		Thread::sleep(SLOW_SLEEP_MS);
+		break;
+	case NetIoMux::EIT_CONNECT:
+	case NetIoMux::EIT_SEND:
+		break;
+	default:
+		mErrors++;
+		break;
+	}
+	mCompleted++;
+}
@@ -0,0 +1,56 @@
+/*******************************************************************************
+* Copyright (c) 2013 matt@moregeek.com.tw
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+* 1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+* 2. Altered source versions must be plainly marked as such, and must not be
+*    misrepresented as being the original software.
+*
+* 3. This notice may not be removed or altered from any source
+*    distribution.
+********************************************************************************/
+
+#ifndef _XPF_TEST_PROFILER_HDR_
+#define _XPF_TEST_PROFILER_HDR_
+
+#include <xpf/platform.h>
+#include <xpf/netiomux.h>
+
+class TestProfiler : public xpf::NetIoMuxCallback
+{
+public:
+	TestProfiler();
+	virtual ~TestProfiler();
+
+	// Verify callbacks are timed per I/O type while the profiler is
+	// enabled, slow ones are recorded with their type and endpoint, and
+	// nothing is accounted while it is disabled or after a reset.
+	bool run();
+
+	void onIoCompleted(xpf::NetIoMux::EIoType type, xpf::NetEndpoint::EError ec, xpf::NetEndpoint *sep, xpf::vptr tepOrPeer, const xpf::c8 *buf, xpf::u32 len);
+
+private:
+	// Run the mux until 'target' completions have been seen.
+	bool pump(xpf::u32 target);
+
+	xpf::NetIoMux    *mMux;
+	xpf::NetEndpoint *mListener;
+	xpf::NetEndpoint *mClient;
+	xpf::NetEndpoint *mServer;
+	xpf::c8           mRecvBuf[16];
+	volatile xpf::u32 mCompleted;
+	volatile xpf::u32 mErrors;
+};
+
+#endif // _XPF_TEST_PROFILER_HDR_
@@ -0,0 +1,144 @@
+/*******************************************************************************
+* Copyright (c) 2013 matt@moregeek.com.tw
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+* 1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+* 2. Altered source versions must be plainly marked as such, and must not be
+*    misrepresented as being the original software.
+*
+* 3. This notice may not be removed or altered from any source
+*    distribution.
+********************************************************************************/
+
+#include "timer_test.h"
+#include <xpf/thread.h>
+
+#include <stdio.h>
+
+#ifdef XPF_PLATFORM_WINDOWS
+#include <Windows.h>
+#else
+#include <time.h>
+#endif
+
+using namespace xpf;
+
+static u64 nowMs()
+{
+#ifdef XPF_PLATFORM_WINDOWS
+	return (u64)::GetTickCount64();
+#else
+	struct timespec ts;
+	::clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((u64)ts.tv_sec * 1000) + ((u64)ts.tv_nsec / 1000000);
+#endif
+}
+
+// Schedules a timer from another thread after a while.
+class TimerScheduler : public Thread
+{
+public:
+	TimerScheduler(NetIoMux *mux, NetIoMuxCallback *cb) : mMux(mux), mCb(cb) {}
+	u32 run(u64 udata)
+	{
+		Thread::sleep(50);
+		mMux->asyncTimer(10, mCb, 7);
+		return 0;
+	}
+private:
+	NetIoMux         *mMux;
+	NetIoMuxCallback *mCb;
+};
+
+TestTimer::TestTimer()
+	: mFiredCnt(0)
+	, mErrors(0)
+{
+	mMux = new NetIoMux();
+}
+
+TestTimer::~TestTimer()
+{
+	delete mMux;
+	mMux = 0;
+}
+
+bool TestTimer::pump(u32 target)
+{
+	for (u32 i = 0; (i < 200) && (mFiredCnt < target); ++i)
+		mMux->runOnce(10);
+	return (mFiredCnt == target);
+}
+
+bool TestTimer::run()
+{
+	bool passed = true;
+
+	// Fire in order of deadlines. The cancelled one never fires.
+	u64 start = nowMs();
+	mMux->asyncTimer(60, this, 3);
+	mMux->asyncTimer(20, this, 1);
+	u64 cancelled = mMux->asyncTimer(30, this, 99);
+	mMux->asyncTimer(40, this, 2);
+	passed = passed && mMux->cancelTimer(cancelled) && !mMux->cancelTimer(cancelled);
+	passed = passed && pump(3);
+	u64 elapsed = nowMs() - start;
+	for (u32 i = 0; i < 10; ++i)
+		mMux->runOnce(5);
+	printf("[Timer] %u timers fired in %u ms: %u, %u, %u.\n", mFiredCnt, (u32)elapsed,
+		(u32)mFired[0], (u32)mFired[1], (u32)mFired[2]);
+	passed = passed && (mFiredCnt == 3) && (mFired[0] == 1) && (mFired[1] == 2) && (mFired[2] == 3)
+		&& (elapsed >= 60) && (elapsed < 1000);
+
+	// A long runOnce() returns for the timer.
+	mFiredCnt = 0;
+	start = nowMs();
+	mMux->asyncTimer(50, this, 5);
+	while ((mFiredCnt == 0) && (nowMs() - start < 5000))
+		mMux->runOnce(5000);
+	elapsed = nowMs() - start;
+	printf("[Timer] Blocking runOnce() returned for the timer in %u ms.\n", (u32)elapsed);
+	passed = passed && (mFiredCnt == 1) && (mFired[0] == 5) && (elapsed >= 50) && (elapsed < 1000);
+
+	// And for a timer scheduled by another thread while waiting.
+	mFiredCnt = 0;
+	TimerScheduler *scheduler = new TimerScheduler(mMux, this);
+	start = nowMs();
+	scheduler->start();
+	while ((mFiredCnt == 0) && (nowMs() - start < 5000))
+		mMux->runOnce(5000);
+	elapsed = nowMs() - start;
+	scheduler->join();
+	delete scheduler;
+	printf("[Timer] Timer scheduled by another thread fired in %u ms.\n", (u32)elapsed);
+	passed = passed && (mFiredCnt == 1) && (mFired[0] == 7) && (elapsed < 1000);
+
+	return passed && (mErrors == 0);
+}
+
+void TestTimer::onIoCompleted(
+	NetIoMux::EIoType type,
+	NetEndpoint::EError ec,
+	NetEndpoint *sep,
+	vptr tepOrPeer,
+	const c8 *buf,
+	u32 len)
+{
+	if ((type != NetIoMux::EIT_TIMER) || (ec != NetEndpoint::EE_SUCCESS) || (mFiredCnt >= 8))
+	{
+		mErrors++;
+		return;
+	}
+	mFired[mFiredCnt++] = tepOrPeer;
+}
@@ -0,0 +1,195 @@
+/*******************************************************************************
+* Copyright (c) 2013 matt@moregeek.com.tw
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+* 1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+* 2. Altered source versions must be plainly marked as such, and must not be
+*    misrepresented as being the original software.
+*
+* 3. This notice may not be removed or altered from any source
+*    distribution.
+********************************************************************************/
+
+#include "watermark_test.h"
+#include "async_server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FRAME_SIZE (1024)
+#define NUM_FRAMES (128)
+#define LOW_WM     (4 * 1024)
+#define HIGH_WM    (64 * 1024)
+
+using namespace xpf;
+
+static volatile bool sOneShotDone = false;
+static volatile bool sDoneInNotify = false;
+static volatile u32  sOneShotHigh = 0;
+
+// A callback living as long as its send, as the waiters of coroutines.
+class OneShotSend : public NetIoMuxCallback
+{
+public:
+	void onIoCompleted(NetIoMux::EIoType type, NetEndpoint::EError ec, NetEndpoint *sep, vptr tepOrPeer, const c8 *buf, u32 len)
+	{
+		sOneShotDone = true;
+		delete this;
+	}
+
+	void onWriteWatermark(NetEndpoint *ep, bool aboveHigh)
+	{
+		if (!aboveHigh)
+			return;
+		// Give the worker time to perform the send.
+		Thread::sleep(50);
+		sDoneInNotify = sOneShotDone;
+		sOneShotHigh++;
+	}
+};
+
+TestWatermark::TestWatermark()
+	: mData(0)
+	, mCompleted(0)
+	, mRejected(0)
+	, mErrors(0)
+	, mHighNotified(0)
+	, mLowNotified(0)
+{
+	mMux = new NetIoMux();
+	mData = new c8[(NUM_FRAMES + 1) * FRAME_SIZE];
+}
+
+TestWatermark::~TestWatermark()
+{
+	delete mMux;
+	mMux = 0;
+	delete[] mData;
+	mData = 0;
+}
+
+bool TestWatermark::run()
+{
+	NetEndpoint *listeningEp = NetEndpoint::create(NetEndpoint::ProtocolIPv4 | NetEndpoint::ProtocolTCP,
+		"localhost", "50125");
+	xpfAssert(listeningEp != 0);
+
+	NetEndpoint *client = NetEndpoint::create(NetEndpoint::ProtocolIPv4 | NetEndpoint::ProtocolTCP);
+	bool connected = client->connect("localhost", "50125");
+	xpfAssert(connected);
+	NetEndpoint *server = listeningEp->accept();
+	xpfAssert(server != 0);
+
+	mMux->join(server);
+	bool passed = mMux->setWriteWatermarks(server, LOW_WM, HIGH_WM);
+
+	// Nothing drains until the worker starts.
+	const u32 total = NUM_FRAMES * FRAME_SIZE;
+	for (u32 i = 0; i < (NUM_FRAMES + 1) * FRAME_SIZE; ++i)
+		mData[i] = (c8)rand();
+	for (u32 i = 0; i < NUM_FRAMES; ++i)
+		mMux->asyncSend(server, &mData[i * FRAME_SIZE], FRAME_SIZE, this);
+
+	printf("[Watermark] Queued %u bytes, blocked: %s, high notified: %u.\n",
+		mMux->getQueuedWriteBytes(server), (mMux->isWriteBlocked(server)) ? "yes" : "no", mHighNotified);
+	passed = passed && mMux->isWriteBlocked(server) && (mHighNotified == 1)
+		&& (mMux->getQueuedWriteBytes(server) == total) && (mMux->getQueuedBytes() == total);
+
+	// One more send beyond the mux-wide cap is rejected.
+	mMux->setMaxQueuedBytes(total);
+	mMux->asyncSend(server, &mData[total], FRAME_SIZE, this);
+	passed = passed && (mMux->getQueuedBytes() == total);
+
+	WorkerThread *worker = new WorkerThread(mMux);
+	worker->start();
+
+	c8 buf[4096];
+	u32 received = 0;
+	while (received < total)
+	{
+		s32 bytes = client->recv(buf, 4096);
+		if (bytes <= 0)
+			break;
+		if (0 != memcmp(buf, &mData[received], bytes))
+			passed = false;
+		received += bytes;
+	}
+	printf("[Watermark] Received %u of %u bytes.\n", received, total);
+
+	for (u32 i = 0; (i < 500) && (mCompleted + mRejected < NUM_FRAMES + 1); ++i)
+		Thread::sleep(10);
+	printf("[Watermark] %u completions, %u rejected, %u errors, low notified: %u.\n",
+		mCompleted, mRejected, mErrors, mLowNotified);
+
+	passed = passed && (received == total) && (mCompleted == NUM_FRAMES) && (mRejected == 1)
+		&& (mErrors == 0) && (mLowNotified == 1) && !mMux->isWriteBlocked(server)
+		&& (mMux->getQueuedWriteBytes(server) == 0) && (mMux->getQueuedBytes() == 0);
+
+	// A send crossing the high watermark with a callback released by
+	// its completion: The completion waits for the notification.
+	mMux->setMaxQueuedBytes(0);
+	passed = passed && mMux->setWriteWatermarks(server, FRAME_SIZE / 2, FRAME_SIZE);
+	mMux->asyncSend(server, mData, FRAME_SIZE, new OneShotSend);
+	for (u32 i = 0; (i < 500) && !sOneShotDone; ++i)
+		Thread::sleep(10);
+	received = 0;
+	while (received < FRAME_SIZE)
+	{
+		s32 bytes = client->recv(buf, FRAME_SIZE - received);
+		if (bytes <= 0)
+			break;
+		received += bytes;
+	}
+	printf("[Watermark] One-shot callback: high notified: %u, completed during the notification: %s.\n",
+		sOneShotHigh, (sDoneInNotify) ? "yes" : "no");
+	passed = passed && sOneShotDone && (sOneShotHigh == 1) && !sDoneInNotify && (received == FRAME_SIZE);
+
+	mMux->disable();
+	worker->join();
+	delete worker;
+
+	mMux->depart(server);
+	delete server;
+	delete client;
+	delete listeningEp;
+
+	return passed;
+}
+
+void TestWatermark::onIoCompleted(
+	NetIoMux::EIoType type,
+	NetEndpoint::EError ec,
+	NetEndpoint *sep,
+	vptr tepOrPeer,
+	const c8 *buf,
+	u32 len)
+{
+	xpfAssert(type == NetIoMux::EIT_SEND);
+
+	if (ec == NetEndpoint::EE_QUEUE_FULL)
+		mRejected++;
+	else if ((ec != NetEndpoint::EE_SUCCESS) || (len != FRAME_SIZE))
+		mErrors++;
+	else
+		mCompleted++;
+}
+
+void TestWatermark::onWriteWatermark(NetEndpoint *ep, bool aboveHigh)
+{
+	if (aboveHigh)
+		mHighNotified++;
+	else
+		mLowNotified++;
+}
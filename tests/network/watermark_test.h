@@ -0,0 +1,56 @@
+/*******************************************************************************
+* Copyright (c) 2013 matt@moregeek.com.tw
+*
+* This software is provided 'as-is', without any express or implied
+* warranty. In no event will the authors be held liable for any damages
+* arising from the use of this software.
+*
+* Permission is granted to anyone to use this software for any purpose,
+* including commercial applications, and to alter it and redistribute it
+* freely, subject to the following restrictions:
+*
+* 1. The origin of this software must not be misrepresented; you must not
+*    claim that you wrote the original software. If you use this software
+*    in a product, an acknowledgment in the product documentation would be
+*    appreciated but is not required.
+*
+* 2. Altered source versions must be plainly marked as such, and must not be
+*    misrepresented as being the original software.
+*
+* 3. This notice may not be removed or altered from any source
+*    distribution.
+********************************************************************************/
+
+#ifndef _XPF_TEST_WATERMARK_HDR_
+#define _XPF_TEST_WATERMARK_HDR_
+
+#include <xpf/platform.h>
+#include <xpf/netiomux.h>
+#include <xpf/thread.h>
+
+class TestWatermark : public xpf::NetIoMuxCallback
+{
+public:
+	TestWatermark();
+	virtual ~TestWatermark();
+
+	// Queue sends beyond the high watermark and the mux-wide cap
+	// before any worker runs, then drain them and verify the
+	// watermark notifications and EE_QUEUE_FULL rejection.
+	bool run();
+
+	// async callbacks (** multi-thread accessing)
+	void onIoCompleted(xpf::NetIoMux::EIoType type, xpf::NetEndpoint::EError ec, xpf::NetEndpoint *sep, xpf::vptr tepOrPeer, const xpf::c8 *buf, xpf::u32 len);
+	void onWriteWatermark(xpf::NetEndpoint *ep, bool aboveHigh);
+
+private:
+	xpf::NetIoMux    *mMux;
+	xpf::c8          *mData;
+	volatile xpf::u32 mCompleted;
+	volatile xpf::u32 mRejected;
+	volatile xpf::u32 mErrors;
+	volatile xpf::u32 mHighNotified;
+	volatile xpf::u32 mLowNotified;
+};
+
+#endif // _XPF_TEST_WATERMARK_HDR_
@@ -23,6 +23,7 @@
 
 #include <xpf/thread.h>
 #include <xpf/tls.h>
+#include <xpf/atomic.h>
 
 #ifdef XPF_PLATFORM_WINDOWS
 // http://msdn.microsoft.com/en-us/library/vstudio/x98tx3cf.aspx
@@ -40,6 +41,19 @@ using namespace xpf;
 
 TlsMap<u64> _g_tlsmap;
 vptr _g_tlsdata;
+vptr _g_tlsexit;
+volatile u32 _g_exits = 0;
+
+// Counts the threads leaving with data associated with _g_tlsexit.
+#ifdef XPF_PLATFORM_WINDOWS
+void __stdcall onThreadExit(vptr data)
+#else
+void onThreadExit(vptr data)
+#endif
+{
+	xpfAssert(data == (vptr)&_g_exits);
+	xpfAtomicAdd(&_g_exits, 1);
+}
 
 struct MyHot
 {
@@ -59,6 +73,7 @@ public:
 		{
 			tid = Thread::getThreadID();
 			TlsSet(_g_tlsdata, (vptr)&tid);
+			TlsSet(_g_tlsexit, (vptr)&_g_exits);
 		}
 
 		u64 sec = userdata;
@@ -102,6 +117,8 @@ int main()
 	_g_hot.sum = 0;
 	_g_tlsdata = TlsCreate();
 	xpfAssert(_g_tlsdata != 0);
+	_g_tlsexit = TlsCreate(onThreadExit);
+	xpfAssert(_g_tlsexit != 0);
 
 	std::vector<Thread*> ta;
 
@@ -147,7 +164,9 @@ int main()
 	}
 
 	xpfAssert(("Expecting matched sum.", _g_hot.sum == expectingCnt));
+	xpfAssert(("Expecting a destructor call per thread.", _g_exits == 30));
 
+	TlsDelete(_g_tlsexit);
 	TlsDelete(_g_tlsdata);
 	return 0;
 }